@@ -0,0 +1,166 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH    4
+#define LZ_MAX_OFFSET   65535
+#define LZ_HASH_BITS    14
+#define LZ_SKIP_SHIFT   6       // search faster after many bytes without a match
+
+static uint32_t read_u32(const unsigned char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static uint64_t read_u64(const unsigned char *p)
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static uint32_t hash_u32(uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char *write_length(unsigned char *op, unsigned char *oend, size_t len)
+{
+  while (len >= 255) {
+    if (op >= oend) return NULL;
+    *op++ = 255;
+    len -= 255;
+  }
+  if (op >= oend) return NULL;
+  *op++ = (unsigned char) len;
+  return op;
+}
+
+static unsigned char *write_sequence(unsigned char *op, unsigned char *oend,
+                                     const unsigned char *literals, size_t num_literals,
+                                     size_t offset, size_t match_len)
+{
+  if (op >= oend) return NULL;
+  unsigned char *token = op++;
+  *token = (unsigned char) (((num_literals >= 15) ? 15 : num_literals) << 4);
+  if (num_literals >= 15 && (op = write_length(op, oend, num_literals - 15)) == NULL) return NULL;
+
+  if ((size_t) (oend - op) < num_literals) return NULL;
+  memcpy(op, literals, num_literals);
+  op += num_literals;
+
+  // the last sequence has only literals
+  if (match_len == 0) return op;
+
+  if (oend - op < 2) return NULL;
+  *op++ = (unsigned char) (offset & 0xff);
+  *op++ = (unsigned char) (offset >> 8);
+  match_len -= LZ_MIN_MATCH;
+  *token |= (unsigned char) ((match_len >= 15) ? 15 : match_len);
+  if (match_len >= 15 && (op = write_length(op, oend, match_len - 15)) == NULL) return NULL;
+  return op;
+}
+
+size_t lz_compress(const void *src, size_t src_size, void *dst, size_t dst_size)
+{
+  const unsigned char *ip = src;
+  const unsigned char *base = src;
+  const unsigned char *anchor = src;
+  const unsigned char *iend = base + src_size;
+  unsigned char *op = dst;
+  unsigned char *oend = op + dst_size;
+
+  uint32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  while (src_size >= LZ_MIN_MATCH && ip <= iend - LZ_MIN_MATCH) {
+    uint32_t seq = read_u32(ip);
+    uint32_t h = hash_u32(seq);
+    const unsigned char *ref = base + table[h];
+    table[h] = (uint32_t) (ip - base);
+
+    if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read_u32(ref) != seq) {
+      ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+      continue;
+    }
+
+    // extend the match backwards and forwards
+    while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+      ip--;
+      ref--;
+    }
+    size_t match_len = LZ_MIN_MATCH;
+    while (ip + match_len + 8 <= iend && read_u64(ip + match_len) == read_u64(ref + match_len)) {
+      match_len += 8;
+    }
+    while (ip + match_len < iend && ip[match_len] == ref[match_len]) {
+      match_len++;
+    }
+
+    op = write_sequence(op, oend, anchor, ip - anchor, ip - ref, match_len);
+    if (!op) return 0;
+    ip += match_len;
+    anchor = ip;
+  }
+
+  op = write_sequence(op, oend, anchor, iend - anchor, 0, 0);
+  if (!op) return 0;
+  return op - (unsigned char *) dst;
+}
+
+static int read_length(const unsigned char **ip, const unsigned char *iend, size_t *len)
+{
+  unsigned char b;
+  do {
+    if (*ip >= iend) return -1;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+int lz_decompress(const void *src, size_t src_size, void *dst, size_t dst_size)
+{
+  const unsigned char *ip = src;
+  const unsigned char *iend = ip + src_size;
+  unsigned char *op = dst;
+  unsigned char *ostart = dst;
+  unsigned char *oend = op + dst_size;
+
+  while (ip < iend) {
+    unsigned char token = *ip++;
+
+    // literals
+    size_t num_literals = token >> 4;
+    if (num_literals == 15 && read_length(&ip, iend, &num_literals) != 0) return -1;
+    if ((size_t) (iend - ip) < num_literals || (size_t) (oend - op) < num_literals) return -1;
+    memcpy(op, ip, num_literals);
+    ip += num_literals;
+    op += num_literals;
+    if (ip == iend) break;
+
+    // match
+    if (iend - ip < 2) return -1;
+    size_t offset = ip[0] | ((size_t) ip[1] << 8);
+    ip += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && read_length(&ip, iend, &match_len) != 0) return -1;
+    match_len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > (size_t) (op - ostart) || (size_t) (oend - op) < match_len) return -1;
+
+    const unsigned char *ref = op - offset;
+    if (offset >= match_len) {
+      memcpy(op, ref, match_len);
+      op += match_len;
+    } else {
+      while (match_len-- > 0) {
+        *op++ = *ref++;
+      }
+    }
+  }
+
+  return (op == oend) ? 0 : -1;
+}
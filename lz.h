@@ -0,0 +1,32 @@
+#ifndef LZ_H_FILE
+#define LZ_H_FILE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/*
+ * Fast LZ77 block codec (LZ4-style sequences of literals and matches with
+ * 16-bit offsets).  Blocks are independent, so they can be compressed and
+ * decompressed in parallel.
+ */
+
+// Compress src into dst.  Returns the compressed size, or 0 if it doesn't
+// fit in dst_size bytes (so passing a dst_size smaller than src_size gives
+// up early on data that doesn't compress).
+size_t lz_compress(const void *src, size_t src_size, void *dst, size_t dst_size);
+
+// Decompress src into exactly dst_size bytes.  Returns 0 on success or -1
+// if the data is corrupt.
+int lz_decompress(const void *src, size_t src_size, void *dst, size_t dst_size);
+
+// Max compressed size of src_size bytes
+#define LZ_COMPRESS_BOUND(src_size)  ((src_size) + (src_size)/255 + 16)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LZ_H_FILE */
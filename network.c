@@ -1,3 +1,7 @@
+#define _FILE_OFFSET_BITS 64
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
 #include "targetver.h"
 #include "network.h"
 
@@ -11,6 +15,7 @@
 #include <sys/types.h>
 
 #include "util.h"
+#include "uring.h"
 
 #define DebugLog(...) do {} while (0)
 #define DebugDumpBytes(...) do {} while (0)
@@ -38,39 +43,138 @@ typedef SOCKET sock_type;
 const char *inet_ntop(int, const void *, char *, size_t);
 #else
 #include <unistd.h>
+#include <signal.h>
 # include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <sys/select.h>
+#include <poll.h>
 typedef int sock_type;
 #endif
 
-#define BEACON_PACKET_MAX_SIZE   256
-#define BEACON_PACKET_SIZE       16
+#if defined(__linux__)
+#define HAVE_SENDFILE 1
+#define HAVE_EPOLL 1
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#endif
+
+#if defined(_WIN32) || defined(__WIN32__)
+#define file_seek(f, off) _fseeki64((f), (__int64) (off), SEEK_SET)
+#else
+#define file_seek(f, off) fseeko((f), (off_t) (off), SEEK_SET)
+#endif
+
+#define BEACON_PACKET_MAX_SIZE   1400   // keep beacons in a single unfragmented datagram
+#define BEACON_HEADER_SIZE       16
+#define BEACON_ENTRY_HEADER_SIZE 8
 #define BEACON_MAGIC             NET_MAKE_MAGIC('S', 'w', 'o', 'o')
-#define BEACON_VERSION           0x00000003
+#define BEACON_VERSION           0x0000000B
 
 #define TCP_BACKLOG         10
 #define TCP_LISTEN_TIME_MS  5000
 
+#define REACTOR_BACKLOG           1024
+#define REACTOR_MAX_EVENTS        64
+#define REACTOR_REQUEST_MAX_SIZE  (16*1024)
+#define REACTOR_TIMEOUT_MS        30000
+#define REACTOR_SEND_DATA_SIZE    (16*1024)
+
+#define MCAST_RECV_BUFFER_SIZE  (4*1024*1024)
+
+#define FILE_CHUNK_SIZE     (64*1024)
+#define RECV_CHUNK_SIZE     (1024*1024)
+#define SENDFILE_CHUNK_SIZE (1024*1024*1024)
+
 struct net_config {
   int      udp_server_port;
   int      tcp_server_port;
   int      use_ipv6;
 };
 
+struct net_conn;
+
 struct net_socket {
   sock_type sock;
+  uint32_t options;
+  struct net_conn *conn;          // set while the socket is owned by the event-driven server
+  unsigned char *recv_buf;        // data received by the event-driven server
+  size_t recv_len;
+  size_t recv_pos;
+  int in_memory;                  // not a real socket, sent data is kept in send_buf
+  unsigned char *send_buf;
+  size_t send_len;
+  size_t send_max;
+  const struct net_socket_ops *ops;   // set for sockets implemented by the caller
+  void *ops_data;
+  net_throttle_callback throttle;     // set for sockets with a limited transfer rate
+  void *throttle_data;
+  net_close_callback on_close;        // set to know when the event-driven server is done with it
+  void *on_close_data;
+};
+
+#if HAVE_EPOLL
+enum net_conn_state {
+  CONN_READING,                   // waiting for the whole request
+  CONN_SENDING,                   // sending queued data
+  CONN_DRAINING,                  // waiting for the receiver to close
+  CONN_DETACHED,                  // handed over to blocking code
+};
+
+// data or file range queued for sending
+struct net_send_segment {
+  struct net_send_segment *next;
+  int fd;                         // file to send, or -1 to send 'data'
+  uint64_t offset;                // file offset or position in 'data'
+  uint64_t len;                   // bytes left to send
+  size_t data_size;
+  unsigned char data[];
+};
+
+struct net_reactor;
+
+// connection served by the event-driven server
+struct net_conn {
+  struct net_conn *prev;
+  struct net_conn *next;
+  struct net_reactor *reactor;
+  struct net_socket *sock;
+  enum net_conn_state state;
+  int recv_short;                 // the request callback ran out of received data
+  uint32_t events;
+  uint64_t deadline;
+  struct net_send_segment *send_head;
+  struct net_send_segment *send_tail;
 };
 
+struct net_reactor {
+  int epoll_fd;
+  sock_type server_sock;
+  net_request_callback callback;
+  void *user_data;
+  struct net_conn conns;          // list of connections, for timeouts
+};
+#endif
+
 struct net_msg_beacon {
   int      net_family;
   char     net_host[INET6_ADDRSTRLEN];
   uint32_t net_port;
   uint32_t message_id;
+  size_t   head_len;              // message head sent in the beacon, if any
+  unsigned char head[];
 };
 
 static struct net_config config;
+static int use_io_uring = 1;
+
+// broadcast socket kept open between beacons
+static sock_type beacon_sock = -1;
+static struct sockaddr_storage beacon_addr;
+static socklen_t beacon_addr_len;
 
 static void pack_u32(unsigned char *data, size_t off, uint32_t val)
 {
@@ -89,6 +193,17 @@ static uint32_t unpack_u32(unsigned char *data, size_t off)
     (((uint32_t) data[off+3]) << 24);
 }
 
+static void pack_u64(unsigned char *data, size_t off, uint64_t val)
+{
+  pack_u32(data, off+0, (uint32_t) (val & 0xffffffff));
+  pack_u32(data, off+4, (uint32_t) (val >> 32));
+}
+
+static uint64_t unpack_u64(unsigned char *data, size_t off)
+{
+  return ((uint64_t) unpack_u32(data, off+0)) | (((uint64_t) unpack_u32(data, off+4)) << 32);
+}
+
 static char *get_address_host(struct sockaddr *addr, char *str, size_t str_size)
 {
   void *addr_data;
@@ -212,12 +327,58 @@ int net_setup(int udp_server_port, int tcp_server_port, int use_ipv6)
   WSADATA wsa_data;
   return WSAStartup(version_wanted, &wsa_data);
 #else
+  // a receiver closing its connection must not kill us while we're sending
+  signal(SIGPIPE, SIG_IGN);
   return 0;
 #endif
 }
 
+void net_set_io_uring(int enable)
+{
+  use_io_uring = enable;
+}
+
+void net_set_socket_throttle(struct net_socket *sock, net_throttle_callback throttle, void *user_data)
+{
+  sock->throttle = throttle;
+  sock->throttle_data = user_data;
+}
+
+void net_set_socket_close_callback(struct net_socket *sock, net_close_callback on_close, void *user_data)
+{
+  sock->on_close = on_close;
+  sock->on_close_data = user_data;
+}
+
+void net_set_socket_options(struct net_socket *sock, uint32_t options)
+{
+  sock->options = options;
+}
+
+uint32_t net_get_socket_options(struct net_socket *sock)
+{
+  return sock->options;
+}
+
 void net_close_socket(struct net_socket *sock)
 {
+  if (sock->conn != NULL) {
+    // the event-driven server closes it after sending the queued data
+    return;
+  }
+  if (sock->in_memory) {
+    free(sock->send_buf);
+    free(sock->recv_buf);
+    free(sock);
+    return;
+  }
+  if (sock->ops != NULL) {
+    sock->ops->close(sock->ops_data);
+    free(sock->recv_buf);
+    free(sock);
+    return;
+  }
+
   DebugLog("========== FREEING SOCKET %p\n", sock);
 
   shutdown(sock->sock, SHUT_WR);
@@ -229,6 +390,7 @@ void net_close_socket(struct net_socket *sock)
   }
 
   close(sock->sock);
+  free(sock->recv_buf);
   free(sock);
 }
 
@@ -239,8 +401,38 @@ void net_free_beacon(struct net_msg_beacon *beacon)
   free(beacon);
 }
 
-int net_send_data(struct net_socket *sock, const void *data, size_t len)
+#if HAVE_EPOLL
+static int queue_send_data(struct net_conn *conn, const void *data, size_t len);
+static int queue_send_file(struct net_conn *conn, const char *file_name, uint64_t offset, uint64_t len);
+#endif
+#if HAVE_IO_URING
+static int uring_send_file(struct net_socket *sock, int fd, uint64_t offset, uint64_t len);
+#endif
+
+static int send_data(struct net_socket *sock, const void *data, size_t len)
 {
+#if HAVE_EPOLL
+  if (sock->conn != NULL) {
+    return queue_send_data(sock->conn, data, len);
+  }
+#endif
+  if (sock->ops != NULL) {
+    return sock->ops->send(sock->ops_data, data, len);
+  }
+  if (sock->in_memory) {
+    if (len > sock->send_max - sock->send_len) {
+      return -1;
+    }
+    unsigned char *send_buf = realloc(sock->send_buf, sock->send_len + len + 1);
+    if (send_buf == NULL) {
+      return -1;
+    }
+    memcpy(send_buf + sock->send_len, data, len);
+    sock->send_buf = send_buf;
+    sock->send_len += len;
+    return 0;
+  }
+
   size_t len_left = len;
   const char *data_left = data;
   while (len_left > 0) {
@@ -255,203 +447,1938 @@ int net_send_data(struct net_socket *sock, const void *data, size_t len)
   return 0;
 }
 
-int net_send_u32(struct net_socket *sock, uint32_t data)
+int net_send_data(struct net_socket *sock, const void *data, size_t len)
 {
-  unsigned char bytes[4];
-  pack_u32(bytes, 0, data);
-  return net_send_data(sock, bytes, sizeof(bytes));
-}
+  if (sock->throttle == NULL) {
+    return send_data(sock, data, len);
+  }
 
-int net_recv_data(struct net_socket *sock, void *data, size_t len)
-{
+  // wait for the throttle before each chunk, so big sends don't go out in bursts
   size_t len_left = len;
-  char *data_left = data;
+  const char *data_left = data;
   while (len_left > 0) {
-    int done = recv(sock->sock, data_left, (int) len_left, 0);
-    if (done <= 0) {
-      if (done < 0 && errno == EINTR) continue;
+    size_t chunk_size = (len_left > FILE_CHUNK_SIZE) ? FILE_CHUNK_SIZE : len_left;
+    sock->throttle(NET_THROTTLE_SEND, chunk_size, sock->throttle_data);
+    if (send_data(sock, data_left, chunk_size) != 0) {
       return -1;
     }
-    len_left -= done;
-    data_left += done;
+    len_left -= chunk_size;
+    data_left += chunk_size;
   }
   return 0;
 }
 
-int net_recv_u32(struct net_socket *sock, uint32_t *data)
+int net_send_u32(struct net_socket *sock, uint32_t data)
 {
   unsigned char bytes[4];
-  if (net_recv_data(sock, bytes, sizeof(bytes)) < 0) {
-    return -1;
-  }
-  *data = unpack_u32(bytes, 0);
-  return 0;
+  pack_u32(bytes, 0, data);
+  return net_send_data(sock, bytes, sizeof(bytes));
 }
 
-uint32_t net_get_beacon_message_id(struct net_msg_beacon *beacon)
+static int send_file_data(struct net_socket *sock, const char *file_name, uint64_t offset, uint64_t len)
 {
-  return beacon->message_id;
-}
+  FILE *file = fopen(file_name, "rb");
+  if (file == NULL) {
+    DebugLog("ERROR: can't open file '%s'\n", file_name);
+    return -1;
+  }
+  if (offset != 0 && file_seek(file, offset) != 0) {
+    DebugLog("ERROR: can't seek file '%s'\n", file_name);
+    fclose(file);
+    return -1;
+  }
 
-static struct net_socket *make_net_socket(sock_type sock)
-{
-  struct net_socket *net_socket = malloc(sizeof(*net_socket));
-  if (net_socket != NULL) {
-    DebugLog("========== ALLOCATED SOCKET %p\n", net_socket);
-    net_socket->sock = sock;
+  char *data = malloc(FILE_CHUNK_SIZE);
+  if (data == NULL) {
+    fclose(file);
+    return -1;
   }
-  return net_socket;
+
+  int ret = 0;
+  uint64_t len_left = len;
+  while (len_left > 0) {
+    size_t chunk_size = (len_left > FILE_CHUNK_SIZE) ? FILE_CHUNK_SIZE : (size_t) len_left;
+    if (fread(data, 1, chunk_size, file) != chunk_size) {
+      DebugLog("ERROR: can't read file '%s'\n", file_name);
+      ret = -1;
+      break;
+    }
+    if (net_send_data(sock, data, chunk_size) != 0) {
+      ret = -1;
+      break;
+    }
+    len_left -= chunk_size;
+  }
+
+  free(data);
+  fclose(file);
+  return ret;
 }
 
-struct net_msg_beacon *make_net_beacon(unsigned char *data, size_t data_len, struct sockaddr *addr)
+int net_send_file(struct net_socket *sock, const char *file_name, uint64_t offset, uint64_t len)
 {
-  if (data_len < BEACON_PACKET_SIZE) {
-    DebugLog("ERROR: beacon data is too small (%d bytes)\n", (int) data_len);
-    return NULL;
+#if HAVE_EPOLL
+  if (sock->conn != NULL) {
+    return queue_send_file(sock->conn, file_name, offset, len);
   }
-  uint32_t beacon_magic   = unpack_u32(data,  0);
-  uint32_t beacon_version = unpack_u32(data,  4);
-  uint32_t net_port       = unpack_u32(data,  8);
-  uint32_t message_id     = unpack_u32(data, 12);
-
-  if (beacon_magic != BEACON_MAGIC) {
-    DebugLog("ERROR: invalid beacon magic: 0x%04x\n", beacon_magic);
-    return NULL;
+#endif
+  if (sock->ops != NULL) {
+    return send_file_data(sock, file_name, offset, len);
   }
-  if (beacon_version != BEACON_VERSION) {
-    DebugLog("ERROR: invalid beacon version: 0x%04x\n", beacon_version);
-    return NULL;
+
+#if HAVE_SENDFILE
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0) {
+    DebugLog("ERROR: can't open file '%s'\n", file_name);
+    return -1;
   }
+  posix_fadvise(fd, (off_t) offset, (off_t) len, POSIX_FADV_SEQUENTIAL);
 
-  struct net_msg_beacon *beacon = malloc(sizeof(*beacon));
-  if (beacon == NULL) {
-    DebugLog("ERROR: out of memory for handling message\n");
-    return NULL;
+  // let the kernel move the data from the page cache to the socket
+  off_t file_offset = (off_t) offset;
+  uint64_t len_left = len;
+  size_t max_chunk_size = (sock->throttle != NULL) ? FILE_CHUNK_SIZE : SENDFILE_CHUNK_SIZE;
+  while (len_left > 0) {
+    size_t chunk_size = (len_left > max_chunk_size) ? max_chunk_size : (size_t) len_left;
+    if (sock->throttle != NULL) {
+      sock->throttle(NET_THROTTLE_SEND, chunk_size, sock->throttle_data);
+    }
+    ssize_t done = sendfile(sock->sock, fd, &file_offset, chunk_size);
+    if (done <= 0) {
+      if (done < 0 && errno == EINTR) continue;
+      if (done < 0 && (errno == EINVAL || errno == ENOSYS) && len_left == len) {
+        // sendfile() is not supported for this file, use the regular copy
+#if HAVE_IO_URING
+        if (use_io_uring && sock->throttle == NULL) {
+          int ret = uring_send_file(sock, fd, offset, len);
+          if (ret != -2) {
+            close(fd);
+            return ret;
+          }
+        }
+#endif
+        close(fd);
+        return send_file_data(sock, file_name, offset, len);
+      }
+      close(fd);
+      return -1;
+    }
+    len_left -= done;
   }
-  DebugLog("======================= ALLOCATED BACON %p\n", beacon);
 
-  beacon->net_family = addr->sa_family;
-  get_address_host(addr, beacon->net_host, sizeof(beacon->net_host));
-  beacon->net_port = net_port;
-  beacon->message_id = message_id;
-  return beacon;
+  close(fd);
+  return 0;
+#else
+  return send_file_data(sock, file_name, offset, len);
+#endif
 }
 
-int net_udp_server(net_beacon_callback callback, void *user_data)
+int net_send_u64(struct net_socket *sock, uint64_t data)
 {
-  char listen_port[16];
-  snprintf(listen_port, sizeof(listen_port), "%d", config.udp_server_port);
-
-  sock_type sock = open_server_socket(SOCK_DGRAM, listen_port, config.use_ipv6, NULL, NULL);
-  if (sock < 0) {
-    DebugLog("ERROR: can't open UDP server socket\n");
-    return -1;
-  }
+  unsigned char bytes[8];
+  pack_u64(bytes, 0, data);
+  return net_send_data(sock, bytes, sizeof(bytes));
+}
 
+// wait until a socket has data to read: 1 if it has (or the peer closed
+// it), 0 on timeout and -1 on error
+static int poll_readable(sock_type sock, int timeout_ms)
+{
   while (1) {
-    struct sockaddr_storage addr;
-    socklen_t addr_len = sizeof(addr);
-    unsigned char data[BEACON_PACKET_MAX_SIZE];
-    int data_len = recvfrom(sock, data, sizeof(data), 0, (struct sockaddr *) &addr, &addr_len);
-    if (data_len < 0) {
+#if defined(_WIN32) || defined(__WIN32__)
+    WSAPOLLFD pfd;
+    pfd.fd = sock;
+    pfd.events = POLLRDNORM;
+    pfd.revents = 0;
+    int ret = WSAPoll(&pfd, 1, timeout_ms);
+#else
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int ret = poll(&pfd, 1, timeout_ms);
+#endif
+    if (ret < 0) {
       if (errno == EINTR) {
         continue;
       }
-      DebugLog("ERROR: recvfrom returns %d, errno is %d\n", data_len, errno);
-      close(sock);
-      return -2;
-    }
-
-    struct net_msg_beacon *beacon = make_net_beacon(data, data_len, (struct sockaddr *) &addr);
-    if (beacon != NULL && callback(beacon, user_data) != 0) {
-      break;
+      DebugLog("ERROR: poll returns %d, errno is %d\n", ret, errno);
+      return -1;
     }
+    return (ret > 0) ? 1 : 0;
   }
-
-  close(sock);
-  return 0;
 }
 
-int net_tcp_server(net_connect_callback callback, void *user_data)
+int net_wait_readable(struct net_socket *sock, int timeout_ms)
 {
-  char listen_port[16];
-  snprintf(listen_port, sizeof(listen_port), "%d", config.tcp_server_port);
+  if (sock->recv_pos < sock->recv_len || sock->in_memory || sock->ops != NULL) {
+    return 1;
+  }
+  return poll_readable(sock->sock, timeout_ms);
+}
 
-  sock_type server_sock = open_server_socket(SOCK_STREAM, listen_port, config.use_ipv6, NULL, NULL);
-  if (server_sock < 0) {
-    DebugLog("ERROR: can't open TCP server socket\n");
-    return -1;
+int net_wait_readable_any(struct net_socket **socks, int *ready, int num_socks, int timeout_ms)
+{
+  // data the event-driven server already received is ready right away
+  int num_ready = 0;
+  for (int i = 0; i < num_socks; i++) {
+    struct net_socket *sock = socks[i];
+    ready[i] = (sock->recv_pos < sock->recv_len || sock->in_memory || sock->ops != NULL);
+    num_ready += ready[i];
+  }
+  if (num_ready > 0) {
+    return num_ready;
   }
 
-  if (listen(server_sock, TCP_BACKLOG) != 0) {
-    DebugLog("ERROR: can't listen on TCP server port\n");
-    close(server_sock);
+#if defined(_WIN32) || defined(__WIN32__)
+  WSAPOLLFD *pfds = malloc(sizeof(*pfds) * (size_t) num_socks);
+#else
+  struct pollfd *pfds = malloc(sizeof(*pfds) * (size_t) num_socks);
+#endif
+  if (pfds == NULL) {
     return -1;
   }
-
-  int error_code = -1;
+  for (int i = 0; i < num_socks; i++) {
+    pfds[i].fd = socks[i]->sock;
+#if defined(_WIN32) || defined(__WIN32__)
+    pfds[i].events = POLLRDNORM;
+#else
+    pfds[i].events = POLLIN;
+#endif
+    pfds[i].revents = 0;
+  }
+  int ret;
   while (1) {
-    // handle connection
-    struct sockaddr_storage client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-    sock_type client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &client_addr_len);
-    if (client_sock < 0) {
-      DebugLog("[net_tcp_server] error in accept\n");
-      continue;
-    }
-    struct net_socket *net_socket = make_net_socket(client_sock);
-    if (net_socket == NULL) {
-      DebugLog("[net_tcp_server] error making socket\n");
-      close(client_sock);
+#if defined(_WIN32) || defined(__WIN32__)
+    ret = WSAPoll(pfds, (ULONG) num_socks, timeout_ms);
+#else
+    ret = poll(pfds, (nfds_t) num_socks, timeout_ms);
+#endif
+    if (ret < 0 && errno == EINTR) {
       continue;
     }
-    DebugLog("[net_tcp_server] running callback\n");
-    callback(net_socket, user_data);
+    break;
   }
-
-  close(server_sock);
-  return error_code;
+  if (ret < 0) {
+    DebugLog("ERROR: poll returns %d, errno is %d\n", ret, errno);
+    free(pfds);
+    return -1;
+  }
+  for (int i = 0; i < num_socks; i++) {
+    ready[i] = (pfds[i].revents != 0);
+    num_ready += ready[i];
+  }
+  free(pfds);
+  return num_ready;
 }
 
-int net_send_msg_beacon(uint32_t message_id)
+static int recv_data(struct net_socket *sock, void *data, size_t len)
 {
-  // broadcast UDP beacon
-  unsigned char beacon_data[BEACON_PACKET_SIZE];
-  pack_u32(beacon_data,  0, BEACON_MAGIC);
-  pack_u32(beacon_data,  4, BEACON_VERSION);
-  pack_u32(beacon_data,  8, config.tcp_server_port);
-  pack_u32(beacon_data, 12, message_id);
+  size_t len_left = len;
+  char *data_left = data;
 
-  struct sockaddr_storage addr;
-  socklen_t addr_len = 0;
-  sock_type sock = open_udp_broadcast_socket(config.udp_server_port, config.use_ipv6, &addr, &addr_len);
-  if (sock < 0) {
+  // use the data already received by the event-driven server first
+  if (sock->recv_pos < sock->recv_len) {
+    size_t buffered = sock->recv_len - sock->recv_pos;
+    size_t done = (buffered < len_left) ? buffered : len_left;
+    memcpy(data_left, sock->recv_buf + sock->recv_pos, done);
+    sock->recv_pos += done;
+    len_left -= done;
+    data_left += done;
+  }
+#if HAVE_EPOLL
+  if (len_left > 0 && sock->conn != NULL) {
+    sock->conn->recv_short = 1;
+    return -1;    // not received yet
+  }
+#endif
+  if (len_left > 0 && sock->in_memory) {
     return -1;
   }
+  if (len_left > 0 && sock->ops != NULL) {
+    return sock->ops->recv(sock->ops_data, data_left, len_left);
+  }
 
-  int len = sendto(sock, beacon_data, (int) sizeof(beacon_data), 0, (struct sockaddr *) &addr, addr_len);
-  close(sock);
-
-  if (len != sizeof(beacon_data)) {
-    return -2;
+  while (len_left > 0) {
+    int done = recv(sock->sock, data_left, (int) len_left, 0);
+    if (done <= 0) {
+      if (done < 0 && errno == EINTR) continue;
+      return -1;
+    }
+    len_left -= done;
+    data_left += done;
   }
   return 0;
 }
 
-struct net_socket *net_connect_to_beacon(struct net_msg_beacon *beacon)
+int net_recv_data(struct net_socket *sock, void *data, size_t len)
 {
-  struct net_socket *net_socket = NULL;
-  DebugLog("[net_connect_to_beacon] will connect to '%s:%d'\n", beacon->net_host, beacon->net_port);
-  sock_type sock = socket(beacon->net_family, SOCK_STREAM, 0);
-  if (sock < 0) goto end;
-
-  struct addrinfo hints;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = beacon->net_family;
-  hints.ai_socktype = SOCK_STREAM;
-
-  char net_port[32];
-  snprintf(net_port, sizeof(net_port), "%d", beacon->net_port);
+  if (sock->throttle == NULL) {
+    return recv_data(sock, data, len);
+  }
+
+  size_t len_left = len;
+  char *data_left = data;
+  while (len_left > 0) {
+    size_t chunk_size = (len_left > FILE_CHUNK_SIZE) ? FILE_CHUNK_SIZE : len_left;
+    sock->throttle(NET_THROTTLE_RECV, chunk_size, sock->throttle_data);
+    if (recv_data(sock, data_left, chunk_size) != 0) {
+      return -1;
+    }
+    len_left -= chunk_size;
+    data_left += chunk_size;
+  }
+  return 0;
+}
+
+int net_recv_u32(struct net_socket *sock, uint32_t *data)
+{
+  unsigned char bytes[4];
+  if (net_recv_data(sock, bytes, sizeof(bytes)) < 0) {
+    return -1;
+  }
+  *data = unpack_u32(bytes, 0);
+  return 0;
+}
+
+int net_recv_u64(struct net_socket *sock, uint64_t *data)
+{
+  unsigned char bytes[8];
+  if (net_recv_data(sock, bytes, sizeof(bytes)) < 0) {
+    return -1;
+  }
+  *data = unpack_u64(bytes, 0);
+  return 0;
+}
+
+int net_prepare_file(const char *file_name, uint64_t size)
+{
+#if defined(__linux__)
+  int fd = open(file_name, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if (fd < 0) {
+    DebugLog("ERROR: can't create file '%s'\n", file_name);
+    return -1;
+  }
+  // reserve all blocks up front so the file doesn't fragment while it grows
+  if (size > 0 && fallocate(fd, 0, 0, (off_t) size) != 0 && ftruncate(fd, (off_t) size) != 0) {
+    DebugLog("ERROR: can't set size of file '%s'\n", file_name);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  return 0;
+#else
+  FILE *file = fopen(file_name, "wb");
+  if (file == NULL) {
+    DebugLog("ERROR: can't create file '%s'\n", file_name);
+    return -1;
+  }
+  int ret = 0;
+  if (size > 0 && (file_seek(file, size - 1) != 0 || fputc(0, file) == EOF)) {
+    DebugLog("ERROR: can't set size of file '%s'\n", file_name);
+    ret = -1;
+  }
+  if (fclose(file) != 0) {
+    ret = -1;
+  }
+  return ret;
+#endif
+}
+
+static void *alloc_file_buffer(size_t size)
+{
+#if defined(__linux__)
+  void *data;
+  if (posix_memalign(&data, 4096, size) != 0) {
+    return NULL;
+  }
+  return data;
+#else
+  return malloc(size);
+#endif
+}
+
+#if HAVE_IO_URING
+// ==========================================================================
+// io_uring transfers
+// ==========================================================================
+
+#define URING_BUFFERS       4
+#define URING_OP_RECV       1
+#define URING_OP_SEND       2
+#define URING_OP_READ       3
+#define URING_OP_WRITE      4
+#define URING_OP_CANCEL     5
+
+#define URING_USER_DATA(op, buf)  (((uint64_t) (op) << 8) | (uint64_t) (buf))
+
+struct uring_buffer {
+  unsigned char *data;
+  size_t len;                     // bytes in this chunk
+  size_t done;                    // bytes received/sent/read/written so far
+  uint64_t file_offset;
+  int busy;
+};
+
+struct uring_transfer {
+  struct uring *ring;
+  struct uring_buffer bufs[URING_BUFFERS];
+  int fixed;                      // buffers are registered with the ring
+  int in_flight;
+};
+
+static int open_uring_transfer(struct uring_transfer *t)
+{
+  memset(t, 0, sizeof(*t));
+  t->ring = uring_open(2 * URING_BUFFERS);
+  if (t->ring == NULL) {
+    return -1;
+  }
+
+  struct iovec iovecs[URING_BUFFERS];
+  for (int i = 0; i < URING_BUFFERS; i++) {
+    t->bufs[i].data = alloc_file_buffer(RECV_CHUNK_SIZE);
+    if (t->bufs[i].data == NULL) {
+      for (int j = 0; j < i; j++) {
+        free(t->bufs[j].data);
+      }
+      uring_close(t->ring);
+      return -1;
+    }
+    iovecs[i].iov_base = t->bufs[i].data;
+    iovecs[i].iov_len = RECV_CHUNK_SIZE;
+  }
+  // registered buffers save mapping the pages for each file operation,
+  // but they count against the locked memory limit
+  t->fixed = (uring_register_buffers(t->ring, iovecs, URING_BUFFERS) == 0);
+  return 0;
+}
+
+static void close_uring_transfer(struct uring_transfer *t)
+{
+  for (int i = 0; i < URING_BUFFERS; i++) {
+    free(t->bufs[i].data);
+  }
+  uring_close(t->ring);
+}
+
+// queue an operation on the rest of a buffer
+static void queue_uring_op(struct uring_transfer *t, int op, int fd, int buf_index)
+{
+  struct uring_buffer *buf = &t->bufs[buf_index];
+  struct io_uring_sqe *sqe = uring_get_sqe(t->ring);    // never full: one entry per buffer at most
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) (buf->data + buf->done);
+  sqe->len = (uint32_t) (buf->len - buf->done);
+  sqe->user_data = URING_USER_DATA(op, buf_index);
+  switch (op) {
+  case URING_OP_RECV:
+    sqe->opcode = IORING_OP_RECV;
+    sqe->msg_flags = MSG_WAITALL;
+    break;
+  case URING_OP_SEND:
+    sqe->opcode = IORING_OP_SEND;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    break;
+  case URING_OP_READ:
+  case URING_OP_WRITE:
+    if (t->fixed) {
+      sqe->opcode = (op == URING_OP_READ) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+      sqe->buf_index = (uint16_t) buf_index;
+    } else {
+      sqe->opcode = (op == URING_OP_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+    }
+    sqe->off = buf->file_offset + buf->done;
+    break;
+  }
+  t->in_flight++;
+}
+
+static void queue_uring_cancel(struct uring_transfer *t, int op, int buf_index)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(t->ring);
+  if (sqe == NULL) {
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = URING_USER_DATA(op, buf_index);
+  sqe->user_data = URING_USER_DATA(URING_OP_CANCEL, 0);
+  t->in_flight++;
+}
+
+// Receive into a file keeping one receive and several writes in flight, so
+// the disk writes overlap with the network.  Returns -2 if io_uring can't
+// be used at all, so the caller can use regular system calls.
+static int uring_recv_file(struct net_socket *sock, int fd, uint64_t offset, uint64_t len, uint64_t len_done,
+                           net_progress_callback progress, void *user_data)
+{
+  struct uring_transfer t;
+  if (open_uring_transfer(&t) != 0) {
+    return -2;
+  }
+
+  int ret = 0;
+  int recv_buf = -1;                // buffer with a receive in flight
+  uint64_t recv_offset = offset;    // file offset of the next chunk to receive
+  uint64_t len_written = len_done;  // progress includes what the caller already wrote
+  while (1) {
+    // receive the next chunk into a free buffer
+    if (ret == 0 && recv_buf < 0 && recv_offset < offset + len) {
+      for (int i = 0; i < URING_BUFFERS; i++) {
+        if (!t.bufs[i].busy) {
+          // keep writes aligned to the chunk size
+          size_t chunk_size = RECV_CHUNK_SIZE - (size_t) (recv_offset % RECV_CHUNK_SIZE);
+          if (chunk_size > offset + len - recv_offset) {
+            chunk_size = (size_t) (offset + len - recv_offset);
+          }
+          t.bufs[i].busy = 1;
+          t.bufs[i].len = chunk_size;
+          t.bufs[i].done = 0;
+          t.bufs[i].file_offset = recv_offset;
+          recv_offset += chunk_size;
+          recv_buf = i;
+          queue_uring_op(&t, URING_OP_RECV, (int) sock->sock, i);
+          break;
+        }
+      }
+    }
+    if (t.in_flight == 0) {
+      break;
+    }
+
+    if (uring_submit(t.ring, 1) != 0) {
+      ret = -1;
+      break;    // can't wait for the operations in flight, leak the buffers
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(t.ring)) != NULL) {
+      int op = (int) (cqe->user_data >> 8);
+      int buf_index = (int) (cqe->user_data & 0xff);
+      int res = cqe->res;
+      uring_cqe_seen(t.ring);
+      t.in_flight--;
+      if (op == URING_OP_CANCEL) {
+        continue;
+      }
+
+      struct uring_buffer *buf = &t.bufs[buf_index];
+      if (res < 0 && (res == -EINTR || res == -EAGAIN) && ret == 0) {
+        queue_uring_op(&t, op, (op == URING_OP_RECV) ? (int) sock->sock : fd, buf_index);
+        continue;
+      }
+      if (res <= 0) {
+        if (ret == 0) {
+          if (op == URING_OP_RECV && res == -EINVAL && buf->file_offset == offset && buf->done == 0) {
+            ret = -2;   // operation not supported by this kernel
+          } else {
+            DebugLog("ERROR: io_uring %s failed: %d\n", (op == URING_OP_RECV) ? "recv" : "write", res);
+            ret = -1;
+          }
+          if (recv_buf >= 0 && op != URING_OP_RECV) {
+            queue_uring_cancel(&t, URING_OP_RECV, recv_buf);
+          }
+        }
+        buf->busy = 0;
+        if (op == URING_OP_RECV) {
+          recv_buf = -1;
+        }
+        continue;
+      }
+
+      buf->done += (size_t) res;
+      if (op == URING_OP_RECV) {
+        if (buf->done < buf->len && ret == 0) {
+          queue_uring_op(&t, URING_OP_RECV, (int) sock->sock, buf_index);
+          continue;
+        }
+        recv_buf = -1;
+        if (ret != 0) {
+          buf->busy = 0;
+          continue;
+        }
+        // write the chunk while receiving the next one
+        buf->done = 0;
+        queue_uring_op(&t, URING_OP_WRITE, fd, buf_index);
+      } else {
+        if (buf->done < buf->len && ret == 0) {
+          queue_uring_op(&t, URING_OP_WRITE, fd, buf_index);
+          continue;
+        }
+        buf->busy = 0;
+        len_written += buf->len;
+        if (ret == 0 && progress != NULL && progress(len_written, user_data) != 0) {
+          // stopped by the caller
+          ret = -1;
+          if (recv_buf >= 0) {
+            queue_uring_cancel(&t, URING_OP_RECV, recv_buf);
+          }
+        }
+      }
+    }
+  }
+
+  if (t.in_flight == 0) {
+    close_uring_transfer(&t);
+  }
+  return ret;
+}
+
+// Send part of a file reading several chunks ahead.  Returns -2 if io_uring
+// can't be used at all, so the caller can use regular system calls.
+static int uring_send_file(struct net_socket *sock, int fd, uint64_t offset, uint64_t len)
+{
+  struct uring_transfer t;
+  if (open_uring_transfer(&t) != 0) {
+    return -2;
+  }
+
+  // chunks are read into the buffers in order and sent in the same order
+  int ret = 0;
+  uint64_t read_offset = offset;
+  uint64_t len_sent = 0;
+  int next_read = 0;                // buffer for the next chunk to read
+  int next_send = 0;                // buffer for the next chunk to send
+  int sending = 0;
+  int ready[URING_BUFFERS] = { 0 };
+  while (1) {
+    if (ret == 0) {
+      while (read_offset < offset + len && !t.bufs[next_read].busy) {
+        struct uring_buffer *buf = &t.bufs[next_read];
+        buf->busy = 1;
+        buf->len = (offset + len - read_offset > RECV_CHUNK_SIZE) ? RECV_CHUNK_SIZE : (size_t) (offset + len - read_offset);
+        buf->done = 0;
+        buf->file_offset = read_offset;
+        read_offset += buf->len;
+        queue_uring_op(&t, URING_OP_READ, fd, next_read);
+        next_read = (next_read + 1) % URING_BUFFERS;
+      }
+      if (!sending && ready[next_send]) {
+        ready[next_send] = 0;
+        t.bufs[next_send].done = 0;
+        sending = 1;
+        queue_uring_op(&t, URING_OP_SEND, (int) sock->sock, next_send);
+      }
+    }
+    if (t.in_flight == 0) {
+      break;
+    }
+
+    if (uring_submit(t.ring, 1) != 0) {
+      ret = -1;
+      break;    // can't wait for the operations in flight, leak the buffers
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(t.ring)) != NULL) {
+      int op = (int) (cqe->user_data >> 8);
+      int buf_index = (int) (cqe->user_data & 0xff);
+      int res = cqe->res;
+      uring_cqe_seen(t.ring);
+      t.in_flight--;
+
+      struct uring_buffer *buf = &t.bufs[buf_index];
+      if (res < 0 && (res == -EINTR || res == -EAGAIN) && ret == 0) {
+        queue_uring_op(&t, op, (op == URING_OP_SEND) ? (int) sock->sock : fd, buf_index);
+        continue;
+      }
+      if (res <= 0) {
+        if (ret == 0) {
+          if (res == -EINVAL && len_sent == 0 && buf->file_offset == offset && buf->done == 0) {
+            ret = -2;   // operation not supported by this kernel or file
+          } else {
+            DebugLog("ERROR: io_uring %s failed: %d\n", (op == URING_OP_SEND) ? "send" : "read", res);
+            ret = -1;
+          }
+        }
+        buf->busy = 0;
+        if (op == URING_OP_SEND) {
+          sending = 0;
+        }
+        continue;
+      }
+
+      buf->done += (size_t) res;
+      if (buf->done < buf->len && ret == 0) {
+        queue_uring_op(&t, op, (op == URING_OP_SEND) ? (int) sock->sock : fd, buf_index);
+        continue;
+      }
+      if (op == URING_OP_READ) {
+        ready[buf_index] = (ret == 0);
+        if (ret != 0) {
+          buf->busy = 0;
+        }
+      } else {
+        buf->busy = 0;
+        sending = 0;
+        len_sent += buf->len;
+        next_send = (next_send + 1) % URING_BUFFERS;
+      }
+    }
+  }
+
+  if (t.in_flight == 0) {
+    close_uring_transfer(&t);
+  }
+  return ret;
+}
+#endif /* HAVE_IO_URING */
+
+int net_recv_file(struct net_socket *sock, const char *file_name, uint64_t offset, uint64_t len,
+                  net_progress_callback progress, void *user_data)
+{
+  uint64_t len_done = 0;      // received before falling back to the regular system calls
+#if defined(__linux__)
+  int fd = open(file_name, O_WRONLY|O_CREAT, 0666);
+  if (fd < 0) {
+    DebugLog("ERROR: can't open file '%s'\n", file_name);
+    return -1;
+  }
+#if HAVE_IO_URING
+  if (use_io_uring && sock->ops == NULL && sock->throttle == NULL) {
+    // write what the event-driven server already received, then receive the rest with io_uring
+    uint64_t buffered = 0;
+    if (sock->recv_pos < sock->recv_len) {
+      buffered = sock->recv_len - sock->recv_pos;
+      if (buffered > len) {
+        buffered = len;
+      }
+      size_t written = 0;
+      while (written < buffered) {
+        ssize_t done = pwrite(fd, sock->recv_buf + sock->recv_pos + written, (size_t) buffered - written, (off_t) (offset + written));
+        if (done < 0 && errno == EINTR) continue;
+        if (done <= 0) {
+          DebugLog("ERROR: can't write to file '%s'\n", file_name);
+          close(fd);
+          return -1;
+        }
+        written += done;
+      }
+      sock->recv_pos += (size_t) buffered;
+      if (progress != NULL && progress(buffered, user_data) != 0) {
+        close(fd);
+        return -1;
+      }
+    }
+    int ret = (buffered < len) ? uring_recv_file(sock, fd, offset + buffered, len - buffered, buffered, progress, user_data) : 0;
+    if (ret != -2) {
+      if (close(fd) != 0) {
+        ret = -1;
+      }
+      return ret;
+    }
+    offset += buffered;
+    len_done = buffered;
+  }
+#endif
+#else
+  FILE *file = fopen(file_name, "r+b");
+  if (file == NULL) {
+    file = fopen(file_name, "w+b");
+  }
+  if (file == NULL) {
+    DebugLog("ERROR: can't open file '%s'\n", file_name);
+    return -1;
+  }
+  if (offset != 0 && file_seek(file, offset) != 0) {
+    DebugLog("ERROR: can't seek file '%s'\n", file_name);
+    fclose(file);
+    return -1;
+  }
+#endif
+
+  int ret = 0;
+  char *data = alloc_file_buffer(RECV_CHUNK_SIZE);
+  if (data == NULL) {
+    ret = -1;
+    goto end;
+  }
+
+  uint64_t file_offset = offset;
+  uint64_t len_left = len - len_done;
+  while (len_left > 0) {
+    // fill a whole chunk before writing, keeping writes aligned to the chunk size
+    size_t chunk_size = RECV_CHUNK_SIZE - (size_t) (file_offset % RECV_CHUNK_SIZE);
+    if (chunk_size > len_left) {
+      chunk_size = (size_t) len_left;
+    }
+    if (net_recv_data(sock, data, chunk_size) != 0) {
+      DebugLog("ERROR: can't read file data\n");
+      ret = -1;
+      break;
+    }
+
+#if defined(__linux__)
+    size_t written = 0;
+    while (written < chunk_size) {
+      ssize_t done = pwrite(fd, data + written, chunk_size - written, (off_t) (file_offset + written));
+      if (done < 0 && errno == EINTR) continue;
+      if (done <= 0) break;
+      written += done;
+    }
+#else
+    size_t written = fwrite(data, 1, chunk_size, file);
+#endif
+    if (written != chunk_size) {
+      DebugLog("ERROR: can't write to file '%s'\n", file_name);
+      ret = -1;
+      break;
+    }
+
+    file_offset += chunk_size;
+    len_left -= chunk_size;
+    if (progress != NULL && progress(len - len_left, user_data) != 0) {
+      // stopped by the caller
+      ret = -1;
+      break;
+    }
+  }
+
+ end:
+  free(data);
+#if defined(__linux__)
+  if (close(fd) != 0) {
+    ret = -1;
+  }
+#else
+  if (fclose(file) != 0) {
+    ret = -1;
+  }
+#endif
+  return ret;
+}
+
+uint32_t net_get_beacon_message_id(struct net_msg_beacon *beacon)
+{
+  return beacon->message_id;
+}
+
+const char *net_get_beacon_host(struct net_msg_beacon *beacon)
+{
+  return beacon->net_host;
+}
+
+uint32_t net_get_beacon_port(struct net_msg_beacon *beacon)
+{
+  return beacon->net_port;
+}
+
+static struct net_socket *make_net_socket(sock_type sock)
+{
+  struct net_socket *net_socket = malloc(sizeof(*net_socket));
+  if (net_socket != NULL) {
+    DebugLog("========== ALLOCATED SOCKET %p\n", net_socket);
+    net_socket->sock = sock;
+    net_socket->options = 0;
+    net_socket->conn = NULL;
+    net_socket->recv_buf = NULL;
+    net_socket->recv_len = 0;
+    net_socket->recv_pos = 0;
+    net_socket->in_memory = 0;
+    net_socket->send_buf = NULL;
+    net_socket->send_len = 0;
+    net_socket->send_max = 0;
+    net_socket->ops = NULL;
+    net_socket->ops_data = NULL;
+    net_socket->throttle = NULL;
+    net_socket->throttle_data = NULL;
+    net_socket->on_close = NULL;
+    net_socket->on_close_data = NULL;
+  }
+  return net_socket;
+}
+
+struct net_msg_beacon *make_net_beacon(struct sockaddr *addr, const char *net_host, uint32_t net_port, uint32_t message_id,
+                                       const unsigned char *head, size_t head_len)
+{
+  struct net_msg_beacon *beacon = malloc(sizeof(*beacon) + head_len);
+  if (beacon == NULL) {
+    DebugLog("ERROR: out of memory for handling message\n");
+    return NULL;
+  }
+  DebugLog("======================= ALLOCATED BACON %p\n", beacon);
+
+  beacon->net_family = addr->sa_family;
+  snprintf(beacon->net_host, sizeof(beacon->net_host), "%s", net_host);
+  beacon->net_port = net_port;
+  beacon->message_id = message_id;
+  beacon->head_len = head_len;
+  if (head_len > 0) {
+    memcpy(beacon->head, head, head_len);
+  }
+  return beacon;
+}
+
+struct net_msg_beacon *net_make_beacon(const char *host, uint32_t port, uint32_t message_id)
+{
+  struct sockaddr_storage addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.ss_family = (strchr(host, ':') != NULL) ? AF_INET6 : AF_INET;
+  return make_net_beacon((struct sockaddr *) &addr, host, port, message_id, NULL, 0);
+}
+
+int net_get_socket_host(struct net_socket *sock, char *host, size_t host_size)
+{
+  if (sock->in_memory || sock->ops != NULL) {
+    return -1;
+  }
+
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  if (getpeername(sock->sock, (struct sockaddr *) &addr, &addr_len) != 0) {
+    DebugLog("ERROR: getpeername fails, errno is %d\n", errno);
+    return -1;
+  }
+  if (addr.ss_family != AF_INET && addr.ss_family != AF_INET6) {
+    return -1;
+  }
+  get_address_host((struct sockaddr *) &addr, host, host_size);
+  return 0;
+}
+
+/*
+ * A beacon packet announces one or more messages:
+ *
+ *   magic, version, TCP port, number of messages, messages...
+ *
+ * Each message is its id and the size of its head followed by the head
+ * itself.  Small heads are sent in the beacon so receivers don't have to
+ * connect to get them; the size is 0 for messages sent without head.
+ *
+ * Run the callback for each message.  Returns non-zero if the callback
+ * asks to stop.
+ */
+static int handle_beacon_packet(unsigned char *data, size_t data_len, struct sockaddr *addr, net_beacon_callback callback, void *user_data)
+{
+  if (data_len < BEACON_HEADER_SIZE) {
+    DebugLog("ERROR: beacon data is too small (%d bytes)\n", (int) data_len);
+    return 0;
+  }
+  uint32_t beacon_magic   = unpack_u32(data,  0);
+  uint32_t beacon_version = unpack_u32(data,  4);
+  uint32_t net_port       = unpack_u32(data,  8);
+  uint32_t num_messages   = unpack_u32(data, 12);
+
+  if (beacon_magic != BEACON_MAGIC) {
+    DebugLog("ERROR: invalid beacon magic: 0x%04x\n", beacon_magic);
+    return 0;
+  }
+  if (beacon_version != BEACON_VERSION) {
+    DebugLog("ERROR: invalid beacon version: 0x%04x\n", beacon_version);
+    return 0;
+  }
+
+  char net_host[INET6_ADDRSTRLEN];
+  get_address_host(addr, net_host, sizeof(net_host));
+  size_t pos = BEACON_HEADER_SIZE;
+  for (uint32_t i = 0; i < num_messages; i++) {
+    if (data_len - pos < BEACON_ENTRY_HEADER_SIZE) {
+      DebugLog("ERROR: beacon is truncated (%d bytes for %u messages)\n", (int) data_len, num_messages);
+      return 0;
+    }
+    uint32_t message_id = unpack_u32(data, pos);
+    uint32_t head_len   = unpack_u32(data, pos + 4);
+    pos += BEACON_ENTRY_HEADER_SIZE;
+    if (head_len > NET_BEACON_MAX_HEAD_SIZE || data_len - pos < head_len) {
+      DebugLog("ERROR: invalid beacon head size: %u\n", head_len);
+      return 0;
+    }
+
+    struct net_msg_beacon *beacon = make_net_beacon(addr, net_host, net_port, message_id, data + pos, head_len);
+    pos += head_len;
+    if (beacon != NULL && callback(beacon, user_data) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int net_udp_server(net_beacon_callback callback, void *user_data)
+{
+  char listen_port[16];
+  snprintf(listen_port, sizeof(listen_port), "%d", config.udp_server_port);
+
+  sock_type sock = open_server_socket(SOCK_DGRAM, listen_port, config.use_ipv6, NULL, NULL);
+  if (sock < 0) {
+    DebugLog("ERROR: can't open UDP server socket\n");
+    return -1;
+  }
+
+  while (1) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    unsigned char data[BEACON_PACKET_MAX_SIZE];
+    int data_len = recvfrom(sock, data, sizeof(data), 0, (struct sockaddr *) &addr, &addr_len);
+    if (data_len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      DebugLog("ERROR: recvfrom returns %d, errno is %d\n", data_len, errno);
+      close(sock);
+      return -2;
+    }
+
+    if (handle_beacon_packet(data, data_len, (struct sockaddr *) &addr, callback, user_data) != 0) {
+      break;
+    }
+  }
+
+  close(sock);
+  return 0;
+}
+
+int net_tcp_server(net_connect_callback callback, void *user_data)
+{
+  char listen_port[16];
+  snprintf(listen_port, sizeof(listen_port), "%d", config.tcp_server_port);
+
+  sock_type server_sock = open_server_socket(SOCK_STREAM, listen_port, config.use_ipv6, NULL, NULL);
+  if (server_sock < 0) {
+    DebugLog("ERROR: can't open TCP server socket\n");
+    return -1;
+  }
+
+  if (listen(server_sock, TCP_BACKLOG) != 0) {
+    DebugLog("ERROR: can't listen on TCP server port\n");
+    close(server_sock);
+    return -1;
+  }
+
+  int error_code = -1;
+  while (1) {
+    // handle connection
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    sock_type client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &client_addr_len);
+    if (client_sock < 0) {
+      DebugLog("[net_tcp_server] error in accept\n");
+      continue;
+    }
+    struct net_socket *net_socket = make_net_socket(client_sock);
+    if (net_socket == NULL) {
+      DebugLog("[net_tcp_server] error making socket\n");
+      close(client_sock);
+      continue;
+    }
+    DebugLog("[net_tcp_server] running callback\n");
+    callback(net_socket, user_data);
+  }
+
+  close(server_sock);
+  return error_code;
+}
+
+// ==========================================================================
+// Multicast
+// ==========================================================================
+
+#if !defined(IPV6_JOIN_GROUP) && defined(IPV6_ADD_MEMBERSHIP)
+#define IPV6_JOIN_GROUP IPV6_ADD_MEMBERSHIP
+#endif
+
+struct net_mcast {
+  sock_type sock;
+  struct sockaddr_storage addr;   // group address, where packets are sent
+  socklen_t addr_len;
+};
+
+static int join_mcast_group(sock_type sock, struct sockaddr *addr)
+{
+  if (addr->sa_family == AF_INET6) {
+    struct ipv6_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.ipv6mr_multiaddr = ((struct sockaddr_in6 *) addr)->sin6_addr;
+    mreq.ipv6mr_interface = 0;
+    return setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, (void *) &mreq, sizeof(mreq));
+  } else {
+    struct ip_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_multiaddr = ((struct sockaddr_in *) addr)->sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    return setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (void *) &mreq, sizeof(mreq));
+  }
+}
+
+static int set_mcast_sender_options(sock_type sock, int family)
+{
+  // keep packets in the local network, and let other processes of this machine get them
+  if (family == AF_INET6) {
+    int hops = 1;
+    unsigned int loop = 1;
+    if (setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (void *) &hops, sizeof(hops)) < 0) return -1;
+    return setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, (void *) &loop, sizeof(loop));
+  } else {
+    unsigned char ttl = 1;
+    unsigned char loop = 1;
+    if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (void *) &ttl, sizeof(ttl)) < 0) return -1;
+    return setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, (void *) &loop, sizeof(loop));
+  }
+}
+
+struct net_mcast *net_mcast_open(const char *group, int port, int join)
+{
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_NUMERICHOST;
+
+  char port_str[16];
+  snprintf(port_str, sizeof(port_str), "%d", port);
+
+  struct addrinfo *servinfo;
+  if (getaddrinfo(group, port_str, &hints, &servinfo) != 0) {
+    DebugLog("ERROR: invalid multicast group '%s'\n", group);
+    return NULL;
+  }
+
+  struct net_mcast *mcast = NULL;
+  for (struct addrinfo *p = servinfo; p != NULL; p = p->ai_next) {
+    sock_type sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (sock < 0) {
+      continue;
+    }
+
+    if (join) {
+      // several receivers on the same machine must be able to bind the group port
+      int reuse = 1;
+      setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *) &reuse, sizeof(reuse));
+#ifdef SO_REUSEPORT
+      setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void *) &reuse, sizeof(reuse));
+#endif
+      // room for bursts while the receiver is busy writing to disk
+      int buf_size = MCAST_RECV_BUFFER_SIZE;
+      setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (void *) &buf_size, sizeof(buf_size));
+      struct sockaddr_storage bind_addr;
+      memset(&bind_addr, 0, sizeof(bind_addr));
+      if (p->ai_family == AF_INET6) {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *) &bind_addr;
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_addr = in6addr_any;
+        addr6->sin6_port = htons((uint16_t) port);
+      } else {
+        struct sockaddr_in *addr4 = (struct sockaddr_in *) &bind_addr;
+        addr4->sin_family = AF_INET;
+        addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+        addr4->sin_port = htons((uint16_t) port);
+      }
+      if (bind(sock, (struct sockaddr *) &bind_addr, (int) p->ai_addrlen) < 0
+          || join_mcast_group(sock, p->ai_addr) < 0) {
+        DebugLog("ERROR: can't join multicast group '%s'\n", group);
+        close(sock);
+        continue;
+      }
+    } else if (set_mcast_sender_options(sock, p->ai_family) < 0) {
+      DebugLog("ERROR: can't set multicast options\n");
+      close(sock);
+      continue;
+    }
+
+    mcast = malloc(sizeof(*mcast));
+    if (mcast == NULL) {
+      close(sock);
+      break;
+    }
+    mcast->sock = sock;
+    memcpy(&mcast->addr, p->ai_addr, p->ai_addrlen);
+    mcast->addr_len = (socklen_t) p->ai_addrlen;
+    break;
+  }
+
+  freeaddrinfo(servinfo);
+  return mcast;
+}
+
+void net_mcast_close(struct net_mcast *mcast)
+{
+  if (mcast == NULL) return;
+  close(mcast->sock);
+  free(mcast);
+}
+
+int net_mcast_send(struct net_mcast *mcast, const void *data, size_t len)
+{
+  while (1) {
+    int ret = sendto(mcast->sock, (const char *) data, (int) len, 0, (struct sockaddr *) &mcast->addr, mcast->addr_len);
+    if (ret >= 0) {
+      return 0;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    DebugLog("ERROR: sendto returns %d, errno is %d\n", ret, errno);
+    return -1;
+  }
+}
+
+int net_mcast_recv(struct net_mcast *mcast, void *data, size_t max_len, int timeout_ms)
+{
+  while (1) {
+    int ret = poll_readable(mcast->sock, timeout_ms);
+    if (ret <= 0) {
+      return ret;
+    }
+
+    int len = recv(mcast->sock, (char *) data, (int) max_len, 0);
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      DebugLog("ERROR: recv returns %d, errno is %d\n", len, errno);
+      return -1;
+    }
+    if (len > 0) {
+      return len;
+    }
+  }
+}
+
+// ==========================================================================
+// Event-driven TCP server
+// ==========================================================================
+
+#if HAVE_EPOLL
+
+static uint64_t get_time_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static int set_socket_blocking(sock_type sock, int blocking)
+{
+  int flags = fcntl(sock, F_GETFL, 0);
+  if (flags < 0) {
+    return -1;
+  }
+  flags = (blocking) ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+  return fcntl(sock, F_SETFL, flags);
+}
+
+static struct net_send_segment *alloc_send_segment(struct net_conn *conn, int fd, size_t data_size)
+{
+  struct net_send_segment *seg = malloc(sizeof(*seg) + data_size);
+  if (seg == NULL) {
+    return NULL;
+  }
+  seg->next = NULL;
+  seg->fd = fd;
+  seg->offset = 0;
+  seg->len = 0;
+  seg->data_size = data_size;
+
+  if (conn->send_tail != NULL) {
+    conn->send_tail->next = seg;
+  } else {
+    conn->send_head = seg;
+  }
+  conn->send_tail = seg;
+  return seg;
+}
+
+static int queue_send_data(struct net_conn *conn, const void *data, size_t len)
+{
+  // append to the last data segment while it has room
+  struct net_send_segment *seg = conn->send_tail;
+  if (seg == NULL || seg->fd >= 0 || seg->data_size - (seg->offset + seg->len) < len) {
+    seg = alloc_send_segment(conn, -1, (len > REACTOR_SEND_DATA_SIZE) ? len : REACTOR_SEND_DATA_SIZE);
+    if (seg == NULL) {
+      return -1;
+    }
+  }
+  memcpy(seg->data + seg->offset + seg->len, data, len);
+  seg->len += len;
+  return 0;
+}
+
+static int queue_send_file(struct net_conn *conn, const char *file_name, uint64_t offset, uint64_t len)
+{
+  if (len == 0) {
+    return 0;
+  }
+  int fd = open(file_name, O_RDONLY|O_CLOEXEC);
+  if (fd < 0) {
+    DebugLog("ERROR: can't open file '%s'\n", file_name);
+    return -1;
+  }
+  posix_fadvise(fd, (off_t) offset, (off_t) len, POSIX_FADV_SEQUENTIAL);
+
+  struct net_send_segment *seg = alloc_send_segment(conn, fd, 0);
+  if (seg == NULL) {
+    close(fd);
+    return -1;
+  }
+  seg->offset = offset;
+  seg->len = len;
+  return 0;
+}
+
+static void set_conn_events(struct net_conn *conn, uint32_t events)
+{
+  if (conn->events == events) {
+    return;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = conn;
+  epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_MOD, conn->sock->sock, &ev);
+  conn->events = events;
+}
+
+static void free_conn(struct net_conn *conn)
+{
+  conn->prev->next = conn->next;
+  conn->next->prev = conn->prev;
+
+  while (conn->send_head != NULL) {
+    struct net_send_segment *seg = conn->send_head;
+    conn->send_head = seg->next;
+    if (seg->fd >= 0) {
+      close(seg->fd);
+    }
+    free(seg);
+  }
+
+  if (conn->sock != NULL) {
+    if (conn->sock->on_close != NULL) {
+      conn->sock->on_close(conn->sock->on_close_data);
+    }
+    DebugLog("========== FREEING SOCKET %p\n", conn->sock);
+    close(conn->sock->sock);    // also removes it from epoll
+    free(conn->sock->recv_buf);
+    free(conn->sock);
+  }
+  free(conn);
+}
+
+int net_detach_socket(struct net_socket *sock)
+{
+  struct net_conn *conn = sock->conn;
+  if (conn == NULL) {
+    return 0;
+  }
+  if (conn->send_head != NULL) {
+    DebugLog("ERROR: can't detach socket with queued data\n");
+    return -1;
+  }
+  if (set_socket_blocking(sock->sock, 1) != 0) {
+    return -1;
+  }
+  epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_DEL, sock->sock, NULL);
+  conn->state = CONN_DETACHED;
+  conn->sock = NULL;
+  sock->conn = NULL;
+  return 0;
+}
+
+// send as much queued data as the socket takes: returns -1 on error
+static int flush_conn(struct net_conn *conn)
+{
+  sock_type sock = conn->sock->sock;
+  int progress = 0;
+  while (conn->send_head != NULL) {
+    struct net_send_segment *seg = conn->send_head;
+    ssize_t done;
+    if (seg->fd < 0) {
+      done = send(sock, seg->data + seg->offset, (size_t) seg->len, MSG_NOSIGNAL);
+    } else {
+      off_t file_offset = (off_t) seg->offset;
+      size_t chunk_size = (seg->len > SENDFILE_CHUNK_SIZE) ? SENDFILE_CHUNK_SIZE : (size_t) seg->len;
+      done = sendfile(sock, seg->fd, &file_offset, chunk_size);
+      if (done < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        // sendfile() is not supported for this file, copy through a buffer
+        char data[FILE_CHUNK_SIZE];
+        if (chunk_size > sizeof(data)) {
+          chunk_size = sizeof(data);
+        }
+        ssize_t len = pread(seg->fd, data, chunk_size, (off_t) seg->offset);
+        done = (len > 0) ? send(sock, data, (size_t) len, MSG_NOSIGNAL) : -1;
+        if (len == 0) {
+          errno = EIO;
+        }
+      }
+      if (done == 0) {
+        DebugLog("ERROR: file was truncated while sending\n");
+        return -1;
+      }
+    }
+    if (done < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // wait until the socket takes more, dropping receivers that stop reading
+        if (progress) {
+          conn->deadline = get_time_ms() + REACTOR_TIMEOUT_MS;
+        }
+        set_conn_events(conn, EPOLLOUT);
+        return 0;
+      }
+      return -1;
+    }
+
+    progress = 1;
+    seg->offset += (uint64_t) done;
+    seg->len -= (uint64_t) done;
+    if (seg->len == 0) {
+      conn->send_head = seg->next;
+      if (conn->send_head == NULL) {
+        conn->send_tail = NULL;
+      }
+      if (seg->fd >= 0) {
+        close(seg->fd);
+      }
+      free(seg);
+    }
+  }
+
+  // everything sent: close our side and wait for the receiver to close
+  shutdown(sock, SHUT_WR);
+  conn->state = CONN_DRAINING;
+  conn->deadline = get_time_ms() + REACTOR_TIMEOUT_MS;
+  set_conn_events(conn, EPOLLIN);
+  return 0;
+}
+
+// read the request and pass it to the callback: returns -1 to drop the connection
+static int read_conn_request(struct net_conn *conn)
+{
+  struct net_socket *sock = conn->sock;
+  int closed = 0;
+  while (sock->recv_len < REACTOR_REQUEST_MAX_SIZE) {
+    ssize_t done = recv(sock->sock, sock->recv_buf + sock->recv_len, REACTOR_REQUEST_MAX_SIZE - sock->recv_len, 0);
+    if (done > 0) {
+      sock->recv_len += (size_t) done;
+      continue;
+    }
+    if (done < 0 && errno == EINTR) continue;
+    if (done < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    closed = 1;
+    break;
+  }
+  if (sock->recv_len == 0) {
+    return (closed) ? -1 : 0;
+  }
+
+  // the callback parses the request from the start each time more data arrives
+  sock->recv_pos = 0;
+  conn->recv_short = 0;
+  if (conn->reactor->callback(sock, conn->reactor->user_data) != 0) {
+    if (conn->recv_short && !closed && sock->recv_len < REACTOR_REQUEST_MAX_SIZE) {
+      return 0;
+    }
+    DebugLog("ERROR: invalid request\n");
+    return -1;
+  }
+
+  if (conn->state == CONN_DETACHED) {
+    free_conn(conn);
+    return 1;
+  }
+  conn->state = CONN_SENDING;
+  conn->deadline = get_time_ms() + REACTOR_TIMEOUT_MS;
+  return flush_conn(conn);
+}
+
+static void drain_conn(struct net_conn *conn)
+{
+  while (1) {
+    char data[256];
+    ssize_t done = recv(conn->sock->sock, data, sizeof(data), 0);
+    if (done > 0) continue;
+    if (done < 0 && errno == EINTR) continue;
+    if (done < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    break;
+  }
+  free_conn(conn);
+}
+
+static void accept_conns(struct net_reactor *reactor)
+{
+  while (1) {
+    sock_type client_sock = accept4(reactor->server_sock, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+    if (client_sock < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      return;    // no more pending connections (or out of descriptors until one closes)
+    }
+
+    struct net_conn *conn = calloc(1, sizeof(*conn));
+    struct net_socket *sock = make_net_socket(client_sock);
+    unsigned char *recv_buf = malloc(REACTOR_REQUEST_MAX_SIZE);
+    if (conn == NULL || sock == NULL || recv_buf == NULL) {
+      DebugLog("[net_tcp_reactor_server] error making socket\n");
+      free(conn);
+      free(sock);
+      free(recv_buf);
+      close(client_sock);
+      continue;
+    }
+    sock->conn = conn;
+    sock->recv_buf = recv_buf;
+    conn->reactor = reactor;
+    conn->sock = sock;
+    conn->state = CONN_READING;
+    conn->events = EPOLLIN;
+    conn->deadline = get_time_ms() + REACTOR_TIMEOUT_MS;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = conn->events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) != 0) {
+      free(conn);
+      free(recv_buf);
+      free(sock);
+      close(client_sock);
+      continue;
+    }
+    conn->next = reactor->conns.next;
+    conn->prev = &reactor->conns;
+    conn->next->prev = conn;
+    conn->prev->next = conn;
+  }
+}
+
+static void expire_conns(struct net_reactor *reactor)
+{
+  // drop connections that made no progress for a while
+  uint64_t now = get_time_ms();
+  struct net_conn *conn = reactor->conns.next;
+  while (conn != &reactor->conns) {
+    struct net_conn *next = conn->next;
+    if (conn->deadline < now) {
+      DebugLog("[net_tcp_reactor_server] connection timed out\n");
+      free_conn(conn);
+    }
+    conn = next;
+  }
+}
+
+static void *run_reactor(void *data)
+{
+  struct net_reactor *reactor = data;
+  uint64_t next_expire = get_time_ms() + 1000;
+  while (1) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int num_events = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, 1000);
+    if (num_events < 0) {
+      if (errno == EINTR) continue;
+      DebugLog("ERROR: epoll_wait returns %d, errno is %d\n", num_events, errno);
+      break;
+    }
+
+    for (int i = 0; i < num_events; i++) {
+      struct net_conn *conn = events[i].data.ptr;
+      if (conn == NULL) {
+        accept_conns(reactor);
+        continue;
+      }
+      int ret = 0;
+      switch (conn->state) {
+      case CONN_READING:  ret = read_conn_request(conn); break;
+      case CONN_SENDING:  ret = flush_conn(conn); break;
+      case CONN_DRAINING: drain_conn(conn); break;
+      case CONN_DETACHED: break;
+      }
+      if (ret < 0) {
+        free_conn(conn);
+      }
+    }
+
+    uint64_t now = get_time_ms();
+    if (now >= next_expire) {
+      expire_conns(reactor);
+      next_expire = now + 1000;
+    }
+  }
+  return NULL;
+}
+
+int net_tcp_reactor_server(int num_threads, net_request_callback callback, void *user_data)
+{
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+
+  char listen_port[16];
+  snprintf(listen_port, sizeof(listen_port), "%d", config.tcp_server_port);
+
+  sock_type server_sock = open_server_socket(SOCK_STREAM, listen_port, config.use_ipv6, NULL, NULL);
+  if (server_sock < 0) {
+    DebugLog("ERROR: can't open TCP server socket\n");
+    return -1;
+  }
+  if (listen(server_sock, REACTOR_BACKLOG) != 0 || set_socket_blocking(server_sock, 0) != 0) {
+    DebugLog("ERROR: can't listen on TCP server port\n");
+    close(server_sock);
+    return -1;
+  }
+
+  // one epoll instance per thread, all waiting on the server socket
+  struct net_reactor *reactors = calloc((size_t) num_threads, sizeof(*reactors));
+  if (reactors == NULL) {
+    close(server_sock);
+    return -2;
+  }
+  int num_reactors = 0;
+  for (; num_reactors < num_threads; num_reactors++) {
+    struct net_reactor *reactor = &reactors[num_reactors];
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd < 0) {
+      break;
+    }
+    reactor->server_sock = server_sock;
+    reactor->callback = callback;
+    reactor->user_data = user_data;
+    reactor->conns.next = reactor->conns.prev = &reactor->conns;
+
+    // wake only one thread per new connection where the kernel supports it
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, server_sock, &ev) != 0) {
+      ev.events = EPOLLIN;
+      if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, server_sock, &ev) != 0) {
+        close(reactor->epoll_fd);
+        break;
+      }
+    }
+  }
+  if (num_reactors == 0) {
+    DebugLog("ERROR: can't create epoll instance\n");
+    free(reactors);
+    close(server_sock);
+    return -2;
+  }
+
+  for (int i = 1; i < num_reactors; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_reactor, &reactors[i]) == 0) {
+      pthread_detach(thread);
+    }
+  }
+  run_reactor(&reactors[0]);
+
+  // only reached if epoll fails, the other threads keep running
+  return -1;
+}
+
+#else /* HAVE_EPOLL */
+
+int net_detach_socket(struct net_socket *sock)
+{
+  return 0;
+}
+
+int net_tcp_reactor_server(int num_threads, net_request_callback callback, void *user_data)
+{
+  return -2;
+}
+
+#endif /* HAVE_EPOLL */
+
+// ==========================================================================
+// Event loop support
+// ==========================================================================
+
+#if HAVE_EPOLL
+
+#include <sys/eventfd.h>
+
+struct net_poller {
+  int epoll_fd;
+  int wakeup_fd;
+};
+
+struct net_poller *net_poller_open(void)
+{
+  struct net_poller *poller = malloc(sizeof(*poller));
+  if (poller == NULL) {
+    return NULL;
+  }
+  poller->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  poller->wakeup_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  if (poller->epoll_fd < 0 || poller->wakeup_fd < 0) {
+    goto err;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, poller->wakeup_fd, &ev) != 0) {
+    goto err;
+  }
+  return poller;
+
+ err:
+  if (poller->epoll_fd >= 0) close(poller->epoll_fd);
+  if (poller->wakeup_fd >= 0) close(poller->wakeup_fd);
+  free(poller);
+  return NULL;
+}
+
+void net_poller_close(struct net_poller *poller)
+{
+  close(poller->epoll_fd);
+  close(poller->wakeup_fd);
+  free(poller);
+}
+
+int net_poller_watch(struct net_poller *poller, struct net_socket *sock, int events, void *user_data)
+{
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLONESHOT;
+  if (events & NET_POLL_READ) ev.events |= EPOLLIN;
+  if (events & NET_POLL_WRITE) ev.events |= EPOLLOUT;
+  ev.data.ptr = user_data;
+  if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_MOD, sock->sock, &ev) != 0) {
+    if (errno != ENOENT || epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, sock->sock, &ev) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void net_poller_unwatch(struct net_poller *poller, struct net_socket *sock)
+{
+  epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, sock->sock, NULL);
+}
+
+int net_poller_wait(struct net_poller *poller, void **ready, int max_ready, int timeout_ms)
+{
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  if (max_ready > REACTOR_MAX_EVENTS) {
+    max_ready = REACTOR_MAX_EVENTS;
+  }
+  int num_events = epoll_wait(poller->epoll_fd, events, max_ready, timeout_ms);
+  if (num_events < 0) {
+    return (errno == EINTR) ? 0 : -1;
+  }
+
+  int num_ready = 0;
+  for (int i = 0; i < num_events; i++) {
+    if (events[i].data.ptr == NULL) {
+      uint64_t count;
+      if (read(poller->wakeup_fd, &count, sizeof(count)) < 0) {
+        // already reset by another wakeup
+      }
+      continue;
+    }
+    ready[num_ready++] = events[i].data.ptr;
+  }
+  return num_ready;
+}
+
+void net_poller_wakeup(struct net_poller *poller)
+{
+  uint64_t count = 1;
+  if (write(poller->wakeup_fd, &count, sizeof(count)) < 0) {
+    // counter is full, so a wakeup is already pending
+  }
+}
+
+struct net_socket *net_start_connect_to_beacon(struct net_msg_beacon *beacon)
+{
+  // the beacon host is always a numeric address, so this doesn't block
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = beacon->net_family;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+
+  char net_port[32];
+  snprintf(net_port, sizeof(net_port), "%d", beacon->net_port);
+
+  struct addrinfo *servinfo;
+  if (getaddrinfo(beacon->net_host, net_port, &hints, &servinfo) != 0) {
+    return NULL;
+  }
+
+  struct net_socket *net_socket = NULL;
+  sock_type sock = socket(servinfo->ai_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  if (sock >= 0) {
+    int ret = connect(sock, servinfo->ai_addr, (socklen_t) servinfo->ai_addrlen);
+    if (ret == 0 || errno == EINPROGRESS) {
+      net_socket = make_net_socket(sock);
+    }
+    if (net_socket == NULL) {
+      close(sock);
+    }
+  }
+  freeaddrinfo(servinfo);
+  return net_socket;
+}
+
+int net_finish_connect(struct net_socket *sock)
+{
+  int error = 0;
+  socklen_t error_len = sizeof(error);
+  if (getsockopt(sock->sock, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0 || error != 0) {
+    DebugLog("[net_finish_connect] ERROR connecting: %d\n", error);
+    return -1;
+  }
+  return 0;
+}
+
+int net_try_send_data(struct net_socket *sock, const void *data, size_t len)
+{
+  while (1) {
+    ssize_t done = send(sock->sock, data, len, MSG_NOSIGNAL|MSG_DONTWAIT);
+    if (done >= 0) return (int) done;
+    if (errno == EINTR) continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return NET_AGAIN;
+    return -1;
+  }
+}
+
+int net_try_recv_data(struct net_socket *sock, void *data, size_t len)
+{
+  while (1) {
+    ssize_t done = recv(sock->sock, data, len, MSG_DONTWAIT);
+    if (done >= 0) return (int) done;
+    if (errno == EINTR) continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return NET_AGAIN;
+    return -1;
+  }
+}
+
+#else /* HAVE_EPOLL */
+
+struct net_poller *net_poller_open(void)
+{
+  return NULL;
+}
+
+void net_poller_close(struct net_poller *poller) {}
+int net_poller_watch(struct net_poller *poller, struct net_socket *sock, int events, void *user_data) { return -1; }
+void net_poller_unwatch(struct net_poller *poller, struct net_socket *sock) {}
+int net_poller_wait(struct net_poller *poller, void **ready, int max_ready, int timeout_ms) { return -1; }
+void net_poller_wakeup(struct net_poller *poller) {}
+struct net_socket *net_start_connect_to_beacon(struct net_msg_beacon *beacon) { return NULL; }
+int net_finish_connect(struct net_socket *sock) { return -1; }
+int net_try_send_data(struct net_socket *sock, const void *data, size_t len) { return -1; }
+int net_try_recv_data(struct net_socket *sock, void *data, size_t len) { return -1; }
+
+#endif /* HAVE_EPOLL */
+
+int net_set_recv_data(struct net_socket *sock, const void *data, size_t len)
+{
+  unsigned char *recv_buf = malloc((len > 0) ? len : 1);
+  if (recv_buf == NULL) {
+    return -1;
+  }
+  memcpy(recv_buf, data, len);
+  free(sock->recv_buf);
+  sock->recv_buf = recv_buf;
+  sock->recv_len = len;
+  sock->recv_pos = 0;
+  return 0;
+}
+
+struct net_socket *net_open_memory_socket(size_t max_send)
+{
+  struct net_socket *net_socket = make_net_socket(-1);
+  if (net_socket != NULL) {
+    net_socket->in_memory = 1;
+    net_socket->send_max = max_send;
+  }
+  return net_socket;
+}
+
+const void *net_get_memory_socket_data(struct net_socket *sock, size_t *len)
+{
+  *len = sock->send_len;
+  return sock->send_buf;
+}
+
+struct net_socket *net_open_custom_socket(const struct net_socket_ops *ops, void *ops_data)
+{
+  struct net_socket *net_socket = make_net_socket(-1);
+  if (net_socket != NULL) {
+    net_socket->ops = ops;
+    net_socket->ops_data = ops_data;
+  }
+  return net_socket;
+}
+
+static int send_beacon_packet(unsigned char *beacon_data, size_t len, uint32_t num_messages)
+{
+  if (beacon_sock < 0) {
+    beacon_sock = open_udp_broadcast_socket(config.udp_server_port, config.use_ipv6, &beacon_addr, &beacon_addr_len);
+    if (beacon_sock < 0) {
+      beacon_sock = -1;
+      return -1;
+    }
+  }
+
+  pack_u32(beacon_data,  0, BEACON_MAGIC);
+  pack_u32(beacon_data,  4, BEACON_VERSION);
+  pack_u32(beacon_data,  8, config.tcp_server_port);
+  pack_u32(beacon_data, 12, num_messages);
+  int sent_len = sendto(beacon_sock, beacon_data, (int) len, 0, (struct sockaddr *) &beacon_addr, beacon_addr_len);
+  if (sent_len != (int) len) {
+    // the network may have changed: open a new socket next time
+    close(beacon_sock);
+    beacon_sock = -1;
+    return -2;
+  }
+  return 0;
+}
+
+int net_send_msg_beacons(const struct net_beacon_entry *entries, size_t num_entries)
+{
+  // broadcast UDP beacons with as many messages as fit in each
+  unsigned char beacon_data[BEACON_PACKET_MAX_SIZE];
+  size_t len = BEACON_HEADER_SIZE;
+  uint32_t num_messages = 0;
+  for (size_t i = 0; i < num_entries; i++) {
+    size_t head_len = (entries[i].head_len <= NET_BEACON_MAX_HEAD_SIZE) ? entries[i].head_len : 0;
+    if (len + BEACON_ENTRY_HEADER_SIZE + head_len > sizeof(beacon_data)) {
+      if (send_beacon_packet(beacon_data, len, num_messages) != 0) {
+        return -1;
+      }
+      len = BEACON_HEADER_SIZE;
+      num_messages = 0;
+    }
+
+    pack_u32(beacon_data, len,     entries[i].message_id);
+    pack_u32(beacon_data, len + 4, (uint32_t) head_len);
+    if (head_len > 0) {
+      memcpy(beacon_data + len + BEACON_ENTRY_HEADER_SIZE, entries[i].head, head_len);
+    }
+    len += BEACON_ENTRY_HEADER_SIZE + head_len;
+    num_messages++;
+  }
+
+  if (num_messages > 0 && send_beacon_packet(beacon_data, len, num_messages) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int net_send_msg_beacon(uint32_t message_id)
+{
+  struct net_beacon_entry entry = { message_id, NULL, 0 };
+  return net_send_msg_beacons(&entry, 1);
+}
+
+struct net_socket *net_connect_to_beacon(struct net_msg_beacon *beacon)
+{
+  struct net_socket *net_socket = NULL;
+  DebugLog("[net_connect_to_beacon] will connect to '%s:%d'\n", beacon->net_host, beacon->net_port);
+  sock_type sock = socket(beacon->net_family, SOCK_STREAM, 0);
+  if (sock < 0) goto end;
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = beacon->net_family;
+  hints.ai_socktype = SOCK_STREAM;
+
+  char net_port[32];
+  snprintf(net_port, sizeof(net_port), "%d", beacon->net_port);
 
   struct addrinfo *servinfo;
   if (getaddrinfo(beacon->net_host, net_port, &hints, &servinfo) != 0) {
@@ -492,3 +2419,42 @@ int net_beacons_are_equal(struct net_msg_beacon *beacon1, struct net_msg_beacon
   if (strcmp(beacon1->net_host, beacon2->net_host) != 0) return 0;
   return 1;
 }
+
+const void *net_get_beacon_head(struct net_msg_beacon *beacon, size_t *len)
+{
+  if (beacon->head_len == 0) {
+    return NULL;
+  }
+  if (len != NULL) {
+    *len = beacon->head_len;
+  }
+  return beacon->head;
+}
+
+uint32_t net_hash_beacon(struct net_msg_beacon *beacon)
+{
+  // FNV-1a over the fields compared by net_beacons_are_equal()
+  uint32_t hash = 2166136261u;
+  uint32_t fields[3] = { (uint32_t) beacon->net_family, beacon->net_port, beacon->message_id };
+  for (int i = 0; i < 3; i++) {
+    for (int b = 0; b < 4; b++) {
+      hash = (hash ^ ((fields[i] >> (8*b)) & 0xff)) * 16777619u;
+    }
+  }
+  for (const char *p = beacon->net_host; *p != '\0'; p++) {
+    hash = (hash ^ (unsigned char) *p) * 16777619u;
+  }
+  return hash;
+}
+
+struct net_msg_beacon *net_copy_beacon(struct net_msg_beacon *beacon)
+{
+  // the copy doesn't keep the message head
+  struct net_msg_beacon *copy = malloc(sizeof(*copy));
+  if (copy == NULL) {
+    return NULL;
+  }
+  memcpy(copy, beacon, sizeof(*copy));
+  copy->head_len = 0;
+  return copy;
+}
@@ -17,12 +17,26 @@ extern "C" {
           (((uint32_t)((b)&0xff)) <<  8) |\
           (((uint32_t)((a)&0xff)) <<  0) )
 
+// max size of a message head sent in a beacon
+#define NET_BEACON_MAX_HEAD_SIZE  1024
+
 struct net_config;
 struct net_socket;
 struct net_msg_beacon;
 
+// message announced in a beacon, optionally with its head
+struct net_beacon_entry {
+  uint32_t message_id;
+  const void *head;             // sent only if it's up to NET_BEACON_MAX_HEAD_SIZE bytes
+  size_t head_len;
+};
+
 typedef int (*net_beacon_callback)(struct net_msg_beacon *beacon, void *user_data);
 typedef void (*net_connect_callback)(struct net_socket *sock, void *user_data);
+typedef int (*net_progress_callback)(uint64_t bytes_done, void *user_data);
+typedef int (*net_request_callback)(struct net_socket *sock, void *user_data);
+typedef void (*net_throttle_callback)(int direction, size_t len, void *user_data);
+typedef void (*net_close_callback)(void *user_data);
 
 // setup network
 int net_setup(int server_udp_port, int server_tcp_port, int use_ipv6);
@@ -33,25 +47,140 @@ int net_udp_server(net_beacon_callback callback, void *user_data);
 // listen to TCP connections and run the callback for each new connections
 int net_tcp_server(net_connect_callback callback, void *user_data);
 
+// serve TCP connections from non-blocking event loops running on 'num_threads' threads
+// (epoll on Linux).  The callback runs on an event loop thread whenever more
+// request data arrives, with the socket reading from the data received so far:
+// it must return -1 if it needs more, or 0 once it took the request.  Sends on
+// the socket are queued and sent without blocking, and the socket is closed
+// after the queued data is sent.  Returns -2 if not supported on this system.
+int net_tcp_reactor_server(int num_threads, net_request_callback callback, void *user_data);
+
+// take a socket out of the event-driven server to use it with blocking calls,
+// keeping the request data it received (must be called before sending anything)
+int net_detach_socket(struct net_socket *sock);
+
+// wait for sockets on an event loop (epoll on Linux, NULL if not supported);
+// each watch fires once, passing its user_data to net_poller_wait()
+#define NET_POLL_READ   0x01
+#define NET_POLL_WRITE  0x02
+struct net_poller;
+struct net_poller *net_poller_open(void);
+void net_poller_close(struct net_poller *poller);
+int net_poller_watch(struct net_poller *poller, struct net_socket *sock, int events, void *user_data);
+void net_poller_unwatch(struct net_poller *poller, struct net_socket *sock);
+int net_poller_wait(struct net_poller *poller, void **ready, int max_ready, int timeout_ms);
+void net_poller_wakeup(struct net_poller *poller);
+
+// non-blocking socket calls for event loops: they return the number of bytes
+// done (0 for end of stream when receiving) or NET_AGAIN if the socket isn't ready
+#define NET_AGAIN  (-2)
+struct net_socket *net_start_connect_to_beacon(struct net_msg_beacon *address);
+int net_finish_connect(struct net_socket *sock);
+int net_try_send_data(struct net_socket *sock, const void *data, size_t len);
+int net_try_recv_data(struct net_socket *sock, void *data, size_t len);
+
+// make the net_recv_*() calls read 'data' before reading from the socket
+int net_set_recv_data(struct net_socket *sock, const void *data, size_t len);
+
 // connect to server to receive a message
 struct net_socket *net_connect_to_beacon(struct net_msg_beacon *address);
 
 // broadcast an UDP message beacon
 int net_send_msg_beacon(uint32_t message_id);
 
+// broadcast beacons announcing several messages, packing as many as fit in
+// each packet; the broadcast socket is kept open between calls, so only one
+// thread should send beacons
+int net_send_msg_beacons(const struct net_beacon_entry *entries, size_t num_entries);
+
+// socket that keeps sent data in memory (up to 'max_send' bytes) instead of
+// sending it; use net_set_recv_data() to give it data to receive
+struct net_socket *net_open_memory_socket(size_t max_send);
+const void *net_get_memory_socket_data(struct net_socket *sock, size_t *len);
+
+// socket whose data goes through the given functions (e.g. a stream sharing
+// a connection with others); recv() must receive all 'len' bytes, and
+// close() is called from net_close_socket()
+struct net_socket_ops {
+  int (*send)(void *ops_data, const void *data, size_t len);
+  int (*recv)(void *ops_data, void *data, size_t len);
+  void (*close)(void *ops_data);
+};
+struct net_socket *net_open_custom_socket(const struct net_socket_ops *ops, void *ops_data);
+
+// UDP multicast socket for a group address ("239.x.x.x" or "ff02::x"),
+// either joining the group to receive packets sent to 'port', or sending
+// packets to it; net_mcast_recv() returns the packet size, 0 on timeout or
+// -1 on error
+struct net_mcast;
+struct net_mcast *net_mcast_open(const char *group, int port, int join);
+void net_mcast_close(struct net_mcast *mcast);
+int net_mcast_send(struct net_mcast *mcast, const void *data, size_t len);
+int net_mcast_recv(struct net_mcast *mcast, void *data, size_t max_len, int timeout_ms);
+
 // send data to a socket
 int net_send_u32(struct net_socket *sock, uint32_t data);
+int net_send_u64(struct net_socket *sock, uint64_t data);
 int net_send_data(struct net_socket *sock, const void *data, size_t len);
 
+// send 'len' bytes of a file starting at 'offset' (uses sendfile() where available)
+int net_send_file(struct net_socket *sock, const char *file_name, uint64_t offset, uint64_t len);
+
 // receive data from a socket
 int net_recv_u32(struct net_socket *sock, uint32_t *data_len);
+int net_recv_u64(struct net_socket *sock, uint64_t *data);
 int net_recv_data(struct net_socket *sock, void *data, size_t len);
 
+// wait up to 'timeout_ms' for data to read; returns 1 if there is some (or
+// the peer closed the connection), 0 on timeout and -1 on error
+int net_wait_readable(struct net_socket *sock, int timeout_ms);
+
+// wait up to 'timeout_ms' for any of the sockets to have data to read,
+// setting ready[i] for each one that has; returns the number of ready
+// sockets, 0 on timeout and -1 on error
+int net_wait_readable_any(struct net_socket **socks, int *ready, int num_socks, int timeout_ms);
+
+// create a file with the given size (preallocating disk space where possible) to receive data
+int net_prepare_file(const char *file_name, uint64_t size);
+
+// use io_uring for file transfers where the kernel supports it (enabled by default)
+void net_set_io_uring(int enable);
+
+// receive 'len' bytes into a file starting at 'offset' (the file is not truncated);
+// fails if 'progress' returns nonzero, so the caller can stop the transfer
+int net_recv_file(struct net_socket *sock, const char *file_name, uint64_t offset, uint64_t len,
+                  net_progress_callback progress, void *user_data);
+
 // beacon functions
 uint32_t net_get_beacon_message_id(struct net_msg_beacon *beacon);
+const char *net_get_beacon_host(struct net_msg_beacon *beacon);
+uint32_t net_get_beacon_port(struct net_msg_beacon *beacon);
+const void *net_get_beacon_head(struct net_msg_beacon *beacon, size_t *len);   // NULL if not sent in the beacon
 int net_beacons_are_equal(struct net_msg_beacon *beacon1, struct net_msg_beacon *beacon2);
+uint32_t net_hash_beacon(struct net_msg_beacon *beacon);      // equal beacons have the same hash
+struct net_msg_beacon *net_copy_beacon(struct net_msg_beacon *beacon);
+struct net_msg_beacon *net_make_beacon(const char *host, uint32_t port, uint32_t message_id);   // to connect to a known peer
 void net_free_beacon(struct net_msg_beacon *beacon);
 
+// per-socket transfer options
+#define NET_SOCKET_COMPRESS  0x01     // bodies are sent as compressed frames
+void net_set_socket_options(struct net_socket *sock, uint32_t options);
+uint32_t net_get_socket_options(struct net_socket *sock);
+
+// limit the transfer rate of a socket: the callback is called before each
+// chunk of data is sent or received, and must wait until the chunk may go
+#define NET_THROTTLE_SEND  0
+#define NET_THROTTLE_RECV  1
+void net_set_socket_throttle(struct net_socket *sock, net_throttle_callback throttle, void *user_data);
+
+// run the callback when the event-driven server closes the socket, after
+// sending its queued data (or dropping it on errors)
+void net_set_socket_close_callback(struct net_socket *sock, net_close_callback on_close, void *user_data);
+
+// host at the other end of a connection (-1 for memory and custom sockets)
+#define NET_MAX_HOST_SIZE  64         // enough for any address
+int net_get_socket_host(struct net_socket *sock, char *host, size_t host_size);
+
 // close a socket
 void net_close_socket(struct net_socket *sock);
 
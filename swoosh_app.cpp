@@ -1,24 +1,74 @@
 #include "targetver.h"
 #include "swoosh_app.h"
 
+#include <wx/stdpaths.h>
+#include <wx/filename.h>
+
 #include "swoosh_frame.h"
 #include "util.h"
 
+#define SHARE_CATALOG_FILE_NAME  "shares.catalog"
+
 wxIMPLEMENT_APP(SwooshApp);
 
 bool SwooshApp::OnInit()
 {
+  if (!wxApp::OnInit()) {
+    return false;
+  }
   wxInitAllImageHandlers();
+
+  // keep the shares between runs
+  wxString data_dir = wxStandardPaths::Get().GetUserDataDir();
+  if (wxFileName::Mkdir(data_dir, wxS_DIR_DEFAULT, wxPATH_MKDIR_FULL)) {
+    SwooshNode::SetShareCatalog(wxFileName(data_dir, SHARE_CATALOG_FILE_NAME).GetFullPath().ToStdString());
+  }
+
   SwooshFrame *frame = new SwooshFrame();
   frame->Show(true);
   return true;
 }
 
-int ReadFileSize(std::string file_name, uint32_t *file_size)
+void SwooshApp::OnInitCmdLine(wxCmdLineParser &parser)
+{
+  wxApp::OnInitCmdLine(parser);
+  parser.AddOption("", "beacon-threads", "number of threads handling received beacons", wxCMD_LINE_VAL_NUMBER);
+  parser.AddOption("", "request-threads", "number of threads serving requests from other nodes", wxCMD_LINE_VAL_NUMBER);
+  parser.AddOption("", "transfer-threads", "number of threads sending files and directories to other nodes", wxCMD_LINE_VAL_NUMBER);
+  parser.AddSwitch("", "no-io-uring", "don't use io_uring for file transfers");
+  parser.AddOption("", "reactor-threads", "number of event loop threads accepting requests, 0 for a blocking accept loop",
+                   wxCMD_LINE_VAL_NUMBER);
+}
+
+bool SwooshApp::OnCmdLineParsed(wxCmdLineParser &parser)
+{
+  if (!wxApp::OnCmdLineParsed(parser)) {
+    return false;
+  }
+
+  // the node reads these when the frame creates it
+  long beacon_threads = 0, request_threads = 0, transfer_threads = 0;
+  parser.Found("beacon-threads", &beacon_threads);
+  parser.Found("request-threads", &request_threads);
+  parser.Found("transfer-threads", &transfer_threads);
+  SwooshNode::SetThreadPoolSize((beacon_threads > 0) ? (size_t) beacon_threads : 0,
+                                (request_threads > 0) ? (size_t) request_threads : 0,
+                                (transfer_threads > 0) ? (size_t) transfer_threads : 0);
+  long reactor_threads;
+  if (parser.Found("reactor-threads", &reactor_threads)) {
+    SwooshNode::SetReactorThreads((int) reactor_threads);
+  }
+  if (parser.Found("no-io-uring")) {
+    net_set_io_uring(0);
+  }
+  return true;
+}
+
+int ReadFileSize(std::string file_name, uint64_t *file_size)
 {
   wxStructStat stat;
   if (wxStat(file_name, &stat) == 0) {
-    *file_size = (uint32_t) stat.st_size;
+    *file_size = (uint64_t) stat.st_size;
     return 0;
   }
   return -1;
@@ -2,17 +2,20 @@
 #define SWOOSH_APP_H_FILE
 
 #include <wx/wx.h>
+#include <wx/cmdline.h>
 
 class SwooshApp : public wxApp
 {
 public:
   bool OnInit() override;
+  void OnInitCmdLine(wxCmdLineParser &parser) override;
+  bool OnCmdLineParsed(wxCmdLineParser &parser) override;
 };
 
 wxDECLARE_APP(SwooshApp);
 
 wxString GetPathFilename(wxString path);
 std::string GetPathFilename(std::string path);
-int ReadFileSize(std::string file_name, uint32_t *file_size);
+int ReadFileSize(std::string file_name, uint64_t *file_size);
 
 #endif /* SWOOSH_APP_H_FILE */
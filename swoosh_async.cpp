@@ -0,0 +1,258 @@
+#include "targetver.h"
+#include "swoosh_async.h"
+
+#include <chrono>
+#include <algorithm>
+
+#include "util.h"
+
+#define LOOP_MAX_EVENTS     64
+#define LOOP_TIMEOUT_MS     30000
+#define RECV_ALL_CHUNK_SIZE 4096
+
+static uint64_t GetTimeMs()
+{
+  using namespace std::chrono;
+  return (uint64_t) duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+SwooshEventLoop::SwooshEventLoop()
+  : poller(net_poller_open()), running(false)
+{
+  if (poller) {
+    running = true;
+    loop_thread = std::thread{[this] { Run(); }};
+  }
+}
+
+SwooshEventLoop::~SwooshEventLoop()
+{
+  Stop();
+  if (poller) {
+    net_poller_close(poller);
+  }
+}
+
+void SwooshEventLoop::Stop()
+{
+  if (running.exchange(false)) {
+    net_poller_wakeup(poller);
+  }
+  if (loop_thread.joinable()) {
+    loop_thread.join();
+  }
+  DestroyTasks();
+}
+
+void SwooshEventLoop::DestroyTasks()
+{
+  // the loop thread is gone, so close the sockets of the coroutines still
+  // waiting and destroy them (each task destroys the coroutines it awaits)
+  for (Waiter *waiter : waiters) {
+    net_poller_unwatch(poller, waiter->sock);
+    net_close_socket(waiter->sock);
+  }
+  waiters.clear();
+
+  std::unordered_set<void *> started;
+  started.swap(tasks);
+  for (void *task : started) {
+    std::coroutine_handle<>::from_address(task).destroy();
+  }
+
+  std::deque<std::coroutine_handle<DetachedTask::promise_type>> not_started;
+  {
+    std::lock_guard<std::mutex> guard(post_lock);
+    not_started.swap(posted);
+  }
+  for (auto handle : not_started) {
+    handle.destroy();
+  }
+}
+
+bool SwooshEventLoop::WaitAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+  waiter.handle = handle;
+  waiter.deadline = GetTimeMs() + LOOP_TIMEOUT_MS;
+  if (net_poller_watch(loop.poller, waiter.sock, events, &waiter) != 0) {
+    waiter.timed_out = true;
+    return false;
+  }
+  loop.waiters.insert(&waiter);
+  return true;
+}
+
+SwooshEventLoop::DetachedTask SwooshEventLoop::RunDetached(SwooshTask<void> task)
+{
+  co_await task;
+}
+
+void SwooshEventLoop::Spawn(SwooshTask<void> task)
+{
+  Post(RunDetached(std::move(task)).handle);
+}
+
+void SwooshEventLoop::Post(std::coroutine_handle<DetachedTask::promise_type> handle)
+{
+  {
+    std::lock_guard<std::mutex> guard(post_lock);
+    if (!running) {
+      handle.destroy();     // the loop is stopped and won't run it
+      return;
+    }
+    posted.push_back(handle);
+  }
+  net_poller_wakeup(poller);
+}
+
+void SwooshEventLoop::ExpireWaiters()
+{
+  uint64_t now = GetTimeMs();
+  std::vector<Waiter *> expired;
+  for (Waiter *waiter : waiters) {
+    if (waiter->deadline < now) {
+      expired.push_back(waiter);
+    }
+  }
+  for (Waiter *waiter : expired) {
+    DebugLog("WARNING: socket wait timed out\n");
+    net_poller_unwatch(poller, waiter->sock);
+    waiters.erase(waiter);
+    waiter->timed_out = true;
+    waiter->handle.resume();
+  }
+}
+
+void SwooshEventLoop::Run()
+{
+  uint64_t next_expire = GetTimeMs() + 1000;
+  while (running) {
+    void *ready[LOOP_MAX_EVENTS];
+    int num_ready = net_poller_wait(poller, ready, LOOP_MAX_EVENTS, 1000);
+    if (num_ready < 0) {
+      DebugLog("ERROR: can't wait for sockets\n");
+      break;
+    }
+    for (int i = 0; i < num_ready; i++) {
+      Waiter *waiter = (Waiter *) ready[i];
+      waiters.erase(waiter);
+      waiter->handle.resume();
+    }
+
+    std::deque<std::coroutine_handle<DetachedTask::promise_type>> run;
+    {
+      std::lock_guard<std::mutex> guard(post_lock);
+      run.swap(posted);
+    }
+    for (auto handle : run) {
+      handle.promise().loop = this;
+      tasks.insert(handle.address());
+      handle.resume();
+    }
+
+    uint64_t now = GetTimeMs();
+    if (now >= next_expire) {
+      ExpireWaiters();
+      next_expire = now + 1000;
+    }
+  }
+}
+
+// ==========================================================================
+// Socket operations
+// ==========================================================================
+
+SwooshTask<net_socket *> SwooshEventLoop::Connect(net_msg_beacon *beacon)
+{
+  net_socket *sock = net_start_connect_to_beacon(beacon);
+  if (!sock) {
+    DebugLog("ERROR: can't connect to '%s'\n", net_get_beacon_host(beacon));
+    co_return nullptr;
+  }
+  if (!co_await WaitWritable(sock) || net_finish_connect(sock) != 0) {
+    DebugLog("ERROR: can't connect to '%s'\n", net_get_beacon_host(beacon));
+    net_close_socket(sock);
+    co_return nullptr;
+  }
+  co_return sock;
+}
+
+SwooshTask<int> SwooshEventLoop::Send(net_socket *sock, const void *data, size_t len)
+{
+  const char *pos = (const char *) data;
+  size_t len_left = len;
+  while (len_left > 0) {
+    int done = net_try_send_data(sock, pos, len_left);
+    if (done == NET_AGAIN) {
+      if (!co_await WaitWritable(sock)) {
+        co_return -1;
+      }
+      continue;
+    }
+    if (done <= 0) {
+      co_return -1;
+    }
+    pos += done;
+    len_left -= done;
+  }
+  co_return 0;
+}
+
+SwooshTask<int> SwooshEventLoop::SendU32(net_socket *sock, uint32_t data)
+{
+  unsigned char bytes[4];
+  for (int i = 0; i < 4; i++) {
+    bytes[i] = (unsigned char) (data >> (8*i));
+  }
+  co_return co_await Send(sock, bytes, sizeof(bytes));
+}
+
+SwooshTask<int> SwooshEventLoop::Recv(net_socket *sock, void *data, size_t len)
+{
+  char *pos = (char *) data;
+  size_t len_left = len;
+  while (len_left > 0) {
+    int done = net_try_recv_data(sock, pos, len_left);
+    if (done == NET_AGAIN) {
+      if (!co_await WaitReadable(sock)) {
+        co_return -1;
+      }
+      continue;
+    }
+    if (done <= 0) {
+      co_return -1;
+    }
+    pos += done;
+    len_left -= done;
+  }
+  co_return 0;
+}
+
+SwooshTask<int> SwooshEventLoop::RecvAll(net_socket *sock, std::vector<char> *data, size_t max_size)
+{
+  // read until the sender closes the connection
+  data->clear();
+  while (true) {
+    size_t size = data->size();
+    if (size >= max_size) {
+      DebugLog("ERROR: reply is too large\n");
+      co_return -1;
+    }
+    size_t chunk_size = std::min(max_size - size, (size_t) RECV_ALL_CHUNK_SIZE);
+    data->resize(size + chunk_size);
+    int done = net_try_recv_data(sock, data->data() + size, chunk_size);
+    data->resize(size + ((done > 0) ? done : 0));
+    if (done == 0) {
+      co_return 0;
+    }
+    if (done == NET_AGAIN) {
+      if (!co_await WaitReadable(sock)) {
+        co_return -1;
+      }
+      continue;
+    }
+    if (done < 0) {
+      co_return -1;
+    }
+  }
+}
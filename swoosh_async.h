@@ -0,0 +1,181 @@
+#ifndef SWOOSH_ASYNC_H_FILE
+#define SWOOSH_ASYNC_H_FILE
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <unordered_set>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <coroutine>
+
+#include "network.h"
+
+// ==========================================================================
+// SwooshTask
+// ==========================================================================
+
+// Coroutine returning a T.  It starts when it's awaited, and resumes the
+// awaiting coroutine when it's done.
+template <typename T> class SwooshTask;
+
+template <typename T>
+struct SwooshTaskPromiseBase {
+  std::coroutine_handle<> continuation;
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept {
+      std::coroutine_handle<> continuation = handle.promise().continuation;
+      return (continuation) ? continuation : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { std::terminate(); }
+};
+
+template <typename T>
+struct SwooshTaskPromise : SwooshTaskPromiseBase<T> {
+  T value{};
+
+  SwooshTask<T> get_return_object();
+  void return_value(T ret) { value = std::move(ret); }
+  T GetValue() { return std::move(value); }
+};
+
+template <>
+struct SwooshTaskPromise<void> : SwooshTaskPromiseBase<void> {
+  SwooshTask<void> get_return_object();
+  void return_void() {}
+  void GetValue() {}
+};
+
+template <typename T>
+class SwooshTask
+{
+public:
+  using promise_type = SwooshTaskPromise<T>;
+
+protected:
+  std::coroutine_handle<promise_type> handle;
+
+public:
+  explicit SwooshTask(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+  SwooshTask(SwooshTask &&other) noexcept : handle(other.handle) { other.handle = nullptr; }
+  SwooshTask(const SwooshTask &) = delete;
+  SwooshTask &operator=(const SwooshTask &) = delete;
+  ~SwooshTask() {
+    if (handle) {
+      handle.destroy();
+    }
+  }
+
+  bool await_ready() { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) {
+    handle.promise().continuation = continuation;
+    return handle;
+  }
+  T await_resume() { return handle.promise().GetValue(); }
+};
+
+template <typename T>
+SwooshTask<T> SwooshTaskPromise<T>::get_return_object()
+{
+  return SwooshTask<T>(std::coroutine_handle<SwooshTaskPromise<T>>::from_promise(*this));
+}
+
+inline SwooshTask<void> SwooshTaskPromise<void>::get_return_object()
+{
+  return SwooshTask<void>(std::coroutine_handle<SwooshTaskPromise<void>>::from_promise(*this));
+}
+
+// ==========================================================================
+// SwooshEventLoop
+// ==========================================================================
+
+// Runs coroutines on a single thread, resuming them when the sockets they
+// wait for are ready.  Socket waits time out after a while, so a silent
+// peer can't hold a coroutine forever.
+class SwooshEventLoop
+{
+protected:
+  struct Waiter {
+    std::coroutine_handle<> handle;
+    net_socket *sock;
+    uint64_t deadline;
+    bool timed_out;
+  };
+
+  class WaitAwaiter {
+    SwooshEventLoop &loop;
+    Waiter waiter;
+    int events;
+  public:
+    WaitAwaiter(SwooshEventLoop &loop, net_socket *sock, int events)
+      : loop(loop), waiter{nullptr, sock, 0, false}, events(events) {}
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    bool await_resume() { return !waiter.timed_out; }    // false on timeout
+  };
+
+  struct DetachedTask {
+    struct promise_type {
+      SwooshEventLoop *loop = nullptr;      // set once it's started on the loop
+      ~promise_type() {
+        if (loop) {
+          loop->tasks.erase(std::coroutine_handle<promise_type>::from_promise(*this).address());
+        }
+      }
+      DetachedTask get_return_object() {
+        return DetachedTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+      }
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { std::terminate(); }
+    };
+    std::coroutine_handle<promise_type> handle;
+  };
+
+  net_poller *poller;
+  std::thread loop_thread;
+  std::atomic<bool> running;
+  std::mutex post_lock;
+  std::deque<std::coroutine_handle<DetachedTask::promise_type>> posted;
+  std::unordered_set<Waiter *> waiters;   // only used in the loop thread
+  std::unordered_set<void *> tasks;       // started and not done, only used in the loop thread
+
+  static DetachedTask RunDetached(SwooshTask<void> task);
+  void Post(std::coroutine_handle<DetachedTask::promise_type> handle);
+  void Run();
+  void ExpireWaiters();
+  void DestroyTasks();
+
+public:
+  SwooshEventLoop();
+  ~SwooshEventLoop();
+
+  bool IsAvailable() { return poller != nullptr; }
+  void Stop();
+
+  // start a coroutine on the loop thread (may be called from any thread)
+  void Spawn(SwooshTask<void> task);
+
+  // wait for a socket (only from coroutines on the loop)
+  WaitAwaiter WaitReadable(net_socket *sock) { return WaitAwaiter(*this, sock, NET_POLL_READ); }
+  WaitAwaiter WaitWritable(net_socket *sock) { return WaitAwaiter(*this, sock, NET_POLL_WRITE); }
+
+  // socket operations; they return 0 on success and -1 on error or timeout
+  SwooshTask<net_socket *> Connect(net_msg_beacon *beacon);
+  SwooshTask<int> Send(net_socket *sock, const void *data, size_t len);
+  SwooshTask<int> SendU32(net_socket *sock, uint32_t data);
+  SwooshTask<int> Recv(net_socket *sock, void *data, size_t len);
+  SwooshTask<int> RecvAll(net_socket *sock, std::vector<char> *data, size_t max_size);
+};
+
+#endif /* SWOOSH_ASYNC_H_FILE */
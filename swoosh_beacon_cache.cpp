@@ -0,0 +1,69 @@
+#include "targetver.h"
+#include "swoosh_beacon_cache.h"
+
+#include "util.h"
+
+SwooshBeaconCache::~SwooshBeaconCache()
+{
+  for (auto &entry : beacons) {
+    net_free_beacon(entry.first);
+  }
+}
+
+void SwooshBeaconCache::RemoveExpired(uint64_t now)
+{
+  while (!expirations.empty()) {
+    Expiration &expiration = expirations.front();
+    if (expiration.time > now && beacons.size() <= max_size) {
+      break;
+    }
+
+    // the last entry for the beacon takes it out, earlier ones are stale
+    // (the beacon was added again after they were queued)
+    auto it = beacons.find(expiration.beacon);
+    if (it != beacons.end() && --it->second.queued == 0) {
+      net_msg_beacon *copy = it->first;
+      beacons.erase(it);
+      net_free_beacon(copy);
+    }
+    expirations.pop_front();
+  }
+}
+
+bool SwooshBeaconCache::Add(net_msg_beacon *beacon, uint64_t now)
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  RemoveExpired(now);
+
+  uint64_t expiration_time = now + ttl;
+  auto it = beacons.find(beacon);
+  if (it != beacons.end()) {
+    if (it->second.time > now) {
+      return false;
+    }
+    it->second.time = expiration_time;
+    it->second.queued++;
+    expirations.push_back(Expiration{expiration_time, it->first});
+    return true;
+  }
+
+  net_msg_beacon *copy = net_copy_beacon(beacon);
+  if (copy == nullptr) {
+    return true;
+  }
+  beacons[copy] = Entry{expiration_time, 1};
+  expirations.push_back(Expiration{expiration_time, copy});
+  return true;
+}
+
+void SwooshBeaconCache::Remove(net_msg_beacon *beacon)
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  // the expiration queue still points to the entry, so just mark it expired
+  auto it = beacons.find(beacon);
+  if (it != beacons.end()) {
+    it->second.time = 0;
+  }
+}
@@ -0,0 +1,59 @@
+#ifndef SWOOSH_BEACON_CACHE_H_FILE
+#define SWOOSH_BEACON_CACHE_H_FILE
+
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+
+#include "network.h"
+
+// ==========================================================================
+// SwooshBeaconCache
+// ==========================================================================
+
+// Beacons received recently, so a message announced again (or by more
+// than one packet) is only fetched once.  Entries expire after a while,
+// in case the sender restarts and reuses message ids.
+class SwooshBeaconCache
+{
+protected:
+  struct BeaconHash {
+    size_t operator()(net_msg_beacon *beacon) const { return net_hash_beacon(beacon); }
+  };
+  struct BeaconEqual {
+    bool operator()(net_msg_beacon *beacon1, net_msg_beacon *beacon2) const {
+      return net_beacons_are_equal(beacon1, beacon2) != 0;
+    }
+  };
+  struct Entry {
+    uint64_t time;        // expiration time, 0 when removed
+    uint32_t queued;      // expirations in the queue pointing to the beacon
+  };
+  struct Expiration {
+    uint64_t time;
+    net_msg_beacon *beacon;
+  };
+
+  uint32_t ttl;
+  size_t max_size;
+  std::mutex lock;
+  std::unordered_map<net_msg_beacon *, Entry, BeaconHash, BeaconEqual> beacons;   // owned copy -> entry
+  std::deque<Expiration> expirations;   // in expiration order, may have stale entries; a copy
+                                        // is only freed when no entry points to it anymore
+
+  void RemoveExpired(uint64_t now);
+
+public:
+  SwooshBeaconCache(uint32_t ttl_msec, size_t max_size) : ttl(ttl_msec), max_size(max_size) {}
+  ~SwooshBeaconCache();
+
+  // return false if the beacon was already added and hasn't expired,
+  // otherwise remember it and return true
+  bool Add(net_msg_beacon *beacon, uint64_t now);
+
+  // forget a beacon, so it's accepted again (e.g. when fetching the message failed)
+  void Remove(net_msg_beacon *beacon);
+};
+
+#endif /* SWOOSH_BEACON_CACHE_H_FILE */
@@ -0,0 +1,183 @@
+#include "targetver.h"
+#include "swoosh_checkpoint.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <wx/filefn.h>
+
+#include "util.h"
+
+#define CHECKPOINT_MAGIC          "swoosh-checkpoint 1"
+#define CHECKPOINT_SAVE_INTERVAL  (16*1024*1024)   // bytes received between saves
+#define CHECKPOINT_FILE_COST      (64*1024)        // count each new file as this many bytes
+
+bool SwooshCheckpoint::Load()
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  ranges.clear();
+  position_name = "";
+  position_offset = 0;
+  unsaved_bytes = 0;
+
+  std::ifstream file(file_name);
+  if (!file.good()) {
+    return false;
+  }
+
+  std::string line;
+  if (!std::getline(file, line) || line != CHECKPOINT_MAGIC) {
+    DebugLog("WARNING: ignoring invalid checkpoint file '%s'\n", file_name.c_str());
+    return false;
+  }
+
+  bool id_matches = false;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string key;
+    fields >> key;
+    if (key == "id") {
+      id_matches = (line.size() > 3 && line.substr(3) == id);
+    } else if (key == "range") {
+      Range range;
+      if (fields >> range.start >> range.end && range.start < range.end) {
+        ranges.push_back(range);
+      }
+    } else if (key == "position") {
+      fields >> position_offset;
+      fields.get();
+      std::getline(fields, position_name);
+    }
+  }
+
+  if (!id_matches) {
+    DebugLog("WARNING: checkpoint '%s' is for a different download\n", file_name.c_str());
+    ranges.clear();
+    position_name = "";
+    position_offset = 0;
+    return false;
+  }
+
+  std::sort(ranges.begin(), ranges.end(), [](const Range &a, const Range &b) { return a.start < b.start; });
+  return true;
+}
+
+bool SwooshCheckpoint::SaveLocked()
+{
+  std::string tmp_file_name = file_name + ".tmp";
+  {
+    std::ofstream file(tmp_file_name, std::ios::trunc);
+    if (!file.good()) {
+      DebugLog("ERROR: can't write checkpoint file '%s'\n", tmp_file_name.c_str());
+      return false;
+    }
+    file << CHECKPOINT_MAGIC << "\n";
+    file << "id " << id << "\n";
+    for (const auto &range : ranges) {
+      file << "range " << range.start << " " << range.end << "\n";
+    }
+    if (!position_name.empty()) {
+      file << "position " << position_offset << " " << position_name << "\n";
+    }
+    file.close();
+    if (file.fail()) {
+      DebugLog("ERROR: can't write checkpoint file '%s'\n", tmp_file_name.c_str());
+      return false;
+    }
+  }
+
+  // replace the old checkpoint in one step so it's never left half-written
+  if (!wxRenameFile(tmp_file_name, file_name, true)) {
+    DebugLog("ERROR: can't rename checkpoint file '%s'\n", tmp_file_name.c_str());
+    return false;
+  }
+  unsaved_bytes = 0;
+  return true;
+}
+
+bool SwooshCheckpoint::Save()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return SaveLocked();
+}
+
+void SwooshCheckpoint::Reset()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  ranges.clear();
+  position_name = "";
+  position_offset = 0;
+  unsaved_bytes = 0;
+}
+
+void SwooshCheckpoint::Remove()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (wxFileExists(file_name)) {
+    wxRemoveFile(file_name);
+  }
+}
+
+void SwooshCheckpoint::AddRange(uint64_t start, uint64_t end)
+{
+  if (start >= end) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  // insert keeping the list sorted, then merge overlapping or touching ranges
+  auto pos = std::lower_bound(ranges.begin(), ranges.end(), start, [](const Range &r, uint64_t val) { return r.start < val; });
+  ranges.insert(pos, Range{start, end});
+  std::vector<Range> merged;
+  for (const auto &range : ranges) {
+    if (!merged.empty() && range.start <= merged.back().end) {
+      merged.back().end = std::max(merged.back().end, range.end);
+    } else {
+      merged.push_back(range);
+    }
+  }
+  ranges = std::move(merged);
+
+  unsaved_bytes += end - start;
+  if (unsaved_bytes >= CHECKPOINT_SAVE_INTERVAL) {
+    SaveLocked();
+  }
+}
+
+std::vector<SwooshCheckpoint::Range> SwooshCheckpoint::GetMissingRanges(uint64_t size)
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  std::vector<Range> missing;
+  uint64_t pos = 0;
+  for (const auto &range : ranges) {
+    if (range.start >= size) break;
+    if (range.start > pos) {
+      missing.push_back(Range{pos, range.start});
+    }
+    pos = std::max(pos, range.end);
+  }
+  if (pos < size) {
+    missing.push_back(Range{pos, size});
+  }
+  return missing;
+}
+
+void SwooshCheckpoint::SetPosition(const std::string &name, uint64_t offset)
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  if (name != position_name) {
+    unsaved_bytes += offset + CHECKPOINT_FILE_COST;
+    position_name = name;
+  } else if (offset > position_offset) {
+    unsaved_bytes += offset - position_offset;
+  }
+  position_offset = offset;
+
+  if (unsaved_bytes >= CHECKPOINT_SAVE_INTERVAL) {
+    SaveLocked();
+  }
+}
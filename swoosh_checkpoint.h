@@ -0,0 +1,53 @@
+#ifndef SWOOSH_CHECKPOINT_H_FILE
+#define SWOOSH_CHECKPOINT_H_FILE
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+
+// ==========================================================================
+// SwooshCheckpoint
+// ==========================================================================
+
+// Sidecar file recording how much of a download is already done, so a
+// failed download can be resumed.  File downloads record the byte ranges
+// already written; directory downloads record the last file received and
+// how many bytes of it were written.
+class SwooshCheckpoint
+{
+public:
+  struct Range {
+    uint64_t start;
+    uint64_t end;
+  };
+
+protected:
+  std::string file_name;
+  std::string id;
+  std::vector<Range> ranges;
+  std::string position_name;
+  uint64_t position_offset;
+  uint64_t unsaved_bytes;
+  std::mutex lock;
+
+  bool SaveLocked();
+
+public:
+  SwooshCheckpoint(const std::string &file_name, const std::string &id)
+    : file_name(file_name), id(id), position_offset(0), unsaved_bytes(0) {}
+
+  bool Load();
+  bool Save();
+  void Reset();
+  void Remove();
+
+  void AddRange(uint64_t start, uint64_t end);
+  std::vector<Range> GetMissingRanges(uint64_t size);
+
+  void SetPosition(const std::string &name, uint64_t offset);
+  const std::string &GetPositionName() { return position_name; }
+  uint64_t GetPositionOffset() { return position_offset; }
+};
+
+#endif /* SWOOSH_CHECKPOINT_H_FILE */
@@ -0,0 +1,304 @@
+#include "targetver.h"
+#include "swoosh_compress.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <fstream>
+
+#include "swoosh_data.h"
+#include "lz.h"
+#include "util.h"
+
+#define COMPRESS_CHUNK_SIZE     SWOOSH_COMPRESS_CHUNK_MAX_SIZE
+#define COMPRESS_MAX_THREADS    4
+#define COMPRESS_MIN_GAIN       8        // compressed chunks must be at least 1/8 smaller
+#define SKIP_MIN_CHUNKS         16       // 4MB
+#define SKIP_MAX_CHUNKS         4096     // 1GB
+
+static double GetSeconds()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// ==========================================================================
+// Sender
+// ==========================================================================
+
+SwooshCompressor::SwooshCompressor()
+  : skip_chunks(0), skip_interval(SKIP_MIN_CHUNKS)
+{
+  num_threads = std::min((size_t) std::thread::hardware_concurrency(), (size_t) COMPRESS_MAX_THREADS);
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+}
+
+void SwooshCompressor::Compress(Batch &batch)
+{
+  std::atomic<size_t> next_chunk(0);
+  auto compress_chunks = [&batch, &next_chunk] {
+    size_t index;
+    while ((index = next_chunk++) < batch.chunks.size()) {
+      Chunk &chunk = batch.chunks[index];
+      chunk.comp_size = 0;
+      if (!chunk.try_compress) {
+        continue;
+      }
+      // give up as soon as the output gets too big
+      size_t max_size = chunk.raw_size - chunk.raw_size / COMPRESS_MIN_GAIN;
+      chunk.comp.resize(max_size);
+      chunk.comp_size = lz_compress(chunk.raw, chunk.raw_size, chunk.comp.data(), max_size);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < std::min(num_threads, batch.chunks.size()); i++) {
+    threads.emplace_back(compress_chunks);
+  }
+  compress_chunks();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+int SwooshCompressor::SendBatch(net_socket *sock, Batch &batch, const SendRawFunction &send_raw, double *send_time)
+{
+  double start = GetSeconds();
+  for (const auto &chunk : batch.chunks) {
+    unsigned char header[8];
+    for (int i = 0; i < 4; i++) {
+      header[i]   = (unsigned char) (chunk.raw_size >> (8*i));
+      header[4+i] = (unsigned char) (chunk.comp_size >> (8*i));
+    }
+    if (net_send_data(sock, header, sizeof(header)) != 0) {
+      return -1;
+    }
+    if (chunk.comp_size > 0) {
+      if (net_send_data(sock, chunk.comp.data(), chunk.comp_size) != 0) return -1;
+    } else if (chunk.raw == nullptr) {
+      if (send_raw(chunk.pos, chunk.raw_size) != 0) return -1;
+    } else {
+      if (net_send_data(sock, chunk.raw, chunk.raw_size) != 0) return -1;
+    }
+  }
+  *send_time = GetSeconds() - start;
+  return 0;
+}
+
+void SwooshCompressor::Skip()
+{
+  // back off more each time compression doesn't pay
+  skip_chunks = skip_interval;
+  skip_interval = std::min(skip_interval * 2, (uint32_t) SKIP_MAX_CHUNKS);
+}
+
+int SwooshCompressor::Send(net_socket *sock, uint64_t len, LoadFunction load, SendRawFunction send_raw)
+{
+  size_t batch_chunks = 2 * num_threads;
+  Batch batches[2];
+  Batch *cur = &batches[0];
+  Batch *next = &batches[1];
+  uint64_t pos = 0;
+
+  auto load_batch = [&] (Batch *batch) {
+    size_t batch_len = (size_t) std::min(len - pos, (uint64_t) batch_chunks * COMPRESS_CHUNK_SIZE);
+    size_t num_chunks = (batch_len + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE;
+    if (send_raw && skip_chunks >= num_chunks) {
+      // nothing to compress, so don't read the data here
+      batch->chunks.resize(num_chunks);
+      for (size_t i = 0; i < num_chunks; i++) {
+        batch->chunks[i].raw = nullptr;
+        batch->chunks[i].raw_size = std::min(batch_len - i * COMPRESS_CHUNK_SIZE, (size_t) COMPRESS_CHUNK_SIZE);
+      }
+    } else if (load(*batch, pos, batch_len) != 0) {
+      return -1;
+    }
+    for (size_t i = 0; i < batch->chunks.size(); i++) {
+      Chunk &chunk = batch->chunks[i];
+      chunk.pos = pos + i * COMPRESS_CHUNK_SIZE;
+      chunk.try_compress = (skip_chunks == 0);
+      if (skip_chunks > 0) {
+        skip_chunks--;
+      }
+    }
+    pos += batch_len;
+    return 0;
+  };
+
+  if (load_batch(cur) != 0) {
+    return -1;
+  }
+  Compress(*cur);
+
+  // compress the next batch while sending the current one
+  while (!cur->chunks.empty()) {
+    next->chunks.clear();
+    if (pos < len && load_batch(next) != 0) {
+      return -1;
+    }
+    std::thread compress_thread{[this, next] {
+      Compress(*next);
+    }};
+
+    double send_time = 0;
+    int ret = SendBatch(sock, *cur, send_raw, &send_time);
+    double wait_start = GetSeconds();
+    compress_thread.join();
+    double wait_time = GetSeconds() - wait_start;
+    if (ret != 0) {
+      return -1;
+    }
+
+    // check if compression paid for this batch
+    size_t num_tried = 0, num_compressed = 0;
+    uint64_t raw_size = 0, sent_size = 0;
+    for (const auto &chunk : cur->chunks) {
+      if (chunk.try_compress) num_tried++;
+      if (chunk.comp_size > 0) num_compressed++;
+      raw_size += chunk.raw_size;
+      sent_size += (chunk.comp_size > 0) ? chunk.comp_size : chunk.raw_size;
+    }
+    if (num_tried > 0) {
+      double raw_send_time = send_time * raw_size / std::max(sent_size, (uint64_t) 1);
+      if (num_compressed == 0) {
+        Skip();    // data doesn't compress
+      } else if (wait_time > send_time && raw_send_time < send_time + wait_time) {
+        Skip();    // link is faster than the compressor
+      } else {
+        skip_interval = SKIP_MIN_CHUNKS;
+      }
+    }
+
+    std::swap(cur, next);
+  }
+
+  return 0;
+}
+
+int SwooshCompressor::SendFile(net_socket *sock, const std::string &file_name, uint64_t offset, uint64_t len)
+{
+  std::ifstream file(file_name, std::ios::binary);
+  if (!file.good()) {
+    DebugLog("ERROR: can't open file '%s'\n", file_name.c_str());
+    return -1;
+  }
+
+  return Send(sock, len, [&file, &file_name, offset] (Batch &batch, uint64_t pos, size_t len) {
+    batch.data.resize(len);
+    if (!file.seekg(offset + pos) || !file.read(batch.data.data(), len)) {
+      DebugLog("ERROR: can't read file '%s'\n", file_name.c_str());
+      return -1;
+    }
+    batch.chunks.resize((len + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE);
+    for (size_t i = 0; i < batch.chunks.size(); i++) {
+      batch.chunks[i].raw = batch.data.data() + i * COMPRESS_CHUNK_SIZE;
+      batch.chunks[i].raw_size = std::min(len - i * COMPRESS_CHUNK_SIZE, (size_t) COMPRESS_CHUNK_SIZE);
+    }
+    return 0;
+  }, [sock, &file_name, offset] (uint64_t pos, size_t len) {
+    return net_send_file(sock, file_name.c_str(), offset + pos, len);
+  });
+}
+
+int SwooshCompressor::SendData(net_socket *sock, const void *data, size_t len)
+{
+  return Send(sock, len, [data] (Batch &batch, uint64_t pos, size_t len) {
+    const char *start = (const char *) data + pos;
+    batch.chunks.resize((len + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE);
+    for (size_t i = 0; i < batch.chunks.size(); i++) {
+      batch.chunks[i].raw = start + i * COMPRESS_CHUNK_SIZE;
+      batch.chunks[i].raw_size = std::min(len - i * COMPRESS_CHUNK_SIZE, (size_t) COMPRESS_CHUNK_SIZE);
+    }
+    return 0;
+  }, nullptr);
+}
+
+// ==========================================================================
+// Receiver
+// ==========================================================================
+
+static int ReceiveFrames(net_socket *sock, uint64_t len, std::function<int(const char *data, size_t len)> write,
+                         net_progress_callback progress, void *user_data)
+{
+  std::vector<char> raw(COMPRESS_CHUNK_SIZE);
+  std::vector<char> comp(COMPRESS_CHUNK_SIZE);
+  uint64_t done = 0;
+  while (done < len) {
+    uint32_t raw_size, comp_size;
+    if (net_recv_u32(sock, &raw_size) != 0 || net_recv_u32(sock, &comp_size) != 0) {
+      DebugLog("ERROR: can't read compressed frame size\n");
+      return -1;
+    }
+    if (raw_size == 0 || raw_size > COMPRESS_CHUNK_SIZE || raw_size > len - done || comp_size >= raw_size) {
+      DebugLog("ERROR: invalid compressed frame size\n");
+      return -1;
+    }
+
+    if (comp_size == 0) {
+      if (net_recv_data(sock, raw.data(), raw_size) != 0) {
+        DebugLog("ERROR: can't read frame data\n");
+        return -1;
+      }
+    } else {
+      if (net_recv_data(sock, comp.data(), comp_size) != 0) {
+        DebugLog("ERROR: can't read frame data\n");
+        return -1;
+      }
+      if (lz_decompress(comp.data(), comp_size, raw.data(), raw_size) != 0) {
+        DebugLog("ERROR: invalid compressed data\n");
+        return -1;
+      }
+    }
+
+    if (write(raw.data(), raw_size) != 0) {
+      return -1;
+    }
+    done += raw_size;
+    if (progress && progress(done, user_data) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int SwooshCompressor::ReceiveFile(net_socket *sock, const std::string &file_name, uint64_t offset, uint64_t len,
+                                  net_progress_callback progress, void *user_data)
+{
+  // the file is already created with its final size
+  std::fstream file(file_name, std::ios::in | std::ios::out | std::ios::binary);
+  if (!file.good()) {
+    DebugLog("ERROR: can't open file '%s'\n", file_name.c_str());
+    return -1;
+  }
+  file.seekp(offset);
+
+  int ret = ReceiveFrames(sock, len, [&file, &file_name] (const char *data, size_t len) {
+    if (!file.write(data, len)) {
+      DebugLog("ERROR: can't write to file '%s'\n", file_name.c_str());
+      return -1;
+    }
+    return 0;
+  }, progress, user_data);
+  if (ret != 0) {
+    return -1;
+  }
+
+  file.close();
+  if (file.fail()) {
+    DebugLog("ERROR: can't write to file '%s'\n", file_name.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+int SwooshCompressor::ReceiveData(net_socket *sock, void *data, size_t len)
+{
+  char *pos = (char *) data;
+  return ReceiveFrames(sock, len, [&pos] (const char *frame, size_t frame_len) {
+    std::copy(frame, frame + frame_len, pos);
+    pos += frame_len;
+    return 0;
+  }, nullptr, nullptr);
+}
@@ -0,0 +1,60 @@
+#ifndef SWOOSH_COMPRESS_H_FILE
+#define SWOOSH_COMPRESS_H_FILE
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "network.h"
+
+// ==========================================================================
+// SwooshCompressor
+// ==========================================================================
+
+// Sends data as a sequence of frames, each with the u32 raw size, the u32
+// compressed size (0 if stored raw) and the data.  Chunks are compressed
+// in parallel, and compression is skipped for a while whenever the data
+// doesn't compress or the link is faster than the compressor.  While it's
+// skipped, file chunks are sent straight from the file with net_send_file().
+class SwooshCompressor
+{
+protected:
+  struct Chunk {
+    uint64_t pos;
+    const char *raw;            // nullptr to send it with send_raw
+    size_t raw_size;
+    std::vector<char> comp;
+    size_t comp_size;
+    bool try_compress;
+  };
+
+  struct Batch {
+    std::vector<Chunk> chunks;
+    std::vector<char> data;     // raw data when read from a file
+  };
+
+  size_t num_threads;
+  uint32_t skip_chunks;         // chunks left to send raw before trying to compress again
+  uint32_t skip_interval;       // how many chunks to skip next time compression doesn't pay
+
+  typedef std::function<int(Batch &batch, uint64_t pos, size_t len)> LoadFunction;
+  typedef std::function<int(uint64_t pos, size_t len)> SendRawFunction;
+
+  void Compress(Batch &batch);
+  int SendBatch(net_socket *sock, Batch &batch, const SendRawFunction &send_raw, double *send_time);
+  void Skip();
+  int Send(net_socket *sock, uint64_t len, LoadFunction load, SendRawFunction send_raw);
+
+public:
+  SwooshCompressor();
+
+  int SendFile(net_socket *sock, const std::string &file_name, uint64_t offset, uint64_t len);
+  int SendData(net_socket *sock, const void *data, size_t len);
+
+  static int ReceiveFile(net_socket *sock, const std::string &file_name, uint64_t offset, uint64_t len,
+                         net_progress_callback progress, void *user_data);
+  static int ReceiveData(net_socket *sock, void *data, size_t len);
+};
+
+#endif /* SWOOSH_COMPRESS_H_FILE */
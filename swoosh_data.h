@@ -6,8 +6,88 @@
 enum {
   SWOOSH_DATA_REQUEST_HEAD = 0,
   SWOOSH_DATA_REQUEST_BODY = 1,
+  SWOOSH_DATA_REQUEST_BODY_RANGE = 2,
+  SWOOSH_DATA_REQUEST_BODY_RESUME = 3,
+  SWOOSH_DATA_REQUEST_MANIFEST = 4,
+  SWOOSH_DATA_REQUEST_FILES = 5,
+  SWOOSH_DATA_REQUEST_BODY_DELTA = 6,
+  SWOOSH_DATA_REQUEST_STREAMS = 7,        // message id 0: carry many requests as streams
+  SWOOSH_DATA_REQUEST_MULTICAST = 8,      // join the multicast session sending the body
+  SWOOSH_DATA_REQUEST_SWARM = 9,          // register with the swarm of a file and list its peers
 };
 
+// flags added to the request type
+#define SWOOSH_DATA_REQUEST_FLAG_COMPRESS  0x10000    // send file data as compressed frames
+#define SWOOSH_DATA_REQUEST_FLAGS          0xffff0000
+
+// requests carrying the bulk of a message's data, throttled by the rate limits
+// (multicast requests aren't: the session sends the data to the group, and
+// their connections only carry the receivers' NACKs)
+#define SWOOSH_DATA_REQUEST_IS_BULK(type)  ((type) == SWOOSH_DATA_REQUEST_BODY || (type) == SWOOSH_DATA_REQUEST_BODY_RANGE || \
+                                            (type) == SWOOSH_DATA_REQUEST_BODY_RESUME || (type) == SWOOSH_DATA_REQUEST_FILES || \
+                                            (type) == SWOOSH_DATA_REQUEST_BODY_DELTA)
+
+// max raw size of a compressed frame
+#define SWOOSH_COMPRESS_CHUNK_MAX_SIZE  (256*1024)
+
+// frames of a directory body stream (after the directory list)
+enum {
+  SWOOSH_DIR_FRAME_END  = 0,      // no more files
+  SWOOSH_DIR_FRAME_PACK = 1,      // u32 size + many small files (name, offset, size, data)
+  SWOOSH_DIR_FRAME_FILE = 2,      // one large file (name, offset, size, data)
+};
+
+#define SWOOSH_DIR_PACK_MAX_SIZE  (1024*1024)
+
+// operations of a delta body stream (after the file size)
+enum {
+  SWOOSH_DELTA_OP_END  = 0,       // hash of the whole file
+  SWOOSH_DELTA_OP_COPY = 1,       // u32 first block + u32 number of blocks from the receiver's copy
+  SWOOSH_DELTA_OP_DATA = 2,       // u32 size + new data
+};
+
+#define SWOOSH_DELTA_DATA_MAX_SIZE  (256*1024)
+
+// frames of a connection carrying streams: u32 stream id + u32 frame type +
+// u32 size + data (only for data frames)
+enum {
+  SWOOSH_STREAM_FRAME_DATA   = 0,
+  SWOOSH_STREAM_FRAME_END    = 1,   // the stream is closed; on stream 0, close the connection
+  SWOOSH_STREAM_FRAME_CREDIT = 2,   // size is the number of bytes the sender may send
+};
+
+#define SWOOSH_STREAM_FRAME_MAX_SIZE  (64*1024)
+#define SWOOSH_STREAM_WINDOW_SIZE     (1024*1024)    // unread data a stream may have in flight
+
+// packets of a multicast session: u32 magic + u32 session id + u32 packet
+// type + u32 index + data
+enum {
+  SWOOSH_MULTICAST_PACKET_DATA   = 0,   // index is the block number
+  SWOOSH_MULTICAST_PACKET_PARITY = 1,   // index is the group number, data is the XOR of its blocks
+  SWOOSH_MULTICAST_PACKET_STATUS = 2,   // nothing left to send, receivers should ask for what they miss
+};
+
+// messages from a receiver to the sender of a multicast session, after the
+// reply to SWOOSH_DATA_REQUEST_MULTICAST (status, group, port, session id,
+// block size, FEC group size and file size)
+enum {
+  SWOOSH_MULTICAST_MSG_NACK = 0,        // u32 number of ranges + (u32 first block, u32 number of blocks)
+  SWOOSH_MULTICAST_MSG_DONE = 1,        // the receiver has the whole file
+};
+
+#define SWOOSH_MULTICAST_MAGIC         NET_MAKE_MAGIC('S', 'w', 'M', 'c')
+#define SWOOSH_MULTICAST_HEADER_SIZE   16
+#define SWOOSH_MULTICAST_BLOCK_SIZE    1400     // keep packets unfragmented
+#define SWOOSH_MULTICAST_FEC_GROUP     16       // blocks covered by each parity packet
+#define SWOOSH_MULTICAST_MAX_RANGES    256      // ranges in a NACK
+#define SWOOSH_MULTICAST_GROUP_IPV4    "239.255.83.119"
+#define SWOOSH_MULTICAST_GROUP_IPV6    "ff02::5377:6f6f"
+
+// a swarm request sends u32 port + u32 message id + u32 time to live in ms +
+// bitmap of chunks the receiver has; the reply is u32 number of peers +
+// (string host, u32 port, u32 message id, chunk bitmap) for each peer
+#define SWOOSH_SWARM_CHUNK_SIZE  (4*1024*1024)
+
 enum {
   SWOOSH_DATA_TEXT = NET_MAKE_MAGIC('T', 'e', 'x', 't'),
   SWOOSH_DATA_FILE = NET_MAKE_MAGIC('F', 'i', 'l', 'e'),
@@ -1,63 +1,241 @@
 #include "targetver.h"
 #include "swoosh_data_store.h"
 
-void SwooshDataStore::Stop(void)
+#include <algorithm>
+
+SwooshDataStore::~SwooshDataStore()
 {
-  std::lock_guard<std::mutex> guard(storeMutex);
+  for (auto &shard : shards) {
+    for (auto table : shard.old_tables) {
+      delete table;
+    }
+    for (auto data : shard.removed) {
+      delete data;
+    }
+    delete shard.table.load();
+  }
+}
 
+void SwooshDataStore::Stop(void)
+{
+  std::lock_guard<std::mutex> guard(expiry_lock);
   running = false;
+  expiry_cond.notify_all();
+}
+
+SwooshLocalData *SwooshDataStore::Find(Shard &shard, uint32_t id, uint64_t cur_time, bool acquire)
+{
+  // writers don't free anything while we're counted as a reader
+  shard.num_readers++;
+  const Table *table = shard.table.load();
+  SwooshLocalData *data = nullptr;
+  auto it = table->find(id);
+  if (it != table->end()) {
+    data = it->second;
+    if (acquire && (data->IsExpiredAt(cur_time) || !data->TryAddRef())) {
+      data = nullptr;
+    }
+  }
+  shard.num_readers--;
+  return data;
+}
+
+void SwooshDataStore::Publish(Shard &shard, const Table *table)
+{
+  // called with the shard's write lock held
+  shard.old_tables.push_back(shard.table.exchange(table));
+  shard.has_old = true;
+}
+
+void SwooshDataStore::FreeOld(Shard &shard)
+{
+  // called with the shard's write lock held; readers that start from now
+  // on see the current table, so if none is running nobody sees the old ones
+  if (shard.num_readers != 0) {
+    // try again later: taking the lock makes sure the collector is either
+    // waiting (and wakes up) or hasn't yet checked for old tables
+    { std::lock_guard<std::mutex> guard(expiry_lock); }
+    expiry_cond.notify_one();
+    return;
+  }
+  for (auto table : shard.old_tables) {
+    delete table;
+  }
+  for (auto data : shard.removed) {
+    delete data;
+  }
+  shard.old_tables.clear();
+  shard.removed.clear();
+  shard.has_old = false;
+}
+
+void SwooshDataStore::FreeAllOld()
+{
+  for (auto &shard : shards) {
+    if (shard.has_old) {
+      std::lock_guard<std::mutex> guard(shard.write_lock);
+      FreeOld(shard);
+    }
+  }
+}
+
+bool SwooshDataStore::HasOld()
+{
+  // true if something is still waiting for the readers to leave
+  for (auto &shard : shards) {
+    if (shard.has_old) {
+      return true;
+    }
+  }
+  return false;
 }
 
 void SwooshDataStore::Store(SwooshLocalData *data)
 {
-  std::lock_guard<std::mutex> guard(storeMutex);
-  store[data->GetMessageId()] = data;
+  Shard &shard = GetShard(data->GetMessageId());
+  std::lock_guard<std::mutex> guard(shard.write_lock);
+
+  Table *table = new Table(*shard.table.load());
+  (*table)[data->GetMessageId()] = data;
+  Publish(shard, table);
+  FreeOld(shard);
+  AddExpiration(data->GetMessageId(), data->GetValidUntil());
 }
 
 SwooshLocalData *SwooshDataStore::Acquire(uint32_t id, uint64_t cur_time)
 {
-  std::lock_guard<std::mutex> guard(storeMutex);
+  return Find(GetShard(id), id, cur_time, true);
+}
 
-  auto it = store.find(id);
-  if (it != store.end()) {
-    SwooshLocalData *data = it->second;
-    if (data->IsExpiredAt(cur_time)) {
-      return nullptr;
+bool SwooshDataStore::Release(uint32_t id)
+{
+  // data with references is never removed, so it's safe to use after the lookup
+  SwooshLocalData *data = Find(GetShard(id), id, 0, false);
+  if (data) {
+    // the collector skips data in use, so tell it again when we're the last one
+    uint64_t valid_until = data->GetValidUntil();
+    if (data->RemoveRef() == 0 && valid_until < last_collect_time) {
+      AddExpiration(id, valid_until);
     }
-    data->AddRef();
-    return data;
+    return true;
   }
-  return nullptr;
+  return false;
 }
 
-bool SwooshDataStore::Release(uint32_t id)
+bool SwooshDataStore::SetValidUntil(uint32_t id, uint64_t valid_until)
 {
-  std::lock_guard<std::mutex> guard(storeMutex);
+  Shard &shard = GetShard(id);
+  std::lock_guard<std::mutex> guard(shard.write_lock);
 
-  auto it = store.find(id);
-  if (it != store.end()) {
-    SwooshLocalData *data = it->second;
-    data->RemoveRef();
+  SwooshLocalData *data = Find(shard, id, 0, false);
+  if (data) {
+    data->SetValidUntil(valid_until);
+    AddExpiration(id, valid_until);
     return true;
   }
   return false;
 }
 
-void SwooshDataStore::RemoveExpired(uint64_t cur_time)
+void SwooshDataStore::AddExpiration(uint32_t id, uint64_t time)
 {
-  std::lock_guard<std::mutex> guard(storeMutex);
-
-  if (!running) {
+  if (time == SWOOSH_DATA_ALWAYS_VALID) {
     return;
   }
 
-  for (auto it = store.begin(); it != store.end(); ) {
-    SwooshLocalData *data = it->second;
-    if (!data->hasRefs() && data->IsExpiredAt(cur_time)) {
-      delete data;
-      it = store.erase(it);
-    } else {
-      ++it;
+  bool is_next;
+  {
+    std::lock_guard<std::mutex> guard(expiry_lock);
+    is_next = expirations.empty() || time < expirations.top().time;
+    expirations.push(Expiration{time, id});
+  }
+  if (is_next) {
+    expiry_cond.notify_one();
+  }
+}
+
+void SwooshDataStore::CollectExpired(std::function<uint64_t()> get_time)
+{
+  std::unique_lock<std::mutex> lock(expiry_lock);
+  std::vector<uint32_t> due;
+  auto retry_time = std::chrono::milliseconds(SWOOSH_DATA_STORE_FREE_RETRY_MS);
+  while (running) {
+    // free what lookups were still using when the last writer was done
+    // (without the expiry lock, which writers take after their own), and
+    // look again with the lock held, so a writer leaving something behind
+    // from now on wakes us up
+    lock.unlock();
+    FreeAllOld();
+    lock.lock();
+    if (!running) {
+      break;
+    }
+    bool pending = HasOld();
+
+    if (expirations.empty()) {
+      if (pending) {
+        expiry_cond.wait_for(lock, retry_time);
+      } else {
+        expiry_cond.wait(lock);
+      }
+      continue;
+    }
+    // data expires once the time is past its valid_until
+    uint64_t now = get_time();
+    if (expirations.top().time >= now) {
+      auto due_time = std::chrono::milliseconds(expirations.top().time - now + 1);
+      expiry_cond.wait_for(lock, (pending) ? std::min(due_time, retry_time) : due_time);
+      continue;
+    }
+
+    due.clear();
+    while (!expirations.empty() && expirations.top().time < now) {
+      due.push_back(expirations.top().id);
+      expirations.pop();
+    }
+    last_collect_time = now;
+    lock.unlock();
+    RemoveExpired(due, now);
+    lock.lock();
+  }
+}
+
+void SwooshDataStore::RemoveExpired(const std::vector<uint32_t> &ids, uint64_t cur_time)
+{
+  std::vector<uint32_t> shard_ids[SWOOSH_DATA_STORE_SHARDS];
+  for (auto id : ids) {
+    shard_ids[id % SWOOSH_DATA_STORE_SHARDS].push_back(id);
+  }
+
+  // one shard at a time, without blocking lookups
+  for (size_t i = 0; i < SWOOSH_DATA_STORE_SHARDS; i++) {
+    if (shard_ids[i].empty()) {
+      continue;
+    }
+    Shard &shard = shards[i];
+    std::lock_guard<std::mutex> guard(shard.write_lock);
+
+    // data still in use is removed when released, and data whose time was
+    // changed has another entry
+    const Table *table = shard.table.load();
+    Table *new_table = nullptr;
+    for (auto id : shard_ids[i]) {
+      auto it = table->find(id);
+      if (it == table->end()) {
+        continue;
+      }
+      SwooshLocalData *data = it->second;
+      if (data->IsExpiredAt(cur_time) && data->TryRemove()) {
+        if (! new_table) {
+          new_table = new Table(*table);
+        }
+        new_table->erase(id);
+        shard.removed.push_back(data);
+      }
+    }
+
+    if (new_table) {
+      Publish(shard, new_table);
+      FreeOld(shard);
     }
   }
 }
@@ -2,26 +2,78 @@
 #define SWOOSH_DATA_STORE_H_FILE
 
 #include <cstdint>
-#include <map>
+#include <unordered_map>
+#include <vector>
+#include <queue>
+#include <functional>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 
 #include "swoosh_local_data.h"
 
+#define SWOOSH_DATA_STORE_SHARDS         16
+#define SWOOSH_DATA_STORE_FREE_RETRY_MS  100    // time between tries to free old tables
+
+// Local data by message id, split in shards by id.  Each shard's table is
+// never changed once published: writers copy it, change the copy and swap
+// it in, so lookups don't take any lock.  Old tables and removed data are
+// freed once no lookup is running in the shard, by the next writer or by
+// the collector; a writer that has to leave them behind wakes the
+// collector, which keeps trying while there's something left to free.
+//
+// Expiration times are kept in a heap, so the collector only looks at data
+// that is due and sleeps until the next one.
 class SwooshDataStore
 {
 protected:
-  bool running;
-  std::map<uint32_t, SwooshLocalData*> store;
-  std::mutex storeMutex;
+  typedef std::unordered_map<uint32_t, SwooshLocalData *> Table;
+
+  struct Shard {
+    std::mutex write_lock;                  // held by writers only
+    std::atomic<const Table *> table;
+    std::atomic<size_t> num_readers;
+    std::vector<const Table *> old_tables;  // waiting for the readers to leave
+    std::vector<SwooshLocalData *> removed;
+    std::atomic<bool> has_old;              // old tables or removed data left to free
+
+    Shard() : table(new Table), num_readers(0), has_old(false) {}
+  };
+
+  struct Expiration {
+    uint64_t time;
+    uint32_t id;
+    bool operator>(const Expiration &other) const { return time > other.time; }
+  };
+
+  std::atomic<bool> running;
+  Shard shards[SWOOSH_DATA_STORE_SHARDS];
+  std::mutex expiry_lock;
+  std::condition_variable expiry_cond;
+  std::priority_queue<Expiration, std::vector<Expiration>, std::greater<Expiration>> expirations;   // may have stale entries
+  std::atomic<uint64_t> last_collect_time;   // data expired by this time was already looked at
+
+  Shard &GetShard(uint32_t id) { return shards[id % SWOOSH_DATA_STORE_SHARDS]; }
+  SwooshLocalData *Find(Shard &shard, uint32_t id, uint64_t cur_time, bool acquire);
+  void Publish(Shard &shard, const Table *table);
+  void FreeOld(Shard &shard);
+  void FreeAllOld();
+  bool HasOld();
+  void AddExpiration(uint32_t id, uint64_t time);
+  void RemoveExpired(const std::vector<uint32_t> &ids, uint64_t cur_time);
 
 public:
-  SwooshDataStore() : running(true) {}
+  SwooshDataStore() : running(true), last_collect_time(0) {}
+  ~SwooshDataStore();
 
   void Stop();
   void Store(SwooshLocalData *data);
   SwooshLocalData *Acquire(uint32_t id, uint64_t cur_time);
   bool Release(uint32_t id);
-  void RemoveExpired(uint64_t cur_time);
+  bool SetValidUntil(uint32_t id, uint64_t valid_until);
+
+  // remove data as it expires (by the given clock) until Stop() is called
+  void CollectExpired(std::function<uint64_t()> get_time);
 };
 
 #endif /* SWOOSH_DATA_STORE_H_FILE */
@@ -0,0 +1,311 @@
+#include "targetver.h"
+#include "swoosh_delta.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+
+#include "util.h"
+
+#define DELTA_MIN_BLOCK_SIZE   (4*1024)
+#define DELTA_MAX_BLOCK_SIZE   (16*1024*1024)
+#define DELTA_MAX_BLOCKS       (1024*1024)
+#define DELTA_READ_SIZE        (4*1024*1024)
+#define FILE_HASH_CHUNK_SIZE   (1024*1024)
+#define STRONG_HASH_SEED       0x73776f6fULL
+
+#define WEAK_TAG(weak)         (((weak) ^ ((weak) >> 16)) & 0xffff)
+
+// ==========================================================================
+// Strong hash (MurmurHash3, x64 128-bit variant)
+// ==========================================================================
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static inline uint64_t load_u64(const unsigned char *p)
+{
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+static inline void store_u64(unsigned char *p, uint64_t v)
+{
+  for (int i = 0; i < 8; i++) {
+    p[i] = (unsigned char) (v >> (8*i));
+  }
+}
+
+static inline void store_u32(unsigned char *p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++) {
+    p[i] = (unsigned char) (v >> (8*i));
+  }
+}
+
+static inline uint32_t load_u32(const unsigned char *p)
+{
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+void SwooshStrongHash(const void *key, size_t len, unsigned char *hash)
+{
+  const unsigned char *data = (const unsigned char *) key;
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = STRONG_HASH_SEED;
+  uint64_t h2 = STRONG_HASH_SEED;
+
+  size_t num_blocks = len / 16;
+  for (size_t i = 0; i < num_blocks; i++) {
+    uint64_t k1 = load_u64(data + 16*i);
+    uint64_t k2 = load_u64(data + 16*i + 8);
+
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+  }
+
+  const unsigned char *tail = data + 16*num_blocks;
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+  switch (len & 15) {
+  case 15: k2 ^= ((uint64_t) tail[14]) << 48;  // fall through
+  case 14: k2 ^= ((uint64_t) tail[13]) << 40;  // fall through
+  case 13: k2 ^= ((uint64_t) tail[12]) << 32;  // fall through
+  case 12: k2 ^= ((uint64_t) tail[11]) << 24;  // fall through
+  case 11: k2 ^= ((uint64_t) tail[10]) << 16;  // fall through
+  case 10: k2 ^= ((uint64_t) tail[ 9]) << 8;   // fall through
+  case  9: k2 ^= ((uint64_t) tail[ 8]);
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    // fall through
+  case  8: k1 ^= ((uint64_t) tail[ 7]) << 56;  // fall through
+  case  7: k1 ^= ((uint64_t) tail[ 6]) << 48;  // fall through
+  case  6: k1 ^= ((uint64_t) tail[ 5]) << 40;  // fall through
+  case  5: k1 ^= ((uint64_t) tail[ 4]) << 32;  // fall through
+  case  4: k1 ^= ((uint64_t) tail[ 3]) << 24;  // fall through
+  case  3: k1 ^= ((uint64_t) tail[ 2]) << 16;  // fall through
+  case  2: k1 ^= ((uint64_t) tail[ 1]) << 8;   // fall through
+  case  1: k1 ^= ((uint64_t) tail[ 0]);
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= len;
+  h2 ^= len;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+
+  store_u64(hash, h1);
+  store_u64(hash + 8, h2);
+}
+
+// ==========================================================================
+// SwooshRollingChecksum
+// ==========================================================================
+
+void SwooshRollingChecksum::Init(const unsigned char *data, uint32_t len)
+{
+  this->len = len;
+  a = 0;
+  b = 0;
+  for (uint32_t i = 0; i < len; i++) {
+    a += data[i];
+    b += (len - i) * data[i];
+  }
+  a &= 0xffff;
+  b &= 0xffff;
+}
+
+// ==========================================================================
+// SwooshFileHash
+// ==========================================================================
+
+// The file is hashed in fixed size chunks, and the result is the hash of
+// all chunk hashes.
+void SwooshFileHash::Update(const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *) data;
+  while (len > 0) {
+    size_t n = std::min(len, FILE_HASH_CHUNK_SIZE - chunk.size());
+    chunk.insert(chunk.end(), p, p + n);
+    p += n;
+    len -= n;
+    if (chunk.size() == FILE_HASH_CHUNK_SIZE) {
+      unsigned char hash[SWOOSH_DELTA_HASH_SIZE];
+      SwooshStrongHash(chunk.data(), chunk.size(), hash);
+      chunk_hashes.insert(chunk_hashes.end(), hash, hash + SWOOSH_DELTA_HASH_SIZE);
+      chunk.clear();
+    }
+  }
+}
+
+void SwooshFileHash::Final(unsigned char *hash)
+{
+  if (!chunk.empty()) {
+    unsigned char chunk_hash[SWOOSH_DELTA_HASH_SIZE];
+    SwooshStrongHash(chunk.data(), chunk.size(), chunk_hash);
+    chunk_hashes.insert(chunk_hashes.end(), chunk_hash, chunk_hash + SWOOSH_DELTA_HASH_SIZE);
+    chunk.clear();
+  }
+  SwooshStrongHash(chunk_hashes.data(), chunk_hashes.size(), hash);
+  chunk_hashes.clear();
+}
+
+// ==========================================================================
+// SwooshDeltaSignature
+// ==========================================================================
+
+uint32_t SwooshDeltaSignature::GetBlockSize(uint64_t file_size)
+{
+  // about sqrt(size) like rsync, but keep the number of blocks bounded
+  uint64_t size = (uint64_t) std::sqrt((double) file_size);
+  size = std::max(size, (file_size + DELTA_MAX_BLOCKS - 1) / DELTA_MAX_BLOCKS);
+  size = (size + 1023) / 1024 * 1024;
+  if (size < DELTA_MIN_BLOCK_SIZE) size = DELTA_MIN_BLOCK_SIZE;
+  if (size > DELTA_MAX_BLOCK_SIZE) size = DELTA_MAX_BLOCK_SIZE;
+  return (uint32_t) size;
+}
+
+bool SwooshDeltaSignature::Build(const std::string &file_name, uint64_t file_size)
+{
+  block_size = GetBlockSize(file_size);
+  uint64_t num_blocks = std::min(file_size / block_size, (uint64_t) DELTA_MAX_BLOCKS);
+  weak.resize((size_t) num_blocks);
+  strong.resize((size_t) num_blocks * SWOOSH_DELTA_HASH_SIZE);
+
+  std::ifstream file(file_name, std::ios::binary);
+  if (!file.good()) {
+    DebugLog("ERROR: can't open file '%s'\n", file_name.c_str());
+    return false;
+  }
+
+  // only whole blocks are listed; a short last block is always sent again
+  size_t blocks_per_read = std::max((size_t) 1, (size_t) (DELTA_READ_SIZE / block_size));
+  std::vector<unsigned char> buf(blocks_per_read * block_size);
+  for (uint64_t block = 0; block < num_blocks; block += blocks_per_read) {
+    size_t n = (size_t) std::min((uint64_t) blocks_per_read, num_blocks - block);
+    if (!file.read((char *) buf.data(), n * block_size)) {
+      DebugLog("ERROR: can't read file '%s'\n", file_name.c_str());
+      return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+      SwooshRollingChecksum checksum;
+      checksum.Init(&buf[i * block_size], block_size);
+      weak[block + i] = checksum.Get();
+      SwooshStrongHash(&buf[i * block_size], block_size, &strong[(block + i) * SWOOSH_DELTA_HASH_SIZE]);
+    }
+  }
+
+  BuildIndex();
+  return true;
+}
+
+void SwooshDeltaSignature::BuildIndex()
+{
+  blocks.resize(weak.size());
+  tags.assign(0x10000, false);
+  for (size_t i = 0; i < weak.size(); i++) {
+    blocks[i] = Block{weak[i], (uint32_t) i};
+    tags[WEAK_TAG(weak[i])] = true;
+  }
+  std::sort(blocks.begin(), blocks.end(), [](const Block &a, const Block &b) {
+    return (a.weak != b.weak) ? a.weak < b.weak : a.index < b.index;
+  });
+}
+
+int SwooshDeltaSignature::Send(net_socket *sock)
+{
+  // send block size, number of blocks and weak checksum + strong hash of each block
+  const size_t entry_size = 4 + SWOOSH_DELTA_HASH_SIZE;
+  std::vector<unsigned char> buf(8 + weak.size() * entry_size);
+  store_u32(&buf[0], block_size);
+  store_u32(&buf[4], (uint32_t) weak.size());
+  for (size_t i = 0; i < weak.size(); i++) {
+    unsigned char *entry = &buf[8 + i * entry_size];
+    store_u32(entry, weak[i]);
+    memcpy(entry + 4, &strong[i * SWOOSH_DELTA_HASH_SIZE], SWOOSH_DELTA_HASH_SIZE);
+  }
+  return net_send_data(sock, buf.data(), buf.size());
+}
+
+int SwooshDeltaSignature::Receive(net_socket *sock)
+{
+  uint32_t num_blocks;
+  if (net_recv_u32(sock, &block_size) != 0 || net_recv_u32(sock, &num_blocks) != 0) {
+    DebugLog("ERROR: can't read signature size\n");
+    return -1;
+  }
+  if (block_size < DELTA_MIN_BLOCK_SIZE || block_size > DELTA_MAX_BLOCK_SIZE || num_blocks > DELTA_MAX_BLOCKS) {
+    DebugLog("ERROR: invalid signature size: %u blocks of %u bytes\n", num_blocks, block_size);
+    return -1;
+  }
+
+  const size_t entry_size = 4 + SWOOSH_DELTA_HASH_SIZE;
+  std::vector<unsigned char> buf(num_blocks * entry_size);
+  if (net_recv_data(sock, buf.data(), buf.size()) != 0) {
+    DebugLog("ERROR: can't read signature\n");
+    return -1;
+  }
+  weak.resize(num_blocks);
+  strong.resize(num_blocks * SWOOSH_DELTA_HASH_SIZE);
+  for (size_t i = 0; i < num_blocks; i++) {
+    const unsigned char *entry = &buf[i * entry_size];
+    weak[i] = load_u32(entry);
+    memcpy(&strong[i * SWOOSH_DELTA_HASH_SIZE], entry + 4, SWOOSH_DELTA_HASH_SIZE);
+  }
+
+  BuildIndex();
+  return 0;
+}
+
+int64_t SwooshDeltaSignature::FindBlock(uint32_t weak_checksum, const unsigned char *data, int64_t expected_block)
+{
+  if (!tags[WEAK_TAG(weak_checksum)]) {
+    return -1;
+  }
+  auto range = std::equal_range(blocks.begin(), blocks.end(), Block{weak_checksum, 0}, [](const Block &a, const Block &b) {
+    return a.weak < b.weak;
+  });
+  if (range.first == range.second) {
+    return -1;
+  }
+
+  // only compute the strong hash when the weak checksum matches
+  unsigned char hash[SWOOSH_DELTA_HASH_SIZE];
+  SwooshStrongHash(data, block_size, hash);
+
+  // prefer the block that continues the previous match
+  int64_t found = -1;
+  for (auto it = range.first; it != range.second; ++it) {
+    if (memcmp(hash, &strong[(size_t) it->index * SWOOSH_DELTA_HASH_SIZE], SWOOSH_DELTA_HASH_SIZE) == 0) {
+      if (it->index == expected_block) {
+        return it->index;
+      }
+      if (found < 0) {
+        found = it->index;
+      }
+    }
+  }
+  return found;
+}
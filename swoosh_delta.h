@@ -0,0 +1,90 @@
+#ifndef SWOOSH_DELTA_H_FILE
+#define SWOOSH_DELTA_H_FILE
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "network.h"
+
+#define SWOOSH_DELTA_HASH_SIZE  16
+
+void SwooshStrongHash(const void *data, size_t len, unsigned char *hash);
+
+// ==========================================================================
+// SwooshRollingChecksum
+// ==========================================================================
+
+// rsync-style weak checksum of a block that can be moved one byte at a time
+class SwooshRollingChecksum
+{
+protected:
+  uint32_t a;
+  uint32_t b;
+  uint32_t len;
+
+public:
+  SwooshRollingChecksum() : a(0), b(0), len(0) {}
+
+  void Init(const unsigned char *data, uint32_t len);
+  void Roll(unsigned char out, unsigned char in) {
+    a = (a - out + in) & 0xffff;
+    b = (b - len * out + a) & 0xffff;
+  }
+  uint32_t Get() { return a | (b << 16); }
+};
+
+// ==========================================================================
+// SwooshFileHash
+// ==========================================================================
+
+// Hash of a whole file, fed sequentially in pieces of any size
+class SwooshFileHash
+{
+protected:
+  std::vector<unsigned char> chunk;
+  std::vector<unsigned char> chunk_hashes;
+
+public:
+  void Update(const void *data, size_t len);
+  void Final(unsigned char *hash);
+};
+
+// ==========================================================================
+// SwooshDeltaSignature
+// ==========================================================================
+
+// Weak checksums and strong hashes of the blocks of a file, used to find
+// which parts of a new version the receiver already has.
+class SwooshDeltaSignature
+{
+protected:
+  struct Block {
+    uint32_t weak;
+    uint32_t index;
+  };
+
+  uint32_t block_size;
+  std::vector<uint32_t> weak;
+  std::vector<unsigned char> strong;   // SWOOSH_DELTA_HASH_SIZE bytes per block
+  std::vector<Block> blocks;           // sorted by weak checksum
+  std::vector<bool> tags;              // quick filter for weak checksums
+
+  void BuildIndex();
+
+public:
+  SwooshDeltaSignature() : block_size(0) {}
+
+  static uint32_t GetBlockSize(uint64_t file_size);
+
+  bool Build(const std::string &file_name, uint64_t file_size);
+  int Send(net_socket *sock);
+  int Receive(net_socket *sock);
+
+  int64_t FindBlock(uint32_t weak_checksum, const unsigned char *data, int64_t expected_block);
+
+  uint32_t GetBlockSize() { return block_size; }
+  uint32_t GetNumBlocks() { return (uint32_t) weak.size(); }
+};
+
+#endif /* SWOOSH_DELTA_H_FILE */
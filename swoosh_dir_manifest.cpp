@@ -0,0 +1,438 @@
+#include "targetver.h"
+#include "swoosh_dir_manifest.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <wx/wx.h>
+#include <wx/dir.h>
+
+#if defined(__linux__)
+#define HAVE_INOTIFY
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#include "util.h"
+
+#define MANIFEST_REFRESH_INTERVAL  60000   // ms between sweeps when changes can't be watched
+#define WATCH_POLL_INTERVAL        500     // ms between checks for a stop request
+#define WATCH_BUFFER_SIZE          (64*1024)
+
+#ifdef HAVE_INOTIFY
+#define WATCH_EVENTS  (IN_CREATE|IN_DELETE|IN_MODIFY|IN_CLOSE_WRITE|IN_ATTRIB|IN_MOVED_FROM|IN_MOVED_TO|IN_DONT_FOLLOW|IN_ONLYDIR)
+#endif
+
+static uint64_t GetMonotonicTime()
+{
+  return (uint64_t) std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string JoinPath(const std::string &dir, const std::string &name)
+{
+  if (dir.empty()) return name;
+  if (name.empty()) return dir;
+  return dir + "/" + name;
+}
+
+// ==========================================================================
+// DirTree
+// ==========================================================================
+
+// Walks a directory, reporting every directory and file found with its
+// name relative to the shared directory.  Directories are reported before
+// their contents, so they can be watched before they're read.
+class DirTree : public wxDirTraverser
+{
+protected:
+  std::string path;
+  std::string prefix;
+  std::function<void(const std::string &)> on_dir;
+  std::function<void(const std::string &)> on_file;
+
+  std::string GetPathFragment(const std::string &full_path) {
+    if (full_path.size() <= path.size()) return prefix;
+    std::string ret = full_path;
+    if (full_path.substr(0, path.size()) == path && (full_path[path.size()] == '/' || full_path[path.size()] == '\\')) {
+      ret = full_path.substr(path.size() + 1);
+    }
+    for (size_t i = 0; i < ret.size(); i++) {
+      if (ret[i] == '\\') {
+        ret[i] = '/';
+      }
+    }
+    return JoinPath(prefix, ret);
+  }
+
+public:
+  DirTree(const std::string &path, const std::string &prefix,
+          std::function<void(const std::string &)> on_dir, std::function<void(const std::string &)> on_file)
+    : path(path), prefix(prefix), on_dir(on_dir), on_file(on_file) {
+  }
+
+  bool Sweep() {
+    wxDir dir;
+    if (!dir.Open(path)) {
+      return false;
+    }
+    dir.Traverse(*this, "", wxDIR_FILES|wxDIR_DIRS|wxDIR_HIDDEN|wxDIR_NO_FOLLOW);
+    dir.Close();
+    return true;
+  }
+
+  virtual wxDirTraverseResult OnFile(const wxString &filename)
+  {
+    on_file(GetPathFragment(filename.ToStdString()));
+    return wxDIR_CONTINUE;
+  }
+
+  virtual wxDirTraverseResult OnDir(const wxString &dirname)
+  {
+    on_dir(GetPathFragment(dirname.ToStdString()));
+    return wxDIR_CONTINUE;
+  }
+};
+
+// ==========================================================================
+// SwooshDirManifest
+// ==========================================================================
+
+SwooshDirManifest::SwooshDirManifest(const std::string &root)
+  : root(root), last_sweep_time(0), watching(false), watch_fd(-1)
+{
+#ifdef HAVE_INOTIFY
+  watch_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if (watch_fd < 0) {
+    DebugLog("WARNING: can't watch '%s' for changes\n", root.c_str());
+  }
+#endif
+  Build();
+  StartWatching(false);
+}
+
+SwooshDirManifest::SwooshDirManifest(const std::string &root, std::shared_ptr<const Snapshot> saved,
+                                     std::function<void(bool changed)> on_swept)
+  : root(root), last_sweep_time(0), watching(false), watch_fd(-1), on_swept(on_swept)
+{
+  // the saved lists are sorted, so they go in at the end of the set and map
+  for (const auto &dir : saved->dirs) {
+    dirs.emplace_hint(dirs.end(), dir);
+  }
+  for (const auto &file : saved->files) {
+    files.emplace_hint(files.end(), file.name, FileInfo{file.size, file.mtime});
+  }
+  snapshot = saved;
+  last_sweep_time = GetMonotonicTime();   // the background sweep counts as the next one
+
+#ifdef HAVE_INOTIFY
+  watch_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if (watch_fd < 0) {
+    DebugLog("WARNING: can't watch '%s' for changes\n", root.c_str());
+  }
+#endif
+  StartWatching(true);
+}
+
+SwooshDirManifest::~SwooshDirManifest()
+{
+  StopWatching();
+}
+
+bool SwooshDirManifest::ReadFileInfo(const std::string &name, FileInfo *info)
+{
+  wxStructStat stat;
+  if (wxStat(JoinPath(root, name), &stat) != 0 || (stat.st_mode & S_IFMT) != S_IFREG) {
+    return false;
+  }
+  info->size = (uint64_t) stat.st_size;
+  info->mtime = (int64_t) stat.st_mtime;
+  return true;
+}
+
+bool SwooshDirManifest::Sweep(const std::string &dir, std::set<std::string> *dirs, std::map<std::string, FileInfo> *files)
+{
+  DirTree tree(JoinPath(root, dir), dir, [this, dirs] (const std::string &name) {
+    WatchDir(name);
+    dirs->insert(name);
+  }, [this, files] (const std::string &name) {
+    FileInfo info;
+    if (ReadFileInfo(name, &info)) {
+      (*files)[name] = info;
+    }
+  });
+  return tree.Sweep();
+}
+
+bool SwooshDirManifest::Build()
+{
+#ifdef HAVE_INOTIFY
+  if (watch_fd >= 0) {
+    for (const auto &watch : watch_dirs) {
+      inotify_rm_watch(watch_fd, watch.first);
+    }
+    watch_dirs.clear();
+    WatchDir("");
+  }
+#endif
+
+  std::set<std::string> new_dirs;
+  std::map<std::string, FileInfo> new_files;
+  bool ok = Sweep("", &new_dirs, &new_files);
+  if (!ok) {
+    DebugLog("ERROR: can't open directory '%s'\n", root.c_str());
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  dirs.swap(new_dirs);
+  files.swap(new_files);
+  snapshot.reset();
+  last_sweep_time = GetMonotonicTime();
+  return ok;
+}
+
+bool SwooshDirManifest::Matches(const Snapshot &other)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (dirs.size() != other.dirs.size() || files.size() != other.files.size()) {
+    return false;
+  }
+  if (!std::equal(dirs.begin(), dirs.end(), other.dirs.begin())) {
+    return false;
+  }
+  auto file = other.files.begin();
+  for (const auto &entry : files) {
+    if (entry.first != file->name || entry.second.size != file->size || entry.second.mtime != file->mtime) {
+      return false;
+    }
+    ++file;
+  }
+  return true;
+}
+
+void SwooshDirManifest::RemoveTree(const std::string &dir)
+{
+  // names inside the directory are all in the range ["dir/", "dir0")
+  std::string first = dir + "/";
+  std::string last = dir + "0";
+
+#ifdef HAVE_INOTIFY
+  for (auto it = watch_dirs.begin(); it != watch_dirs.end(); ) {
+    if (it->second == dir || (it->second >= first && it->second < last)) {
+      inotify_rm_watch(watch_fd, it->first);
+      it = watch_dirs.erase(it);
+    } else {
+      ++it;
+    }
+  }
+#endif
+
+  std::lock_guard<std::mutex> guard(lock);
+  dirs.erase(dir);
+  dirs.erase(dirs.lower_bound(first), dirs.lower_bound(last));
+  files.erase(files.lower_bound(first), files.lower_bound(last));
+  snapshot.reset();
+}
+
+std::shared_ptr<const SwooshDirManifest::Snapshot> SwooshDirManifest::GetSnapshot(bool refresh)
+{
+  // without a watcher, sweep again from time to time
+  bool sweep = false;
+  if (refresh) {
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t now = GetMonotonicTime();
+    if (!watching && now - last_sweep_time >= MANIFEST_REFRESH_INTERVAL) {
+      last_sweep_time = now;
+      sweep = true;
+    }
+  }
+  if (sweep) {
+    Build();
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  if (!snapshot) {
+    auto new_snapshot = std::make_shared<Snapshot>();
+    new_snapshot->dirs.assign(dirs.begin(), dirs.end());
+    new_snapshot->files.reserve(files.size());
+    for (const auto &file : files) {
+      new_snapshot->files.push_back(File{file.first, file.second.size, file.second.mtime});
+    }
+    snapshot = new_snapshot;
+  }
+  return snapshot;
+}
+
+bool SwooshDirManifest::GetFile(const std::string &name, FileInfo *info)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = files.find(name);
+  if (it == files.end()) {
+    return false;
+  }
+  *info = it->second;
+  return true;
+}
+
+size_t SwooshDirManifest::GetNumItems()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return dirs.size() + files.size();
+}
+
+// ==========================================================================
+// Watcher
+// ==========================================================================
+
+void SwooshDirManifest::StartWatching(bool sweep)
+{
+#ifdef HAVE_INOTIFY
+  watching = (watch_fd >= 0);
+#endif
+  if (!watching && !sweep) {
+    return;
+  }
+  std::shared_ptr<const Snapshot> saved = snapshot;
+  watch_thread = std::thread{[this, sweep, saved] {
+    // a sweep also adds the watches, so changes made while it runs aren't lost
+    if (sweep) {
+      Build();
+      if (on_swept && saved) {
+        on_swept(!Matches(*saved));
+      }
+    }
+    if (watching) {
+      WatchLoop();
+    }
+  }};
+}
+
+void SwooshDirManifest::StopWatching()
+{
+  watching = false;
+  if (watch_thread.joinable()) {
+    watch_thread.join();
+  }
+#ifdef HAVE_INOTIFY
+  if (watch_fd >= 0) {
+    close(watch_fd);
+    watch_fd = -1;
+  }
+#endif
+}
+
+void SwooshDirManifest::WatchDir(const std::string &name)
+{
+#ifdef HAVE_INOTIFY
+  if (watch_fd < 0) {
+    return;
+  }
+  int wd = inotify_add_watch(watch_fd, JoinPath(root, name).c_str(), WATCH_EVENTS);
+  if (wd < 0) {
+    // most likely out of watches; the directory will still be picked up by a new sweep
+    DebugLog("WARNING: can't watch directory '%s'\n", name.c_str());
+    return;
+  }
+  watch_dirs[wd] = name;
+#endif
+}
+
+void SwooshDirManifest::WatchLoop()
+{
+#ifdef HAVE_INOTIFY
+  std::vector<uint64_t> buffer(WATCH_BUFFER_SIZE / sizeof(uint64_t));   // aligned for inotify_event
+  char *buf = (char *) buffer.data();
+
+  while (watching) {
+    struct pollfd pfd;
+    pfd.fd = watch_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int ret = poll(&pfd, 1, WATCH_POLL_INTERVAL);
+    if (ret < 0 && errno != EINTR) {
+      DebugLog("ERROR: can't wait for changes in '%s'\n", root.c_str());
+      break;
+    }
+    if (ret <= 0) {
+      continue;
+    }
+
+    while (true) {
+      ssize_t len = read(watch_fd, buf, WATCH_BUFFER_SIZE);
+      if (len <= 0) {
+        break;
+      }
+      for (ssize_t pos = 0; pos < len; ) {
+        struct inotify_event *event = (struct inotify_event *) (buf + pos);
+        OnWatchEvent(event->wd, event->mask, (event->len > 0) ? std::string(event->name) : std::string());
+        pos += sizeof(struct inotify_event) + event->len;
+      }
+    }
+  }
+#endif
+}
+
+void SwooshDirManifest::OnWatchEvent(int wd, uint32_t mask, const std::string &child)
+{
+#ifdef HAVE_INOTIFY
+  if (mask & IN_Q_OVERFLOW) {
+    // some changes were lost, start over
+    DebugLog("WARNING: too many changes in '%s', sweeping again\n", root.c_str());
+    Build();
+    return;
+  }
+
+  auto watch = watch_dirs.find(wd);
+  if (watch == watch_dirs.end()) {
+    return;
+  }
+  if (mask & IN_IGNORED) {
+    watch_dirs.erase(watch);
+    return;
+  }
+  if (child.empty()) {
+    return;
+  }
+  std::string name = JoinPath(watch->second, child);
+
+  if (mask & IN_ISDIR) {
+    if (mask & (IN_DELETE|IN_MOVED_FROM)) {
+      RemoveTree(name);
+    } else if (mask & (IN_CREATE|IN_MOVED_TO)) {
+      // a directory moved here may already have contents
+      std::set<std::string> new_dirs;
+      std::map<std::string, FileInfo> new_files;
+      WatchDir(name);
+      new_dirs.insert(name);
+      Sweep(name, &new_dirs, &new_files);
+
+      std::lock_guard<std::mutex> guard(lock);
+      dirs.insert(new_dirs.begin(), new_dirs.end());
+      for (const auto &file : new_files) {
+        files[file.first] = file.second;
+      }
+      snapshot.reset();
+    }
+    return;
+  }
+
+  FileInfo info;
+  bool exists = !(mask & (IN_DELETE|IN_MOVED_FROM)) && ReadFileInfo(name, &info);
+
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = files.find(name);
+  if (exists) {
+    if (it != files.end() && it->second.size == info.size && it->second.mtime == info.mtime) {
+      return;
+    }
+    files[name] = info;
+  } else {
+    if (it == files.end()) {
+      return;
+    }
+    files.erase(it);
+  }
+  snapshot.reset();
+#endif
+}
@@ -0,0 +1,86 @@
+#ifndef SWOOSH_DIR_MANIFEST_H_FILE
+#define SWOOSH_DIR_MANIFEST_H_FILE
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+// ==========================================================================
+// SwooshDirManifest
+// ==========================================================================
+
+// List of all directories and files (with sizes and modification times)
+// of a shared directory.  The tree is swept once; after that the list is
+// kept up to date with inotify on Linux, and swept again at most once a
+// minute elsewhere.  Requests are served from immutable snapshots, which
+// are only rebuilt after something changed.
+//
+// A manifest can start from a saved snapshot, which is served while the
+// tree is swept again in the background; once the sweep is done we're
+// told whether anything changed since the snapshot was saved.
+class SwooshDirManifest
+{
+public:
+  struct File {
+    std::string name;
+    uint64_t size;
+    int64_t mtime;
+  };
+
+  struct Snapshot {
+    std::vector<std::string> dirs;   // sorted, parents before children
+    std::vector<File> files;         // sorted by name
+  };
+
+  struct FileInfo {
+    uint64_t size;
+    int64_t mtime;
+  };
+
+protected:
+  std::string root;
+  std::mutex lock;
+  std::set<std::string> dirs;
+  std::map<std::string, FileInfo> files;
+  std::shared_ptr<const Snapshot> snapshot;
+  uint64_t last_sweep_time;
+
+  std::atomic<bool> watching;
+  int watch_fd;
+  std::map<int, std::string> watch_dirs;   // only used by the watch thread once it's running
+  std::thread watch_thread;
+  std::function<void(bool changed)> on_swept;
+
+  bool Sweep(const std::string &dir, std::set<std::string> *dirs, std::map<std::string, FileInfo> *files);
+  void RemoveTree(const std::string &dir);
+  bool ReadFileInfo(const std::string &name, FileInfo *info);
+
+  bool Matches(const Snapshot &other);
+  void StartWatching(bool sweep);
+  void StopWatching();
+  void WatchDir(const std::string &name);
+  void WatchLoop();
+  void OnWatchEvent(int wd, uint32_t mask, const std::string &child);
+
+public:
+  SwooshDirManifest(const std::string &root);
+  SwooshDirManifest(const std::string &root, std::shared_ptr<const Snapshot> saved,
+                    std::function<void(bool changed)> on_swept = nullptr);
+  ~SwooshDirManifest();
+
+  bool Build();
+  std::shared_ptr<const Snapshot> GetSnapshot(bool refresh = true);
+  bool GetFile(const std::string &name, FileInfo *info);
+  size_t GetNumItems();
+
+  static bool FileNameLess(const File &file, const std::string &name) { return file.name < name; }
+};
+
+#endif /* SWOOSH_DIR_MANIFEST_H_FILE */
@@ -0,0 +1,210 @@
+#include "targetver.h"
+#include "swoosh_download_manager.h"
+
+#include <thread>
+
+// ==========================================================================
+// SwooshDownloadManager
+// ==========================================================================
+
+std::vector<SwooshDownloadManager::Job>::iterator SwooshDownloadManager::FindJob(SwooshRemotePermanentData *data)
+{
+  for (auto it = queue.begin(); it != queue.end(); ++it) {
+    if (it->data == data) {
+      return it;
+    }
+  }
+  return queue.end();
+}
+
+bool SwooshDownloadManager::IsBefore(const Job &a, const Job &b)
+{
+  if (a.first != b.first) {
+    return a.first;
+  }
+  if (a.first) {
+    return a.seq > b.seq;      // the last one moved to the front goes first
+  }
+  if (shortest_first && a.size != b.size) {
+    return a.size < b.size;
+  }
+  return a.seq < b.seq;
+}
+
+void SwooshDownloadManager::Dispatch()
+{
+  // called with the lock held
+  while (!stopping && (max_running == 0 || running.size() < max_running)) {
+    auto next = queue.end();
+    for (auto it = queue.begin(); it != queue.end(); ++it) {
+      if (it->paused) {
+        continue;
+      }
+      auto peer = peer_running.find(it->peer);
+      if (max_per_peer != 0 && peer != peer_running.end() && peer->second >= max_per_peer) {
+        continue;
+      }
+      if (next == queue.end() || IsBefore(*it, *next)) {
+        next = it;
+      }
+    }
+    if (next == queue.end()) {
+      break;
+    }
+
+    Job job = *next;
+    queue.erase(next);
+    Start(job);
+  }
+}
+
+void SwooshDownloadManager::Start(const Job &job)
+{
+  // called with the lock held
+  running[job.data] = job;
+  peer_running[job.peer]++;
+  job.data->ClearCancel();
+
+  std::thread download_thread{[this, job] {
+    bool success = runner(job.data, job.local_path);
+    Finish(job.data, success);
+    done(job.data, success);
+  }};
+  download_thread.detach();
+}
+
+void SwooshDownloadManager::Finish(SwooshRemotePermanentData *data, bool success)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = running.find(data);
+  if (it == running.end()) {
+    return;
+  }
+  Job job = it->second;
+  if (--peer_running[job.peer] == 0) {
+    peer_running.erase(job.peer);
+  }
+  running.erase(it);
+
+  // paused while running: wait in the queue to resume from the checkpoint
+  if (!success && job.paused && !job.cancelled && !stopping) {
+    queue.push_back(job);
+  }
+  Dispatch();
+}
+
+void SwooshDownloadManager::Stop()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  stopping = true;
+  queue.clear();
+}
+
+bool SwooshDownloadManager::Add(SwooshRemotePermanentData *data, const std::string &local_path)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (stopping || running.count(data) != 0 || FindJob(data) != queue.end()) {
+    return false;
+  }
+
+  Job job;
+  job.data = data;
+  job.local_path = local_path;
+  job.peer = net_get_beacon_host(data->GetBeacon());
+  job.size = (data->GetType() == SWOOSH_DATA_FILE) ? ((SwooshRemoteFileData *) data)->GetFileSize() : UINT64_MAX;
+  job.seq = next_seq++;
+  job.first = false;
+  job.paused = false;
+  job.cancelled = false;
+  queue.push_back(job);
+  Dispatch();
+  return true;
+}
+
+bool SwooshDownloadManager::Pause(SwooshRemotePermanentData *data)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto run = running.find(data);
+  if (run != running.end()) {
+    run->second.paused = true;
+    data->Cancel();
+    return true;
+  }
+  auto it = FindJob(data);
+  if (it == queue.end()) {
+    return false;
+  }
+  it->paused = true;
+  return true;
+}
+
+bool SwooshDownloadManager::Resume(SwooshRemotePermanentData *data)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = FindJob(data);
+  if (it == queue.end()) {
+    return false;
+  }
+  it->paused = false;
+  Dispatch();
+  return true;
+}
+
+bool SwooshDownloadManager::MoveToFront(SwooshRemotePermanentData *data)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = FindJob(data);
+  if (it == queue.end()) {
+    return false;
+  }
+  it->first = true;
+  it->paused = false;
+  it->seq = next_seq++;
+  Dispatch();
+  return true;
+}
+
+bool SwooshDownloadManager::Cancel(SwooshRemotePermanentData *data)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto run = running.find(data);
+  if (run != running.end()) {
+    run->second.cancelled = true;
+    data->Cancel();
+    return true;
+  }
+  auto it = FindJob(data);
+  if (it == queue.end()) {
+    return false;
+  }
+  queue.erase(it);
+  return true;
+}
+
+int SwooshDownloadManager::GetState(SwooshRemotePermanentData *data)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (running.count(data) != 0) {
+    return SWOOSH_DOWNLOAD_RUNNING;
+  }
+  auto it = FindJob(data);
+  if (it == queue.end()) {
+    return SWOOSH_DOWNLOAD_NONE;
+  }
+  return (it->paused) ? SWOOSH_DOWNLOAD_PAUSED : SWOOSH_DOWNLOAD_QUEUED;
+}
+
+void SwooshDownloadManager::SetLimits(size_t max_running, size_t max_per_peer)
+{
+  // lowering the limits doesn't stop downloads already running
+  std::lock_guard<std::mutex> guard(lock);
+  this->max_running = max_running;
+  this->max_per_peer = max_per_peer;
+  Dispatch();
+}
+
+void SwooshDownloadManager::SetShortestFirst(bool enable)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  shortest_first = enable;
+}
@@ -0,0 +1,95 @@
+#ifndef SWOOSH_DOWNLOAD_MANAGER_H_FILE
+#define SWOOSH_DOWNLOAD_MANAGER_H_FILE
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <functional>
+
+#include "swoosh_remote_data.h"
+
+#define SWOOSH_DOWNLOADS_MAX_RUNNING   4     // downloads at the same time
+#define SWOOSH_DOWNLOADS_MAX_PER_PEER  2     // downloads from the same sender at the same time
+
+#define SWOOSH_DOWNLOAD_NONE     0
+#define SWOOSH_DOWNLOAD_QUEUED   1
+#define SWOOSH_DOWNLOAD_PAUSED   2
+#define SWOOSH_DOWNLOAD_RUNNING  3
+
+// ==========================================================================
+// SwooshDownloadManager
+// ==========================================================================
+
+// Queue of downloads, started a few at a time (in total and per sender)
+// so they don't all fight for the disk and the bandwidth.  Downloads start
+// in the order they were queued, or smallest first if asked to; the ones
+// moved to the front go before all others.  Downloads waiting in the queue
+// can be paused, resumed, moved to the front or cancelled.  Running ones
+// can be paused or cancelled too: they are stopped, keeping what they got
+// in their checkpoint, and a paused one goes back to the queue to resume
+// from there.
+class SwooshDownloadManager
+{
+public:
+  typedef std::function<bool(SwooshRemotePermanentData *data, const std::string &local_path)> Runner;
+  typedef std::function<void(SwooshRemotePermanentData *data, bool success)> DoneCallback;
+
+protected:
+  struct Job {
+    SwooshRemotePermanentData *data;
+    std::string local_path;
+    std::string peer;
+    uint64_t size;        // UINT64_MAX if not known
+    uint64_t seq;         // order in which it was queued
+    bool first;           // moved to the front of the queue
+    bool paused;          // if running, goes back to the queue paused when it stops
+    bool cancelled;       // stopped while running
+  };
+
+  std::mutex lock;
+  Runner runner;
+  DoneCallback done;
+  std::vector<Job> queue;                             // waiting to start
+  std::map<SwooshRemotePermanentData *, Job> running;
+  std::map<std::string, size_t> peer_running;
+  size_t max_running;
+  size_t max_per_peer;
+  bool shortest_first;
+  bool stopping;
+  uint64_t next_seq;
+
+  std::vector<Job>::iterator FindJob(SwooshRemotePermanentData *data);
+  bool IsBefore(const Job &a, const Job &b);
+  void Dispatch();
+  void Start(const Job &job);
+  void Finish(SwooshRemotePermanentData *data, bool success);
+
+public:
+  // 'done' is called when a download stops, after it's back in the queue
+  // if it was paused
+  SwooshDownloadManager(Runner runner, DoneCallback done)
+    : runner(runner), done(done), max_running(SWOOSH_DOWNLOADS_MAX_RUNNING), max_per_peer(SWOOSH_DOWNLOADS_MAX_PER_PEER),
+      shortest_first(false), stopping(false), next_seq(0) {}
+
+  // forget the queue and don't start anything else
+  void Stop();
+
+  // false if the data is already queued or being downloaded
+  bool Add(SwooshRemotePermanentData *data, const std::string &local_path);
+  bool Pause(SwooshRemotePermanentData *data);
+  bool Resume(SwooshRemotePermanentData *data);
+  bool MoveToFront(SwooshRemotePermanentData *data);
+  bool Cancel(SwooshRemotePermanentData *data);
+  int GetState(SwooshRemotePermanentData *data);
+
+  // 0 for no limit
+  void SetLimits(size_t max_running, size_t max_per_peer);
+  size_t GetMaxRunning() { return max_running; }
+  size_t GetMaxPerPeer() { return max_per_peer; }
+  void SetShortestFirst(bool enable);
+  bool GetShortestFirst() { return shortest_first; }
+};
+
+#endif /* SWOOSH_DOWNLOAD_MANAGER_H_FILE */
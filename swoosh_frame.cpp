@@ -2,13 +2,16 @@
 #include "swoosh_frame.h"
 
 #include <vector>
+#include <algorithm>
 #include <thread>
 #include <iostream>
 #include <functional>
 #include <wx/splitter.h>
 #include <wx/listbook.h>
+#include <wx/spinctrl.h>
 
 #include "swoosh_app.h"
+#include "swoosh_multicast.h"
 #include "util.h"
 
 #include "data/folder.xpm"
@@ -18,8 +21,23 @@
 #define TCP_SERVER_PORT 5559
 #define USE_IPV6        0
 
+#define MAX_RATE_LIMIT_KB  (1024*1024*1024)   // largest limit accepted in the limits dialog, in KB/s
+#define MAX_DOWNLOADS      64                  // largest number of downloads at the same time in the downloads dialog
+#define MAX_DIR_CONNS      16                  // largest number of connections per directory download in the downloads dialog
+
+// columns of the remote data list
+#define REMOTE_COL_PATH      2
+#define REMOTE_COL_PROGRESS  3
+#define REMOTE_COL_STATUS    4
+
 enum {
   ID_SendTextMessage = wxID_HIGHEST + 1,
+  ID_RateLimits,
+  ID_DownloadSettings,
+  ID_DownloadPause,
+  ID_DownloadResume,
+  ID_DownloadFirst,
+  ID_DownloadCancel,
 };
 
 SwooshFrame::SwooshFrame()
@@ -37,8 +55,16 @@ SwooshFrame::SwooshFrame()
   SetupContent();
   SetMinSize(wxSize(640, 480));
 
+  // shares restored from the last run are already being served
+  for (const auto &share : net.GetShares()) {
+    net.SendDataBeacon(share.data->GetMessageId());
+    AddLocalDataRow((share.type == SWOOSH_DATA_DIR) ? "dir" : "file", share.path, share.data);
+  }
+
   Bind(wxEVT_MENU, &SwooshFrame::OnAbout, this, wxID_ABOUT);
   Bind(wxEVT_MENU, &SwooshFrame::OnExit, this, wxID_EXIT);
+  Bind(wxEVT_MENU, &SwooshFrame::OnRateLimits, this, ID_RateLimits);
+  Bind(wxEVT_MENU, &SwooshFrame::OnDownloadSettings, this, ID_DownloadSettings);
   Bind(wxEVT_SIZE, &SwooshFrame::OnSize, this);
   Bind(wxEVT_CLOSE_WINDOW, &SwooshFrame::OnClose, this);
 
@@ -64,35 +90,27 @@ void SwooshFrame::SendTextMessage()
 void SwooshFrame::AddLocalFile(std::string file_name)
 {
   // add data to serve and broadcast beacon
-  auto data = new SwooshLocalFileData(net.GenerateMessageId(), file_name);
-  net.AddLocalData(data);       // data must be added before the beacon is sent
+  auto data = net.AddShare(SWOOSH_DATA_FILE, file_name);
   net.SendDataBeacon(data->GetMessageId());
-  net.ReleaseLocalData(data);   // so the message can expire (even though files never expire)
-
-  // add to local file list table
-  auto name = GetPathFilename(file_name);
-  wxVector<wxVariant> row;
-  row.push_back(wxVariant("file"));
-  row.push_back(wxVariant(name));
-  row.push_back(wxVariant(file_name));
-  localDataList->AppendItem(row, (wxUIntPtr) data);
-  localDataList->Refresh();
+  AddLocalDataRow("file", file_name, data);
 }
 
 void SwooshFrame::AddLocalDir(std::string dir_name)
 {
   // add data to serve and broadcast beacon
-  auto data = new SwooshLocalDirData(net.GenerateMessageId(), dir_name);
-  net.AddLocalData(data);       // data must be added before the beacon is sent
+  auto data = net.AddShare(SWOOSH_DATA_DIR, dir_name);
   net.SendDataBeacon(data->GetMessageId());
-  net.ReleaseLocalData(data);   // so the message can expire (even though files never expire)
+  AddLocalDataRow("dir", dir_name, data);
+}
 
+void SwooshFrame::AddLocalDataRow(const std::string &type, const std::string &path, SwooshLocalData *data)
+{
   // add to local file list table
-  auto name = GetPathFilename(dir_name);
+  auto name = GetPathFilename(path);
   wxVector<wxVariant> row;
-  row.push_back(wxVariant("dir"));
+  row.push_back(wxVariant(type));
   row.push_back(wxVariant(name));
-  row.push_back(wxVariant(dir_name));
+  row.push_back(wxVariant(path));
   localDataList->AppendItem(row, (wxUIntPtr) data);
   localDataList->Refresh();
 }
@@ -119,6 +137,7 @@ void SwooshFrame::AddRemoteData(SwooshRemotePermanentData *data)
   row.push_back(wxVariant(data->GetName()));
   row.push_back(wxVariant(""));
   row.push_back(wxVariant(0));
+  row.push_back(wxVariant(""));
   remoteDataList->AppendItem(row, (wxUIntPtr) data);
   remoteDataList->Refresh();
 
@@ -244,7 +263,9 @@ void SwooshFrame::SetupFileMessagesPanel(wxWindow *parent)
   remoteDataList->AppendTextColumn("Name", wxDATAVIEW_CELL_INERT, 130);
   remoteDataList->AppendTextColumn("Download to", wxDATAVIEW_CELL_INERT, 200);
   remoteDataList->AppendProgressColumn("Download progress", wxDATAVIEW_CELL_INERT);
+  remoteDataList->AppendTextColumn("Status", wxDATAVIEW_CELL_INERT, 90);
   remoteDataList->Bind(wxEVT_DATAVIEW_ITEM_ACTIVATED, &SwooshFrame::OnRemoteFileActivated, this);
+  remoteDataList->Bind(wxEVT_DATAVIEW_ITEM_CONTEXT_MENU, &SwooshFrame::OnRemoteFileContextMenu, this);
   topSizer->Add(remoteDataList, wxSizerFlags(1).Expand().Border(wxALL));
 
   topPanel->SetSizer(topSizer);
@@ -290,11 +311,16 @@ void SwooshFrame::SetupMenu()
   menuFile->AppendSeparator();
   menuFile->Append(wxID_EXIT);
 
+  wxMenu* menuSettings = new wxMenu;
+  menuSettings->Append(ID_RateLimits, "Transfer &limits...", "Limit the send and receive rates");
+  menuSettings->Append(ID_DownloadSettings, "&Downloads...", "Choose how many downloads run at the same time");
+
   wxMenu* menuHelp = new wxMenu;
   menuHelp->Append(wxID_ABOUT);
 
   wxMenuBar* menuBar = new wxMenuBar;
   menuBar->Append(menuFile, "&File");
+  menuBar->Append(menuSettings, "&Settings");
   menuBar->Append(menuHelp, "&Help");
 
   SetMenuBar(menuBar);
@@ -311,6 +337,99 @@ void SwooshFrame::OnExit(wxCommandEvent &event)
   Close(true);
 }
 
+void SwooshFrame::OnRateLimits(wxCommandEvent &event)
+{
+  uint64_t SwooshRateLimits::*fields[] = { &SwooshRateLimits::global, &SwooshRateLimits::per_peer, &SwooshRateLimits::per_transfer };
+  const char *labels[] = { "Total:", "Per peer:", "Per transfer:" };
+  int directions[] = { NET_THROTTLE_SEND, NET_THROTTLE_RECV };
+  SwooshRateLimits limits[] = { SwooshRateLimiter::GetLimits(NET_THROTTLE_SEND), SwooshRateLimiter::GetLimits(NET_THROTTLE_RECV) };
+
+  wxDialog dlg(this, wxID_ANY, "Transfer Limits");
+  wxFlexGridSizer *grid = new wxFlexGridSizer(3, 5, 10);
+  grid->Add(new wxStaticText(&dlg, wxID_ANY, "KB/s (0 for no limit)"));
+  grid->Add(new wxStaticText(&dlg, wxID_ANY, "Send"));
+  grid->Add(new wxStaticText(&dlg, wxID_ANY, "Receive"));
+  wxSpinCtrl *spins[3][2];
+  for (int i = 0; i < 3; i++) {
+    grid->Add(new wxStaticText(&dlg, wxID_ANY, labels[i]), 0, wxALIGN_CENTER_VERTICAL);
+    for (int dir = 0; dir < 2; dir++) {
+      int value = (int) std::min(limits[dir].*fields[i] / 1024, (uint64_t) MAX_RATE_LIMIT_KB);
+      spins[i][dir] = new wxSpinCtrl(&dlg, wxID_ANY, "", wxDefaultPosition, wxDefaultSize, wxSP_ARROW_KEYS, 0, MAX_RATE_LIMIT_KB, value);
+      grid->Add(spins[i][dir]);
+    }
+  }
+  grid->Add(new wxStaticText(&dlg, wxID_ANY, "Multicast:"), 0, wxALIGN_CENTER_VERTICAL);
+  int multicast_value = (int) std::min(SwooshMulticastSender::GetRate() / 1024, (uint64_t) MAX_RATE_LIMIT_KB);
+  wxSpinCtrl *multicastRate = new wxSpinCtrl(&dlg, wxID_ANY, "", wxDefaultPosition, wxDefaultSize, wxSP_ARROW_KEYS, 0, MAX_RATE_LIMIT_KB,
+                                             multicast_value);
+  grid->Add(multicastRate);
+  grid->AddSpacer(0);
+
+  wxBoxSizer *mainSizer = new wxBoxSizer(wxVERTICAL);
+  mainSizer->Add(grid, 0, wxALL, 10);
+  mainSizer->Add(dlg.CreateButtonSizer(wxOK|wxCANCEL), 0, wxEXPAND|wxALL, 10);
+  dlg.SetSizerAndFit(mainSizer);
+  if (dlg.ShowModal() != wxID_OK)
+    return;
+
+  // the new limits also apply to transfers already running
+  for (int dir = 0; dir < 2; dir++) {
+    for (int i = 0; i < 3; i++) {
+      limits[dir].*fields[i] = (uint64_t) spins[i][dir]->GetValue() * 1024;
+    }
+    SwooshRateLimiter::SetLimits(directions[dir], limits[dir]);
+  }
+  SwooshMulticastSender::SetRate((uint64_t) multicastRate->GetValue() * 1024);
+}
+
+void SwooshFrame::OnDownloadSettings(wxCommandEvent &event)
+{
+  SwooshDownloadManager &downloads = net.GetDownloads();
+
+  wxDialog dlg(this, wxID_ANY, "Downloads");
+  wxFlexGridSizer *grid = new wxFlexGridSizer(2, 5, 10);
+  grid->Add(new wxStaticText(&dlg, wxID_ANY, "Downloads at the same time (0 for no limit)"));
+  grid->AddSpacer(0);
+  grid->Add(new wxStaticText(&dlg, wxID_ANY, "Total:"), 0, wxALIGN_CENTER_VERTICAL);
+  wxSpinCtrl *maxRunning = new wxSpinCtrl(&dlg, wxID_ANY, "", wxDefaultPosition, wxDefaultSize, wxSP_ARROW_KEYS, 0, MAX_DOWNLOADS,
+                                          (int) std::min(downloads.GetMaxRunning(), (size_t) MAX_DOWNLOADS));
+  grid->Add(maxRunning);
+  grid->Add(new wxStaticText(&dlg, wxID_ANY, "From the same sender:"), 0, wxALIGN_CENTER_VERTICAL);
+  wxSpinCtrl *maxPerPeer = new wxSpinCtrl(&dlg, wxID_ANY, "", wxDefaultPosition, wxDefaultSize, wxSP_ARROW_KEYS, 0, MAX_DOWNLOADS,
+                                          (int) std::min(downloads.GetMaxPerPeer(), (size_t) MAX_DOWNLOADS));
+  grid->Add(maxPerPeer);
+  grid->Add(new wxStaticText(&dlg, wxID_ANY, "Connections per directory:"), 0, wxALIGN_CENTER_VERTICAL);
+  wxSpinCtrl *dirConnections = new wxSpinCtrl(&dlg, wxID_ANY, "", wxDefaultPosition, wxDefaultSize, wxSP_ARROW_KEYS, 1, MAX_DIR_CONNS,
+                                              std::min(SwooshRemoteDirData::GetDownloadConnections(), MAX_DIR_CONNS));
+  grid->Add(dirConnections);
+  wxCheckBox *shortestFirst = new wxCheckBox(&dlg, wxID_ANY, "Start the smallest files first");
+  shortestFirst->SetValue(downloads.GetShortestFirst());
+  wxCheckBox *compression = new wxCheckBox(&dlg, wxID_ANY, "Ask senders to compress files that aren't compressed already");
+  compression->SetValue(SwooshRemoteData::GetCompression());
+  wxCheckBox *multicast = new wxCheckBox(&dlg, wxID_ANY, "Join the sender's multicast session for large files");
+  multicast->SetValue(SwooshRemoteFileData::GetMulticast());
+  wxCheckBox *swarm = new wxCheckBox(&dlg, wxID_ANY, "Get chunks of large files from other receivers too");
+  swarm->SetValue(SwooshNode::GetSwarm());
+
+  wxBoxSizer *mainSizer = new wxBoxSizer(wxVERTICAL);
+  mainSizer->Add(grid, 0, wxALL, 10);
+  mainSizer->Add(shortestFirst, 0, wxLEFT|wxRIGHT, 10);
+  mainSizer->Add(compression, 0, wxTOP|wxLEFT|wxRIGHT, 10);
+  mainSizer->Add(multicast, 0, wxTOP|wxLEFT|wxRIGHT, 10);
+  mainSizer->Add(swarm, 0, wxTOP|wxLEFT|wxRIGHT, 10);
+  mainSizer->Add(dlg.CreateButtonSizer(wxOK|wxCANCEL), 0, wxEXPAND|wxALL, 10);
+  dlg.SetSizerAndFit(mainSizer);
+  if (dlg.ShowModal() != wxID_OK)
+    return;
+
+  downloads.SetShortestFirst(shortestFirst->GetValue());
+  downloads.SetLimits((size_t) maxRunning->GetValue(), (size_t) maxPerPeer->GetValue());
+  SwooshRemoteDirData::SetDownloadConnections(dirConnections->GetValue());
+  SwooshRemoteData::SetCompression(compression->GetValue());
+  SwooshRemoteFileData::SetMulticast(multicast->GetValue());
+  SwooshNode::SetSwarm(swarm->GetValue());
+}
+
 void SwooshFrame::OnAbout(wxCommandEvent &event)
 {
   wxMessageDialog dlg(this, "By MoeFH\n\nhttps://github.com/moefh/swoosh", "About Swoosh", wxOK);
@@ -385,7 +504,8 @@ void SwooshFrame::OnNetDataDownloading(SwooshRemotePermanentData *data, double p
     }
 
     wxDataViewItem &item = it->second;
-    remoteDataList->GetStore()->SetValue(wxVariant((int)(progress*100)), item, 3);
+    remoteDataList->GetStore()->SetValue(wxVariant((int)(progress*100)), item, REMOTE_COL_PROGRESS);
+    remoteDataList->GetStore()->SetValue(wxVariant("downloading"), item, REMOTE_COL_STATUS);
     remoteDataList->Refresh();
   });
 }
@@ -400,10 +520,17 @@ void SwooshFrame::OnNetDataDownloaded(SwooshRemotePermanentData *data, bool succ
     }
 
     wxDataViewItem &item = it->second;
+    if (net.GetDownloads().GetState(data) != SWOOSH_DOWNLOAD_NONE) {
+      // paused while running, or already started again
+      UpdateRemoteDataStatus(item, data);
+      return;
+    }
     if (success) {
-      remoteDataList->GetStore()->SetValue(wxVariant(100), item, 3);
-      remoteDataList->Refresh();
+      remoteDataList->GetStore()->SetValue(wxVariant(100), item, REMOTE_COL_PROGRESS);
     }
+    const char *status = (success) ? "done" : (data->IsCancelled()) ? "" : "failed";
+    remoteDataList->GetStore()->SetValue(wxVariant(status), item, REMOTE_COL_STATUS);
+    remoteDataList->Refresh();
   });
 }
 
@@ -462,7 +589,7 @@ void SwooshFrame::OnRemoteFileActivated(wxDataViewEvent &event)
   auto data = (SwooshRemotePermanentData *) remoteDataList->GetItemData(item);
 
   wxVariant val;
-  remoteDataList->GetStore()->GetValue(val, item, 2);
+  remoteDataList->GetStore()->GetValue(val, item, REMOTE_COL_PATH);
   auto local_path = val.GetString();
 
   if (local_path.IsEmpty()) {
@@ -473,7 +600,7 @@ void SwooshFrame::OnRemoteFileActivated(wxDataViewEvent &event)
         if (saveFileDialog.ShowModal() == wxID_CANCEL)
           return;
         local_path = saveFileDialog.GetPath();
-        remoteDataList->GetStore()->SetValue(wxVariant(local_path), item, 2);
+        remoteDataList->GetStore()->SetValue(wxVariant(local_path), item, REMOTE_COL_PATH);
         remoteDataList->Refresh();
         break;
       }
@@ -484,7 +611,7 @@ void SwooshFrame::OnRemoteFileActivated(wxDataViewEvent &event)
         if (saveDirDialog.ShowModal() == wxID_CANCEL)
           return;
         local_path = saveDirDialog.GetPath();
-        remoteDataList->GetStore()->SetValue(wxVariant(local_path), item, 2);
+        remoteDataList->GetStore()->SetValue(wxVariant(local_path), item, REMOTE_COL_PATH);
         remoteDataList->Refresh();
         break;
       }
@@ -494,8 +621,63 @@ void SwooshFrame::OnRemoteFileActivated(wxDataViewEvent &event)
       return;
     }
   }
-  
-  net.ReceiveDataContent(data, local_path.ToStdString());
+
+  // a paused download is resumed, anything else already queued is left alone
+  if (net.GetDownloads().GetState(data) == SWOOSH_DOWNLOAD_PAUSED) {
+    net.GetDownloads().Resume(data);
+  } else {
+    net.ReceiveDataContent(data, local_path.ToStdString());
+  }
+  UpdateRemoteDataStatus(item, data);
+}
+
+void SwooshFrame::UpdateRemoteDataStatus(const wxDataViewItem &item, SwooshRemotePermanentData *data)
+{
+  // running downloads update their status as they go
+  const char *status;
+  switch (net.GetDownloads().GetState(data)) {
+  case SWOOSH_DOWNLOAD_QUEUED: status = "queued"; break;
+  case SWOOSH_DOWNLOAD_PAUSED: status = "paused"; break;
+  default: return;
+  }
+  remoteDataList->GetStore()->SetValue(wxVariant(status), item, REMOTE_COL_STATUS);
+  remoteDataList->Refresh();
+}
+
+void SwooshFrame::OnRemoteFileContextMenu(wxDataViewEvent &event)
+{
+  auto item = event.GetItem();
+  if (!item.IsOk()) {
+    return;
+  }
+  auto data = (SwooshRemotePermanentData *) remoteDataList->GetItemData(item);
+
+  // running downloads can only be paused or cancelled
+  int state = net.GetDownloads().GetState(data);
+  wxMenu menu;
+  menu.Append(ID_DownloadPause, "&Pause");
+  menu.Append(ID_DownloadResume, "&Resume");
+  menu.Append(ID_DownloadFirst, "Download &next");
+  menu.AppendSeparator();
+  menu.Append(ID_DownloadCancel, "&Cancel");
+  menu.Enable(ID_DownloadPause, state == SWOOSH_DOWNLOAD_QUEUED || state == SWOOSH_DOWNLOAD_RUNNING);
+  menu.Enable(ID_DownloadResume, state == SWOOSH_DOWNLOAD_PAUSED);
+  menu.Enable(ID_DownloadFirst, state == SWOOSH_DOWNLOAD_QUEUED || state == SWOOSH_DOWNLOAD_PAUSED);
+  menu.Enable(ID_DownloadCancel, state != SWOOSH_DOWNLOAD_NONE);
+
+  switch (remoteDataList->GetPopupMenuSelectionFromUser(menu)) {
+  case ID_DownloadPause:  net.GetDownloads().Pause(data); break;
+  case ID_DownloadResume: net.GetDownloads().Resume(data); break;
+  case ID_DownloadFirst:  net.GetDownloads().MoveToFront(data); break;
+  case ID_DownloadCancel:
+    if (net.GetDownloads().Cancel(data)) {
+      remoteDataList->GetStore()->SetValue(wxVariant(""), item, REMOTE_COL_STATUS);
+      remoteDataList->Refresh();
+    }
+    return;
+  default: return;
+  }
+  UpdateRemoteDataStatus(item, data);
 }
 
 void SwooshFrame::OnLocalFileActivated(wxDataViewEvent &event)
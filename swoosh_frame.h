@@ -31,8 +31,10 @@ protected:
 
   void AddTextMessage(const std::string &title, const std::string &content);
   void AddRemoteData(SwooshRemotePermanentData *data);
+  void UpdateRemoteDataStatus(const wxDataViewItem &item, SwooshRemotePermanentData *data);
   void AddLocalFile(std::string file_name);
   void AddLocalDir(std::string file_name);
+  void AddLocalDataRow(const std::string &type, const std::string &path, SwooshLocalData *data);
   void SendTextMessage();
 
   void OnUrlClicked(wxTextUrlEvent &event);
@@ -40,9 +42,12 @@ protected:
   void OnSendTextClicked(wxCommandEvent &event);
   void OnLocalFileActivated(wxDataViewEvent &event);
   void OnRemoteFileActivated(wxDataViewEvent &event);
+  void OnRemoteFileContextMenu(wxDataViewEvent &event);
   void OnAddSendFileClicked(wxCommandEvent &event);
   void OnAddSendDirClicked(wxCommandEvent &event);
   void OnExit(wxCommandEvent &event);
+  void OnRateLimits(wxCommandEvent &event);
+  void OnDownloadSettings(wxCommandEvent &event);
   void OnAbout(wxCommandEvent &event);
   void OnClose(wxCloseEvent &event);
   void OnQuit(wxCommandEvent &event);
@@ -2,15 +2,91 @@
 #include "swoosh_local_data.h"
 
 #include <vector>
+#include <cstring>
 #include <algorithm>
 #include <iterator>
 #include <memory>
 #include <fstream>
-#include <wx/dir.h>
 
 #include "swoosh_app.h"
+#include "swoosh_delta.h"
 #include "util.h"
 
+#define PACK_FILE_MAX_SIZE  (256*1024)   // files up to this size are packed together
+#define MAX_REQUEST_NAME_SIZE  4096
+#define DELTA_SCAN_BUFFER_SIZE  (4*1024*1024)
+#define DELTA_SEND_BUFFER_SIZE  (1024*1024)
+
+static bool IsSafeRelativePath(const std::string &path)
+{
+  if (path.empty() || path[0] == '/' || path.find('\\') != std::string::npos || path.find(':') != std::string::npos) {
+    return false;
+  }
+  size_t start = 0;
+  while (start <= path.size()) {
+    size_t end = path.find('/', start);
+    if (end == std::string::npos) end = path.size();
+    std::string part = path.substr(start, end - start);
+    if (part.empty() || part == "." || part == "..") {
+      return false;
+    }
+    start = end + 1;
+  }
+  return true;
+}
+
+// ==========================================================================
+// PackBuffer
+// ==========================================================================
+
+// Collects many small writes so they can be sent with a single call.
+class PackBuffer
+{
+protected:
+  std::vector<char> data;
+
+public:
+  size_t Size() { return data.size(); }
+  void Clear() { data.clear(); }
+
+  char *Reserve(size_t len) {
+    size_t pos = data.size();
+    data.resize(pos + len);
+    return data.data() + pos;
+  }
+
+  void AddU32(uint32_t val) {
+    char *p = Reserve(4);
+    for (int i = 0; i < 4; i++) p[i] = (char) ((val >> (8*i)) & 0xff);
+  }
+
+  void AddU64(uint64_t val) {
+    AddU32((uint32_t) (val & 0xffffffff));
+    AddU32((uint32_t) (val >> 32));
+  }
+
+  void AddString(const std::string &str) {
+    AddU32((uint32_t) str.size());
+    str.copy(Reserve(str.size()), str.size());
+  }
+
+  void SetU32(size_t pos, uint32_t val) {
+    for (int i = 0; i < 4; i++) data[pos+i] = (char) ((val >> (8*i)) & 0xff);
+  }
+
+  int Send(net_socket *sock) {
+    if (data.empty()) return 0;
+    return net_send_data(sock, data.data(), data.size());
+  }
+
+  // send the header as is and the rest as compressed frames if requested
+  int Send(net_socket *sock, size_t header_size, SwooshCompressor *compressor) {
+    if (!(net_get_socket_options(sock) & NET_SOCKET_COMPRESS)) return Send(sock);
+    if (net_send_data(sock, data.data(), header_size) != 0) return -1;
+    return compressor->SendData(sock, data.data() + header_size, data.size() - header_size);
+  }
+};
+
 // ==========================================================================
 // SwooshLocalData
 // ==========================================================================
@@ -35,44 +111,102 @@ int SwooshLocalData::SendString(net_socket *sock, const std::string &str)
 
 int SwooshLocalData::SendFile(net_socket *sock, const std::string &file_name)
 {
-  uint32_t data_size = 0;
+  uint64_t data_size = 0;
   if (ReadFileSize(file_name, &data_size) != 0) {
     DebugLog("ERROR: can't read file size for '%s'\n", file_name.c_str());
     return -1;
   }
 
-  // send file size
-  if (net_send_u32(sock, data_size) != 0) {
-    DebugLog("ERROR: can't send file size\n");
+  return SendFileData(sock, file_name, 0, data_size);
+}
+
+int SwooshLocalData::SendFileRange(net_socket *sock, const std::string &file_name, uint64_t offset, uint64_t len)
+{
+  uint64_t data_size = 0;
+  if (ReadFileSize(file_name, &data_size) != 0) {
+    DebugLog("ERROR: can't read file size for '%s'\n", file_name.c_str());
+    return -1;
+  }
+  if (offset > data_size || len > data_size - offset) {
+    DebugLog("ERROR: invalid range requested for '%s'\n", file_name.c_str());
     return -1;
   }
 
-  // send file data
-  std::ifstream file(file_name, std::ios::binary);
-  if (!file.good()) {
-    DebugLog("ERROR: can't open file '%s'\n", file_name.c_str());
+  return SendFileData(sock, file_name, offset, len);
+}
+
+int SwooshLocalData::SendFileData(net_socket *sock, const std::string &file_name, uint64_t offset, uint64_t len,
+                                  SwooshCompressor *compressor)
+{
+  // send range size
+  if (net_send_u64(sock, len) != 0) {
+    DebugLog("ERROR: can't send range size\n");
     return -1;
   }
 
-  uint32_t size_left = data_size;
-  while (size_left > 0) {
-    char data[4096];
-    uint32_t chunk_size = (size_left > sizeof(data)) ? sizeof(data) : size_left;
-    file.read(data, chunk_size);
-    if (!file.good()) {
-      DebugLog("ERROR: can't read file '%s'\n", file_name.c_str());
-      return -1;
+  // send range data, compressed if the receiver asked for it
+  int ret;
+  if (net_get_socket_options(sock) & NET_SOCKET_COMPRESS) {
+    if (compressor) {
+      ret = compressor->SendFile(sock, file_name, offset, len);
+    } else {
+      SwooshCompressor file_compressor;
+      ret = file_compressor.SendFile(sock, file_name, offset, len);
     }
-    if (net_send_data(sock, data, chunk_size) != 0) {
-      DebugLog("ERROR: can't send file data\n");
-      return -1;
-    }
-    size_left -= chunk_size;
+  } else {
+    ret = net_send_file(sock, file_name.c_str(), offset, len);
+  }
+  if (ret != 0) {
+    DebugLog("ERROR: can't send file '%s'\n", file_name.c_str());
+    return -1;
   }
 
   return 0;
 }
 
+int SwooshLocalData::SendContentRange(net_socket *sock, uint64_t offset, uint64_t len)
+{
+  DebugLog("ERROR: range requests are not supported for message %u\n", GetMessageId());
+  return -1;
+}
+
+int SwooshLocalData::SendContentResume(net_socket *sock, const std::string &file_name, uint64_t offset)
+{
+  DebugLog("ERROR: resume requests are not supported for message %u\n", GetMessageId());
+  return -1;
+}
+
+int SwooshLocalData::SendContentManifest(net_socket *sock)
+{
+  DebugLog("ERROR: manifest requests are not supported for message %u\n", GetMessageId());
+  return -1;
+}
+
+int SwooshLocalData::SendContentFiles(net_socket *sock)
+{
+  DebugLog("ERROR: file requests are not supported for message %u\n", GetMessageId());
+  return -1;
+}
+
+int SwooshLocalData::SendContentDelta(net_socket *sock)
+{
+  DebugLog("ERROR: delta requests are not supported for message %u\n", GetMessageId());
+  return -1;
+}
+
+int SwooshLocalData::SendContentMulticast(net_socket *sock)
+{
+  DebugLog("ERROR: multicast requests are not supported for message %u\n", GetMessageId());
+  net_close_socket(sock);
+  return -1;
+}
+
+int SwooshLocalData::SendContentSwarm(net_socket *sock)
+{
+  DebugLog("ERROR: swarm requests are not supported for message %u\n", GetMessageId());
+  return -1;
+}
+
 // ==========================================================================
 // SwooshLocalTextData
 // ==========================================================================
@@ -99,6 +233,11 @@ int SwooshLocalTextData::SendContentBody(net_socket *sock)
   return 0;
 }
 
+bool SwooshLocalTextData::CanQueueContent(uint32_t request_type)
+{
+  return request_type == SWOOSH_DATA_REQUEST_HEAD || request_type == SWOOSH_DATA_REQUEST_BODY;
+}
+
 // ==========================================================================
 // SwooshLocalFileData
 // ==========================================================================
@@ -121,7 +260,7 @@ int SwooshLocalFileData::SendContentHead(net_socket *sock)
   }
 
   // send file size
-  if (net_send_u32(sock, file_size) != 0) {
+  if (net_send_u64(sock, file_size) != 0) {
     DebugLog("ERROR: can't send file size\n");
     return -1;
   }
@@ -134,93 +273,261 @@ int SwooshLocalFileData::SendContentBody(net_socket *sock)
   return SendFile(sock, file_name);
 }
 
-// ==========================================================================
-// SwooshLocalDirData
-// ==========================================================================
+int SwooshLocalFileData::SendContentRange(net_socket *sock, uint64_t offset, uint64_t len)
+{
+  return SendFileRange(sock, file_name, offset, len);
+}
 
-class DirTree : public wxDirTraverser
+int SwooshLocalFileData::SendContentResume(net_socket *sock, const std::string &name, uint64_t offset)
 {
-protected:
-  int num_dirs;
-  int num_files;
-  std::vector<std::string> *dirs;
-  std::vector<std::string> *files;
-  const std::string *root;
-
-  std::string GetPathFragment(const std::string &path) {
-    if (!root) return "";
-    if (path.size() <= root->size()) return "";
-    if (path.substr(0, root->size()) == *root && (path[root->size()] == '/' || path[root->size()] == '\\')) {
-      auto ret = path.substr(root->size() + 1);
-      for (size_t i = 0; i < ret.size(); i++) {
-        if (ret[i] == '\\') {
-          ret[i] = '/';
-        }
+  // a single file has no names inside it, so the offset alone says where to continue
+  uint64_t data_size = 0;
+  if (ReadFileSize(file_name, &data_size) != 0) {
+    DebugLog("ERROR: can't read file size for '%s'\n", file_name.c_str());
+    return -1;
+  }
+  if (offset > data_size) {
+    DebugLog("ERROR: invalid resume offset requested for '%s'\n", file_name.c_str());
+    return -1;
+  }
+
+  return SendFileData(sock, file_name, offset, data_size - offset);
+}
+
+int SwooshLocalFileData::SendContentMulticast(net_socket *sock)
+{
+  // receivers asking while a session is running join it
+  std::shared_ptr<SwooshMulticastSender> session;
+  {
+    std::lock_guard<std::mutex> guard(multicast_lock);
+    if (!multicast_session || !multicast_session->AddReceiver()) {
+      multicast_session = SwooshMulticastSender::Create(file_name, file_size);
+      if (multicast_session && !multicast_session->AddReceiver()) {
+        multicast_session = nullptr;
       }
-      return ret;
     }
-    return path;
+    session = multicast_session;
+  }
+  if (!session) {
+    // tell the receiver to download over TCP
+    net_send_u32(sock, 1);
+    net_close_socket(sock);
+    return -1;
   }
 
-public:
-  DirTree(std::vector<std::string> *dirs, std::vector<std::string> *files)
-    : num_dirs(0), num_files(0), dirs(dirs), files(files), root(nullptr) {
+  // the session keeps the socket to hear from the receiver until it's done
+  return session->ServeReceiver(sock);
+}
+
+int SwooshLocalFileData::SendContentSwarm(net_socket *sock)
+{
+  return swarm_tracker.Serve(sock, file_name, file_size);
+}
+
+bool SwooshLocalFileData::CanQueueContent(uint32_t request_type)
+{
+  // the file data is sent straight from the page cache
+  return (request_type == SWOOSH_DATA_REQUEST_HEAD ||
+          request_type == SWOOSH_DATA_REQUEST_BODY ||
+          request_type == SWOOSH_DATA_REQUEST_BODY_RANGE);
+}
+
+int SwooshLocalFileData::SendContentDelta(net_socket *sock)
+{
+  // read signature of the receiver's old copy
+  SwooshDeltaSignature signature;
+  if (signature.Receive(sock) != 0) {
+    DebugLog("ERROR: can't read delta signature\n");
+    return -1;
+  }
+  size_t block_size = signature.GetBlockSize();
+
+  uint64_t data_size = 0;
+  if (ReadFileSize(file_name, &data_size) != 0) {
+    DebugLog("ERROR: can't read file size for '%s'\n", file_name.c_str());
+    return -1;
+  }
+  std::ifstream input(file_name, std::ios::binary);
+  if (!input.good()) {
+    DebugLog("ERROR: can't open file '%s'\n", file_name.c_str());
+    return -1;
   }
 
-  DirTree() : num_dirs(0), num_files(0), dirs(nullptr), files(nullptr), root(nullptr) {}
+  // send file size
+  if (net_send_u64(sock, data_size) != 0) {
+    DebugLog("ERROR: can't send file size\n");
+    return -1;
+  }
 
-  bool Sweep(const std::string &dir_name) {
-    wxDir dir;
-    if (!dir.Open(dir_name)) {
-      return false;
+  std::vector<unsigned char> buf(std::max((size_t) DELTA_SCAN_BUFFER_SIZE, 2 * block_size));
+  size_t start = 0;      // start of the current block in buf
+  size_t end = 0;        // end of valid data in buf
+  size_t literal = 0;    // start of data not yet matched in buf
+  uint64_t remaining = data_size;
+  uint32_t copy_first = 0, copy_count = 0;
+  bool have_checksum = false;
+  SwooshRollingChecksum checksum;
+  SwooshFileHash file_hash;
+  PackBuffer pack;
+
+  auto add_copy = [&] {
+    if (copy_count > 0) {
+      pack.AddU32(SWOOSH_DELTA_OP_COPY);
+      pack.AddU32(copy_first);
+      pack.AddU32(copy_count);
+      copy_count = 0;
+    }
+  };
+  auto add_data = [&] (size_t data_end) {
+    if (literal < data_end) {
+      add_copy();
+    }
+    while (literal < data_end) {
+      size_t len = std::min(data_end - literal, (size_t) SWOOSH_DELTA_DATA_MAX_SIZE);
+      pack.AddU32(SWOOSH_DELTA_OP_DATA);
+      pack.AddU32((uint32_t) len);
+      memcpy(pack.Reserve(len), &buf[literal], len);
+      literal += len;
+    }
+  };
+  auto flush = [&] {
+    if (pack.Size() < DELTA_SEND_BUFFER_SIZE) return 0;
+    int ret = pack.Send(sock);
+    pack.Clear();
+    return ret;
+  };
+
+  // slide a block-sized window over the file looking for blocks the receiver has
+  while (true) {
+    // keep a whole block plus the next byte in the buffer
+    if (remaining > 0 && end - start <= block_size) {
+      add_data(start);
+      memmove(&buf[0], &buf[start], end - start);
+      end -= start;
+      start = literal = 0;
+      size_t len = (size_t) std::min((uint64_t) (buf.size() - end), remaining);
+      if (!input.read((char *) &buf[end], len)) {
+        DebugLog("ERROR: can't read file '%s'\n", file_name.c_str());
+        return -1;
+      }
+      file_hash.Update(&buf[end], len);
+      end += len;
+      remaining -= len;
+    }
+    if (end - start < block_size) {
+      break;
+    }
+
+    if (!have_checksum) {
+      checksum.Init(&buf[start], (uint32_t) block_size);
+      have_checksum = true;
+    }
+    int64_t block = signature.FindBlock(checksum.Get(), &buf[start], (copy_count > 0) ? (int64_t) copy_first + copy_count : -1);
+    if (block >= 0) {
+      // extend the current copy or start a new one
+      if (literal < start || copy_count == 0 || (uint32_t) block != copy_first + copy_count) {
+        add_data(start);
+        copy_first = (uint32_t) block;
+      }
+      copy_count++;
+      start += block_size;
+      literal = start;
+      have_checksum = false;
+    } else {
+      if (end - start == block_size) {
+        break;
+      }
+      checksum.Roll(buf[start], buf[start + block_size]);
+      start++;
+      if (start - literal >= SWOOSH_DELTA_DATA_MAX_SIZE) {
+        add_data(start);
+      }
+    }
+
+    if (flush() != 0) {
+      DebugLog("ERROR: can't send delta\n");
+      return -1;
     }
-    num_dirs = 0;
-    num_files = 0;
-    if (dirs) dirs->clear();
-    if (files) files->clear();
-    root = &dir_name;
-    dir.Traverse(*this, "", wxDIR_FILES|wxDIR_DIRS|wxDIR_HIDDEN|wxDIR_NO_FOLLOW);
-    root = nullptr;
-    dir.Close();
-    return true;
   }
 
-  int GetNumDirs() { return num_dirs; }
-  int GetNumFiles() { return num_files; }
+  // send what's left and the hash of the whole file
+  add_data(end);
+  unsigned char hash[SWOOSH_DELTA_HASH_SIZE];
+  file_hash.Final(hash);
+  pack.AddU32(SWOOSH_DELTA_OP_END);
+  memcpy(pack.Reserve(SWOOSH_DELTA_HASH_SIZE), hash, SWOOSH_DELTA_HASH_SIZE);
+  if (pack.Send(sock) != 0) {
+    DebugLog("ERROR: can't send delta\n");
+    return -1;
+  }
 
-  virtual wxDirTraverseResult OnFile(const wxString &filename)
-  {
-    num_files++;
-    if (files) files->push_back(GetPathFragment(filename.ToStdString()));
-    return wxDIR_CONTINUE;
+  return 0;
+}
+
+// ==========================================================================
+// SwooshLocalSwarmData
+// ==========================================================================
+
+int SwooshLocalSwarmData::SendContentHead(net_socket *sock)
+{
+  // send data type
+  if (net_send_u32(sock, SWOOSH_DATA_FILE) != 0) return -1;
+
+  // send file name
+  if (SendString(sock, GetPathFilename(file_name)) != 0) {
+    DebugLog("ERROR: can't send file name\n");
+    return -1;
   }
 
-  virtual wxDirTraverseResult OnDir(const wxString &dirname)
-  {
-    num_dirs++;
-    if (dirs) dirs->push_back(GetPathFragment(dirname.ToStdString()));
-    return wxDIR_CONTINUE;
+  // send file size
+  if (net_send_u64(sock, file_size) != 0) {
+    DebugLog("ERROR: can't send file size\n");
+    return -1;
   }
-};
 
-SwooshLocalDirData::SwooshLocalDirData(uint32_t message_id, const std::string &dir_name)
-  : SwooshLocalPermanentData(message_id), dir_name(dir_name)
+  return 0;
+}
+
+int SwooshLocalSwarmData::SendContentBody(net_socket *sock)
 {
-  DirTree tree;
-  if (!tree.Sweep(dir_name)) {
-    tree_size = 0;
-  } else {
-    tree_size = tree.GetNumDirs() + tree.GetNumFiles();
+  DebugLog("ERROR: swarm peers only send file ranges\n");
+  return -1;
+}
+
+int SwooshLocalSwarmData::SendContentRange(net_socket *sock, uint64_t offset, uint64_t len)
+{
+  // only send data we already downloaded
+  if (!chunks->HasRange(offset, len)) {
+    DebugLog("ERROR: don't have range %llu+%llu of '%s'\n", (unsigned long long) offset,
+             (unsigned long long) len, file_name.c_str());
+    return -1;
   }
-};
+  return SendFileRange(sock, file_name, offset, len);
+}
+
+// ==========================================================================
+// SwooshLocalDirData
+// ==========================================================================
+
+SwooshLocalDirData::SwooshLocalDirData(uint32_t message_id, const std::string &dir_name)
+  : SwooshLocalPermanentData(message_id), dir_name(dir_name), manifest(dir_name)
+{
+}
+
+SwooshLocalDirData::SwooshLocalDirData(uint32_t message_id, const std::string &dir_name,
+                                       std::shared_ptr<const SwooshDirManifest::Snapshot> saved_manifest,
+                                       std::function<void(bool changed)> on_swept)
+  : SwooshLocalPermanentData(message_id), dir_name(dir_name), manifest(dir_name, saved_manifest, on_swept)
+{
+}
 
 int SwooshLocalDirData::SendContentHead(net_socket *sock)
 {
   // send data type
   if (net_send_u32(sock, SWOOSH_DATA_DIR) != 0) return -1;
 
-  // send file size
-  if (net_send_u32(sock, tree_size) != 0) {
+  // send tree size
+  if (net_send_u32(sock, (uint32_t) manifest.GetNumItems()) != 0) {
     DebugLog("ERROR: can't send tree size\n");
     return -1;
   }
@@ -236,43 +543,163 @@ int SwooshLocalDirData::SendContentHead(net_socket *sock)
 
 int SwooshLocalDirData::SendContentBody(net_socket *sock)
 {
-  std::vector<std::string> dirs, files;
-  DirTree tree(&dirs, &files);
-  if (!tree.Sweep(dir_name)) {
-    DebugLog("ERROR: can't open directory '%s'\n", dir_name.c_str());
-    return -1;
+  return SendDirBody(sock, "", 0);
+}
+
+int SwooshLocalDirData::SendContentResume(net_socket *sock, const std::string &file_name, uint64_t offset)
+{
+  return SendDirBody(sock, file_name, offset);
+}
+
+int SwooshLocalDirData::SendContentManifest(net_socket *sock)
+{
+  auto snapshot = manifest.GetSnapshot();
+
+  // send manifest size, number of dirs, number of files, directory names and file names with sizes
+  PackBuffer pack;
+  pack.AddU32(0);    // manifest size, filled before sending
+  pack.AddU32((uint32_t) snapshot->dirs.size());
+  pack.AddU32((uint32_t) snapshot->files.size());
+  for (const auto &dir : snapshot->dirs) {
+    pack.AddString(dir);
   }
-  
-  // send number of directories
-  if (net_send_u32(sock, tree.GetNumDirs()) != 0) {
-    DebugLog("ERROR: can't send num dirs\n");
-    return -1;
+  for (const auto &file : snapshot->files) {
+    pack.AddString(file.name);
+    pack.AddU64(file.size);
   }
-
-  // send number of files
-  if (net_send_u32(sock, tree.GetNumFiles()) != 0) {
-    DebugLog("ERROR: can't send num files\n");
+  pack.SetU32(0, (uint32_t) (pack.Size() - 4));
+  if (pack.Send(sock) != 0) {
+    DebugLog("ERROR: can't send manifest\n");
     return -1;
   }
 
-  // send directory names
-  for (const auto &dir : dirs) {
-    if (SendString(sock, dir) != 0) {
-      DebugLog("ERROR: can't send dir name\n");
+  return 0;
+}
+
+int SwooshLocalDirData::SendContentFiles(net_socket *sock)
+{
+  SwooshCompressor compressor;
+
+  // serve file ranges until the receiver sends an empty name
+  while (true) {
+    uint32_t name_len;
+    if (net_recv_u32(sock, &name_len) != 0 || name_len > MAX_REQUEST_NAME_SIZE) {
+      DebugLog("ERROR: can't read requested file name\n");
+      return -1;
+    }
+    if (name_len == 0) {
+      return 0;
+    }
+    std::string file(name_len, '\0');
+    uint64_t offset, len;
+    if (net_recv_data(sock, &file[0], name_len) != 0 || net_recv_u64(sock, &offset) != 0 || net_recv_u64(sock, &len) != 0) {
+      DebugLog("ERROR: can't read requested file range\n");
       return -1;
     }
-  }
 
-  // send files
-  for (const auto &file : files) {
-    if (SendString(sock, file) != 0) {
-      DebugLog("ERROR: can't send file name\n");
+    // only serve files listed in the manifest
+    SwooshDirManifest::FileInfo info;
+    if (!IsSafeRelativePath(file) || !manifest.GetFile(file, &info)) {
+      DebugLog("ERROR: refusing to send file with invalid name\n");
+      return -1;
+    }
+    if (offset > info.size || len > info.size - offset) {
+      DebugLog("ERROR: invalid range requested for '%s'\n", file.c_str());
       return -1;
     }
-    if (SendFile(sock, dir_name + "/" + file) != 0) {
+    if (SendFileData(sock, dir_name + "/" + file, offset, len, &compressor) != 0) {
       return -1;
     }
   }
+}
+
+int SwooshLocalDirData::SendDirBody(net_socket *sock, const std::string &first_file, uint64_t first_offset)
+{
+  auto snapshot = manifest.GetSnapshot();
+  const auto &files = snapshot->files;
+
+  // skip files the receiver already has (files are sorted by name)
+  auto first = std::lower_bound(files.begin(), files.end(), first_file, SwooshDirManifest::FileNameLess);
+
+  // send number of dirs, number of files and directory names
+  PackBuffer pack;
+  pack.AddU32((uint32_t) snapshot->dirs.size());
+  pack.AddU32((uint32_t) (files.end() - first));
+  for (const auto &dir : snapshot->dirs) {
+    pack.AddString(dir);
+  }
+  if (pack.Send(sock) != 0) {
+    DebugLog("ERROR: can't send directory list\n");
+    return -1;
+  }
+  pack.Clear();
+
+  // send files, packing small files together
+  SwooshCompressor compressor;
+  for (auto it = first; it != files.end(); ++it) {
+    const auto &file = it->name;
+    auto file_path = dir_name + "/" + file;
+    uint64_t file_size = it->size;
+
+    // start from the beginning if the file changed since it was partially sent
+    uint64_t offset = (file == first_file && first_offset <= file_size) ? first_offset : 0;
+    uint64_t len = file_size - offset;
+    size_t entry_size = 4 + file.size() + 8 + 8 + len;
+
+    // send pending pack if the file doesn't fit
+    if (pack.Size() > 0 && (len > PACK_FILE_MAX_SIZE || pack.Size() + entry_size > SWOOSH_DIR_PACK_MAX_SIZE)) {
+      pack.SetU32(4, (uint32_t) (pack.Size() - 8));
+      if (pack.Send(sock, 8, &compressor) != 0) {
+        DebugLog("ERROR: can't send file pack\n");
+        return -1;
+      }
+      pack.Clear();
+    }
+
+    // large files are sent on their own
+    if (len > PACK_FILE_MAX_SIZE) {
+      if (net_send_u32(sock, SWOOSH_DIR_FRAME_FILE) != 0 || SendString(sock, file) != 0 || net_send_u64(sock, offset) != 0) {
+        DebugLog("ERROR: can't send file header\n");
+        return -1;
+      }
+      if (SendFileData(sock, file_path, offset, len, &compressor) != 0) {
+        return -1;
+      }
+      continue;
+    }
+
+    // add small file to the pack
+    if (pack.Size() == 0) {
+      pack.AddU32(SWOOSH_DIR_FRAME_PACK);
+      pack.AddU32(0);    // pack size, filled before sending
+    }
+    pack.AddString(file);
+    pack.AddU64(offset);
+    pack.AddU64(len);
+    if (len > 0) {
+      std::ifstream input(file_path, std::ios::binary);
+      input.seekg(offset);
+      input.read(pack.Reserve((size_t) len), len);
+      if (!input.good()) {
+        DebugLog("ERROR: can't read file '%s'\n", file_path.c_str());
+        return -1;
+      }
+    }
+  }
+
+  // send last pack
+  if (pack.Size() > 0) {
+    pack.SetU32(4, (uint32_t) (pack.Size() - 8));
+    if (pack.Send(sock, 8, &compressor) != 0) {
+      DebugLog("ERROR: can't send file pack\n");
+      return -1;
+    }
+  }
+
+  if (net_send_u32(sock, SWOOSH_DIR_FRAME_END) != 0) {
+    DebugLog("ERROR: can't send end of directory\n");
+    return -1;
+  }
 
   return 0;
 }
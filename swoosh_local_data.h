@@ -5,11 +5,19 @@
 
 #include <cstdint>
 #include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
 #include <wx/filefn.h>
 
 #include "network.h"
+#include "swoosh_dir_manifest.h"
+#include "swoosh_compress.h"
+#include "swoosh_multicast.h"
+#include "swoosh_swarm.h"
 
 #define SWOOSH_DATA_ALWAYS_VALID ((uint64_t) -1)
+#define SWOOSH_DATA_REMOVED      (-1)     // num_refs of data taken out of the store
 
 // ==========================================================================
 // SwooshLocalData
@@ -19,16 +27,30 @@ class SwooshLocalData
   friend class SwooshNode;
 
 protected:
-  uint64_t message_id;
-  uint64_t valid_until;
-  int num_refs;
+  std::atomic<uint32_t> message_id;     // only changed for shares found changed after a restart
+  std::atomic<uint64_t> valid_until;
+  std::atomic<int> num_refs;
 
   virtual int SendContentHead(net_socket *sock) = 0;
   virtual int SendContentBody(net_socket *sock) = 0;
+  virtual int SendContentRange(net_socket *sock, uint64_t offset, uint64_t len);
+  virtual int SendContentResume(net_socket *sock, const std::string &file_name, uint64_t offset);
+  virtual int SendContentManifest(net_socket *sock);
+  virtual int SendContentFiles(net_socket *sock);
+  virtual int SendContentDelta(net_socket *sock);
+  virtual int SendContentMulticast(net_socket *sock);    // takes the socket
+  virtual int SendContentSwarm(net_socket *sock);
+  // true if the reply is small or a plain file range, so it can be queued without blocking
+  virtual bool CanQueueContent(uint32_t request_type) { return false; }
+  // true if the reply is a bulk transfer, which is scheduled behind the other replies
+  virtual bool IsBulkContent(uint32_t request_type) { return SWOOSH_DATA_REQUEST_IS_BULK(request_type); }
 
   void SetMessageId(uint32_t message_id) { this->message_id = message_id; }
   int SendString(net_socket *sock, const std::string &str);
   int SendFile(net_socket *sock, const std::string &filename);
+  int SendFileRange(net_socket *sock, const std::string &filename, uint64_t offset, uint64_t len);
+  int SendFileData(net_socket *sock, const std::string &filename, uint64_t offset, uint64_t len,
+                   SwooshCompressor *compressor = nullptr);
 
 public:
   SwooshLocalData(uint32_t message_id, uint64_t valid_until)
@@ -38,11 +60,27 @@ public:
 
   uint32_t GetMessageId() { return message_id; }
 
-  void AddRef() { num_refs++; }
-  void RemoveRef() { num_refs--; }
-  bool hasRefs() { return num_refs != 0; }
+  int RemoveRef() { return --num_refs; }
+
+  // add a reference unless the data was removed from the store
+  bool TryAddRef() {
+    int refs = num_refs;
+    while (refs != SWOOSH_DATA_REMOVED) {
+      if (num_refs.compare_exchange_weak(refs, refs + 1)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // mark the data as removed if it has no references
+  bool TryRemove() {
+    int refs = 0;
+    return num_refs.compare_exchange_strong(refs, SWOOSH_DATA_REMOVED);
+  }
 
   uint64_t GetValidUntil() { return valid_until; }
+  void SetValidUntil(uint64_t valid_until) { this->valid_until = valid_until; }
   bool IsExpiredAt(uint64_t time) { return (valid_until != SWOOSH_DATA_ALWAYS_VALID) && (valid_until < time); }
 };
 
@@ -67,6 +105,8 @@ protected:
 
   virtual int SendContentHead(net_socket *sock);
   virtual int SendContentBody(net_socket *sock);
+  virtual bool CanQueueContent(uint32_t request_type);
+  virtual bool IsBulkContent(uint32_t request_type) { return false; }
 
 public:
   SwooshLocalTextData(uint32_t message_id, uint64_t valid_until, const std::string &str)
@@ -85,10 +125,19 @@ class SwooshLocalFileData : public SwooshLocalPermanentData
 {
 protected:
   std::string file_name;
-  uint32_t file_size;
+  uint64_t file_size;
+  std::mutex multicast_lock;
+  std::shared_ptr<SwooshMulticastSender> multicast_session;
+  SwooshSwarmTracker swarm_tracker;
 
   virtual int SendContentHead(net_socket *sock);
   virtual int SendContentBody(net_socket *sock);
+  virtual int SendContentRange(net_socket *sock, uint64_t offset, uint64_t len);
+  virtual int SendContentResume(net_socket *sock, const std::string &name, uint64_t offset);
+  virtual int SendContentDelta(net_socket *sock);
+  virtual int SendContentMulticast(net_socket *sock);
+  virtual int SendContentSwarm(net_socket *sock);
+  virtual bool CanQueueContent(uint32_t request_type);
 
 public:
   SwooshLocalFileData(uint32_t message_id, const std::string &file_name);
@@ -96,7 +145,34 @@ public:
   virtual ~SwooshLocalFileData() {}
 
   virtual std::string &GetFileName() { return file_name; }
-  virtual uint32_t GetFileSize() { return file_size; }
+  virtual uint64_t GetFileSize() { return file_size; }
+};
+
+// ==========================================================================
+// SwooshLocalSwarmData
+// ==========================================================================
+
+// File being downloaded in swarm mode, serving the chunks we already have
+// to other receivers of the same file
+class SwooshLocalSwarmData : public SwooshLocalData
+{
+protected:
+  std::string file_name;
+  uint64_t file_size;
+  std::shared_ptr<SwooshSwarmChunks> chunks;
+
+  virtual int SendContentHead(net_socket *sock);
+  virtual int SendContentBody(net_socket *sock);
+  virtual int SendContentRange(net_socket *sock, uint64_t offset, uint64_t len);
+
+public:
+  SwooshLocalSwarmData(uint32_t message_id, const std::string &file_name, uint64_t file_size)
+    : SwooshLocalData(message_id, SWOOSH_DATA_ALWAYS_VALID), file_name(file_name), file_size(file_size),
+      chunks(std::make_shared<SwooshSwarmChunks>(file_size)) {}
+
+  virtual ~SwooshLocalSwarmData() {}
+
+  std::shared_ptr<SwooshSwarmChunks> GetChunks() { return chunks; }
 };
 
 // ==========================================================================
@@ -106,17 +182,28 @@ class SwooshLocalDirData : public SwooshLocalPermanentData
 {
 protected:
   std::string dir_name;
-  uint32_t tree_size;
+  SwooshDirManifest manifest;
 
   virtual int SendContentHead(net_socket *sock);
   virtual int SendContentBody(net_socket *sock);
+  virtual int SendContentResume(net_socket *sock, const std::string &file_name, uint64_t offset);
+  virtual int SendContentManifest(net_socket *sock);
+  virtual int SendContentFiles(net_socket *sock);
+
+  int SendDirBody(net_socket *sock, const std::string &first_file, uint64_t first_offset);
 
 public:
   SwooshLocalDirData(uint32_t message_id, const std::string &dir_name);
+  // served from the saved manifest until the directory is swept again
+  SwooshLocalDirData(uint32_t message_id, const std::string &dir_name,
+                     std::shared_ptr<const SwooshDirManifest::Snapshot> saved_manifest,
+                     std::function<void(bool changed)> on_swept);
 
   virtual ~SwooshLocalDirData() {}
 
   virtual std::string &GetDirName() { return dir_name; }
+  // current list of the directory contents, without sweeping it
+  std::shared_ptr<const SwooshDirManifest::Snapshot> GetManifest() { return manifest.GetSnapshot(false); }
 };
 
 #endif /* SWOOSH_LOCAL_DATA_H_FILE */
@@ -0,0 +1,617 @@
+#include "targetver.h"
+#include "swoosh_multicast.h"
+
+#include <cstring>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <system_error>
+
+#include "swoosh_data.h"
+#include "util.h"
+
+#define MULTICAST_DEFAULT_PORT      5560
+#define MULTICAST_DEFAULT_RATE      (40*1024*1024)
+#define MULTICAST_STATUS_INTERVAL_MS  100     // how often an idle sender tells receivers it's idle
+#define MULTICAST_RECV_TIMEOUT_MS     100
+#define MULTICAST_NACK_INTERVAL_MS    200     // silence before a receiver asks for missed blocks
+#define MULTICAST_NACK_MIN_INTERVAL_MS  50
+#define MULTICAST_SESSION_TIMEOUT_MS  5000    // silence before a receiver gives up
+#define MULTICAST_MAX_GROUP_NAME_SIZE 64
+#define MULTICAST_MAX_BLOCK_SIZE      (64*1024)
+
+static void PutU32(char *p, uint32_t val)
+{
+  for (int i = 0; i < 4; i++) p[i] = (char) ((val >> (8*i)) & 0xff);
+}
+
+static uint32_t GetU32(const char *p)
+{
+  uint32_t val = 0;
+  for (int i = 0; i < 4; i++) val |= ((uint32_t) (unsigned char) p[i]) << (8*i);
+  return val;
+}
+
+// ==========================================================================
+// SwooshMulticastSender
+// ==========================================================================
+
+std::mutex SwooshMulticastSender::config_lock;
+std::string SwooshMulticastSender::group = SWOOSH_MULTICAST_GROUP_IPV4;
+int SwooshMulticastSender::port = MULTICAST_DEFAULT_PORT;
+uint64_t SwooshMulticastSender::rate = MULTICAST_DEFAULT_RATE;
+
+SwooshMulticastSender::SwooshMulticastSender(const std::string &file_name, uint64_t file_size, uint32_t session_id, net_mcast *mcast)
+  : file_name(file_name), file_size(file_size), session_id(session_id), mcast(mcast),
+    input(file_name, std::ios::binary), next_block(0), num_receivers(0), running(false), finished(false)
+{
+  num_blocks = (uint32_t) ((file_size + SWOOSH_MULTICAST_BLOCK_SIZE - 1) / SWOOSH_MULTICAST_BLOCK_SIZE);
+  pending.assign(num_blocks, true);
+  num_pending = num_blocks;
+}
+
+SwooshMulticastSender::~SwooshMulticastSender()
+{
+  net_mcast_close(mcast);
+}
+
+void SwooshMulticastSender::SetGroup(const std::string &group, int port)
+{
+  std::lock_guard<std::mutex> guard(config_lock);
+  SwooshMulticastSender::group = group;
+  SwooshMulticastSender::port = port;
+}
+
+uint64_t SwooshMulticastSender::GetRate()
+{
+  std::lock_guard<std::mutex> guard(config_lock);
+  return rate;
+}
+
+void SwooshMulticastSender::SetRate(uint64_t bytes_per_sec)
+{
+  std::lock_guard<std::mutex> guard(config_lock);
+  rate = bytes_per_sec;
+}
+
+std::shared_ptr<SwooshMulticastSender> SwooshMulticastSender::Create(const std::string &file_name, uint64_t file_size)
+{
+  if (file_size == 0 || (file_size + SWOOSH_MULTICAST_BLOCK_SIZE - 1) / SWOOSH_MULTICAST_BLOCK_SIZE > UINT32_MAX) {
+    DebugLog("ERROR: can't send file of size %llu by multicast\n", (unsigned long long) file_size);
+    return nullptr;
+  }
+
+  std::string group_name;
+  int group_port;
+  {
+    std::lock_guard<std::mutex> guard(config_lock);
+    group_name = group;
+    group_port = port;
+  }
+  net_mcast *mcast = net_mcast_open(group_name.c_str(), group_port, 0);
+  if (!mcast) {
+    DebugLog("ERROR: can't open multicast socket for group '%s'\n", group_name.c_str());
+    return nullptr;
+  }
+
+  // without the file there's no session, so the receivers use TCP
+  std::random_device rd;
+  std::uniform_int_distribution<uint32_t> dist;
+  auto session = std::make_shared<SwooshMulticastSender>(file_name, file_size, dist(rd), mcast);
+  if (!session->input.is_open()) {
+    DebugLog("ERROR: can't open file '%s'\n", file_name.c_str());
+    return nullptr;
+  }
+  return session;
+}
+
+bool SwooshMulticastSender::AddReceiver()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (finished) {
+    return false;
+  }
+  num_receivers++;
+  if (!running) {
+    try {
+      std::thread sender_thread{[session = shared_from_this()] {
+        session->Run();
+      }};
+      sender_thread.detach();
+      std::thread receivers_thread{[session = shared_from_this()] {
+        session->ServeReceivers();
+      }};
+      receivers_thread.detach();
+    } catch (const std::system_error &) {
+      DebugLog("ERROR: can't start multicast sender\n");
+      num_receivers--;
+      finished = true;
+      cond.notify_all();
+      return false;
+    }
+    running = true;
+  }
+  return true;
+}
+
+void SwooshMulticastSender::RemoveReceiver()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  num_receivers--;
+  cond.notify_all();
+}
+
+void SwooshMulticastSender::AddNack(uint32_t first, uint32_t count)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (first >= num_blocks) {
+    return;
+  }
+  uint32_t end = first + std::min(count, num_blocks - first);
+  for (uint32_t block = first; block < end; block++) {
+    if (!pending[block]) {
+      pending[block] = true;
+      num_pending++;
+    }
+  }
+  cond.notify_all();
+}
+
+int SwooshMulticastSender::SendPacket(std::vector<char> &packet, uint32_t type, uint32_t index, size_t data_len)
+{
+  PutU32(&packet[0], SWOOSH_MULTICAST_MAGIC);
+  PutU32(&packet[4], session_id);
+  PutU32(&packet[8], type);
+  PutU32(&packet[12], index);
+  return net_mcast_send(mcast, packet.data(), SWOOSH_MULTICAST_HEADER_SIZE + data_len);
+}
+
+void SwooshMulticastSender::Run()
+{
+  uint64_t bytes_per_sec;
+  {
+    std::lock_guard<std::mutex> guard(config_lock);
+    bytes_per_sec = rate;
+  }
+
+  if (!input.good()) {
+    DebugLog("ERROR: can't read file '%s'\n", file_name.c_str());
+    std::lock_guard<std::mutex> guard(lock);
+    finished = true;
+    return;
+  }
+
+  std::vector<char> packet(SWOOSH_MULTICAST_HEADER_SIZE + SWOOSH_MULTICAST_BLOCK_SIZE);
+  std::vector<char> parity(SWOOSH_MULTICAST_BLOCK_SIZE);
+  uint32_t parity_group = UINT32_MAX;     // group whose parity is being computed
+  uint32_t parity_blocks = 0;
+  auto next_send = std::chrono::steady_clock::now();
+
+  while (input.good()) {
+    uint32_t block;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      while (num_receivers > 0 && num_pending == 0) {
+        // nothing to send: let receivers know, so they ask for what they miss
+        guard.unlock();
+        SendPacket(packet, SWOOSH_MULTICAST_PACKET_STATUS, 0, 0);
+        guard.lock();
+        if (num_receivers > 0 && num_pending == 0) {
+          cond.wait_for(guard, std::chrono::milliseconds(MULTICAST_STATUS_INTERVAL_MS));
+        }
+      }
+      if (num_receivers == 0) {
+        break;
+      }
+
+      // send pending blocks in order, wrapping around for the repairs
+      while (!pending[next_block]) {
+        next_block = (next_block + 1) % num_blocks;
+      }
+      block = next_block;
+      pending[block] = false;
+      num_pending--;
+      next_block = (block + 1) % num_blocks;
+    }
+
+    uint64_t offset = (uint64_t) block * SWOOSH_MULTICAST_BLOCK_SIZE;
+    size_t len = (size_t) std::min((uint64_t) SWOOSH_MULTICAST_BLOCK_SIZE, file_size - offset);
+    char *data = &packet[SWOOSH_MULTICAST_HEADER_SIZE];
+    input.seekg(offset);
+    if (!input.read(data, len)) {
+      DebugLog("ERROR: can't read file '%s'\n", file_name.c_str());
+      break;
+    }
+
+    // compute the parity of groups sent in full, one block after another
+    uint32_t group = block / SWOOSH_MULTICAST_FEC_GROUP;
+    uint32_t group_blocks = std::min((uint32_t) SWOOSH_MULTICAST_FEC_GROUP, num_blocks - group * SWOOSH_MULTICAST_FEC_GROUP);
+    if (block % SWOOSH_MULTICAST_FEC_GROUP == 0) {
+      parity_group = group;
+      parity_blocks = 0;
+      std::fill(parity.begin(), parity.end(), 0);
+    }
+    if (group == parity_group && block == group * SWOOSH_MULTICAST_FEC_GROUP + parity_blocks) {
+      for (size_t i = 0; i < len; i++) {
+        parity[i] ^= data[i];
+      }
+      parity_blocks++;
+    } else {
+      parity_group = UINT32_MAX;
+    }
+
+    // a lost packet is like any other loss: the receivers will ask for it again
+    size_t sent = len;
+    if (SendPacket(packet, SWOOSH_MULTICAST_PACKET_DATA, block, len) != 0) {
+      DebugLog("WARNING: can't send multicast packet\n");
+    }
+    if (group == parity_group && parity_blocks == group_blocks) {
+      memcpy(data, parity.data(), parity.size());
+      SendPacket(packet, SWOOSH_MULTICAST_PACKET_PARITY, group, parity.size());
+      sent += parity.size();
+      parity_group = UINT32_MAX;
+    }
+
+    // pace packets so we don't flood the network
+    if (bytes_per_sec > 0) {
+      next_send += std::chrono::microseconds(sent * 1000000 / bytes_per_sec);
+      auto now = std::chrono::steady_clock::now();
+      if (next_send > now) {
+        std::this_thread::sleep_until(next_send);
+      } else if (now - next_send > std::chrono::milliseconds(50)) {
+        next_send = now;
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  finished = true;
+}
+
+int SwooshMulticastSender::ServeReceiver(net_socket *sock)
+{
+  std::string group_name;
+  int group_port;
+  {
+    std::lock_guard<std::mutex> guard(config_lock);
+    group_name = group;
+    group_port = port;
+  }
+
+  if (net_send_u32(sock, 0) != 0 ||
+      net_send_u32(sock, (uint32_t) group_name.size()) != 0 ||
+      net_send_data(sock, group_name.data(), group_name.size()) != 0 ||
+      net_send_u32(sock, (uint32_t) group_port) != 0 ||
+      net_send_u32(sock, session_id) != 0 ||
+      net_send_u32(sock, SWOOSH_MULTICAST_BLOCK_SIZE) != 0 ||
+      net_send_u32(sock, SWOOSH_MULTICAST_FEC_GROUP) != 0 ||
+      net_send_u64(sock, file_size) != 0) {
+    DebugLog("ERROR: can't send multicast session info\n");
+    net_close_socket(sock);
+    RemoveReceiver();
+    return -1;
+  }
+
+  // the receivers thread listens to it from now on
+  std::lock_guard<std::mutex> guard(lock);
+  new_socks.push_back(sock);
+  cond.notify_all();
+  return 0;
+}
+
+int SwooshMulticastSender::ReadReceiverMessage(net_socket *sock)
+{
+  // 1 when the receiver is done, 0 if it may send more
+  uint32_t msg;
+  if (net_recv_u32(sock, &msg) != 0) {
+    DebugLog("ERROR: multicast receiver went away\n");
+    return -1;
+  }
+  if (msg == SWOOSH_MULTICAST_MSG_DONE) {
+    return 1;
+  }
+  if (msg != SWOOSH_MULTICAST_MSG_NACK) {
+    DebugLog("ERROR: invalid multicast message: %u\n", msg);
+    return -1;
+  }
+
+  uint32_t num_ranges;
+  if (net_recv_u32(sock, &num_ranges) != 0 || num_ranges > SWOOSH_MULTICAST_MAX_RANGES) {
+    DebugLog("ERROR: invalid multicast NACK\n");
+    return -1;
+  }
+  for (uint32_t i = 0; i < num_ranges; i++) {
+    uint32_t first, count;
+    if (net_recv_u32(sock, &first) != 0 || net_recv_u32(sock, &count) != 0) {
+      DebugLog("ERROR: can't read multicast NACK\n");
+      return -1;
+    }
+    AddNack(first, count);
+  }
+  return 0;
+}
+
+void SwooshMulticastSender::ServeReceivers()
+{
+  // send again whatever the receivers miss until each one has the whole file
+  std::vector<net_socket *> socks;
+  std::vector<int> ready;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      socks.insert(socks.end(), new_socks.begin(), new_socks.end());
+      new_socks.clear();
+      if (socks.empty()) {
+        if (num_receivers == 0) {
+          break;
+        }
+        cond.wait(guard);
+        continue;
+      }
+    }
+
+    // wake up now and then to pick up new receivers
+    ready.assign(socks.size(), 0);
+    int num_ready = net_wait_readable_any(socks.data(), ready.data(), (int) socks.size(), MULTICAST_STATUS_INTERVAL_MS);
+    for (size_t i = socks.size(); i-- > 0; ) {
+      if (num_ready < 0 || (ready[i] && ReadReceiverMessage(socks[i]) != 0)) {
+        net_close_socket(socks[i]);
+        socks.erase(socks.begin() + i);
+        RemoveReceiver();
+      }
+    }
+  }
+}
+
+// ==========================================================================
+// SwooshMulticastReceiver
+// ==========================================================================
+
+SwooshMulticastReceiver::~SwooshMulticastReceiver()
+{
+  net_mcast_close(mcast);
+}
+
+size_t SwooshMulticastReceiver::GetBlockSize(uint32_t index)
+{
+  uint64_t offset = (uint64_t) index * block_size;
+  return (size_t) std::min((uint64_t) block_size, file_size - offset);
+}
+
+int SwooshMulticastReceiver::ReadSessionInfo()
+{
+  uint32_t status;
+  if (net_recv_u32(sock, &status) != 0 || status != 0) {
+    DebugLog("ERROR: sender has no multicast session\n");
+    return -1;
+  }
+
+  uint32_t group_len;
+  if (net_recv_u32(sock, &group_len) != 0 || group_len > MULTICAST_MAX_GROUP_NAME_SIZE) {
+    DebugLog("ERROR: can't read multicast group\n");
+    return -1;
+  }
+  std::string group(group_len, '\0');
+  uint32_t port;
+  uint64_t size;
+  if (net_recv_data(sock, &group[0], group_len) != 0 ||
+      net_recv_u32(sock, &port) != 0 ||
+      net_recv_u32(sock, &session_id) != 0 ||
+      net_recv_u32(sock, &block_size) != 0 ||
+      net_recv_u32(sock, &fec_group_size) != 0 ||
+      net_recv_u64(sock, &size) != 0) {
+    DebugLog("ERROR: can't read multicast session info\n");
+    return -1;
+  }
+  if (block_size == 0 || block_size > MULTICAST_MAX_BLOCK_SIZE || size != file_size ||
+      (file_size + block_size - 1) / block_size > UINT32_MAX) {
+    DebugLog("ERROR: invalid multicast session (block size %u, file size %llu)\n", block_size, (unsigned long long) size);
+    return -1;
+  }
+  num_blocks = (uint32_t) ((file_size + block_size - 1) / block_size);
+
+  mcast = net_mcast_open(group.c_str(), (int) port, 1);
+  if (!mcast) {
+    DebugLog("ERROR: can't join multicast group '%s'\n", group.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+int SwooshMulticastReceiver::WriteBlock(uint32_t index, const char *data, size_t len)
+{
+  if (len != GetBlockSize(index)) {
+    DebugLog("WARNING: ignoring multicast block %u with bad size %u\n", index, (unsigned) len);
+    return 0;
+  }
+  file.seekp((uint64_t) index * block_size);
+  if (!file.write(data, len)) {
+    DebugLog("ERROR: can't write multicast block %u\n", index);
+    return -1;
+  }
+  received[index] = true;
+  num_received++;
+  return 0;
+}
+
+int SwooshMulticastReceiver::RepairGroup(uint32_t group, const char *parity, size_t len)
+{
+  uint64_t first = (uint64_t) group * fec_group_size;
+  if (len != block_size || first >= num_blocks) {
+    return 0;
+  }
+  uint32_t end = (uint32_t) std::min(first + fec_group_size, (uint64_t) num_blocks);
+
+  // the parity can only rebuild a single missing block
+  uint32_t missing = UINT32_MAX;
+  for (uint32_t block = (uint32_t) first; block < end; block++) {
+    if (!received[block]) {
+      if (missing != UINT32_MAX) {
+        return 0;
+      }
+      missing = block;
+    }
+  }
+  if (missing == UINT32_MAX) {
+    return 0;
+  }
+
+  std::vector<char> data(parity, parity + len);
+  std::vector<char> other(block_size);
+  for (uint32_t block = (uint32_t) first; block < end; block++) {
+    if (block == missing) {
+      continue;
+    }
+    size_t block_len = GetBlockSize(block);
+    file.seekg((uint64_t) block * block_size);
+    if (!file.read(other.data(), block_len)) {
+      DebugLog("ERROR: can't read multicast block %u\n", block);
+      return -1;
+    }
+    for (size_t i = 0; i < block_len; i++) {
+      data[i] ^= other[i];
+    }
+  }
+  return WriteBlock(missing, data.data(), GetBlockSize(missing));
+}
+
+int SwooshMulticastReceiver::SendNack()
+{
+  std::vector<char> msg(8);
+  uint32_t num_ranges = 0;
+  uint32_t block = 0;
+  while (block < num_blocks && num_ranges < SWOOSH_MULTICAST_MAX_RANGES) {
+    if (received[block]) {
+      block++;
+      continue;
+    }
+    uint32_t first = block;
+    while (block < num_blocks && !received[block]) {
+      block++;
+    }
+    msg.resize(msg.size() + 8);
+    PutU32(&msg[msg.size() - 8], first);
+    PutU32(&msg[msg.size() - 4], block - first);
+    num_ranges++;
+  }
+  if (num_ranges == 0) {
+    return 0;
+  }
+
+  PutU32(&msg[0], SWOOSH_MULTICAST_MSG_NACK);
+  PutU32(&msg[4], num_ranges);
+  if (net_send_data(sock, msg.data(), msg.size()) != 0) {
+    DebugLog("ERROR: can't send multicast NACK\n");
+    return -1;
+  }
+  return 0;
+}
+
+bool SwooshMulticastReceiver::Receive(const std::string &local_path, std::function<void(double)> progress,
+                                      const std::atomic<bool> &cancelled)
+{
+  if (ReadSessionInfo() != 0) {
+    return false;
+  }
+
+  if (net_prepare_file(local_path.c_str(), file_size) != 0) {
+    DebugLog("ERROR: can't create file '%s'\n", local_path.c_str());
+    return false;
+  }
+  file.open(local_path, std::ios::in | std::ios::out | std::ios::binary);
+  if (!file.good()) {
+    DebugLog("ERROR: can't open file '%s'\n", local_path.c_str());
+    return false;
+  }
+  received.assign(num_blocks, false);
+
+  std::vector<char> packet(SWOOSH_MULTICAST_HEADER_SIZE + block_size);
+  auto last_packet = std::chrono::steady_clock::now();
+  auto last_nack = last_packet;
+  uint32_t progress_step = std::max(num_blocks / 100, (uint32_t) 1);
+  uint32_t next_progress = progress_step;
+  while (num_received < num_blocks) {
+    if (cancelled) {
+      return false;
+    }
+    int len = net_mcast_recv(mcast, packet.data(), packet.size(), MULTICAST_RECV_TIMEOUT_MS);
+    if (len < 0) {
+      return false;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (len < SWOOSH_MULTICAST_HEADER_SIZE ||
+        GetU32(&packet[0]) != SWOOSH_MULTICAST_MAGIC ||
+        GetU32(&packet[4]) != session_id) {
+      // nothing from our session for a while: ask for what's missing
+      if (now - last_packet > std::chrono::milliseconds(MULTICAST_SESSION_TIMEOUT_MS)) {
+        DebugLog("ERROR: multicast sender went silent\n");
+        return false;
+      }
+      if (now - last_packet > std::chrono::milliseconds(MULTICAST_NACK_INTERVAL_MS) &&
+          now - last_nack > std::chrono::milliseconds(MULTICAST_NACK_INTERVAL_MS)) {
+        if (SendNack() != 0) return false;
+        last_nack = now;
+      }
+      continue;
+    }
+    last_packet = now;
+
+    uint32_t type = GetU32(&packet[8]);
+    uint32_t index = GetU32(&packet[12]);
+    const char *data = &packet[SWOOSH_MULTICAST_HEADER_SIZE];
+    size_t data_len = len - SWOOSH_MULTICAST_HEADER_SIZE;
+    switch (type) {
+    case SWOOSH_MULTICAST_PACKET_DATA:
+      if (index < num_blocks && !received[index] && WriteBlock(index, data, data_len) != 0) return false;
+      break;
+
+    case SWOOSH_MULTICAST_PACKET_PARITY:
+      if (fec_group_size > 0 && RepairGroup(index, data, data_len) != 0) return false;
+      break;
+
+    case SWOOSH_MULTICAST_PACKET_STATUS:
+      if (now - last_nack > std::chrono::milliseconds(MULTICAST_NACK_MIN_INTERVAL_MS)) {
+        if (SendNack() != 0) return false;
+        last_nack = now;
+      }
+      break;
+    }
+
+    if (num_received >= next_progress) {
+      progress((double) num_received / num_blocks);
+      next_progress = num_received + progress_step;
+    }
+  }
+
+  file.flush();
+  if (!file.good()) {
+    DebugLog("ERROR: can't write file '%s'\n", local_path.c_str());
+    return false;
+  }
+  file.close();
+  if (net_send_u32(sock, SWOOSH_MULTICAST_MSG_DONE) != 0) {
+    // we have the file anyway
+    DebugLog("WARNING: can't tell multicast sender we're done\n");
+  }
+  return true;
+}
+
+std::vector<SwooshCheckpoint::Range> SwooshMulticastReceiver::GetReceivedRanges()
+{
+  std::vector<SwooshCheckpoint::Range> ranges;
+  uint32_t block = 0;
+  while (block < (uint32_t) received.size()) {
+    if (!received[block]) {
+      block++;
+      continue;
+    }
+    uint32_t first = block;
+    while (block < (uint32_t) received.size() && received[block]) {
+      block++;
+    }
+    uint64_t end = std::min((uint64_t) block * block_size, file_size);
+    ranges.push_back(SwooshCheckpoint::Range{(uint64_t) first * block_size, end});
+  }
+  return ranges;
+}
@@ -0,0 +1,126 @@
+#ifndef SWOOSH_MULTICAST_H_FILE
+#define SWOOSH_MULTICAST_H_FILE
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <condition_variable>
+
+#include "network.h"
+#include "swoosh_checkpoint.h"
+
+#define SWOOSH_MULTICAST_MIN_SIZE  (32*1024*1024)   // smaller files go over TCP
+
+// ==========================================================================
+// SwooshMulticastSender
+// ==========================================================================
+
+// Session sending a file once to a multicast group for all its receivers.
+// Each receiver keeps a TCP connection to the sender to ask for the blocks
+// it missed (NACKs); those blocks are sent again to the whole group, so the
+// time to send the file doesn't grow with the number of receivers.  The
+// first pass also sends a parity packet for each group of blocks, so a
+// receiver can rebuild a block lost in a group without asking for it.  One
+// thread sends the packets and another one listens to all the receivers'
+// connections.  The session ends when its last receiver is done.
+class SwooshMulticastSender : public std::enable_shared_from_this<SwooshMulticastSender>
+{
+protected:
+  std::string file_name;
+  uint64_t file_size;
+  uint32_t session_id;
+  uint32_t num_blocks;
+  net_mcast *mcast;
+  std::ifstream input;
+
+  std::mutex lock;
+  std::condition_variable cond;
+  std::vector<bool> pending;     // blocks to send
+  uint32_t num_pending;
+  uint32_t next_block;
+  int num_receivers;
+  std::vector<net_socket *> new_socks;   // receivers handed over by ServeReceiver()
+  bool running;
+  bool finished;
+
+  static std::mutex config_lock;
+  static std::string group;
+  static int port;
+  static uint64_t rate;
+
+  void Run();
+  int SendPacket(std::vector<char> &packet, uint32_t type, uint32_t index, size_t data_len);
+  void AddNack(uint32_t first, uint32_t count);
+  void RemoveReceiver();
+  void ServeReceivers();
+  int ReadReceiverMessage(net_socket *sock);
+
+public:
+  SwooshMulticastSender(const std::string &file_name, uint64_t file_size, uint32_t session_id, net_mcast *mcast);
+  ~SwooshMulticastSender();
+
+  // open a session for a file, or return nullptr on error
+  static std::shared_ptr<SwooshMulticastSender> Create(const std::string &file_name, uint64_t file_size);
+
+  // set the group and port used by new sessions
+  static void SetGroup(const std::string &group, int port);
+
+  // set the max rate in bytes per second of new packets sent by each session
+  static uint64_t GetRate();
+  static void SetRate(uint64_t bytes_per_sec);
+
+  // add a receiver, starting to send if needed; false if the session is already over
+  bool AddReceiver();
+
+  // reply to a receiver's request and keep its socket in the session, which
+  // handles its NACKs and closes it when the receiver is done (the receiver
+  // must have been added with AddReceiver()); returns without waiting
+  int ServeReceiver(net_socket *sock);
+};
+
+// ==========================================================================
+// SwooshMulticastReceiver
+// ==========================================================================
+
+// Receiver of a file sent by a multicast session, using the connection
+// that sent SWOOSH_DATA_REQUEST_MULTICAST to ask for missed blocks.
+class SwooshMulticastReceiver
+{
+protected:
+  net_socket *sock;
+  net_mcast *mcast;
+  std::fstream file;
+  uint64_t file_size;
+  uint32_t session_id;
+  uint32_t block_size;
+  uint32_t fec_group_size;
+  uint32_t num_blocks;
+  uint32_t num_received;
+  std::vector<bool> received;
+
+  int ReadSessionInfo();
+  size_t GetBlockSize(uint32_t index);
+  int WriteBlock(uint32_t index, const char *data, size_t len);
+  int RepairGroup(uint32_t group, const char *parity, size_t len);
+  int SendNack();
+
+public:
+  SwooshMulticastReceiver(net_socket *sock, uint64_t file_size)
+    : sock(sock), mcast(nullptr), file_size(file_size), session_id(0), block_size(0),
+      fec_group_size(0), num_blocks(0), num_received(0) {}
+  ~SwooshMulticastReceiver();
+
+  // receive the file into 'local_path', returning false on error, if the
+  // sender goes silent or if 'cancelled' is set
+  bool Receive(const std::string &local_path, std::function<void(double)> progress, const std::atomic<bool> &cancelled);
+
+  // parts of the file received so far
+  std::vector<SwooshCheckpoint::Range> GetReceivedRanges();
+};
+
+#endif /* SWOOSH_MULTICAST_H_FILE */
@@ -2,15 +2,26 @@
 #include "swoosh_node.h"
 
 #include <vector>
+#include <algorithm>
 #include <random>
 #include <thread>
+#include <chrono>
 #include <wx/wx.h>
 #include <wx/time.h>
+#include <wx/filefn.h>
 
 #include "swoosh_data.h"
 #include "util.h"
 
+#define MAX_REQUEST_NAME_SIZE  4096
+
 bool SwooshNode::running = false;
+size_t SwooshNode::beacon_threads = 4;
+size_t SwooshNode::request_threads = 32;
+size_t SwooshNode::transfer_threads = 32;
+int SwooshNode::reactor_threads = 2;
+bool SwooshNode::swarm = false;
+std::string SwooshNode::share_catalog;
 
 uint32_t SwooshNode::MakeClientId() {
   std::random_device rd;
@@ -18,11 +29,6 @@ uint32_t SwooshNode::MakeClientId() {
   return dist(rd);
 }
 
-void SwooshNode::Sleep(uint32_t msec)
-{
-  wxMilliSleep(msec);
-}
-
 uint64_t SwooshNode::GetTime(uint32_t msec_in_future)
 {
   wxLongLong now = wxGetUTCTimeMillis();
@@ -37,20 +43,67 @@ int SwooshNode::OnBeaconReceived(net_msg_beacon *beacon, void *user_data)
   }
 
   SwooshNode *swoosh_node = (SwooshNode *) user_data;
-  std::thread receiver_thread{[swoosh_node, beacon] {
+
+  // don't connect again for messages we already have
+  if (!swoosh_node->beacon_cache.Add(beacon, GetTime(0))) {
+    net_free_beacon(beacon);
+    return 0;
+  }
+
+  // messages with the head in the beacon don't need a connection
+  if (net_get_beacon_head(beacon, nullptr) != nullptr) {
+    SwooshRemoteData *data = SwooshRemoteData::ReceiveInlineData(beacon);
+    if (data) {
+      if (data->IsGood()) {
+        swoosh_node->client.OnNetReceivedData(data);
+      } else {
+        delete data;
+      }
+      return 0;
+    }
+    // bad head: fetch it from the sender
+  }
+
+  // fetch the message head on the event loop where available
+  if (swoosh_node->event_loop.IsAvailable()) {
+    if (swoosh_node->num_head_fetches++ >= SWOOSH_NODE_MAX_HEAD_FETCHES) {
+      swoosh_node->num_head_fetches--;
+      DebugLog("WARNING: dropping beacon, too many pending\n");
+      swoosh_node->beacon_cache.Remove(beacon);
+      net_free_beacon(beacon);
+      return 0;
+    }
+    swoosh_node->event_loop.Spawn(swoosh_node->RequestMessageAsync(beacon));
+    return 0;
+  }
+
+  auto drop = [swoosh_node, beacon] {
+    swoosh_node->beacon_cache.Remove(beacon);
+    net_free_beacon(beacon);
+  };
+  bool queued = swoosh_node->beacon_pool.Submit([swoosh_node, beacon] {
     swoosh_node->RequestMessage(beacon);
-  }};
-  receiver_thread.detach();
+  }, drop);
+  if (!queued) {
+    // too many beacons waiting: drop this one, but keep the server running
+    DebugLog("WARNING: dropping beacon, too many pending\n");
+    drop();
+  }
   return 0;
 }
 
 void SwooshNode::OnMessageRequested(net_socket *sock, void *user_data)
 {
   SwooshNode *swoosh_node = (SwooshNode *) user_data;
-  std::thread message_thread{[swoosh_node, sock] {
-    swoosh_node->HandleMessageRequest(sock);
-  }};
-  message_thread.detach();
+  bool queued = swoosh_node->request_pool.Submit([swoosh_node, sock] {
+    swoosh_node->HandleMessageRequest(sock, "");
+  }, [sock] {
+    net_close_socket(sock);
+  });
+  if (!queued) {
+    DebugLog("WARNING: dropping connection, too many pending requests\n");
+    net_close_socket(sock);
+  }
 }
 
 void SwooshNode::StartUDPServer()
@@ -66,6 +119,16 @@ void SwooshNode::StartUDPServer()
 void SwooshNode::StartTCPServer()
 {
   std::thread tcp_server_thread{[this] {
+    if (reactor_threads > 0) {
+      int ret = net_tcp_reactor_server(reactor_threads, SwooshNode::OnRequestReceived, this);
+      if (ret != -2) {
+        if (ret != 0) {
+          client.OnNetNotify("ERROR: can't initialize TCP server");
+        }
+        return;
+      }
+      // no event-driven server on this system
+    }
     if (net_tcp_server(SwooshNode::OnMessageRequested, this) != 0) {
       client.OnNetNotify("ERROR: can't initialize TCP server");
     }
@@ -76,59 +139,315 @@ void SwooshNode::StartTCPServer()
 void SwooshNode::StartDataCollector()
 {
   std::thread data_collector_thread{[this] {
-    while (running) {
-      Sleep(5000);
-      local_data_store.RemoveExpired(GetTime(0));
-    }
+    local_data_store.CollectExpired([] { return GetTime(0); });
   }};
   data_collector_thread.detach();
 }
 
-void SwooshNode::SendDataBeacon(uint32_t message_id)
+void SwooshNode::StartCatalogWriter()
 {
-  std::thread send_beacon_thread{[message_id] {
-    net_send_msg_beacon(message_id);
+  if (share_catalog.empty()) {
+    return;
+  }
+
+  std::thread catalog_writer_thread{[queue = catalog_queue, file_name = share_catalog] {
+    std::vector<SwooshShareCatalog::Share> added;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(queue->lock);
+        queue->cond.wait(lock, [&queue] {
+          return queue->stopping || !queue->added.empty();
+        });
+        if (queue->stopping) {
+          break;    // the final save writes the whole catalog
+        }
+      }
+
+      // a full save may have written them while we waited for the file
+      std::lock_guard<std::mutex> write_guard(queue->write_lock);
+      {
+        std::lock_guard<std::mutex> lock(queue->lock);
+        added.swap(queue->added);
+      }
+      if (!added.empty()) {
+        SwooshShareCatalog(file_name).Append(added);
+        added.clear();
+      }
+    }
   }};
-  send_beacon_thread.detach();
+  catalog_writer_thread.detach();
 }
 
-void SwooshNode::HandleMessageRequest(net_socket *sock)
+void SwooshNode::StartBeaconSender()
 {
-  // read message id
-  uint32_t message_id = 0;
-  if (net_recv_u32(sock, &message_id) < 0) {
-    DebugLog("ERROR: can't read message id\n");
-    net_close_socket(sock);
-    return;
+  std::thread beacon_sender_thread{[queue = beacon_queue] {
+    std::vector<PendingBeacon> beacons;
+    std::vector<net_beacon_entry> entries;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(queue->lock);
+        queue->cond.wait(lock, [&queue] {
+          return queue->stopping || !queue->beacons.empty();
+        });
+        if (queue->stopping) {
+          break;
+        }
+
+        // give a burst of new messages the chance to go in the same beacon
+        queue->cond.wait_for(lock, std::chrono::milliseconds(SWOOSH_NODE_BEACON_COALESCE_MS), [&queue] {
+          return queue->stopping;
+        });
+        if (queue->stopping) {
+          break;
+        }
+        beacons.swap(queue->beacons);
+      }
+
+      for (auto &beacon : beacons) {
+        entries.push_back(net_beacon_entry{beacon.message_id, beacon.head.data(), beacon.head.size()});
+      }
+      if (net_send_msg_beacons(entries.data(), entries.size()) != 0) {
+        DebugLog("ERROR: can't send beacon for %d messages\n", (int) entries.size());
+      }
+      entries.clear();
+      beacons.clear();
+    }
+  }};
+  beacon_sender_thread.detach();
+}
+
+void SwooshNode::SendDataBeacon(uint32_t message_id)
+{
+  PendingBeacon beacon{message_id, {}};
+
+  // send the head in the beacon if it's small, so receivers don't have to
+  // connect to get it
+  SwooshLocalData *data = local_data_store.Acquire(message_id, GetTime(0));
+  if (data) {
+    net_socket *sock = net_open_memory_socket(NET_BEACON_MAX_HEAD_SIZE);
+    if (sock) {
+      if (data->SendContentHead(sock) == 0) {
+        size_t head_len = 0;
+        const char *head = (const char *) net_get_memory_socket_data(sock, &head_len);
+        beacon.head.assign(head, head + head_len);
+      }
+      net_close_socket(sock);
+    }
+    local_data_store.Release(message_id);
   }
 
-  // read request type
-  uint32_t request_type = 0;
-  if (net_recv_u32(sock, &request_type) < 0) {
-    DebugLog("ERROR: can't read request type\n");
+  {
+    std::lock_guard<std::mutex> guard(beacon_queue->lock);
+    beacon_queue->beacons.push_back(std::move(beacon));
+  }
+  beacon_queue->cond.notify_one();
+}
+
+int SwooshNode::ReadRequest(net_socket *sock, MessageRequest *request)
+{
+  // read message id and request type
+  if (net_recv_u32(sock, &request->message_id) < 0 || net_recv_u32(sock, &request->type) < 0) {
+    return -1;
+  }
+
+  // the receiver may ask for compressed data
+  if (request->type & SWOOSH_DATA_REQUEST_FLAG_COMPRESS) {
+    net_set_socket_options(sock, NET_SOCKET_COMPRESS);
+  }
+  request->type &= ~SWOOSH_DATA_REQUEST_FLAGS;
+
+  // read range for partial requests
+  request->range_offset = 0;
+  request->range_len = 0;
+  if (request->type == SWOOSH_DATA_REQUEST_BODY_RANGE) {
+    if (net_recv_u64(sock, &request->range_offset) < 0 || net_recv_u64(sock, &request->range_len) < 0) {
+      return -1;
+    }
+  }
+
+  // read resume position for resumed requests
+  request->resume_name.clear();
+  request->resume_offset = 0;
+  if (request->type == SWOOSH_DATA_REQUEST_BODY_RESUME) {
+    std::string *name = SwooshRemoteData::ReceiveString(sock, MAX_REQUEST_NAME_SIZE);
+    if (name == nullptr || net_recv_u64(sock, &request->resume_offset) < 0) {
+      delete name;
+      return -1;
+    }
+    request->resume_name = std::move(*name);
+    delete name;
+  }
+
+  return 0;
+}
+
+void SwooshNode::HandleMessageRequest(net_socket *sock, const std::string &peer_host)
+{
+  MessageRequest request;
+  if (ReadRequest(sock, &request) != 0) {
+    DebugLog("ERROR: can't read request\n");
     net_close_socket(sock);
     return;
   }
+  if (request.type == SWOOSH_DATA_REQUEST_STREAMS) {
+    ServeStreams(sock);
+    return;
+  }
+  request.peer_host = (peer_host.empty()) ? GetSocketHost(sock) : peer_host;
 
   // get data corresponding to the message id
-  SwooshLocalData *data = local_data_store.Acquire(message_id, GetTime(0));
+  SwooshLocalData *data = local_data_store.Acquire(request.message_id, GetTime(0));
   if (!data) {
-    DebugLog("ERROR: message %u not found\n", message_id);
+    DebugLog("ERROR: message %u not found\n", request.message_id);
     net_close_socket(sock);
     return;
   }
 
-  // send data
-  switch (request_type) {
+  if (data->IsBulkContent(request.type)) {
+    SubmitBulkResponse(sock, data, request);
+    return;
+  }
+  SendResponse(sock, data, request, false);
+}
+
+void SwooshNode::ServeStreams(net_socket *sock)
+{
+  // streams can't tell where they come from, so remember it for the scheduler
+  std::string peer_host = GetSocketHost(sock);
+
+  // each stream carries one request, handled like a connection of its own
+  SwooshPeerConnection::Serve(sock, [this, peer_host](net_socket *stream) {
+    bool queued = request_pool.Submit([this, stream, peer_host] {
+      HandleMessageRequest(stream, peer_host);
+    }, [stream] {
+      net_close_socket(stream);
+    });
+    if (!queued) {
+      DebugLog("WARNING: dropping stream, too many pending requests\n");
+      net_close_socket(stream);
+    }
+  });
+}
+
+std::string SwooshNode::GetSocketHost(net_socket *sock)
+{
+  char host[NET_MAX_HOST_SIZE];
+  return (net_get_socket_host(sock, host, sizeof(host)) == 0) ? host : "";
+}
+
+void SwooshNode::SubmitBulkResponse(net_socket *sock, SwooshLocalData *data, const MessageRequest &request)
+{
+  // bulk transfers have a pool of their own, so they never hold up heads and text messages
+  auto drop = [this, sock, id = request.message_id] {
+    local_data_store.Release(id);
+    net_close_socket(sock);
+  };
+  bool queued = transfer_pool.Submit([this, sock, data, request] {
+    SendResponse(sock, data, request, true);
+  }, drop);
+  if (!queued) {
+    DebugLog("WARNING: dropping connection, too many pending transfers\n");
+    drop();
+  }
+}
+
+int SwooshNode::OnRequestReceived(net_socket *sock, void *user_data)
+{
+  SwooshNode *swoosh_node = (SwooshNode *) user_data;
+
+  // called again when more data arrives until the whole request is here
+  MessageRequest request;
+  if (swoosh_node->ReadRequest(sock, &request) != 0) {
+    return -1;
+  }
+  if (request.type == SWOOSH_DATA_REQUEST_STREAMS) {
+    if (net_detach_socket(sock) != 0) {
+      net_close_socket(sock);
+      return 0;
+    }
+    swoosh_node->ServeStreams(sock);
+    return 0;
+  }
+
+  SwooshLocalData *data = swoosh_node->local_data_store.Acquire(request.message_id, GetTime(0));
+  if (!data) {
+    DebugLog("ERROR: message %u not found\n", request.message_id);
+    net_close_socket(sock);
+    return 0;
+  }
+
+  // small replies and plain file ranges are queued on the event loop, the
+  // rest need blocking calls and go to the pools (as do bulk transfers that
+  // must take turns with others or wait for the rate limits).  Queued bulk
+  // replies count as running for the scheduler until they're sent.
+  bool compress = (net_get_socket_options(sock) & NET_SOCKET_COMPRESS) != 0;
+  bool bulk = data->IsBulkContent(request.type);
+  bool scheduled = bulk && (!swoosh_node->scheduler.IsIdle() || SwooshRateLimiter::IsLimited(NET_THROTTLE_SEND));
+  if (!compress && !scheduled && data->CanQueueContent(request.type)) {
+    if (bulk) {
+      swoosh_node->scheduler.AttachQueued(sock);
+    }
+    swoosh_node->SendResponse(sock, data, request, false);
+    return 0;
+  }
+
+  if (net_detach_socket(sock) != 0) {
+    swoosh_node->local_data_store.Release(request.message_id);
+    net_close_socket(sock);
+    return 0;
+  }
+  request.peer_host = GetSocketHost(sock);
+  if (bulk) {
+    swoosh_node->SubmitBulkResponse(sock, data, request);
+    return 0;
+  }
+  auto drop = [swoosh_node, sock, id = request.message_id] {
+    swoosh_node->local_data_store.Release(id);
+    net_close_socket(sock);
+  };
+  bool queued = swoosh_node->request_pool.Submit([swoosh_node, sock, data, request] {
+    swoosh_node->SendResponse(sock, data, request, false);
+  }, drop);
+  if (!queued) {
+    DebugLog("WARNING: dropping connection, too many pending requests\n");
+    drop();
+  }
+  return 0;
+}
+
+void SwooshNode::SendResponse(net_socket *sock, SwooshLocalData *data, const MessageRequest &request, bool bulk)
+{
+  // bulk transfers take turns sending their chunks, after waiting for the rate limits
+  std::unique_ptr<SwooshSendScheduler::Transfer> transfer;
+  if (bulk) {
+    std::shared_ptr<SwooshThrottle> throttle;
+    if (SwooshRateLimiter::IsLimited(NET_THROTTLE_SEND)) {
+      throttle = SwooshRateLimiter::GetThrottle(NET_THROTTLE_SEND, request.peer_host,
+                                                request.peer_host + " " + std::to_string(request.message_id));
+    }
+    transfer = std::make_unique<SwooshSendScheduler::Transfer>(scheduler, request.peer_host, throttle);
+    transfer->Attach(sock);
+  }
+
+  switch (request.type) {
   case SWOOSH_DATA_REQUEST_HEAD: data->SendContentHead(sock); break;
   case SWOOSH_DATA_REQUEST_BODY: data->SendContentBody(sock); break;
+  case SWOOSH_DATA_REQUEST_BODY_RANGE: data->SendContentRange(sock, request.range_offset, request.range_len); break;
+  case SWOOSH_DATA_REQUEST_BODY_RESUME: data->SendContentResume(sock, request.resume_name, request.resume_offset); break;
+  case SWOOSH_DATA_REQUEST_MANIFEST: data->SendContentManifest(sock); break;
+  case SWOOSH_DATA_REQUEST_FILES: data->SendContentFiles(sock); break;
+  case SWOOSH_DATA_REQUEST_BODY_DELTA: data->SendContentDelta(sock); break;
+  case SWOOSH_DATA_REQUEST_MULTICAST: data->SendContentMulticast(sock); sock = nullptr; break;
+  case SWOOSH_DATA_REQUEST_SWARM: data->SendContentSwarm(sock); break;
   default:
-    DebugLog("ERROR: unknown request type: %u\n", request_type);
+    DebugLog("ERROR: unknown request type: %u\n", request.type);
     break;
   }
   
-  local_data_store.Release(message_id);
-  net_close_socket(sock);
+  local_data_store.Release(request.message_id);
+  if (sock != nullptr) {
+    net_close_socket(sock);
+  }
 }
 
 void SwooshNode::RequestMessage(net_msg_beacon *beacon)
@@ -136,6 +455,7 @@ void SwooshNode::RequestMessage(net_msg_beacon *beacon)
   SwooshRemoteData *data = SwooshRemoteData::ReceiveData(beacon);
   if (!data) {
     DebugLog("ERROR: can't read message response\n");
+    beacon_cache.Remove(beacon);
     net_free_beacon(beacon);
     return;
   }
@@ -148,19 +468,196 @@ void SwooshNode::RequestMessage(net_msg_beacon *beacon)
   }
 }
 
-void SwooshNode::ReceiveDataContent(SwooshRemotePermanentData *data, std::string local_path)
+SwooshTask<void> SwooshNode::RequestMessageAsync(net_msg_beacon *beacon)
 {
-  std::thread data_downloader_thread{[this, data, local_path] {
-    client.OnNetDataDownloading(data, 0.0);
-    bool success = data->Download(local_path, [this, data] (double progress) {
-      client.OnNetDataDownloading(data, progress);
-    });
-    client.OnNetDataDownloaded(data, success);
-  }};
-  data_downloader_thread.detach();
+  SwooshRemoteData *data = co_await SwooshRemoteData::ReceiveDataAsync(event_loop, beacon);
+  num_head_fetches--;
+  if (!data) {
+    DebugLog("ERROR: can't read message response\n");
+    beacon_cache.Remove(beacon);
+    net_free_beacon(beacon);
+    co_return;
+  }
+
+  // show message on UI
+  if (data->IsGood()) {
+    client.OnNetReceivedData(data);
+  } else {
+    delete data;
+  }
+}
+
+bool SwooshNode::ReceiveDataContent(SwooshRemotePermanentData *data, std::string local_path)
+{
+  return downloads.Add(data, local_path);
+}
+
+bool SwooshNode::DownloadDataContent(SwooshRemotePermanentData *data, const std::string &local_path)
+{
+  // in swarm mode, serve the chunks we have to other receivers while downloading
+  SwooshLocalSwarmData *swarm_data = nullptr;
+  if (swarm && data->GetType() == SWOOSH_DATA_FILE) {
+    SwooshRemoteFileData *file_data = (SwooshRemoteFileData *) data;
+    if (file_data->GetFileSize() >= SWOOSH_SWARM_MIN_SIZE) {
+      swarm_data = new SwooshLocalSwarmData(GenerateMessageId(), local_path, file_data->GetFileSize());
+      AddLocalData(swarm_data);
+      file_data->SetSwarm(swarm_data->GetChunks(), swarm_data->GetMessageId(), tcp_port);
+    }
+  }
+
+  client.OnNetDataDownloading(data, 0.0);
+  bool success = data->Download(local_path, [this, data] (double progress) {
+    client.OnNetDataDownloading(data, progress);
+  });
+
+  if (swarm_data) {
+    // keep seeding the whole file for a while
+    local_data_store.SetValidUntil(swarm_data->GetMessageId(), GetTime((success) ? SWOOSH_SWARM_SEED_TIME_MS : 0));
+    ReleaseLocalData(swarm_data);
+  }
+  return success;
 }
 
 bool SwooshNode::BeaconsAreEqual(net_msg_beacon *beacon1, net_msg_beacon *beacon2)
 {
   return net_beacons_are_equal(beacon1, beacon2) == 1;
 }
+
+void SwooshNode::LoadShares()
+{
+  if (share_catalog.empty()) {
+    return;
+  }
+
+  std::vector<SwooshShareCatalog::Share> saved;
+  uint32_t saved_next_id;
+  SwooshShareCatalog(share_catalog).Load(&saved, &saved_next_id);
+
+  // keep counting from the last run, so peers don't take new messages for old ones
+  uint32_t next_id = std::max<uint32_t>(saved_next_id, 1);
+  for (const auto &share : saved) {
+    next_id = std::max(next_id, share.message_id + 1);
+  }
+
+  std::lock_guard<std::mutex> guard(shares_lock);
+  for (const auto &share : saved) {
+    uint32_t id = share.message_id;
+    Share entry{share.type, share.path, share.size, share.mtime, nullptr};
+    if (share.type == SWOOSH_DATA_DIR) {
+      if (!wxDirExists(share.path)) {
+        DebugLog("WARNING: shared directory '%s' is gone\n", share.path.c_str());
+        continue;
+      }
+      // served from the saved manifest while the directory is swept again;
+      // it gets a new id if the sweep finds it changed
+      entry.data = new SwooshLocalDirData(id, share.path, share.manifest, [watch = share_watch, id] (bool changed) {
+        std::lock_guard<std::mutex> guard(watch->lock);
+        if (watch->node) {
+          watch->node->OnShareSwept(id, changed);
+        }
+      });
+    } else {
+      if (!SwooshShareCatalog::ReadFileInfo(share.path, &entry.size, &entry.mtime)) {
+        DebugLog("WARNING: shared file '%s' is gone\n", share.path.c_str());
+        continue;
+      }
+      if (entry.size != share.size || entry.mtime != share.mtime) {
+        id = next_id++;
+      }
+      entry.data = new SwooshLocalFileData(id, share.path);
+    }
+    local_data_store.Store(entry.data);
+    local_data_store.Release(id);
+    shares.push_back(entry);
+  }
+  next_message_id = next_id;
+}
+
+void SwooshNode::OnShareSwept(uint32_t message_id, bool changed)
+{
+  if (!changed) {
+    return;
+  }
+
+  // peers may have the old contents under the old id, so the share is
+  // announced again under a new one (the old id still answers, with the
+  // current contents)
+  uint32_t new_id;
+  {
+    std::lock_guard<std::mutex> guard(shares_lock);
+    auto it = std::find_if(shares.begin(), shares.end(), [message_id] (const Share &share) {
+      return share.data->GetMessageId() == message_id;
+    });
+    if (it == shares.end()) {
+      return;
+    }
+    new_id = GenerateMessageId();
+    it->data->SetMessageId(new_id);
+    local_data_store.Store(it->data);
+  }
+  SaveShares();
+  SendDataBeacon(new_id);
+}
+
+SwooshShareCatalog::Share SwooshNode::GetCatalogShare(const Share &share)
+{
+  SwooshShareCatalog::Share entry{share.type, share.data->GetMessageId(), share.path, share.size, share.mtime, nullptr};
+  if (share.type == SWOOSH_DATA_DIR) {
+    entry.manifest = static_cast<SwooshLocalDirData *>(share.data)->GetManifest();
+  }
+  return entry;
+}
+
+bool SwooshNode::SaveShares()
+{
+  if (share_catalog.empty()) {
+    return true;
+  }
+
+  // shares waiting to be appended are written with the others
+  std::lock_guard<std::mutex> write_guard(catalog_queue->write_lock);
+  std::vector<SwooshShareCatalog::Share> saved;
+  {
+    std::lock_guard<std::mutex> guard(shares_lock);
+    {
+      std::lock_guard<std::mutex> queue_guard(catalog_queue->lock);
+      catalog_queue->added.clear();
+    }
+    saved.reserve(shares.size());
+    for (const auto &share : shares) {
+      saved.push_back(GetCatalogShare(share));
+    }
+  }
+  return SwooshShareCatalog(share_catalog).Save(saved, next_message_id);
+}
+
+SwooshLocalPermanentData *SwooshNode::AddShare(uint32_t type, const std::string &path)
+{
+  Share share{type, path, 0, 0, nullptr};
+  if (type == SWOOSH_DATA_DIR) {
+    share.data = new SwooshLocalDirData(GenerateMessageId(), path);
+  } else {
+    SwooshShareCatalog::ReadFileInfo(path, &share.size, &share.mtime);
+    share.data = new SwooshLocalFileData(GenerateMessageId(), path);
+  }
+  AddLocalData(share.data);
+  ReleaseLocalData(share.data);   // permanent data is never removed, so we can keep using it
+
+  {
+    std::lock_guard<std::mutex> guard(shares_lock);
+    shares.push_back(share);
+    if (!share_catalog.empty()) {
+      // appended to the catalog by the catalog writer thread
+      std::lock_guard<std::mutex> queue_guard(catalog_queue->lock);
+      catalog_queue->added.push_back(GetCatalogShare(share));
+    }
+  }
+  catalog_queue->cond.notify_one();
+  return share.data;
+}
+
+std::vector<SwooshNode::Share> SwooshNode::GetShares()
+{
+  std::lock_guard<std::mutex> guard(shares_lock);
+  return shares;
+}
@@ -4,11 +4,34 @@
 #include <cstdint>
 #include <string>
 #include <map>
+#include <vector>
+#include <memory>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 
 #include "swoosh_local_data.h"
 #include "swoosh_remote_data.h"
 #include "swoosh_data_store.h"
+#include "swoosh_thread_pool.h"
+#include "swoosh_async.h"
+#include "swoosh_beacon_cache.h"
+#include "swoosh_rate_limit.h"
+#include "swoosh_scheduler.h"
+#include "swoosh_share_catalog.h"
+#include "swoosh_download_manager.h"
+
+// beacons and requests waiting for a worker; more than this are dropped
+#define SWOOSH_NODE_MAX_QUEUED_BEACONS   256
+#define SWOOSH_NODE_MAX_QUEUED_REQUESTS  256
+#define SWOOSH_NODE_MAX_HEAD_FETCHES     1024   // message heads being fetched on the event loop
+
+// time to wait for more messages to announce in the same beacon
+#define SWOOSH_NODE_BEACON_COALESCE_MS   20
+
+// repeated beacons received within this time are ignored
+#define SWOOSH_NODE_BEACON_CACHE_TTL_MS  (10*60*1000)
+#define SWOOSH_NODE_BEACON_CACHE_SIZE    4096
 
 class SwooshNodeClient {
   friend class SwooshNode;
@@ -21,43 +44,192 @@ protected:
 };
 
 class SwooshNode {
+public:
+  // file or directory we share; shares are never removed, so the data
+  // stays valid while the node runs
+  struct Share {
+    uint32_t type;                  // SWOOSH_DATA_FILE or SWOOSH_DATA_DIR
+    std::string path;
+    uint64_t size;                  // files only, when shared
+    int64_t mtime;
+    SwooshLocalPermanentData *data;
+  };
+
 private:
+  struct MessageRequest {
+    uint32_t message_id;
+    uint32_t type;
+    uint64_t range_offset;
+    uint64_t range_len;
+    std::string resume_name;
+    uint64_t resume_offset;
+    std::string peer_host;          // receiver, for the scheduler and rate limits
+  };
+
+  // message waiting to be announced, with its head if it's small enough
+  // to go in the beacon
+  struct PendingBeacon {
+    uint32_t message_id;
+    std::vector<char> head;
+  };
+
+  // messages waiting to be announced, shared with the beacon sender thread
+  struct BeaconQueue {
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<PendingBeacon> beacons;
+    bool stopping = false;
+  };
+
+  // new shares waiting to be appended to the catalog, shared with the
+  // catalog writer thread
+  struct CatalogQueue {
+    std::mutex lock;
+    std::mutex write_lock;            // held while the catalog file is written
+    std::condition_variable cond;
+    std::vector<SwooshShareCatalog::Share> added;
+    bool stopping = false;
+  };
+
+  // lets the sweeps of saved directories call back into the node until
+  // it's stopped, since they may finish after that
+  struct ShareWatch {
+    std::mutex lock;
+    SwooshNode *node;
+  };
+
   SwooshNodeClient &client;
   SwooshDataStore local_data_store;
-  uint32_t next_message_id;
+  std::atomic<uint32_t> next_message_id;
+  int tcp_port;
+  SwooshThreadPool beacon_pool;
+  SwooshThreadPool request_pool;     // heads, text and other small replies
+  SwooshThreadPool transfer_pool;    // bulk transfers
+  SwooshSendScheduler scheduler;
+  SwooshEventLoop event_loop;
+  std::atomic<int> num_head_fetches;
+  std::shared_ptr<BeaconQueue> beacon_queue;
+  SwooshBeaconCache beacon_cache;
+  std::mutex shares_lock;
+  std::vector<Share> shares;
+  std::shared_ptr<CatalogQueue> catalog_queue;
+  std::shared_ptr<ShareWatch> share_watch;
+  SwooshDownloadManager downloads;
 
   void StartUDPServer();
   void StartTCPServer();
   void StartDataCollector();
+  void StartBeaconSender();
+  void StartCatalogWriter();
 
   static bool running;
+  static size_t beacon_threads;
+  static size_t request_threads;
+  static size_t transfer_threads;
+  static int reactor_threads;
+  static bool swarm;
+  static std::string share_catalog;
   static int OnBeaconReceived(net_msg_beacon *beacon, void *user_data);
   static void OnMessageRequested(net_socket *sock, void *user_data);
+  static int OnRequestReceived(net_socket *sock, void *user_data);
   static uint32_t MakeClientId();
-  static void Sleep(uint32_t msec);
+  static std::string GetSocketHost(net_socket *sock);
+  static SwooshShareCatalog::Share GetCatalogShare(const Share &share);
 
-  void HandleMessageRequest(net_socket *sock);
+  int ReadRequest(net_socket *sock, MessageRequest *request);
+  void HandleMessageRequest(net_socket *sock, const std::string &peer_host);
+  void ServeStreams(net_socket *sock);
+  void SubmitBulkResponse(net_socket *sock, SwooshLocalData *data, const MessageRequest &request);
+  void SendResponse(net_socket *sock, SwooshLocalData *data, const MessageRequest &request, bool bulk);
+  void LoadShares();
+  void OnShareSwept(uint32_t message_id, bool changed);
   void RequestMessage(net_msg_beacon *beacon);
+  bool DownloadDataContent(SwooshRemotePermanentData *data, const std::string &local_path);
+  SwooshTask<void> RequestMessageAsync(net_msg_beacon *beacon);
 
 public:
-  SwooshNode(SwooshNodeClient &client, int server_udp_port, int server_tcp_port, bool use_ipv6) : client(client) {
+  SwooshNode(SwooshNodeClient &client, int server_udp_port, int server_tcp_port, bool use_ipv6)
+    : client(client),
+      beacon_pool(beacon_threads, SWOOSH_NODE_MAX_QUEUED_BEACONS),
+      request_pool(request_threads, SWOOSH_NODE_MAX_QUEUED_REQUESTS),
+      transfer_pool(transfer_threads, SWOOSH_NODE_MAX_QUEUED_REQUESTS),
+      num_head_fetches(0),
+      beacon_queue(std::make_shared<BeaconQueue>()),
+      beacon_cache(SWOOSH_NODE_BEACON_CACHE_TTL_MS, SWOOSH_NODE_BEACON_CACHE_SIZE),
+      catalog_queue(std::make_shared<CatalogQueue>()),
+      share_watch(std::make_shared<ShareWatch>()),
+      downloads([this] (SwooshRemotePermanentData *data, const std::string &local_path) {
+        return DownloadDataContent(data, local_path);
+      }, [this] (SwooshRemotePermanentData *data, bool success) {
+        this->client.OnNetDataDownloaded(data, success);
+      }) {
     running = true;
     next_message_id = 1;
+    share_watch->node = this;
+    tcp_port = server_tcp_port;
     net_setup(server_udp_port, server_tcp_port, use_ipv6);
+    SwooshMulticastSender::SetGroup((use_ipv6) ? SWOOSH_MULTICAST_GROUP_IPV6 : SWOOSH_MULTICAST_GROUP_IPV4,
+                                    server_udp_port + 1);
+    LoadShares();     // before the servers start, so requests for them are answered
     StartUDPServer();
     StartTCPServer();
     StartDataCollector();
+    StartBeaconSender();
+    StartCatalogWriter();
   }
   uint32_t GenerateMessageId() { return next_message_id++; }
-  void Stop() { running = false; local_data_store.Stop(); }
+  void Stop() {
+    running = false;
+    {
+      std::lock_guard<std::mutex> guard(beacon_queue->lock);
+      beacon_queue->stopping = true;
+    }
+    beacon_queue->cond.notify_all();
+    event_loop.Stop();
+    beacon_pool.Stop();
+    request_pool.Stop();
+    transfer_pool.Stop();
+    local_data_store.Stop();
+    downloads.Stop();
+    {
+      std::lock_guard<std::mutex> guard(catalog_queue->lock);
+      catalog_queue->stopping = true;
+    }
+    catalog_queue->cond.notify_all();
+    {
+      std::lock_guard<std::mutex> guard(share_watch->lock);
+      share_watch->node = nullptr;
+    }
+    SaveShares();     // with the latest directory manifests
+  }
   void SendDataBeacon(uint32_t message_id);
-  void ReceiveDataContent(SwooshRemotePermanentData *data, std::string local_path);
+  // queue the download; false if it's already queued or running
+  bool ReceiveDataContent(SwooshRemotePermanentData *data, std::string local_path);
+  SwooshDownloadManager &GetDownloads() { return downloads; }
   bool BeaconsAreEqual(net_msg_beacon *beacon1, net_msg_beacon *beacon2);
 
   void AddLocalData(SwooshLocalData *data) { local_data_store.Store(data); }
   void ReleaseLocalData(SwooshLocalData *data) { local_data_store.Release(data->GetMessageId()); }
 
+  // serve a file or directory, now and after a restart (the beacon must still be sent)
+  SwooshLocalPermanentData *AddShare(uint32_t type, const std::string &path);
+  std::vector<Share> GetShares();
+  bool SaveShares();
+
   static uint64_t GetTime(uint32_t msec_in_future);
+  // threads for the pools created with the node, 0 to keep the current number
+  static void SetThreadPoolSize(size_t beacons, size_t requests, size_t transfers) {
+    if (beacons > 0) beacon_threads = beacons;
+    if (requests > 0) request_threads = requests;
+    if (transfers > 0) transfer_threads = transfers;
+  }
+  // threads for the event-driven request server, 0 to use a blocking accept loop
+  static void SetReactorThreads(int num) { reactor_threads = (num > 0) ? num : 0; }
+  // receivers of large files serve the chunks they have to each other
+  static void SetSwarm(bool enable) { swarm = enable; }
+  static bool GetSwarm() { return swarm; }
+  // file where the shares are kept between runs, empty to forget them on exit
+  static void SetShareCatalog(const std::string &file_name) { share_catalog = file_name; }
 };
 
 #endif /* SWOOSH_NODE_H_FILE */
@@ -0,0 +1,458 @@
+#include "targetver.h"
+#include "swoosh_peer_pool.h"
+
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <system_error>
+
+#include "swoosh_data.h"
+#include "util.h"
+
+#define FRAME_HEADER_SIZE  12
+
+static void PutU32(char *p, uint32_t val)
+{
+  for (int i = 0; i < 4; i++) p[i] = (char) ((val >> (8*i)) & 0xff);
+}
+
+// ==========================================================================
+// SwooshPeerConnection
+// ==========================================================================
+
+const net_socket_ops SwooshPeerConnection::stream_ops = {
+  SwooshPeerConnection::StreamSend,
+  SwooshPeerConnection::StreamRecv,
+  SwooshPeerConnection::StreamClose,
+};
+
+SwooshPeerConnection::~SwooshPeerConnection()
+{
+  net_close_socket(sock);
+}
+
+std::shared_ptr<SwooshPeerConnection> SwooshPeerConnection::Connect(net_msg_beacon *beacon)
+{
+  net_socket *sock = net_connect_to_beacon(beacon);
+  if (sock == nullptr) {
+    return nullptr;
+  }
+
+  // the rest of the connection is made of stream frames
+  if (net_send_u32(sock, 0) != 0 || net_send_u32(sock, SWOOSH_DATA_REQUEST_STREAMS) != 0) {
+    DebugLog("ERROR: can't send stream request\n");
+    net_close_socket(sock);
+    return nullptr;
+  }
+
+  auto conn = std::make_shared<SwooshPeerConnection>(sock, nullptr);
+  if (!conn->Start()) {
+    return nullptr;
+  }
+  return conn;
+}
+
+void SwooshPeerConnection::Serve(net_socket *sock, StreamCallback on_stream)
+{
+  // the reader keeps the connection alive; if it can't start, the socket
+  // is closed right away
+  auto conn = std::make_shared<SwooshPeerConnection>(sock, on_stream);
+  conn->Start();
+}
+
+bool SwooshPeerConnection::Start()
+{
+  try {
+    std::thread reader_thread{[conn = shared_from_this()] {
+      conn->ReadFrames();
+    }};
+    reader_thread.detach();
+  } catch (const std::system_error &) {
+    DebugLog("ERROR: can't start connection reader\n");
+    return false;
+  }
+  return true;
+}
+
+int SwooshPeerConnection::SendFrame(uint32_t stream_id, uint32_t type, const void *data, uint32_t len)
+{
+  std::lock_guard<std::mutex> guard(send_lock);
+
+  // send the header with the data, so small frames go in one packet
+  size_t data_len = (type == SWOOSH_STREAM_FRAME_DATA) ? len : 0;
+  send_buf.resize(FRAME_HEADER_SIZE + data_len);
+  PutU32(&send_buf[0], stream_id);
+  PutU32(&send_buf[4], type);
+  PutU32(&send_buf[8], len);
+  if (data_len > 0) {
+    memcpy(&send_buf[FRAME_HEADER_SIZE], data, data_len);
+  }
+  return net_send_data(sock, send_buf.data(), send_buf.size());
+}
+
+net_socket *SwooshPeerConnection::AddStream(uint32_t id)
+{
+  // called with the lock held
+  Stream *stream = new Stream{shared_from_this(), id, {}, 0, 0, SWOOSH_STREAM_WINDOW_SIZE, false};
+  net_socket *stream_sock = net_open_custom_socket(&stream_ops, stream);
+  if (stream_sock == nullptr) {
+    delete stream;
+    return nullptr;
+  }
+  streams[id] = stream;
+  last_stream_id = id;
+  return stream_sock;
+}
+
+net_socket *SwooshPeerConnection::OpenStream()
+{
+  // streams must be announced in order, so the peer can tell new streams
+  // from ones it already closed
+  std::lock_guard<std::mutex> send_guard(send_lock);
+  net_socket *stream_sock;
+  uint32_t id;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (closed) {
+      return nullptr;
+    }
+    id = last_stream_id + 1;
+    stream_sock = AddStream(id);
+    if (stream_sock == nullptr) {
+      return nullptr;
+    }
+  }
+
+  // an empty data frame opens the stream
+  char header[FRAME_HEADER_SIZE];
+  PutU32(&header[0], id);
+  PutU32(&header[4], SWOOSH_STREAM_FRAME_DATA);
+  PutU32(&header[8], 0);
+  if (net_send_data(sock, header, sizeof(header)) != 0) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      closed = true;
+    }
+    cond.notify_all();
+  }
+  return stream_sock;
+}
+
+void SwooshPeerConnection::ReadFrames()
+{
+  std::vector<char> data;
+  while (true) {
+    // a connection we serve is closed when the peer leaves it idle
+    if (on_stream) {
+      int ready;
+      while ((ready = net_wait_readable(sock, SWOOSH_PEER_SERVE_IDLE_MS)) == 0 &&
+             !IsIdleSince(std::chrono::steady_clock::now() - std::chrono::milliseconds(SWOOSH_PEER_SERVE_IDLE_MS))) {
+      }
+      if (ready <= 0) {
+        break;
+      }
+    }
+
+    uint32_t stream_id, type, len;
+    if (net_recv_u32(sock, &stream_id) != 0 || net_recv_u32(sock, &type) != 0 || net_recv_u32(sock, &len) != 0) {
+      break;
+    }
+    if (stream_id == 0) {
+      break;      // the peer is closing the connection
+    }
+    data.clear();
+    if (type == SWOOSH_STREAM_FRAME_DATA) {
+      if (len > SWOOSH_STREAM_FRAME_MAX_SIZE) {
+        DebugLog("ERROR: stream frame too large: %u\n", len);
+        break;
+      }
+      data.resize(len);
+      if (net_recv_data(sock, data.data(), len) != 0) {
+        break;
+      }
+    }
+
+    net_socket *new_stream = nullptr;
+    bool bad_frame = false;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      auto it = streams.find(stream_id);
+      Stream *stream = (it != streams.end()) ? it->second : nullptr;
+      if (stream == nullptr && on_stream && type == SWOOSH_STREAM_FRAME_DATA && stream_id > last_stream_id) {
+        new_stream = AddStream(stream_id);
+        if (new_stream != nullptr) {
+          stream = streams[stream_id];
+        }
+      }
+
+      // frames for streams already closed here are dropped
+      if (stream != nullptr) {
+        switch (type) {
+        case SWOOSH_STREAM_FRAME_DATA:
+          if (stream->recv_data.size() - stream->recv_pos + data.size() > SWOOSH_STREAM_WINDOW_SIZE) {
+            DebugLog("ERROR: stream %u sent more data than allowed\n", stream_id);
+            bad_frame = true;
+            break;
+          }
+          stream->recv_data.insert(stream->recv_data.end(), data.begin(), data.end());
+          break;
+
+        case SWOOSH_STREAM_FRAME_END:
+          stream->peer_closed = true;
+          break;
+
+        case SWOOSH_STREAM_FRAME_CREDIT:
+          stream->send_credit += len;
+          break;
+        }
+      }
+    }
+    if (bad_frame) {
+      if (new_stream != nullptr) {
+        net_close_socket(new_stream);
+      }
+      break;
+    }
+    cond.notify_all();
+    if (new_stream != nullptr) {
+      on_stream(new_stream);
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    closed = true;
+  }
+  cond.notify_all();
+}
+
+int SwooshPeerConnection::StreamSend(void *ops_data, const void *data, size_t len)
+{
+  Stream *stream = (Stream *) ops_data;
+  SwooshPeerConnection *conn = stream->conn.get();
+  const char *data_left = (const char *) data;
+  while (len > 0) {
+    // wait until the peer has room for more
+    uint32_t frame_len;
+    {
+      std::unique_lock<std::mutex> lock(conn->lock);
+      conn->cond.wait(lock, [stream, conn] {
+        return stream->send_credit > 0 || stream->peer_closed || conn->closed;
+      });
+      if (stream->peer_closed || conn->closed) {
+        return -1;
+      }
+      size_t max_len = std::min<size_t>(stream->send_credit, SWOOSH_STREAM_FRAME_MAX_SIZE);
+      frame_len = (uint32_t) std::min(len, max_len);
+      stream->send_credit -= frame_len;
+    }
+
+    if (conn->SendFrame(stream->id, SWOOSH_STREAM_FRAME_DATA, data_left, frame_len) != 0) {
+      return -1;
+    }
+    data_left += frame_len;
+    len -= frame_len;
+  }
+  return 0;
+}
+
+int SwooshPeerConnection::StreamRecv(void *ops_data, void *data, size_t len)
+{
+  Stream *stream = (Stream *) ops_data;
+  SwooshPeerConnection *conn = stream->conn.get();
+  char *data_left = (char *) data;
+  std::unique_lock<std::mutex> lock(conn->lock);
+  while (len > 0) {
+    conn->cond.wait(lock, [stream, conn] {
+      return stream->recv_pos < stream->recv_data.size() || stream->peer_closed || conn->closed;
+    });
+    if (stream->recv_pos == stream->recv_data.size()) {
+      return -1;    // closed with nothing left to read
+    }
+
+    size_t done = std::min(len, stream->recv_data.size() - stream->recv_pos);
+    memcpy(data_left, stream->recv_data.data() + stream->recv_pos, done);
+    stream->recv_pos += done;
+    if (stream->recv_pos == stream->recv_data.size()) {
+      stream->recv_data.clear();
+      stream->recv_pos = 0;
+    }
+    data_left += done;
+    len -= done;
+
+    // give credit back to the sender a half window at a time
+    stream->recv_unacked += done;
+    if (stream->recv_unacked >= SWOOSH_STREAM_WINDOW_SIZE / 2) {
+      uint32_t credit = (uint32_t) stream->recv_unacked;
+      stream->recv_unacked = 0;
+      lock.unlock();
+      conn->SendFrame(stream->id, SWOOSH_STREAM_FRAME_CREDIT, nullptr, credit);
+      lock.lock();
+    }
+  }
+  return 0;
+}
+
+void SwooshPeerConnection::StreamClose(void *ops_data)
+{
+  Stream *stream = (Stream *) ops_data;
+  std::shared_ptr<SwooshPeerConnection> conn = std::move(stream->conn);
+  bool tell_peer;
+  {
+    std::lock_guard<std::mutex> guard(conn->lock);
+    conn->streams.erase(stream->id);
+    if (conn->streams.empty()) {
+      conn->idle_since = std::chrono::steady_clock::now();
+    }
+    tell_peer = !conn->closed && !stream->peer_closed;
+  }
+  if (tell_peer) {
+    conn->SendFrame(stream->id, SWOOSH_STREAM_FRAME_END, nullptr, 0);
+  }
+  delete stream;
+}
+
+void SwooshPeerConnection::Close()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (closed) {
+      return;
+    }
+    closed = true;
+  }
+  cond.notify_all();
+
+  // the peer closes its end, which stops our reader
+  SendFrame(0, SWOOSH_STREAM_FRAME_END, nullptr, 0);
+}
+
+bool SwooshPeerConnection::IsClosed()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return closed;
+}
+
+size_t SwooshPeerConnection::GetNumStreams()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return streams.size();
+}
+
+bool SwooshPeerConnection::IsIdleSince(std::chrono::steady_clock::time_point time)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return streams.empty() && idle_since <= time;
+}
+
+// ==========================================================================
+// SwooshPeerPool
+// ==========================================================================
+
+SwooshPeerPool::~SwooshPeerPool()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  reaper_cond.notify_all();
+  if (reaper_thread.joinable()) {
+    reaper_thread.join();
+  }
+}
+
+void SwooshPeerPool::ReapIdle()
+{
+  std::unique_lock<std::mutex> guard(lock);
+  while (!stopping) {
+    reaper_cond.wait_for(guard, std::chrono::milliseconds(SWOOSH_PEER_REAP_INTERVAL_MS));
+    std::vector<std::shared_ptr<SwooshPeerConnection>> idle;
+    RemoveIdle(&idle);
+
+    // closing sends a message, which may block on a peer that stopped reading
+    guard.unlock();
+    for (auto &conn : idle) {
+      conn->Close();
+    }
+    guard.lock();
+  }
+}
+
+void SwooshPeerPool::RemoveIdle(std::vector<std::shared_ptr<SwooshPeerConnection>> *idle)
+{
+  // called with the lock held; the caller closes the idle connections after releasing it
+  auto idle_time = std::chrono::steady_clock::now() - std::chrono::milliseconds(SWOOSH_PEER_IDLE_TIME_MS);
+  for (auto it = peers.begin(); it != peers.end(); ) {
+    auto &conns = it->second.conns;
+    for (size_t i = 0; i < conns.size(); ) {
+      if (conns[i]->IsClosed() || conns[i]->IsIdleSince(idle_time)) {
+        idle->push_back(conns[i]);
+        conns.erase(conns.begin() + i);
+      } else {
+        i++;
+      }
+    }
+    it = (conns.empty() && it->second.connecting == 0) ? peers.erase(it) : std::next(it);
+  }
+}
+
+net_socket *SwooshPeerPool::OpenStream(net_msg_beacon *beacon)
+{
+  std::string peer_name = std::string(net_get_beacon_host(beacon)) + " " + std::to_string(net_get_beacon_port(beacon));
+
+  // pick a connection with the lock held, but open streams and close idle
+  // connections (which send messages) without it, so a peer that stopped
+  // reading doesn't hold up requests to the others
+  std::vector<std::shared_ptr<SwooshPeerConnection>> idle;
+  std::shared_ptr<SwooshPeerConnection> best;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    RemoveIdle(&idle);
+
+    // use the least busy connection, unless it's busy and we can open another
+    Peer &peer = peers[peer_name];
+    size_t best_streams = 0;
+    for (auto &conn : peer.conns) {
+      size_t num_streams = conn->GetNumStreams();
+      if (!best || num_streams < best_streams) {
+        best = conn;
+        best_streams = num_streams;
+      }
+    }
+    if (!best || (best_streams > 0 && peer.conns.size() + peer.connecting < SWOOSH_PEER_MAX_CONNECTIONS)) {
+      best = nullptr;
+      peer.connecting++;
+    }
+  }
+  for (auto &conn : idle) {
+    conn->Close();
+  }
+  if (best) {
+    net_socket *stream = best->OpenStream();
+    if (stream != nullptr) {
+      return stream;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    peers[peer_name].connecting++;
+  }
+
+  // connect without holding the lock, it may take a while
+  std::shared_ptr<SwooshPeerConnection> conn = SwooshPeerConnection::Connect(beacon);
+  net_socket *stream = (conn) ? conn->OpenStream() : nullptr;
+
+  std::lock_guard<std::mutex> guard(lock);
+  Peer &peer = peers[peer_name];
+  peer.connecting--;
+  if (stream != nullptr) {
+    peer.conns.push_back(conn);
+    if (!reaper_thread.joinable() && !stopping) {
+      try {
+        reaper_thread = std::thread{[this] { ReapIdle(); }};
+      } catch (const std::system_error &) {
+        DebugLog("WARNING: can't start idle connection reaper\n");   // they're still closed on the next request
+      }
+    }
+  }
+  return stream;
+}
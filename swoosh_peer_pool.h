@@ -0,0 +1,121 @@
+#ifndef SWOOSH_PEER_POOL_H_FILE
+#define SWOOSH_PEER_POOL_H_FILE
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <condition_variable>
+
+#include "network.h"
+
+#define SWOOSH_PEER_MAX_CONNECTIONS  4       // connections kept to each peer
+#define SWOOSH_PEER_IDLE_TIME_MS     30000   // idle connections are closed after this
+#define SWOOSH_PEER_REAP_INTERVAL_MS 10000   // how often the pool looks for idle connections
+#define SWOOSH_PEER_SERVE_IDLE_MS    (2*SWOOSH_PEER_IDLE_TIME_MS)   // served connections left idle are closed after this
+
+// ==========================================================================
+// SwooshPeerConnection
+// ==========================================================================
+
+// Connection to a peer carrying many requests at once, each in its own
+// stream.  Streams are net_sockets, so requests and replies use the same
+// code as with a connection of their own.  A stream can only have a window
+// of unread data in flight, so one that isn't being read can't hold up the
+// others.
+class SwooshPeerConnection : public std::enable_shared_from_this<SwooshPeerConnection>
+{
+public:
+  typedef std::function<void(net_socket *stream)> StreamCallback;
+
+protected:
+  struct Stream {
+    std::shared_ptr<SwooshPeerConnection> conn;
+    uint32_t id;
+    std::vector<char> recv_data;
+    size_t recv_pos;
+    size_t recv_unacked;       // bytes read and not yet given back as credit
+    size_t send_credit;
+    bool peer_closed;
+  };
+
+  net_socket *sock;
+  StreamCallback on_stream;    // set when serving streams opened by the peer
+  std::mutex lock;
+  std::condition_variable cond;
+  std::mutex send_lock;
+  std::vector<char> send_buf;
+  std::map<uint32_t, Stream *> streams;
+  uint32_t last_stream_id;
+  bool closed;
+  std::chrono::steady_clock::time_point idle_since;
+
+  static const net_socket_ops stream_ops;
+  static int StreamSend(void *ops_data, const void *data, size_t len);
+  static int StreamRecv(void *ops_data, void *data, size_t len);
+  static void StreamClose(void *ops_data);
+
+  int SendFrame(uint32_t stream_id, uint32_t type, const void *data, uint32_t len);
+  net_socket *AddStream(uint32_t id);
+  void ReadFrames();
+  bool Start();
+
+public:
+  SwooshPeerConnection(net_socket *sock, StreamCallback on_stream)
+    : sock(sock), on_stream(on_stream), last_stream_id(0), closed(false),
+      idle_since(std::chrono::steady_clock::now()) {}
+  ~SwooshPeerConnection();
+
+  // connect to the sender of a beacon
+  static std::shared_ptr<SwooshPeerConnection> Connect(net_msg_beacon *beacon);
+
+  // serve the streams of a connection that sent SWOOSH_DATA_REQUEST_STREAMS;
+  // the socket is closed when the connection ends
+  static void Serve(net_socket *sock, StreamCallback on_stream);
+
+  net_socket *OpenStream();
+  void Close();
+  bool IsClosed();
+  size_t GetNumStreams();
+  bool IsIdleSince(std::chrono::steady_clock::time_point time);
+};
+
+// ==========================================================================
+// SwooshPeerPool
+// ==========================================================================
+
+// Connections to peers, kept open to be reused by later requests.  A new
+// connection is opened when the ones to a peer are all busy, up to
+// SWOOSH_PEER_MAX_CONNECTIONS, so parallel downloads still get connections
+// of their own.  Idle connections are closed from a thread of their own,
+// before the peer gives up on them.
+class SwooshPeerPool
+{
+protected:
+  struct Peer {
+    std::vector<std::shared_ptr<SwooshPeerConnection>> conns;
+    size_t connecting = 0;     // connections being opened
+  };
+
+  std::mutex lock;
+  std::map<std::string, Peer> peers;
+  std::thread reaper_thread;   // started with the first connection
+  std::condition_variable reaper_cond;
+  bool stopping = false;
+
+  void RemoveIdle(std::vector<std::shared_ptr<SwooshPeerConnection>> *idle);
+  void ReapIdle();
+
+public:
+  ~SwooshPeerPool();
+
+  // open a stream to the sender of a beacon, or return nullptr on error
+  net_socket *OpenStream(net_msg_beacon *beacon);
+};
+
+#endif /* SWOOSH_PEER_POOL_H_FILE */
@@ -0,0 +1,153 @@
+#include "targetver.h"
+#include "swoosh_rate_limit.h"
+
+#include <algorithm>
+#include <thread>
+
+#define WAIT_SLICE_MS  100
+
+// ==========================================================================
+// SwooshTokenBucket
+// ==========================================================================
+
+SwooshTokenBucket::SwooshTokenBucket(uint64_t rate)
+  : rate(rate), tokens(0), last_fill(std::chrono::steady_clock::now())
+{
+}
+
+void SwooshTokenBucket::SetRate(uint64_t new_rate)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (new_rate != rate) {
+    // forget debt taken at the old rate
+    rate = new_rate;
+    tokens = 0;
+    last_fill = std::chrono::steady_clock::now();
+  }
+}
+
+std::chrono::microseconds SwooshTokenBucket::Take(size_t len)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto now = std::chrono::steady_clock::now();
+  if (rate == 0) {
+    last_fill = now;
+    return std::chrono::microseconds{0};
+  }
+
+  double burst = std::max((double) rate * SWOOSH_RATE_BURST_MS / 1000, (double) SWOOSH_RATE_MIN_BURST);
+  tokens = std::min(burst, tokens + std::chrono::duration<double>(now - last_fill).count() * rate);
+  last_fill = now;
+  tokens -= (double) len;
+  if (tokens >= 0) {
+    return std::chrono::microseconds{0};
+  }
+  return std::chrono::microseconds{(int64_t) (-tokens * 1000000 / rate)};
+}
+
+// ==========================================================================
+// SwooshThrottle
+// ==========================================================================
+
+void SwooshThrottle::OnThrottle(int direction, size_t len, void *user_data)
+{
+  static_cast<SwooshThrottle *>(user_data)->Wait(direction, len);
+}
+
+void SwooshThrottle::Wait(int direction, size_t len)
+{
+  if (direction != this->direction) {
+    return;
+  }
+
+  uint32_t generation = SwooshRateLimiter::generation;
+  std::chrono::microseconds wait{0};
+  for (auto &bucket : buckets) {
+    wait = std::max(wait, bucket->Take(len));
+  }
+
+  // wait in slices, so a change of limits doesn't leave us waiting for the old ones
+  auto until = std::chrono::steady_clock::now() + wait;
+  while (generation == SwooshRateLimiter::generation) {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= until) {
+      break;
+    }
+    std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(until - now, std::chrono::milliseconds(WAIT_SLICE_MS)));
+  }
+}
+
+// ==========================================================================
+// SwooshRateLimiter
+// ==========================================================================
+
+std::mutex SwooshRateLimiter::lock;
+SwooshRateLimits SwooshRateLimiter::limits[2];
+std::shared_ptr<SwooshTokenBucket> SwooshRateLimiter::global_buckets[2] = {
+  std::make_shared<SwooshTokenBucket>(0),
+  std::make_shared<SwooshTokenBucket>(0),
+};
+SwooshRateLimiter::BucketMap SwooshRateLimiter::peer_buckets[2];
+SwooshRateLimiter::BucketMap SwooshRateLimiter::transfer_buckets[2];
+std::atomic<uint32_t> SwooshRateLimiter::generation{0};
+
+void SwooshRateLimiter::SetLimits(int direction, const SwooshRateLimits &new_limits)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  limits[direction] = new_limits;
+
+  global_buckets[direction]->SetRate(new_limits.global);
+  for (auto &entry : peer_buckets[direction]) {
+    if (auto bucket = entry.second.lock()) {
+      bucket->SetRate(new_limits.per_peer);
+    }
+  }
+  for (auto &entry : transfer_buckets[direction]) {
+    if (auto bucket = entry.second.lock()) {
+      bucket->SetRate(new_limits.per_transfer);
+    }
+  }
+  generation++;
+}
+
+SwooshRateLimits SwooshRateLimiter::GetLimits(int direction)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return limits[direction];
+}
+
+bool SwooshRateLimiter::IsLimited(int direction)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return limits[direction].global != 0 || limits[direction].per_peer != 0 || limits[direction].per_transfer != 0;
+}
+
+std::shared_ptr<SwooshTokenBucket> SwooshRateLimiter::GetBucket(BucketMap &buckets, const std::string &key, uint64_t rate)
+{
+  // drop buckets of finished transfers
+  for (auto it = buckets.begin(); it != buckets.end(); ) {
+    if (it->second.expired()) {
+      it = buckets.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  std::shared_ptr<SwooshTokenBucket> bucket = buckets[key].lock();
+  if (! bucket) {
+    bucket = std::make_shared<SwooshTokenBucket>(rate);
+    buckets[key] = bucket;
+  }
+  return bucket;
+}
+
+std::shared_ptr<SwooshThrottle> SwooshRateLimiter::GetThrottle(int direction, const std::string &peer, const std::string &transfer)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto throttle = std::make_shared<SwooshThrottle>();
+  throttle->direction = direction;
+  throttle->buckets[0] = global_buckets[direction];
+  throttle->buckets[1] = GetBucket(peer_buckets[direction], peer, limits[direction].per_peer);
+  throttle->buckets[2] = GetBucket(transfer_buckets[direction], transfer, limits[direction].per_transfer);
+  return throttle;
+}
@@ -0,0 +1,101 @@
+#ifndef SWOOSH_RATE_LIMIT_H_FILE
+#define SWOOSH_RATE_LIMIT_H_FILE
+
+#include <cstdint>
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+#include "network.h"
+
+#define SWOOSH_RATE_BURST_MS    100          // a bucket saves up tokens for this long at its rate
+#define SWOOSH_RATE_MIN_BURST   (64*1024)    // but at least this many bytes
+
+// ==========================================================================
+// SwooshTokenBucket
+// ==========================================================================
+
+// Token bucket for a transfer rate.  Each chunk takes tokens for its bytes;
+// the bucket may go into debt for a chunk, which makes the next chunks
+// wait until it's paid.
+class SwooshTokenBucket
+{
+protected:
+  std::mutex lock;
+  uint64_t rate;                    // bytes per second, 0 for no limit
+  double tokens;
+  std::chrono::steady_clock::time_point last_fill;
+
+public:
+  SwooshTokenBucket(uint64_t rate);
+
+  void SetRate(uint64_t rate);
+
+  // take tokens for 'len' bytes, returning how long to wait before moving them
+  std::chrono::microseconds Take(size_t len);
+};
+
+// ==========================================================================
+// SwooshRateLimiter
+// ==========================================================================
+
+// transfer rate limits in bytes per second, 0 for no limit
+struct SwooshRateLimits {
+  uint64_t global = 0;              // for all transfers together
+  uint64_t per_peer = 0;            // for all transfers with each peer
+  uint64_t per_transfer = 0;        // for each transfer
+};
+
+// Buckets a transfer takes tokens from, given to a socket with Attach().
+// It must live while the socket is used.
+class SwooshThrottle
+{
+  friend class SwooshRateLimiter;
+
+protected:
+  int direction;
+  std::shared_ptr<SwooshTokenBucket> buckets[3];
+
+  static void OnThrottle(int direction, size_t len, void *user_data);
+
+public:
+  void Attach(net_socket *sock) { net_set_socket_throttle(sock, OnThrottle, this); }
+
+  // wait until 'len' bytes may go in the given direction (the other direction isn't limited)
+  void Wait(int direction, size_t len);
+};
+
+// Limits for sending and receiving (direction is NET_THROTTLE_SEND or
+// NET_THROTTLE_RECV).  Transfers are only throttled if a limit was set when
+// they started; limits can be changed at any time, and the new rates apply
+// to the throttled transfers right away.
+class SwooshRateLimiter
+{
+  friend class SwooshThrottle;
+
+protected:
+  typedef std::map<std::string, std::weak_ptr<SwooshTokenBucket>> BucketMap;
+
+  static std::mutex lock;
+  static SwooshRateLimits limits[2];
+  static std::shared_ptr<SwooshTokenBucket> global_buckets[2];
+  static BucketMap peer_buckets[2];
+  static BucketMap transfer_buckets[2];
+  static std::atomic<uint32_t> generation;   // changes with the limits, to stop waits for old limits
+
+  static std::shared_ptr<SwooshTokenBucket> GetBucket(BucketMap &buckets, const std::string &key, uint64_t rate);
+
+public:
+  static void SetLimits(int direction, const SwooshRateLimits &new_limits);
+  static SwooshRateLimits GetLimits(int direction);
+  static bool IsLimited(int direction);
+
+  // throttle for a transfer with a peer; transfers with the same key
+  // (e.g. segments of the same file) share the per-transfer limit
+  static std::shared_ptr<SwooshThrottle> GetThrottle(int direction, const std::string &peer, const std::string &transfer);
+};
+
+#endif /* SWOOSH_RATE_LIMIT_H_FILE */
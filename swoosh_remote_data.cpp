@@ -2,25 +2,77 @@
 #include "swoosh_remote_data.h"
 
 #include <vector>
+#include <cstring>
 #include <algorithm>
 #include <iterator>
 #include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <cctype>
 #include <fstream>
 #include <wx/filefn.h>
 
+#include "swoosh_app.h"
+#include "swoosh_checkpoint.h"
+#include "swoosh_delta.h"
+#include "swoosh_compress.h"
+#include "swoosh_multicast.h"
 #include "util.h"
 
 #define MAX_TEXT_SIZE      (1024*1024)
 #define MAX_FILENAME_SIZE  (128)
+#define MAX_HEAD_SIZE      (MAX_TEXT_SIZE + 4096)   // text messages send the whole text as head
+
+#define DOWNLOAD_SEGMENTS      4                    // max number of connections per file
+#define SEGMENT_MIN_SIZE       (16*1024*1024)       // files smaller than 2 segments use 1 connection
+#define SEGMENT_ALIGN          (1024*1024)
+
+#define DIR_DOWNLOAD_CONNECTIONS     4                 // default connections per directory download
+#define DIR_PARALLEL_MIN_FILE_SIZE   (1024*1024)       // min average file size to use parallel download
+#define DIR_PIPELINE_DEPTH           8                 // max file requests in flight per connection
+#define MAX_MANIFEST_SIZE            (256*1024*1024)
+
+#define DELTA_MIN_SIZE         (1024*1024)          // smaller files are always downloaded whole
+#define DELTA_COPY_BUFFER_SIZE (1024*1024)
+#define DELTA_SUFFIX           ".swoosh-delta"      // new version of a file being rebuilt
+
+#define SWARM_DOWNLOAD_CONNECTIONS   4                 // chunks downloaded at the same time
+#define SWARM_MAX_PEER_REQUESTS      2                 // chunk requests in flight to each peer
+#define SWARM_ANNOUNCE_INTERVAL_MS   3000
+#define SWARM_MAX_SENDER_FAILURES    3
+
+#define CHECKPOINT_SUFFIX      ".swoosh-part"       // sidecar for partially downloaded files
+#define DIR_CHECKPOINT_NAME    ".swoosh-part"       // sidecar inside partially downloaded dirs
+
+// files of these types don't compress any further
+static const char *const compressed_extensions[] = {
+  "7z", "aac", "apk", "avi", "bz2", "docx", "flac", "gif", "gz", "heic", "jar", "jpeg", "jpg", "lz4", "m4a", "mkv",
+  "mov", "mp3", "mp4", "ogg", "pdf", "png", "pptx", "rar", "tgz", "webm", "webp", "xlsx", "xz", "zip", "zst",
+};
 
 // ==========================================================================
 // SwooshRemoteData
 // ==========================================================================
 
+bool SwooshRemoteData::compression = false;
+bool SwooshRemoteData::persistent_connections = true;
+SwooshPeerPool SwooshRemoteData::peer_pool;
+
+net_socket *SwooshRemoteData::ConnectToSender(net_msg_beacon *beacon)
+{
+  if (persistent_connections) {
+    return peer_pool.OpenStream(beacon);
+  }
+  return net_connect_to_beacon(beacon);
+}
+
 SwooshRemoteData *SwooshRemoteData::ReceiveData(net_msg_beacon *beacon)
 {
   SwooshRemoteData *data = nullptr;
-  struct net_socket *sock = net_connect_to_beacon(beacon);
+  struct net_socket *sock = ConnectToSender(beacon);
   if (!sock) {
     return nullptr;
   }
@@ -38,26 +90,143 @@ SwooshRemoteData *SwooshRemoteData::ReceiveData(net_msg_beacon *beacon)
     goto end;
   }
 
+  data = ReceiveHead(beacon, sock);
+
+end:
+  net_close_socket(sock);
+  return data;
+}
+
+SwooshTask<SwooshRemoteData *> SwooshRemoteData::ReceiveDataAsync(SwooshEventLoop &loop, net_msg_beacon *beacon)
+{
+  net_socket *sock = co_await loop.Connect(beacon);
+  if (!sock) {
+    co_return nullptr;
+  }
+
+  // send request for message information and read the whole reply
+  uint32_t message_id = net_get_beacon_message_id(beacon);
+  std::vector<char> reply;
+  if (co_await loop.SendU32(sock, message_id) != 0 ||
+      co_await loop.SendU32(sock, SWOOSH_DATA_REQUEST_HEAD) != 0 ||
+      co_await loop.RecvAll(sock, &reply, MAX_HEAD_SIZE) != 0) {
+    DebugLog("ERROR: can't read message information\n");
+    net_close_socket(sock);
+    co_return nullptr;
+  }
+
+  // parse it with the same code as blocking requests
+  SwooshRemoteData *data = nullptr;
+  if (net_set_recv_data(sock, reply.data(), reply.size()) == 0) {
+    data = ReceiveHead(beacon, sock);
+  }
+  net_close_socket(sock);
+  co_return data;
+}
+
+SwooshRemoteData *SwooshRemoteData::ReceiveInlineData(net_msg_beacon *beacon)
+{
+  size_t head_len = 0;
+  const void *head = net_get_beacon_head(beacon, &head_len);
+  if (!head) {
+    return nullptr;
+  }
+
+  // the head came in the beacon, read it from memory
+  net_socket *sock = net_open_memory_socket(0);
+  if (!sock) {
+    return nullptr;
+  }
+  SwooshRemoteData *data = nullptr;
+  if (net_set_recv_data(sock, head, head_len) == 0) {
+    data = ReceiveHead(beacon, sock);
+  }
+  net_close_socket(sock);
+  return data;
+}
+
+SwooshRemoteData *SwooshRemoteData::ReceiveHead(net_msg_beacon *beacon, net_socket *sock)
+{
   // read data type
   uint32_t data_type_id;
   if (net_recv_u32(sock, &data_type_id) != 0) {
     DebugLog("ERROR: can't read message type\n");
-    goto end;
+    return nullptr;
   }
 
   switch (data_type_id) {
-  case SWOOSH_DATA_TEXT: data = new SwooshRemoteTextData(beacon, sock); break;
-  case SWOOSH_DATA_FILE: data = new SwooshRemoteFileData(beacon, sock); break;
-  case SWOOSH_DATA_DIR:  data = new SwooshRemoteDirData(beacon, sock); break;
+  case SWOOSH_DATA_TEXT: return new SwooshRemoteTextData(beacon, sock);
+  case SWOOSH_DATA_FILE: return new SwooshRemoteFileData(beacon, sock);
+  case SWOOSH_DATA_DIR:  return new SwooshRemoteDirData(beacon, sock);
 
   default:
     DebugLog("ERROR: unknown data type id: %u (0x%x)\n", data_type_id, data_type_id);
-    break;
+    return nullptr;
   }
+}
 
-end:
-  net_close_socket(sock);
-  return data;
+net_socket *SwooshRemoteData::OpenRequest(uint32_t request_type, net_msg_beacon *source)
+{
+  if (source == nullptr) {
+    source = beacon;
+  }
+
+  // the sender needs our address for swarm requests, multicast sessions
+  // keep their connection until we're done, and bulk bodies would be held
+  // to the stream window and miss sendfile() and io_uring, so only small
+  // requests go on the shared connections
+  bool direct = (request_type == SWOOSH_DATA_REQUEST_SWARM || request_type == SWOOSH_DATA_REQUEST_MULTICAST ||
+                 SWOOSH_DATA_REQUEST_IS_BULK(request_type));
+  net_socket *sock = (direct) ? net_connect_to_beacon(source) : ConnectToSender(source);
+  if (sock == nullptr) {
+    DebugLog("ERROR: can't connect to sender\n");
+    return nullptr;
+  }
+  if (SWOOSH_DATA_REQUEST_IS_BULK(request_type) && SwooshRateLimiter::IsLimited(NET_THROTTLE_RECV)) {
+    GetThrottle(source)->Attach(sock);
+  }
+
+  // request message
+  uint32_t message_id = net_get_beacon_message_id(source);
+  if (net_send_u32(sock, message_id) != 0) {
+    DebugLog("ERROR: can't send request message_id\n");
+    net_close_socket(sock);
+    return nullptr;
+  }
+
+  // ask for compressed file data
+  if (WantsCompression() && (request_type == SWOOSH_DATA_REQUEST_BODY || request_type == SWOOSH_DATA_REQUEST_BODY_RANGE ||
+                      request_type == SWOOSH_DATA_REQUEST_BODY_RESUME || request_type == SWOOSH_DATA_REQUEST_FILES)) {
+    request_type |= SWOOSH_DATA_REQUEST_FLAG_COMPRESS;
+    net_set_socket_options(sock, NET_SOCKET_COMPRESS);
+  }
+
+  // request type
+  if (net_send_u32(sock, request_type) != 0) {
+    DebugLog("ERROR: can't send request type\n");
+    net_close_socket(sock);
+    return nullptr;
+  }
+
+  return sock;
+}
+
+SwooshThrottle *SwooshRemoteData::GetThrottle(net_msg_beacon *source)
+{
+  // all requests of this download share the per-transfer limit, even the ones to other peers
+  std::string peer = net_get_beacon_host(source);
+  std::lock_guard<std::mutex> guard(throttle_lock);
+  std::shared_ptr<SwooshThrottle> &throttle = throttles[peer];
+  if (! throttle) {
+    std::string transfer = std::string(net_get_beacon_host(beacon)) + " " + std::to_string(net_get_beacon_message_id(beacon));
+    throttle = SwooshRateLimiter::GetThrottle(NET_THROTTLE_RECV, peer, transfer);
+  }
+  return throttle.get();
+}
+
+std::string SwooshRemoteData::GetCheckpointId(const std::string &name, uint64_t size)
+{
+  return std::string(net_get_beacon_host(beacon)) + " " + std::to_string(size) + " " + name;
 }
 
 std::string *SwooshRemoteData::ReceiveString(net_socket *sock, size_t max_size)
@@ -84,39 +253,21 @@ std::string *SwooshRemoteData::ReceiveString(net_socket *sock, size_t max_size)
   return new std::string(data.begin(), data.end());
 }
 
-int SwooshRemoteData::ReceiveFile(net_socket *sock, const std::string &local_path, std::function<void(double)> progress)
+int SwooshRemoteData::ReceiveFileData(net_socket *sock, const std::string &local_path, uint64_t offset, uint64_t len,
+                                      net_progress_callback progress, void *user_data)
 {
-  // read file size
-  uint32_t file_size;
-  if (net_recv_u32(sock, &file_size) != 0) {
-    DebugLog("ERROR: can't read file size\n");
-    return -1;
-  }
-
-  std::ofstream file(local_path, std::ios::binary);
-  if (!file.good()) {
-    DebugLog("ERROR: can't open download file '%s'\n", local_path.c_str());
-    return -1;
+  if (net_get_socket_options(sock) & NET_SOCKET_COMPRESS) {
+    return SwooshCompressor::ReceiveFile(sock, local_path, offset, len, progress, user_data);
   }
+  return net_recv_file(sock, local_path.c_str(), offset, len, progress, user_data);
+}
 
-  uint32_t size_left = file_size;
-  while (size_left > 0) {
-    char data[4096];
-    uint32_t chunk_size = (size_left > sizeof(data)) ? sizeof(data) : size_left;
-    if (net_recv_data(sock, data, chunk_size) != 0) {
-      DebugLog("ERROR: can't read file data\n");
-      return -1;
-    }
-    file.write(data, chunk_size);
-    if (!file.good()) {
-      DebugLog("ERROR: can't write to file '%s'\n", local_path.c_str());
-      return -1;
-    }
-    progress(1.0 - (double) size_left / file_size);
-    size_left -= chunk_size;
+int SwooshRemoteData::ReceiveBodyData(net_socket *sock, void *data, size_t len)
+{
+  if (net_get_socket_options(sock) & NET_SOCKET_COMPRESS) {
+    return SwooshCompressor::ReceiveData(sock, data, len);
   }
-
-  return 0;
+  return net_recv_data(sock, data, len);
 }
 
 // ==========================================================================
@@ -126,12 +277,6 @@ int SwooshRemoteData::ReceiveFile(net_socket *sock, const std::string &local_pat
 SwooshRemoteTextData::SwooshRemoteTextData(net_msg_beacon *beacon, net_socket *sock)
   : SwooshRemoteData(beacon), text("")
 {
-  // request head
-  if (net_send_u32(sock, SWOOSH_DATA_REQUEST_HEAD) != 0) {
-    DebugLog("ERROR: can't send request type\n");
-    return;
-  }
-
   // read message text
   auto text_ptr = ReceiveString(sock, MAX_TEXT_SIZE);
   if (text_ptr == nullptr) {
@@ -156,14 +301,8 @@ bool SwooshRemoteTextData::Download(std::string local_path, std::function<void(d
 // ==========================================================================
 
 SwooshRemoteFileData::SwooshRemoteFileData(net_msg_beacon *beacon, net_socket *sock)
-  : SwooshRemotePermanentData(beacon), file_name(""), file_size(0)
+  : SwooshRemotePermanentData(beacon), file_name(""), file_size(0), swarm_message_id(0), swarm_port(0)
 {
-  // request info
-  if (net_send_u32(sock, SWOOSH_DATA_REQUEST_HEAD) != 0) {
-    DebugLog("ERROR: can't send request type\n");
-    return;
-  }
-
   // read file name
   auto file_name_ptr = ReceiveString(sock, MAX_FILENAME_SIZE);
   if (file_name_ptr == nullptr) {
@@ -174,7 +313,7 @@ SwooshRemoteFileData::SwooshRemoteFileData(net_msg_beacon *beacon, net_socket *s
   delete file_name_ptr;
 
   // read file size
-  if (net_recv_u32(sock, &file_size) != 0) {
+  if (net_recv_u64(sock, &file_size) != 0) {
     DebugLog("ERROR: can't read file size\n");
     return;
   }
@@ -182,56 +321,639 @@ SwooshRemoteFileData::SwooshRemoteFileData(net_msg_beacon *beacon, net_socket *s
   is_good = true;
 }
 
-bool SwooshRemoteFileData::Download(std::string local_path, std::function<void(double)> progress)
+bool SwooshRemoteFileData::WantsCompression()
 {
-  progress(0.0);
+  if (!compression) {
+    return false;
+  }
+  auto dot = file_name.find_last_of('.');
+  if (dot == std::string::npos) {
+    return true;
+  }
+  std::string ext = file_name.substr(dot + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char) tolower(c); });
+  for (const char *compressed : compressed_extensions) {
+    if (ext == compressed) {
+      return false;
+    }
+  }
+  return true;
+}
 
-  net_socket *sock = net_connect_to_beacon(beacon);
+struct SegmentProgress {
+  std::atomic<uint64_t> &total_done;
+  uint64_t segment_offset;
+  uint64_t segment_done;
+  uint64_t total_size;
+  SwooshCheckpoint &checkpoint;
+  std::function<void(double)> &progress;
+  const std::atomic<bool> &cancelled;
+};
+
+static int ReportSegmentProgress(uint64_t bytes_done, void *user_data)
+{
+  SegmentProgress *segment = (SegmentProgress *) user_data;
+  segment->checkpoint.AddRange(segment->segment_offset + segment->segment_done, segment->segment_offset + bytes_done);
+  uint64_t total_done = segment->total_done += bytes_done - segment->segment_done;
+  segment->segment_done = bytes_done;
+  segment->progress((double) total_done / segment->total_size);
+  return (segment->cancelled) ? -1 : 0;
+}
+
+static int CheckCancelled(uint64_t bytes_done, void *user_data)
+{
+  return (*(const std::atomic<bool> *) user_data) ? -1 : 0;
+}
+
+bool SwooshRemoteFileData::DownloadRange(const std::string &local_path, uint64_t offset, uint64_t len,
+                                         net_progress_callback progress, void *user_data, net_msg_beacon *source)
+{
+  net_socket *sock = OpenRequest(SWOOSH_DATA_REQUEST_BODY_RANGE, source);
   if (sock == nullptr) {
-    DebugLog("ERROR: can't connect to sender\n");
     return false;
   }
 
   bool success = false;
+  uint64_t range_len = 0;
 
-  // request file
-  uint32_t message_id = net_get_beacon_message_id(beacon);
-  if (net_send_u32(sock, message_id) != 0) {
-    DebugLog("ERROR: can't send request message_id\n");
+  // send range
+  if (net_send_u64(sock, offset) != 0 || net_send_u64(sock, len) != 0) {
+    DebugLog("ERROR: can't send request range\n");
     goto end;
   }
 
-  // request body
-  if (net_send_u32(sock, SWOOSH_DATA_REQUEST_BODY) != 0) {
-    DebugLog("ERROR: can't send request type\n");
+  // read range size
+  if (net_recv_u64(sock, &range_len) != 0 || range_len != len) {
+    DebugLog("ERROR: can't read range size\n");
     goto end;
   }
 
-  // download file
-  if (ReceiveFile(sock, local_path, progress) != 0) {
+  // download range
+  if (ReceiveFileData(sock, local_path, offset, len, progress, user_data) != 0) {
+    DebugLog("ERROR: can't receive file range\n");
+    goto end;
+  }
+
+  success = true;
+end:
+  net_close_socket(sock);
+  return success;
+}
+
+bool SwooshRemoteFileData::OpenCheckpoint(const std::string &local_path, SwooshCheckpoint &checkpoint)
+{
+  // resume from the checkpoint if the partial file is still there
+  uint64_t local_size = 0;
+  if (!checkpoint.Load() || ReadFileSize(local_path, &local_size) != 0 || local_size != file_size) {
+    checkpoint.Reset();
+    if (net_prepare_file(local_path.c_str(), file_size) != 0) {
+      DebugLog("ERROR: can't open download file '%s'\n", local_path.c_str());
+      return false;
+    }
+    checkpoint.Save();
+  }
+  return true;
+}
+
+bool SwooshRemoteFileData::DownloadSegments(const std::string &local_path, std::function<void(double)> progress)
+{
+  SwooshCheckpoint checkpoint(local_path + CHECKPOINT_SUFFIX, GetCheckpointId(file_name, file_size));
+  if (!OpenCheckpoint(local_path, checkpoint)) {
+    return false;
+  }
+
+  // split what's missing into segments
+  auto missing = checkpoint.GetMissingRanges(file_size);
+  uint64_t missing_size = 0;
+  for (const auto &range : missing) {
+    missing_size += range.end - range.start;
+  }
+  uint64_t segment_size = (missing_size / DOWNLOAD_SEGMENTS + SEGMENT_ALIGN - 1) / SEGMENT_ALIGN * SEGMENT_ALIGN;
+  if (segment_size < SEGMENT_MIN_SIZE) {
+    segment_size = SEGMENT_MIN_SIZE;
+  }
+  std::vector<SwooshCheckpoint::Range> segments;
+  for (const auto &range : missing) {
+    for (uint64_t start = range.start; start < range.end; start += segment_size) {
+      segments.push_back(SwooshCheckpoint::Range{start, std::min(start + segment_size, range.end)});
+    }
+  }
+
+  // download segments over parallel connections
+  std::atomic<uint64_t> total_done(file_size - missing_size);
+  std::atomic<size_t> next_segment(0);
+  std::atomic<bool> success(true);
+  std::vector<std::thread> segment_threads;
+  size_t num_threads = std::min(segments.size(), (size_t) DOWNLOAD_SEGMENTS);
+  for (size_t i = 0; i < num_threads; i++) {
+    segment_threads.emplace_back([&] {
+      size_t index;
+      while (success && (index = next_segment++) < segments.size()) {
+        const auto &range = segments[index];
+        SegmentProgress segment{total_done, range.start, 0, file_size, checkpoint, progress, cancelled};
+        if (!DownloadRange(local_path, range.start, range.end - range.start, ReportSegmentProgress, &segment)) {
+          success = false;
+        }
+      }
+    });
+  }
+  for (auto &thread : segment_threads) {
+    thread.join();
+  }
+
+  if (!success) {
+    checkpoint.Save();
+    return false;
+  }
+  checkpoint.Remove();
+  return true;
+}
+
+bool SwooshRemoteFileData::DownloadResume(const std::string &local_path, std::function<void(double)> progress)
+{
+  SwooshCheckpoint checkpoint(local_path + CHECKPOINT_SUFFIX, GetCheckpointId(file_name, file_size));
+  if (!OpenCheckpoint(local_path, checkpoint)) {
+    return false;
+  }
+
+  // continue from the first byte we don't have
+  auto missing = checkpoint.GetMissingRanges(file_size);
+  if (missing.empty()) {
+    checkpoint.Remove();
+    return true;
+  }
+  uint64_t resume_offset = missing[0].start;
+
+  net_socket *sock = OpenRequest((resume_offset > 0) ? SWOOSH_DATA_REQUEST_BODY_RESUME : SWOOSH_DATA_REQUEST_BODY);
+  if (sock == nullptr) {
+    checkpoint.Save();
+    return false;
+  }
+
+  bool success = false;
+  uint64_t data_size = 0;
+  std::atomic<uint64_t> total_done(resume_offset);
+  SegmentProgress segment{total_done, resume_offset, 0, file_size, checkpoint, progress, cancelled};
+
+  // send resume position
+  if (resume_offset > 0) {
+    if (net_send_u32(sock, 0) != 0 || net_send_u64(sock, resume_offset) != 0) {
+      DebugLog("ERROR: can't send resume position\n");
+      goto end;
+    }
+  }
+
+  // read size of the rest of the file
+  if (net_recv_u64(sock, &data_size) != 0 || data_size != file_size - resume_offset) {
+    DebugLog("ERROR: can't read file size\n");
+    goto end;
+  }
+
+  // download the rest of the file
+  if (ReceiveFileData(sock, local_path, resume_offset, data_size, ReportSegmentProgress, &segment) != 0) {
+    DebugLog("ERROR: can't receive file '%s'\n", local_path.c_str());
+    goto end;
+  }
+
+  success = true;
+end:
+  net_close_socket(sock);
+  if (!success) {
+    checkpoint.Save();
+    return false;
+  }
+  checkpoint.Remove();
+  return true;
+}
+
+bool SwooshRemoteFileData::DownloadDelta(const std::string &local_path, uint64_t local_size, std::function<void(double)> progress)
+{
+  // list the blocks of our old copy
+  SwooshDeltaSignature signature;
+  if (!signature.Build(local_path, local_size)) {
+    return false;
+  }
+
+  net_socket *sock = OpenRequest(SWOOSH_DATA_REQUEST_BODY_DELTA);
+  if (sock == nullptr) {
+    return false;
+  }
+
+  bool success = false;
+  std::string new_path = local_path + DELTA_SUFFIX;
+  std::ifstream old_file;
+  std::ofstream new_file;
+  std::vector<char> buf(std::max((size_t) DELTA_COPY_BUFFER_SIZE, (size_t) SWOOSH_DELTA_DATA_MAX_SIZE));
+  SwooshFileHash file_hash;
+  unsigned char hash[SWOOSH_DELTA_HASH_SIZE], remote_hash[SWOOSH_DELTA_HASH_SIZE];
+  uint64_t new_size = 0, done = 0;
+
+  // send signature
+  if (signature.Send(sock) != 0) {
+    DebugLog("ERROR: can't send delta signature\n");
+    goto end;
+  }
+
+  // read file size
+  if (net_recv_u64(sock, &new_size) != 0 || new_size != file_size) {
+    DebugLog("ERROR: can't read file size\n");
+    goto end;
+  }
+
+  // rebuild the file next to the old copy
+  old_file.open(local_path, std::ios::binary);
+  new_file.open(new_path, std::ios::binary | std::ios::trunc);
+  if (!old_file.good() || !new_file.good()) {
+    DebugLog("ERROR: can't open download file '%s'\n", new_path.c_str());
+    goto end;
+  }
+
+  while (true) {
+    if (cancelled) {
+      goto end;
+    }
+    uint32_t op;
+    if (net_recv_u32(sock, &op) != 0) {
+      DebugLog("ERROR: can't read delta operation\n");
+      goto end;
+    }
+    if (op == SWOOSH_DELTA_OP_END) {
+      break;
+    }
+
+    if (op == SWOOSH_DELTA_OP_COPY) {
+      // copy blocks we already have
+      uint32_t first, count;
+      if (net_recv_u32(sock, &first) != 0 || net_recv_u32(sock, &count) != 0) {
+        DebugLog("ERROR: can't read delta copy\n");
+        goto end;
+      }
+      uint64_t len = (uint64_t) count * signature.GetBlockSize();
+      if ((uint64_t) first + count > signature.GetNumBlocks() || len > new_size - done) {
+        DebugLog("ERROR: invalid delta copy\n");
+        goto end;
+      }
+      old_file.seekg((uint64_t) first * signature.GetBlockSize());
+      while (len > 0) {
+        size_t n = (size_t) std::min(len, (uint64_t) buf.size());
+        if (!old_file.read(buf.data(), n) || !new_file.write(buf.data(), n)) {
+          DebugLog("ERROR: can't copy data to '%s'\n", new_path.c_str());
+          goto end;
+        }
+        file_hash.Update(buf.data(), n);
+        len -= n;
+        done += n;
+        progress((double) done / file_size);
+      }
+    } else if (op == SWOOSH_DELTA_OP_DATA) {
+      // write new data
+      uint32_t len;
+      if (net_recv_u32(sock, &len) != 0 || len > SWOOSH_DELTA_DATA_MAX_SIZE || len > new_size - done) {
+        DebugLog("ERROR: can't read delta data size\n");
+        goto end;
+      }
+      if (net_recv_data(sock, buf.data(), len) != 0) {
+        DebugLog("ERROR: can't read delta data\n");
+        goto end;
+      }
+      if (!new_file.write(buf.data(), len)) {
+        DebugLog("ERROR: can't write to file '%s'\n", new_path.c_str());
+        goto end;
+      }
+      file_hash.Update(buf.data(), len);
+      done += len;
+      progress((double) done / file_size);
+    } else {
+      DebugLog("ERROR: unknown delta operation: %u\n", op);
+      goto end;
+    }
+  }
+
+  // check that the rebuilt file is the same as the sender's
+  if (net_recv_data(sock, remote_hash, sizeof(remote_hash)) != 0) {
+    DebugLog("ERROR: can't read file hash\n");
+    goto end;
+  }
+  file_hash.Final(hash);
+  if (done != new_size || memcmp(hash, remote_hash, sizeof(hash)) != 0) {
+    DebugLog("ERROR: rebuilt file doesn't match '%s'\n", file_name.c_str());
+    goto end;
+  }
+
+  old_file.close();
+  new_file.close();
+  if (new_file.fail() || !wxRenameFile(new_path, local_path, true)) {
+    DebugLog("ERROR: can't replace file '%s'\n", local_path.c_str());
     goto end;
   }
 
   success = true;
-  progress(1.0);
 end:
   net_close_socket(sock);
+  if (!success) {
+    new_file.close();
+    if (wxFileExists(new_path)) {
+      wxRemoveFile(new_path);
+    }
+  }
   return success;
 }
 
+bool SwooshRemoteFileData::multicast = false;
+
+bool SwooshRemoteFileData::DownloadMulticast(const std::string &local_path, std::function<void(double)> progress)
+{
+  net_socket *sock = OpenRequest(SWOOSH_DATA_REQUEST_MULTICAST);
+  if (sock == nullptr) {
+    return false;
+  }
+
+  SwooshMulticastReceiver receiver(sock, file_size);
+  bool success = receiver.Receive(local_path, progress, cancelled);
+  if (!success) {
+    // keep what we got, so the download over TCP only gets the rest
+    auto received = receiver.GetReceivedRanges();
+    if (!received.empty()) {
+      SwooshCheckpoint checkpoint(local_path + CHECKPOINT_SUFFIX, GetCheckpointId(file_name, file_size));
+      for (const auto &range : received) {
+        checkpoint.AddRange(range.start, range.end);
+      }
+      checkpoint.Save();
+    }
+  }
+  net_close_socket(sock);
+  return success;
+}
+
+bool SwooshRemoteFileData::AnnounceSwarm(uint32_t ttl_ms, std::vector<SwooshSwarmPeer> *peers, std::vector<unsigned char> *hashes)
+{
+  net_socket *sock = OpenRequest(SWOOSH_DATA_REQUEST_SWARM);
+  if (sock == nullptr) {
+    return false;
+  }
+
+  bool success = (SwooshSwarmTracker::SendAnnounce(sock, swarm_port, swarm_message_id, ttl_ms, swarm_chunks->GetBitmap()) == 0 &&
+                  SwooshSwarmTracker::ReceivePeers(sock, file_size, peers, hashes) == 0);
+  net_close_socket(sock);
+  return success;
+}
+
+bool SwooshRemoteFileData::DownloadSwarm(const std::string &local_path, std::function<void(double)> progress)
+{
+  struct Source {
+    SwooshSwarmPeer peer;
+    int busy;
+    bool failed;
+  };
+  enum { CHUNK_MISSING, CHUNK_DOWNLOADING, CHUNK_DONE };
+
+  // join the swarm; chunks are checked against the hashes the sender sends
+  std::vector<SwooshSwarmPeer> peers;
+  std::vector<unsigned char> chunk_hashes;
+  std::vector<unsigned char> hashes;
+  if (!AnnounceSwarm(SWOOSH_SWARM_PEER_TTL_MS, &peers, &chunk_hashes)) {
+    return false;
+  }
+
+  SwooshCheckpoint checkpoint(local_path + CHECKPOINT_SUFFIX, GetCheckpointId(file_name, file_size));
+  if (!OpenCheckpoint(local_path, checkpoint)) {
+    AnnounceSwarm(0, &peers, &hashes);
+    return false;
+  }
+
+  // chunks already in the file from an earlier attempt
+  uint32_t num_chunks = swarm_chunks->GetNumChunks();
+  std::vector<int> chunk_state(num_chunks, CHUNK_MISSING);
+  uint32_t num_done = 0;
+  uint64_t bytes_done = 0;
+  auto missing = checkpoint.GetMissingRanges(file_size);
+  for (uint32_t chunk = 0; chunk < num_chunks; chunk++) {
+    uint64_t start = (uint64_t) chunk * SWOOSH_SWARM_CHUNK_SIZE;
+    uint64_t end = std::min(start + SWOOSH_SWARM_CHUNK_SIZE, file_size);
+    if (std::none_of(missing.begin(), missing.end(), [&](const SwooshCheckpoint::Range &r) { return r.start < end && r.end > start; })) {
+      chunk_state[chunk] = CHUNK_DONE;
+      swarm_chunks->Add(chunk);
+      num_done++;
+      bytes_done += end - start;
+    }
+  }
+
+  std::mutex lock;
+  std::condition_variable cond;
+  std::vector<std::shared_ptr<Source>> sources;
+  int sender_failures = 0;
+  bool failed = false;
+
+  // start at a random chunk, so receivers get different chunks from the
+  // sender and then trade them
+  std::random_device rd;
+  uint32_t first_chunk = std::uniform_int_distribution<uint32_t>(0, num_chunks - 1)(rd);
+
+  auto update_sources = [&](std::vector<SwooshSwarmPeer> &peers) {
+    std::vector<std::shared_ptr<Source>> new_sources;
+    for (auto &peer : peers) {
+      auto it = std::find_if(sources.begin(), sources.end(), [&](const std::shared_ptr<Source> &source) {
+        return source->peer.host == peer.host && source->peer.port == peer.port && source->peer.message_id == peer.message_id;
+      });
+      if (it != sources.end()) {
+        (*it)->peer.bitmap = std::move(peer.bitmap);
+        new_sources.push_back(*it);
+      } else {
+        new_sources.push_back(std::make_shared<Source>(Source{std::move(peer), 0, false}));
+      }
+    }
+    sources = std::move(new_sources);
+  };
+
+  // pick the missing chunk fewest peers have from the least busy of them;
+  // chunks no free peer has come from the sender
+  auto pick_chunk = [&](uint32_t *chunk, std::shared_ptr<Source> *source) {
+    bool found = false;
+    size_t best_holders = SIZE_MAX;
+    for (uint32_t i = 0; i < num_chunks; i++) {
+      uint32_t c = (first_chunk + i) % num_chunks;
+      if (chunk_state[c] != CHUNK_MISSING) {
+        continue;
+      }
+      size_t holders = 0;
+      std::shared_ptr<Source> free_source;
+      for (const auto &s : sources) {
+        if (!s->failed && SwooshSwarmChunks::HasChunk(s->peer.bitmap, c)) {
+          holders++;
+          if (s->busy < SWARM_MAX_PEER_REQUESTS && (!free_source || s->busy < free_source->busy)) {
+            free_source = s;
+          }
+        }
+      }
+      if (!free_source) {
+        holders = (holders == 0) ? SIZE_MAX - 2 : SIZE_MAX - 1;
+      }
+      if (!found || holders < best_holders) {
+        found = true;
+        best_holders = holders;
+        *chunk = c;
+        *source = free_source;
+      }
+    }
+    return found;
+  };
+
+  update_sources(peers);
+
+  std::vector<std::thread> chunk_threads;
+  for (int i = 0; i < SWARM_DOWNLOAD_CONNECTIONS; i++) {
+    chunk_threads.emplace_back([&] {
+      std::unique_lock<std::mutex> guard(lock);
+      while (!failed && num_done < num_chunks) {
+        uint32_t chunk;
+        std::shared_ptr<Source> source;
+        if (!pick_chunk(&chunk, &source)) {
+          // the rest is being downloaded
+          cond.wait(guard);
+          continue;
+        }
+        chunk_state[chunk] = CHUNK_DOWNLOADING;
+        net_msg_beacon *source_beacon = nullptr;
+        if (source) {
+          source->busy++;
+          source_beacon = net_make_beacon(source->peer.host.c_str(), source->peer.port, source->peer.message_id);
+        }
+        guard.unlock();
+
+        uint64_t start = (uint64_t) chunk * SWOOSH_SWARM_CHUNK_SIZE;
+        uint64_t len = std::min((uint64_t) SWOOSH_SWARM_CHUNK_SIZE, file_size - start);
+        bool ok = ((!source || source_beacon) && DownloadRange(local_path, start, len, CheckCancelled, &cancelled, source_beacon) &&
+                   SwooshSwarmChunks::CheckChunk(local_path, file_size, chunk, &chunk_hashes[(size_t) chunk * SWOOSH_DELTA_HASH_SIZE]));
+        if (source_beacon) {
+          net_free_beacon(source_beacon);
+        }
+
+        guard.lock();
+        if (ok) {
+          chunk_state[chunk] = CHUNK_DONE;
+          swarm_chunks->Add(chunk);
+          checkpoint.AddRange(start, start + len);
+          num_done++;
+          bytes_done += len;
+          progress((double) bytes_done / file_size);
+        } else {
+          chunk_state[chunk] = CHUNK_MISSING;
+          if (cancelled) {
+            failed = true;
+          } else if (source) {
+            DebugLog("WARNING: swarm peer %s:%u failed, not using it again\n", source->peer.host.c_str(), source->peer.port);
+            source->failed = true;
+          } else if (++sender_failures > SWARM_MAX_SENDER_FAILURES) {
+            failed = true;
+          }
+        }
+        if (source) {
+          source->busy--;
+        }
+        cond.notify_all();
+      }
+    });
+  }
+
+  // keep the sender up to date with our chunks, and learn about new peers
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    while (!failed && num_done < num_chunks) {
+      cond.wait_for(guard, std::chrono::milliseconds(SWARM_ANNOUNCE_INTERVAL_MS));
+      if (failed || num_done == num_chunks) {
+        break;
+      }
+      guard.unlock();
+      bool announced = AnnounceSwarm(SWOOSH_SWARM_PEER_TTL_MS, &peers, &hashes);
+      guard.lock();
+      if (announced) {
+        update_sources(peers);
+        cond.notify_all();
+      }
+    }
+  }
+  for (auto &thread : chunk_threads) {
+    thread.join();
+  }
+
+  // stay in the swarm to serve the whole file for a while, or leave it
+  AnnounceSwarm((failed) ? 0 : SWOOSH_SWARM_SEED_TIME_MS, &peers, &hashes);
+  if (failed) {
+    checkpoint.Save();
+    return false;
+  }
+  checkpoint.Remove();
+  return true;
+}
+
+bool SwooshRemoteFileData::Download(std::string local_path, std::function<void(double)> progress)
+{
+  progress(0.0);
+
+  // if we have an older version of the file, only download what changed
+  uint64_t local_size = 0;
+  if (file_size >= DELTA_MIN_SIZE && !wxFileExists(local_path + CHECKPOINT_SUFFIX) &&
+      ReadFileSize(local_path, &local_size) == 0 && local_size >= DELTA_MIN_SIZE) {
+    if (DownloadDelta(local_path, local_size, progress)) {
+      progress(1.0);
+      return true;
+    }
+    if (cancelled) {
+      return false;
+    }
+    DebugLog("WARNING: can't download changes to '%s', downloading whole file\n", local_path.c_str());
+    progress(0.0);
+  }
+
+  // in swarm mode, get chunks from other receivers too
+  if (swarm_chunks) {
+    if (DownloadSwarm(local_path, progress)) {
+      progress(1.0);
+      return true;
+    }
+    if (cancelled) {
+      return false;
+    }
+    DebugLog("WARNING: can't download '%s' from the swarm, downloading from the sender\n", local_path.c_str());
+  }
+
+  // large files are sent once to all receivers that want them at the same time
+  if (multicast && file_size >= SWOOSH_MULTICAST_MIN_SIZE && !wxFileExists(local_path + CHECKPOINT_SUFFIX)) {
+    if (DownloadMulticast(local_path, progress)) {
+      progress(1.0);
+      return true;
+    }
+    if (cancelled) {
+      return false;
+    }
+    DebugLog("WARNING: can't download '%s' by multicast, downloading over TCP\n", local_path.c_str());
+  }
+
+  // large files are downloaded in segments over parallel connections
+  if (file_size >= 2 * SEGMENT_MIN_SIZE) {
+    if (!DownloadSegments(local_path, progress)) {
+      return false;
+    }
+    progress(1.0);
+    return true;
+  }
+
+  if (!DownloadResume(local_path, progress)) {
+    return false;
+  }
+  progress(1.0);
+  return true;
+}
+
 // ==========================================================================
 // SwooshRemoteDirData
 // ==========================================================================
 
+int SwooshRemoteDirData::download_connections = DIR_DOWNLOAD_CONNECTIONS;
+
 SwooshRemoteDirData::SwooshRemoteDirData(net_msg_beacon *beacon, net_socket *sock)
   : SwooshRemotePermanentData(beacon), dir_name(""), tree_size(0)
 {
-  // request info
-  if (net_send_u32(sock, SWOOSH_DATA_REQUEST_HEAD) != 0) {
-    DebugLog("ERROR: can't send request type\n");
-    return;
-  }
-
   // read num items
   if (net_recv_u32(sock, &tree_size) != 0) {
     DebugLog("ERROR: can't read tree size\n");
@@ -250,29 +972,190 @@ SwooshRemoteDirData::SwooshRemoteDirData(net_msg_beacon *beacon, net_socket *soc
   is_good = true;
 }
 
-bool SwooshRemoteDirData::Download(std::string local_path, std::function<void(double)> progress)
+// Reads the fields of a file pack.
+class PackReader
 {
-  progress(0.0);
+protected:
+  const char *p;
+  const char *end;
+
+public:
+  PackReader(const std::vector<char> &data) : p(data.data()), end(data.data() + data.size()) {}
+
+  bool AtEnd() { return p >= end; }
+
+  bool GetU32(uint32_t *val) {
+    if (end - p < 4) return false;
+    *val = 0;
+    for (int i = 0; i < 4; i++) *val |= ((uint32_t) (unsigned char) p[i]) << (8*i);
+    p += 4;
+    return true;
+  }
+
+  bool GetU64(uint64_t *val) {
+    uint32_t lo, hi;
+    if (!GetU32(&lo) || !GetU32(&hi)) return false;
+    *val = ((uint64_t) hi << 32) | lo;
+    return true;
+  }
+
+  bool GetData(const char **data, uint64_t len) {
+    if ((uint64_t) (end - p) < len) return false;
+    *data = p;
+    p += len;
+    return true;
+  }
+
+  bool GetString(std::string *str, size_t max_size) {
+    uint32_t len;
+    const char *data;
+    if (!GetU32(&len) || len > max_size || !GetData(&data, len)) return false;
+    str->assign(data, len);
+    return true;
+  }
+};
+
+static int WriteFileData(const std::string &file_path, uint64_t offset, const char *data, size_t len)
+{
+  std::ofstream file;
+  if (offset == 0) {
+    file.open(file_path, std::ios::binary|std::ios::trunc);
+  } else {
+    file.open(file_path, std::ios::binary|std::ios::in|std::ios::out);
+    file.seekp(offset);
+  }
+  file.write(data, len);
+  file.close();
+  return (file.fail()) ? -1 : 0;
+}
+
+struct DirFileProgress {
+  SwooshCheckpoint &checkpoint;
+  const std::string &file_name;
+  uint64_t offset;
+  const std::atomic<bool> &cancelled;
+};
+
+static int ReportDirFileProgress(uint64_t bytes_done, void *user_data)
+{
+  DirFileProgress *file = (DirFileProgress *) user_data;
+  file->checkpoint.SetPosition(file->file_name, file->offset + bytes_done);
+  return (file->cancelled) ? -1 : 0;
+}
+
+int SwooshRemoteDirData::ReceiveDirFile(net_socket *sock, const std::string &local_path, SwooshCheckpoint &checkpoint,
+                                        const std::string &resume_name, uint64_t resume_offset)
+{
+  auto file_name_ptr = ReceiveString(sock, MAX_FILENAME_SIZE);
+  if (file_name_ptr == nullptr) {
+    DebugLog("ERROR: can't read file name\n");
+    return -1;
+  }
+  std::string file_name = *file_name_ptr;
+  delete file_name_ptr;
+
+  if (! isGoodLocalFileName(file_name)) {
+    DebugLog("ERROR: refusing to receive file with invalid name\n");
+    return -1;
+  }
+
+  // read where the file data starts (only a file we have partially can start after 0)
+  uint64_t offset, len;
+  if (net_recv_u64(sock, &offset) != 0 || net_recv_u64(sock, &len) != 0) {
+    DebugLog("ERROR: can't read file size\n");
+    return -1;
+  }
+  if (offset != 0 && !(file_name == resume_name && offset == resume_offset)) {
+    DebugLog("ERROR: unexpected offset for file '%s'\n", file_name.c_str());
+    return -1;
+  }
+
+  auto file_path = local_path + "/" + file_name;
+  if (offset == 0 && net_prepare_file(file_path.c_str(), len) != 0) {
+    DebugLog("ERROR: can't open download file '%s'\n", file_path.c_str());
+    return -1;
+  }
+  checkpoint.SetPosition(file_name, offset);
+  DirFileProgress file_progress{checkpoint, file_name, offset, cancelled};
+  if (ReceiveFileData(sock, file_path, offset, len, ReportDirFileProgress, &file_progress) != 0) {
+    DebugLog("ERROR: can't receive file '%s'\n", file_path.c_str());
+    return -1;
+  }
+  checkpoint.SetPosition(file_name, offset + len);
+  return 1;
+}
+
+int SwooshRemoteDirData::ReceiveDirPack(net_socket *sock, const std::string &local_path, SwooshCheckpoint &checkpoint,
+                                        const std::string &resume_name, uint64_t resume_offset)
+{
+  // read the whole pack
+  uint32_t pack_size;
+  if (net_recv_u32(sock, &pack_size) != 0 || pack_size > SWOOSH_DIR_PACK_MAX_SIZE) {
+    DebugLog("ERROR: can't read file pack size\n");
+    return -1;
+  }
+  std::vector<char> pack_data(pack_size);
+  if (ReceiveBodyData(sock, pack_data.data(), pack_size) != 0) {
+    DebugLog("ERROR: can't read file pack\n");
+    return -1;
+  }
+
+  // write each file in the pack
+  int num_files = 0;
+  PackReader pack(pack_data);
+  while (!pack.AtEnd()) {
+    std::string file_name;
+    uint64_t offset, len;
+    const char *data;
+    if (!pack.GetString(&file_name, MAX_FILENAME_SIZE) || !pack.GetU64(&offset) || !pack.GetU64(&len) || !pack.GetData(&data, len)) {
+      DebugLog("ERROR: invalid file pack\n");
+      return -1;
+    }
+
+    if (! isGoodLocalFileName(file_name)) {
+      DebugLog("ERROR: refusing to receive file with invalid name\n");
+      return -1;
+    }
+    if (offset != 0 && !(file_name == resume_name && offset == resume_offset)) {
+      DebugLog("ERROR: unexpected offset for file '%s'\n", file_name.c_str());
+      return -1;
+    }
+
+    auto file_path = local_path + "/" + file_name;
+    if (WriteFileData(file_path, offset, data, (size_t) len) != 0) {
+      DebugLog("ERROR: can't write to file '%s'\n", file_path.c_str());
+      return -1;
+    }
+    checkpoint.SetPosition(file_name, offset + len);
+    num_files++;
+  }
 
-  net_socket *sock = net_connect_to_beacon(beacon);
+  return num_files;
+}
+
+bool SwooshRemoteDirData::DownloadStream(const std::string &local_path, std::function<void(double)> progress)
+{
+  // files are sent sorted by name, so we resume from the last file received
+  SwooshCheckpoint checkpoint(local_path + "/" + DIR_CHECKPOINT_NAME, GetCheckpointId(dir_name, tree_size));
+  bool resume = checkpoint.Load() && !checkpoint.GetPositionName().empty();
+  std::string resume_name = (resume) ? checkpoint.GetPositionName() : "";
+  uint64_t resume_offset = (resume) ? checkpoint.GetPositionOffset() : 0;
+
+  net_socket *sock = OpenRequest(resume ? SWOOSH_DATA_REQUEST_BODY_RESUME : SWOOSH_DATA_REQUEST_BODY);
   if (sock == nullptr) {
-    DebugLog("ERROR: can't connect to sender\n");
     return false;
   }
 
   bool success = false;
 
-  // request dir
-  uint32_t message_id = net_get_beacon_message_id(beacon);
-  if (net_send_u32(sock, message_id) != 0) {
-    DebugLog("ERROR: can't send request message_id\n");
-    goto end;
-  }
-
-  // request body
-  if (net_send_u32(sock, SWOOSH_DATA_REQUEST_BODY) != 0) {
-    DebugLog("ERROR: can't send request type\n");
-    goto end;
+  // send resume position
+  if (resume) {
+    if (net_send_u32(sock, (uint32_t) resume_name.size()) != 0 ||
+        net_send_data(sock, resume_name.data(), resume_name.size()) != 0 ||
+        net_send_u64(sock, resume_offset) != 0) {
+      DebugLog("ERROR: can't send resume position\n");
+      goto end;
+    }
   }
 
   // read num dirs
@@ -309,31 +1192,289 @@ bool SwooshRemoteDirData::Download(std::string local_path, std::function<void(do
   }
 
   // download files
-  for (uint32_t i = 0; i < num_files; i++) {
-    progress(double(i + num_dirs) / (num_dirs + num_files));
-
-    auto file_name_ptr = ReceiveString(sock, MAX_FILENAME_SIZE);
-    if (file_name_ptr == nullptr) {
-      DebugLog("ERROR: can't read dir name\n");
+  for (uint32_t files_done = 0; ; ) {
+    progress(double(num_dirs + files_done) / (num_dirs + num_files));
+    if (cancelled) {
       goto end;
     }
-    std::string file_name = *file_name_ptr;
-    delete file_name_ptr;
 
-    if (! isGoodLocalFileName(file_name)) {
-      DebugLog("ERROR: refusing to receive file with invalid name\n");
+    uint32_t frame_type;
+    if (net_recv_u32(sock, &frame_type) != 0) {
+      DebugLog("ERROR: can't read directory frame type\n");
       goto end;
     }
+    if (frame_type == SWOOSH_DIR_FRAME_END) {
+      break;
+    }
 
-    auto file_path = local_path + "/" + file_name;
-    if (ReceiveFile(sock, file_path, [](double) {}) != 0) {
+    int frame_files = -1;
+    switch (frame_type) {
+    case SWOOSH_DIR_FRAME_FILE: frame_files = ReceiveDirFile(sock, local_path, checkpoint, resume_name, resume_offset); break;
+    case SWOOSH_DIR_FRAME_PACK: frame_files = ReceiveDirPack(sock, local_path, checkpoint, resume_name, resume_offset); break;
+    default:
+      DebugLog("ERROR: unknown directory frame type: %u\n", frame_type);
+      break;
+    }
+    if (frame_files < 0) {
       goto end;
     }
+    files_done += frame_files;
   }
 
   success = true;
   progress(1.0);
+end:
+  net_close_socket(sock);
+  if (success) {
+    checkpoint.Remove();
+  } else if (!checkpoint.GetPositionName().empty()) {
+    checkpoint.Save();
+  }
+  return success;
+}
+
+bool SwooshRemoteDirData::ReceiveManifest(std::vector<std::string> *dirs, std::vector<ManifestFile> *files)
+{
+  net_socket *sock = OpenRequest(SWOOSH_DATA_REQUEST_MANIFEST);
+  if (sock == nullptr) {
+    return false;
+  }
+
+  bool success = false;
+  uint32_t manifest_size = 0;
+  std::vector<char> manifest_data;
+
+  // read the whole manifest
+  if (net_recv_u32(sock, &manifest_size) != 0 || manifest_size > MAX_MANIFEST_SIZE) {
+    DebugLog("ERROR: can't read manifest size\n");
+    goto end;
+  }
+  manifest_data.resize(manifest_size);
+  if (net_recv_data(sock, manifest_data.data(), manifest_size) != 0) {
+    DebugLog("ERROR: can't read manifest\n");
+    goto end;
+  }
+
+  {
+    PackReader manifest(manifest_data);
+    uint32_t num_dirs, num_files;
+    if (!manifest.GetU32(&num_dirs) || !manifest.GetU32(&num_files)) {
+      DebugLog("ERROR: invalid manifest\n");
+      goto end;
+    }
+    for (uint32_t i = 0; i < num_dirs; i++) {
+      std::string name;
+      if (!manifest.GetString(&name, MAX_FILENAME_SIZE) || !isGoodLocalFileName(name)) {
+        DebugLog("ERROR: invalid directory in manifest\n");
+        goto end;
+      }
+      dirs->push_back(std::move(name));
+    }
+    for (uint32_t i = 0; i < num_files; i++) {
+      ManifestFile file;
+      if (!manifest.GetString(&file.name, MAX_FILENAME_SIZE) || !manifest.GetU64(&file.size) || !isGoodLocalFileName(file.name)) {
+        DebugLog("ERROR: invalid file in manifest\n");
+        goto end;
+      }
+      files->push_back(std::move(file));
+    }
+  }
+
+  success = true;
 end:
   net_close_socket(sock);
   return success;
 }
+
+std::string SwooshRemoteDirData::GetManifestHash(const std::vector<std::string> &dirs, const std::vector<ManifestFile> &files)
+{
+  // FNV-1a over all names and sizes
+  uint64_t hash = 0xcbf29ce484222325ull;
+  auto add = [&hash](const std::string &str) {
+    for (size_t i = 0; i <= str.size(); i++) {
+      hash = (hash ^ (unsigned char) str.c_str()[i]) * 0x100000001b3ull;
+    }
+  };
+  for (const auto &dir : dirs) {
+    add(dir);
+  }
+  for (const auto &file : files) {
+    add(file.name);
+    add(std::to_string(file.size));
+  }
+  return std::to_string(hash);
+}
+
+bool SwooshRemoteDirData::DownloadParallel(const std::string &local_path, const std::vector<std::string> &dirs,
+                                           const std::vector<ManifestFile> &files, std::function<void(double)> progress)
+{
+  // create directories
+  for (const auto &dir : dirs) {
+    wxMkDir(local_path + "/" + dir, wxS_DIR_DEFAULT);
+  }
+
+  // In the checkpoint, each file takes size+1 bytes: its data plus one
+  // byte marking the file as complete (so empty files are also tracked).
+  std::vector<uint64_t> file_starts;
+  uint64_t checkpoint_size = 0;
+  uint64_t total_size = 0;
+  for (const auto &file : files) {
+    file_starts.push_back(checkpoint_size);
+    checkpoint_size += file.size + 1;
+    total_size += file.size;
+  }
+  SwooshCheckpoint checkpoint(local_path + "/" + DIR_CHECKPOINT_NAME, GetCheckpointId(dir_name, tree_size) + " " + GetManifestHash(dirs, files));
+  if (!checkpoint.Load()) {
+    checkpoint.Reset();
+  }
+
+  // work out the missing parts of each file
+  struct FileWork {
+    size_t file;
+    bool create;
+    std::vector<SwooshCheckpoint::Range> parts;
+  };
+  std::vector<FileWork> work;
+  uint64_t missing_size = 0;
+  auto missing = checkpoint.GetMissingRanges(checkpoint_size);
+  auto range = missing.begin();
+  for (size_t i = 0; i < files.size() && range != missing.end(); i++) {
+    uint64_t start = file_starts[i];
+    uint64_t end = start + files[i].size + 1;
+    while (range != missing.end() && range->end <= start) ++range;
+    if (range == missing.end() || range->start >= end) continue;
+
+    FileWork file_work{i, range->start <= start && range->end >= end, {}};
+    for (auto r = range; r != missing.end() && r->start < end - 1; ++r) {
+      uint64_t part_start = std::max(r->start, start) - start;
+      uint64_t part_end = std::min(r->end, end - 1) - start;
+      if (part_start < part_end) {
+        file_work.parts.push_back(SwooshCheckpoint::Range{part_start, part_end});
+        missing_size += part_end - part_start;
+      }
+    }
+    work.push_back(std::move(file_work));
+  }
+
+  // download files over a pool of connections, each one pipelining file requests
+  std::atomic<uint64_t> total_done(total_size - missing_size);
+  std::atomic<size_t> next_work(0);
+  std::atomic<bool> success(true);
+  std::vector<std::thread> threads;
+  size_t num_threads = std::min(work.size(), (size_t) download_connections);
+  for (size_t t = 0; t < num_threads; t++) {
+    threads.emplace_back([&] {
+      net_socket *sock = OpenRequest(SWOOSH_DATA_REQUEST_FILES);
+      if (sock == nullptr) {
+        success = false;
+        return;
+      }
+
+      struct InFlight {
+        size_t work;
+        size_t part;
+      };
+      std::vector<InFlight> in_flight;
+      size_t in_flight_start = 0;
+      bool no_more_work = false;
+      while (success) {
+        // send requests for more files
+        while (!no_more_work && in_flight.size() - in_flight_start < DIR_PIPELINE_DEPTH) {
+          size_t index = next_work++;
+          if (index >= work.size()) {
+            no_more_work = true;
+            break;
+          }
+          const auto &file_work = work[index];
+          const auto &file = files[file_work.file];
+          auto file_path = local_path + "/" + file.name;
+          if (file_work.create && net_prepare_file(file_path.c_str(), file.size) != 0) {
+            DebugLog("ERROR: can't open download file '%s'\n", file_path.c_str());
+            success = false;
+            break;
+          }
+          if (file_work.parts.empty()) {
+            uint64_t file_end = file_starts[file_work.file] + file.size;
+            checkpoint.AddRange(file_end, file_end + 1);
+            continue;
+          }
+          for (size_t part = 0; part < file_work.parts.size(); part++) {
+            const auto &range = file_work.parts[part];
+            if (net_send_u32(sock, (uint32_t) file.name.size()) != 0 ||
+                net_send_data(sock, file.name.data(), file.name.size()) != 0 ||
+                net_send_u64(sock, range.start) != 0 ||
+                net_send_u64(sock, range.end - range.start) != 0) {
+              DebugLog("ERROR: can't send file request\n");
+              success = false;
+              break;
+            }
+            in_flight.push_back(InFlight{index, part});
+          }
+        }
+        if (!success || in_flight_start == in_flight.size()) {
+          break;
+        }
+
+        // receive the oldest request
+        InFlight request = in_flight[in_flight_start++];
+        const auto &file_work = work[request.work];
+        const auto &file = files[file_work.file];
+        const auto &range = file_work.parts[request.part];
+        auto file_path = local_path + "/" + file.name;
+        uint64_t len = 0;
+        if (net_recv_u64(sock, &len) != 0 || len != range.end - range.start) {
+          DebugLog("ERROR: can't read file range size\n");
+          success = false;
+          break;
+        }
+        SegmentProgress segment{total_done, file_starts[file_work.file] + range.start, 0, total_size, checkpoint, progress, cancelled};
+        if (ReceiveFileData(sock, file_path, range.start, len, ReportSegmentProgress, &segment) != 0) {
+          DebugLog("ERROR: can't receive file '%s'\n", file_path.c_str());
+          success = false;
+          break;
+        }
+        if (request.part == file_work.parts.size() - 1) {
+          uint64_t file_end = file_starts[file_work.file] + file.size;
+          checkpoint.AddRange(file_end, file_end + 1);
+        }
+      }
+
+      if (success) {
+        net_send_u32(sock, 0);
+      }
+      net_close_socket(sock);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  if (!success) {
+    checkpoint.Save();
+    return false;
+  }
+  checkpoint.Remove();
+  progress(1.0);
+  return true;
+}
+
+bool SwooshRemoteDirData::Download(std::string local_path, std::function<void(double)> progress)
+{
+  progress(0.0);
+
+  // directories with large files are downloaded in parallel, one file per request
+  std::vector<std::string> dirs;
+  std::vector<ManifestFile> files;
+  if (download_connections > 1 && ReceiveManifest(&dirs, &files)) {
+    uint64_t total_size = 0;
+    for (const auto &file : files) {
+      total_size += file.size;
+    }
+    if (files.size() > 1 && total_size / files.size() >= DIR_PARALLEL_MIN_FILE_SIZE) {
+      return DownloadParallel(local_path, dirs, files, progress);
+    }
+  }
+
+  // small files are better served in a single packed stream
+  return DownloadStream(local_path, progress);
+}
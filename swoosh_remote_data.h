@@ -4,7 +4,19 @@
 #include "swoosh_data.h"
 
 #include <string>
+#include <vector>
+#include <map>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include "swoosh_async.h"
+#include "swoosh_peer_pool.h"
+#include "swoosh_swarm.h"
+#include "swoosh_rate_limit.h"
+
+class SwooshCheckpoint;
 
 // ==========================================================================
 // SwooshRemoteData
@@ -14,13 +26,30 @@ class SwooshRemoteData
   friend class SwooshNode;
 
 protected:
+  static bool compression;
+  static bool persistent_connections;
+  static SwooshPeerPool peer_pool;
+
   net_msg_beacon *beacon;
   bool is_good;
+  std::mutex throttle_lock;
+  std::map<std::string, std::shared_ptr<SwooshThrottle>> throttles;   // peer host -> throttle for our requests
 
   static SwooshRemoteData *ReceiveData(net_msg_beacon *beacon);
+  static SwooshTask<SwooshRemoteData *> ReceiveDataAsync(SwooshEventLoop &loop, net_msg_beacon *beacon);
+  static SwooshRemoteData *ReceiveInlineData(net_msg_beacon *beacon);
+  static SwooshRemoteData *ReceiveHead(net_msg_beacon *beacon, net_socket *sock);
+  static net_socket *ConnectToSender(net_msg_beacon *beacon);
   static std::string *ReceiveString(net_socket *sock, size_t max_size);
-  static int ReceiveFile(net_socket *sock, const std::string &local_path, std::function<void(double)> progress);
-
+  static int ReceiveFileData(net_socket *sock, const std::string &local_path, uint64_t offset, uint64_t len,
+                             net_progress_callback progress, void *user_data);
+  static int ReceiveBodyData(net_socket *sock, void *data, size_t len);
+
+  // open a request to the sender, or to another peer with the same data
+  net_socket *OpenRequest(uint32_t request_type, net_msg_beacon *source = nullptr);
+  SwooshThrottle *GetThrottle(net_msg_beacon *source);
+  std::string GetCheckpointId(const std::string &name, uint64_t size);
+  virtual bool WantsCompression() { return compression; }
   virtual bool Download(std::string local_path, std::function<void(double)> progress) = 0;
 
 public:
@@ -32,6 +61,12 @@ public:
   net_msg_beacon *GetBeacon() { return beacon; }
 
   bool IsGood() { return is_good; };
+
+  // ask senders to compress the data, except files of types that are already compressed
+  static bool GetCompression() { return compression; }
+  static void SetCompression(bool enable) { compression = enable; }
+  // send heads and other small requests as streams on connections kept open to each peer
+  static void SetPersistentConnections(bool enable) { persistent_connections = enable; }
 };
 
 // ==========================================================================
@@ -40,12 +75,21 @@ public:
 
 class SwooshRemotePermanentData : public SwooshRemoteData
 {
+protected:
+  std::atomic<bool> cancelled;
+
 public:
-  SwooshRemotePermanentData(net_msg_beacon *beacon) : SwooshRemoteData(beacon) {}
+  SwooshRemotePermanentData(net_msg_beacon *beacon) : SwooshRemoteData(beacon), cancelled(false) {}
   virtual ~SwooshRemotePermanentData() = default;
 
   virtual std::string &GetName() = 0;
   virtual uint32_t GetType() = 0;
+
+  // make a running download fail as soon as possible; what it got so far
+  // stays in its checkpoint, so downloading again resumes from there
+  void Cancel() { cancelled = true; }
+  void ClearCancel() { cancelled = false; }
+  bool IsCancelled() { return cancelled; }
 };
 
 // ==========================================================================
@@ -71,10 +115,25 @@ public:
 class SwooshRemoteFileData : public SwooshRemotePermanentData
 {
 protected:
+  static bool multicast;
+
   std::string file_name;
-  uint32_t file_size;
+  uint64_t file_size;
+  std::shared_ptr<SwooshSwarmChunks> swarm_chunks;   // set to download in swarm mode
+  uint32_t swarm_message_id;
+  int swarm_port;
 
+  virtual bool WantsCompression();
   virtual bool Download(std::string local_path, std::function<void(double)> progress);
+  bool DownloadMulticast(const std::string &local_path, std::function<void(double)> progress);
+  bool DownloadSwarm(const std::string &local_path, std::function<void(double)> progress);
+  bool AnnounceSwarm(uint32_t ttl_ms, std::vector<SwooshSwarmPeer> *peers, std::vector<unsigned char> *hashes);
+  bool DownloadSegments(const std::string &local_path, std::function<void(double)> progress);
+  bool DownloadResume(const std::string &local_path, std::function<void(double)> progress);
+  bool OpenCheckpoint(const std::string &local_path, SwooshCheckpoint &checkpoint);
+  bool DownloadRange(const std::string &local_path, uint64_t offset, uint64_t len, net_progress_callback progress, void *user_data,
+                     net_msg_beacon *source = nullptr);
+  bool DownloadDelta(const std::string &local_path, uint64_t local_size, std::function<void(double)> progress);
 
 public:
   SwooshRemoteFileData(net_msg_beacon *beacon, net_socket *sock);
@@ -84,7 +143,20 @@ public:
   virtual uint32_t GetType() { return SWOOSH_DATA_FILE; }
 
   std::string &GetFileName() { return file_name; }
-  uint32_t GetFileSize() { return file_size; }
+  uint64_t GetFileSize() { return file_size; }
+
+  // get chunks from other receivers too, and tell them we serve the chunks
+  // we have as message 'message_id' on 'port'
+  void SetSwarm(std::shared_ptr<SwooshSwarmChunks> chunks, uint32_t message_id, int port) {
+    swarm_chunks = chunks;
+    swarm_message_id = message_id;
+    swarm_port = port;
+  }
+
+  // join the sender's multicast session for large files, so many receivers
+  // of the same file cost the sender a single transfer
+  static bool GetMulticast() { return multicast; }
+  static void SetMulticast(bool enable) { multicast = enable; }
 };
 
 // ==========================================================================
@@ -93,10 +165,26 @@ public:
 class SwooshRemoteDirData : public SwooshRemotePermanentData
 {
 protected:
+  struct ManifestFile {
+    std::string name;
+    uint64_t size;
+  };
+
+  static int download_connections;
+
   std::string dir_name;
   uint32_t tree_size;
 
   virtual bool Download(std::string local_path, std::function<void(double)> progress);
+  bool DownloadStream(const std::string &local_path, std::function<void(double)> progress);
+  bool DownloadParallel(const std::string &local_path, const std::vector<std::string> &dirs,
+                        const std::vector<ManifestFile> &files, std::function<void(double)> progress);
+  bool ReceiveManifest(std::vector<std::string> *dirs, std::vector<ManifestFile> *files);
+  static std::string GetManifestHash(const std::vector<std::string> &dirs, const std::vector<ManifestFile> &files);
+  int ReceiveDirFile(net_socket *sock, const std::string &local_path, SwooshCheckpoint &checkpoint,
+                     const std::string &resume_name, uint64_t resume_offset);
+  int ReceiveDirPack(net_socket *sock, const std::string &local_path, SwooshCheckpoint &checkpoint,
+                     const std::string &resume_name, uint64_t resume_offset);
 
   bool isGoodLocalFileName(const std::string &file_name) {
     if (file_name.find("../") != std::string::npos || file_name.find('\\') != std::string::npos) {
@@ -114,6 +202,9 @@ public:
 
   std::string &GetDirName() { return dir_name; }
   uint32_t GetTreeSize() { return tree_size; }
+
+  static int GetDownloadConnections() { return download_connections; }
+  static void SetDownloadConnections(int num) { download_connections = (num > 0) ? num : 1; }
 };
 
 #endif /* SWOOSH_REMOTE_DATA_H_FILE */
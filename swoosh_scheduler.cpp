@@ -0,0 +1,128 @@
+#include "targetver.h"
+#include "swoosh_scheduler.h"
+
+// ==========================================================================
+// SwooshSendScheduler
+// ==========================================================================
+
+bool SwooshSendScheduler::IsIdle()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return flows.empty() && num_queued == 0;
+}
+
+void SwooshSendScheduler::AttachQueued(net_socket *sock)
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    num_queued++;
+  }
+  net_set_socket_close_callback(sock, OnQueuedClosed, this);
+}
+
+void SwooshSendScheduler::OnQueuedClosed(void *user_data)
+{
+  SwooshSendScheduler *scheduler = static_cast<SwooshSendScheduler *>(user_data);
+  std::lock_guard<std::mutex> guard(scheduler->lock);
+  scheduler->num_queued--;
+}
+
+void SwooshSendScheduler::Dispatch()
+{
+  // called with the lock held
+  auto now = std::chrono::steady_clock::now();
+  if (turns.size() >= SWOOSH_SCHEDULER_SLOTS && !active.empty()) {
+    for (auto it = turns.begin(); it != turns.end(); ) {
+      if (it->second <= now) {
+        it = turns.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  bool granted = false;
+  while (turns.size() < SWOOSH_SCHEDULER_SLOTS && !active.empty()) {
+    Flow *flow = active.front();
+    Waiter *waiter = flow->waiters.front();
+    if (flow->deficit < waiter->len) {
+      // out of bytes for this round: refill and go to the end of the line
+      flow->deficit += SWOOSH_SCHEDULER_QUANTUM;
+      active.pop_front();
+      active.push_back(flow);
+      continue;
+    }
+
+    flow->deficit -= waiter->len;
+    flow->waiters.pop_front();
+    waiter->granted = true;
+    granted = true;
+    turns[waiter->transfer] = now + std::chrono::milliseconds(SWOOSH_SCHEDULER_TURN_MS);
+    if (flow->waiters.empty()) {
+      // idle flows don't keep their deficit
+      flow->deficit = 0;
+      active.pop_front();
+    }
+  }
+  if (granted) {
+    cond.notify_all();
+  }
+}
+
+// ==========================================================================
+// SwooshSendScheduler::Transfer
+// ==========================================================================
+
+SwooshSendScheduler::Transfer::Transfer(SwooshSendScheduler &scheduler, const std::string &receiver,
+                                        std::shared_ptr<SwooshThrottle> throttle)
+  : scheduler(scheduler), receiver(receiver), throttle(throttle)
+{
+  std::lock_guard<std::mutex> guard(scheduler.lock);
+  flow = &scheduler.flows[receiver];
+  flow->num_transfers++;
+}
+
+SwooshSendScheduler::Transfer::~Transfer()
+{
+  std::lock_guard<std::mutex> guard(scheduler.lock);
+  scheduler.turns.erase(this);
+  if (--flow->num_transfers == 0) {
+    scheduler.flows.erase(receiver);
+  }
+  scheduler.Dispatch();
+}
+
+void SwooshSendScheduler::Transfer::OnThrottle(int direction, size_t len, void *user_data)
+{
+  Transfer *transfer = static_cast<Transfer *>(user_data);
+  if (direction != NET_THROTTLE_SEND) {
+    return;
+  }
+
+  // wait for the rate limits before taking a turn, so throttled transfers don't hold turns
+  if (transfer->throttle) {
+    transfer->throttle->Wait(direction, len);
+  }
+  transfer->Wait(len);
+}
+
+void SwooshSendScheduler::Transfer::Wait(size_t len)
+{
+  std::unique_lock<std::mutex> guard(scheduler.lock);
+
+  // the previous chunk is sent, so our turn is over (if it didn't time out)
+  scheduler.turns.erase(this);
+
+  Waiter waiter{this, len, false};
+  if (flow->waiters.empty()) {
+    scheduler.active.push_back(flow);
+  }
+  flow->waiters.push_back(&waiter);
+  scheduler.Dispatch();
+  while (!waiter.granted) {
+    // look again for turns that timed out when the slots are all taken
+    if (scheduler.cond.wait_for(guard, std::chrono::milliseconds(SWOOSH_SCHEDULER_TURN_MS)) == std::cv_status::timeout) {
+      scheduler.Dispatch();
+    }
+  }
+}
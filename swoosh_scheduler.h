@@ -0,0 +1,91 @@
+#ifndef SWOOSH_SCHEDULER_H_FILE
+#define SWOOSH_SCHEDULER_H_FILE
+
+#include <cstdint>
+#include <string>
+#include <map>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+#include "network.h"
+#include "swoosh_rate_limit.h"
+
+#define SWOOSH_SCHEDULER_QUANTUM   (64*1024)   // bytes each receiver may send per round
+#define SWOOSH_SCHEDULER_SLOTS     8           // chunks being sent at the same time
+#define SWOOSH_SCHEDULER_TURN_MS   100         // a turn stops holding its slot after this time
+
+// ==========================================================================
+// SwooshSendScheduler
+// ==========================================================================
+
+// Shares the upload between receivers with deficit round robin.  Bulk
+// transfers ask for a turn before sending each chunk; turns go around the
+// receivers waiting, each getting up to a quantum of bytes per round, so a
+// receiver with many connections gets the same share as one with a single
+// connection.  A turn lasts until the transfer asks for the next one (or
+// ends), and only a few turns run at the same time; a chunk stuck on a slow
+// receiver gives up its slot when its turn times out.  Replies queued on the
+// event-driven server don't take turns, but are counted so the next bulk
+// transfers are scheduled.
+class SwooshSendScheduler
+{
+public:
+  class Transfer;
+
+protected:
+  struct Waiter {
+    Transfer *transfer;
+    size_t len;
+    bool granted;
+  };
+
+  struct Flow {
+    size_t num_transfers = 0;
+    uint64_t deficit = 0;
+    std::deque<Waiter *> waiters;
+  };
+
+  std::mutex lock;
+  std::condition_variable cond;
+  std::map<std::string, Flow> flows;    // receiver host -> flow
+  std::deque<Flow *> active;            // flows with waiters, in round robin order
+  std::map<Transfer *, std::chrono::steady_clock::time_point> turns;   // transfers sending -> turn timeout
+  size_t num_queued;
+
+  void Dispatch();
+  static void OnQueuedClosed(void *user_data);
+
+public:
+  // one bulk transfer to a receiver, given to its socket with Attach();
+  // it must live while the socket is used
+  class Transfer
+  {
+  protected:
+    SwooshSendScheduler &scheduler;
+    std::string receiver;
+    Flow *flow;
+    std::shared_ptr<SwooshThrottle> throttle;
+
+    static void OnThrottle(int direction, size_t len, void *user_data);
+    void Wait(size_t len);
+
+  public:
+    Transfer(SwooshSendScheduler &scheduler, const std::string &receiver, std::shared_ptr<SwooshThrottle> throttle);
+    ~Transfer();
+
+    void Attach(net_socket *sock) { net_set_socket_throttle(sock, OnThrottle, this); }
+  };
+
+  SwooshSendScheduler() : num_queued(0) {}
+
+  // count a bulk reply queued on the socket until the event-driven server closes it
+  void AttachQueued(net_socket *sock);
+
+  // true if no bulk transfer is running
+  bool IsIdle();
+};
+
+#endif /* SWOOSH_SCHEDULER_H_FILE */
@@ -0,0 +1,309 @@
+#include "targetver.h"
+#include "swoosh_share_catalog.h"
+
+#include <cstring>
+#include <fstream>
+#include <wx/wx.h>
+#include <wx/filefn.h>
+
+#if defined(__linux__) || defined(__APPLE__)
+#define HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "swoosh_data.h"
+#include "util.h"
+
+#define CATALOG_MAGIC  "SwCt"
+
+// ==========================================================================
+// CatalogWriter
+// ==========================================================================
+
+class CatalogWriter
+{
+protected:
+  std::vector<char> data;
+
+public:
+  const std::vector<char> &GetData() { return data; }
+
+  void AddBytes(const char *bytes, size_t len) {
+    data.insert(data.end(), bytes, bytes + len);
+  }
+
+  void AddU32(uint32_t val) {
+    for (int i = 0; i < 4; i++) data.push_back((char) ((val >> (8*i)) & 0xff));
+  }
+
+  void AddU64(uint64_t val) {
+    AddU32((uint32_t) (val & 0xffffffff));
+    AddU32((uint32_t) (val >> 32));
+  }
+
+  void AddString(const std::string &str) {
+    AddU32((uint32_t) str.size());
+    AddBytes(str.data(), str.size());
+  }
+};
+
+// ==========================================================================
+// CatalogReader
+// ==========================================================================
+
+// Reads from the mapped file, failing (and staying failed) on anything
+// that would go past its end
+class CatalogReader
+{
+protected:
+  const unsigned char *data;
+  size_t size;
+  size_t pos;
+  bool ok;
+
+  bool Need(size_t len) {
+    if (!ok || size - pos < len) {
+      ok = false;
+    }
+    return ok;
+  }
+
+public:
+  CatalogReader(const void *data, size_t size)
+    : data((const unsigned char *) data), size(size), pos(0), ok(true) {}
+
+  bool IsOk() { return ok; }
+  bool AtEnd() { return pos == size; }
+
+  bool ReadBytes(const char *expected, size_t len) {
+    if (!Need(len)) return false;
+    if (memcmp(data + pos, expected, len) != 0) {
+      ok = false;
+      return false;
+    }
+    pos += len;
+    return true;
+  }
+
+  uint32_t ReadU32() {
+    if (!Need(4)) return 0;
+    uint32_t val = 0;
+    for (int i = 0; i < 4; i++) val |= (uint32_t) data[pos+i] << (8*i);
+    pos += 4;
+    return val;
+  }
+
+  uint64_t ReadU64() {
+    uint64_t low = ReadU32();
+    uint64_t high = ReadU32();
+    return (high << 32) | low;
+  }
+
+  std::string ReadString() {
+    uint32_t len = ReadU32();
+    if (!Need(len)) return std::string();
+    std::string str((const char *) data + pos, len);
+    pos += len;
+    return str;
+  }
+
+  // a count of items taking at least item_size bytes each, so a corrupted
+  // count can't make us reserve more than the file could hold
+  uint32_t ReadCount(size_t item_size) {
+    uint32_t count = ReadU32();
+    if (ok && count > (size - pos) / item_size) {
+      ok = false;
+    }
+    return (ok) ? count : 0;
+  }
+};
+
+// ==========================================================================
+// SwooshShareCatalog
+// ==========================================================================
+
+bool SwooshShareCatalog::ReadFileInfo(const std::string &path, uint64_t *size, int64_t *mtime)
+{
+  wxStructStat stat;
+  if (wxStat(path, &stat) != 0 || (stat.st_mode & S_IFMT) != S_IFREG) {
+    return false;
+  }
+  *size = (uint64_t) stat.st_size;
+  *mtime = (int64_t) stat.st_mtime;
+  return true;
+}
+
+static bool ParseCatalog(const void *data, size_t size, std::vector<SwooshShareCatalog::Share> *shares, uint32_t *next_message_id)
+{
+  CatalogReader reader(data, size);
+  if (!reader.ReadBytes(CATALOG_MAGIC, 4) || reader.ReadU32() != SWOOSH_SHARE_CATALOG_VERSION) {
+    return false;
+  }
+  *next_message_id = reader.ReadU32();
+
+  // shares go until the end; a share cut short (by a crash while it was
+  // appended) and anything after it is dropped
+  while (!reader.AtEnd()) {
+    SwooshShareCatalog::Share share;
+    share.type = reader.ReadU32();
+    share.message_id = reader.ReadU32();
+    share.path = reader.ReadString();
+    share.size = reader.ReadU64();
+    share.mtime = (int64_t) reader.ReadU64();
+
+    if (share.type == SWOOSH_DATA_DIR) {
+      auto manifest = std::make_shared<SwooshDirManifest::Snapshot>();
+      uint32_t num_dirs = reader.ReadCount(4);
+      manifest->dirs.reserve(num_dirs);
+      for (uint32_t j = 0; j < num_dirs && reader.IsOk(); j++) {
+        manifest->dirs.push_back(reader.ReadString());
+      }
+      uint32_t num_files = reader.ReadCount(20);
+      manifest->files.reserve(num_files);
+      for (uint32_t j = 0; j < num_files && reader.IsOk(); j++) {
+        SwooshDirManifest::File file;
+        file.name = reader.ReadString();
+        file.size = reader.ReadU64();
+        file.mtime = (int64_t) reader.ReadU64();
+        manifest->files.push_back(file);
+      }
+      share.manifest = manifest;
+    } else if (share.type != SWOOSH_DATA_FILE) {
+      DebugLog("WARNING: invalid share type %u in share catalog\n", share.type);
+      break;
+    }
+    if (!reader.IsOk()) {
+      DebugLog("WARNING: share catalog ends with an incomplete share\n");
+      break;
+    }
+    shares->push_back(share);
+  }
+  return true;
+}
+
+static void WriteHeader(CatalogWriter &writer, uint32_t next_message_id)
+{
+  writer.AddBytes(CATALOG_MAGIC, 4);
+  writer.AddU32(SWOOSH_SHARE_CATALOG_VERSION);
+  writer.AddU32(next_message_id);
+}
+
+static void WriteShare(CatalogWriter &writer, const SwooshShareCatalog::Share &share)
+{
+  static const SwooshDirManifest::Snapshot empty;
+  const SwooshDirManifest::Snapshot &manifest = (share.manifest) ? *share.manifest : empty;
+
+  writer.AddU32(share.type);
+  writer.AddU32(share.message_id);
+  writer.AddString(share.path);
+  writer.AddU64(share.size);
+  writer.AddU64((uint64_t) share.mtime);
+  if (share.type == SWOOSH_DATA_DIR) {
+    writer.AddU32((uint32_t) manifest.dirs.size());
+    for (const auto &dir : manifest.dirs) {
+      writer.AddString(dir);
+    }
+    writer.AddU32((uint32_t) manifest.files.size());
+    for (const auto &file : manifest.files) {
+      writer.AddString(file.name);
+      writer.AddU64(file.size);
+      writer.AddU64((uint64_t) file.mtime);
+    }
+  }
+}
+
+bool SwooshShareCatalog::Load(std::vector<Share> *shares, uint32_t *next_message_id)
+{
+  shares->clear();
+  *next_message_id = 0;
+  if (!wxFileExists(file_name)) {
+    return true;
+  }
+
+  bool ok = false;
+#ifdef HAVE_MMAP
+  int fd = open(file_name.c_str(), O_RDONLY|O_CLOEXEC);
+  if (fd < 0) {
+    DebugLog("ERROR: can't open share catalog '%s'\n", file_name.c_str());
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      ok = ParseCatalog(data, (size_t) st.st_size, shares, next_message_id);
+      munmap(data, (size_t) st.st_size);
+    }
+  }
+  close(fd);
+#else
+  std::ifstream file(file_name, std::ios::binary);
+  std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  ok = !file.bad() && ParseCatalog(data.data(), data.size(), shares, next_message_id);
+#endif
+
+  if (!ok) {
+    DebugLog("WARNING: ignoring invalid share catalog '%s'\n", file_name.c_str());
+    shares->clear();
+    *next_message_id = 0;
+  }
+  return ok;
+}
+
+bool SwooshShareCatalog::Save(const std::vector<Share> &shares, uint32_t next_message_id)
+{
+  CatalogWriter writer;
+  WriteHeader(writer, next_message_id);
+  for (const auto &share : shares) {
+    WriteShare(writer, share);
+  }
+
+  std::string tmp_file_name = file_name + ".tmp";
+  {
+    std::ofstream file(tmp_file_name, std::ios::binary|std::ios::trunc);
+    if (!file.good()) {
+      DebugLog("ERROR: can't write share catalog '%s'\n", tmp_file_name.c_str());
+      return false;
+    }
+    file.write(writer.GetData().data(), writer.GetData().size());
+    file.close();
+    if (file.fail()) {
+      DebugLog("ERROR: can't write share catalog '%s'\n", tmp_file_name.c_str());
+      return false;
+    }
+  }
+
+  // replace the old catalog in one step so it's never left half-written
+  if (!wxRenameFile(tmp_file_name, file_name, true)) {
+    DebugLog("ERROR: can't rename share catalog '%s'\n", tmp_file_name.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool SwooshShareCatalog::Append(const std::vector<Share> &shares)
+{
+  CatalogWriter writer;
+  if (!wxFileExists(file_name)) {
+    WriteHeader(writer, 0);
+  }
+  for (const auto &share : shares) {
+    WriteShare(writer, share);
+  }
+
+  std::ofstream file(file_name, std::ios::binary|std::ios::app);
+  if (!file.good()) {
+    DebugLog("ERROR: can't open share catalog '%s'\n", file_name.c_str());
+    return false;
+  }
+  file.write(writer.GetData().data(), writer.GetData().size());
+  file.close();
+  if (file.fail()) {
+    DebugLog("ERROR: can't write share catalog '%s'\n", file_name.c_str());
+    return false;
+  }
+  return true;
+}
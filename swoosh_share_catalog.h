@@ -0,0 +1,50 @@
+#ifndef SWOOSH_SHARE_CATALOG_H_FILE
+#define SWOOSH_SHARE_CATALOG_H_FILE
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "swoosh_dir_manifest.h"
+
+#define SWOOSH_SHARE_CATALOG_VERSION  2
+
+// ==========================================================================
+// SwooshShareCatalog
+// ==========================================================================
+
+// Files and directories we share, kept on disk so they're served again
+// with the same message ids right after a restart.  The catalog is read
+// through a memory map, and directory manifests are cached in it so big
+// directories can be served before they're swept again.
+//
+// New shares are appended to the end of the catalog; the whole catalog is
+// only written again to update the manifests and drop old entries.
+class SwooshShareCatalog
+{
+public:
+  struct Share {
+    uint32_t type;                  // SWOOSH_DATA_FILE or SWOOSH_DATA_DIR
+    uint32_t message_id;
+    std::string path;
+    uint64_t size;                  // files only
+    int64_t mtime;                  // files only; directories are checked against the manifest
+    std::shared_ptr<const SwooshDirManifest::Snapshot> manifest;   // directories only
+  };
+
+protected:
+  std::string file_name;
+
+public:
+  SwooshShareCatalog(const std::string &file_name) : file_name(file_name) {}
+
+  // an empty list is returned if there's no catalog yet
+  bool Load(std::vector<Share> *shares, uint32_t *next_message_id);
+  bool Save(const std::vector<Share> &shares, uint32_t next_message_id);
+  bool Append(const std::vector<Share> &shares);
+
+  static bool ReadFileInfo(const std::string &path, uint64_t *size, int64_t *mtime);
+};
+
+#endif /* SWOOSH_SHARE_CATALOG_H_FILE */
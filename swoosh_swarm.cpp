@@ -0,0 +1,231 @@
+#include "targetver.h"
+#include "swoosh_swarm.h"
+
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+
+#include "swoosh_delta.h"
+#include "util.h"
+
+#define SWARM_MAX_HOST_SIZE  64
+
+// ==========================================================================
+// SwooshSwarmChunks
+// ==========================================================================
+
+SwooshSwarmChunks::SwooshSwarmChunks(uint64_t file_size)
+  : file_size(file_size), num_chunks(GetNumChunks(file_size)), bitmap(GetBitmapSize(file_size))
+{
+}
+
+uint32_t SwooshSwarmChunks::GetNumChunks(uint64_t file_size)
+{
+  return (uint32_t) ((file_size + SWOOSH_SWARM_CHUNK_SIZE - 1) / SWOOSH_SWARM_CHUNK_SIZE);
+}
+
+bool SwooshSwarmChunks::HasChunk(const std::vector<unsigned char> &bitmap, uint32_t chunk)
+{
+  return chunk / 8 < bitmap.size() && (bitmap[chunk / 8] & (1 << (chunk % 8))) != 0;
+}
+
+static bool HashChunk(std::ifstream &file, uint64_t file_size, uint32_t chunk, std::vector<char> &buf, unsigned char *hash)
+{
+  uint64_t start = (uint64_t) chunk * SWOOSH_SWARM_CHUNK_SIZE;
+  size_t len = (size_t) std::min((uint64_t) SWOOSH_SWARM_CHUNK_SIZE, file_size - start);
+  buf.resize(len);
+  if (!file.seekg((std::streamoff) start) || !file.read(buf.data(), len)) {
+    return false;
+  }
+  SwooshStrongHash(buf.data(), len, hash);
+  return true;
+}
+
+bool SwooshSwarmChunks::CheckChunk(const std::string &file_name, uint64_t file_size, uint32_t chunk, const unsigned char *hash)
+{
+  std::ifstream file(file_name, std::ios::binary);
+  std::vector<char> buf;
+  unsigned char chunk_hash[SWOOSH_DELTA_HASH_SIZE];
+  if (!file.good() || !HashChunk(file, file_size, chunk, buf, chunk_hash)) {
+    DebugLog("ERROR: can't read chunk %u of '%s'\n", chunk, file_name.c_str());
+    return false;
+  }
+  if (memcmp(chunk_hash, hash, SWOOSH_DELTA_HASH_SIZE) != 0) {
+    DebugLog("ERROR: chunk %u of '%s' doesn't match its hash\n", chunk, file_name.c_str());
+    return false;
+  }
+  return true;
+}
+
+void SwooshSwarmChunks::Add(uint32_t chunk)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (chunk < num_chunks) {
+    bitmap[chunk / 8] |= 1 << (chunk % 8);
+  }
+}
+
+bool SwooshSwarmChunks::HasRange(uint64_t offset, uint64_t len)
+{
+  if (len == 0 || offset > file_size || len > file_size - offset) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  uint32_t last = (uint32_t) ((offset + len - 1) / SWOOSH_SWARM_CHUNK_SIZE);
+  for (uint32_t chunk = (uint32_t) (offset / SWOOSH_SWARM_CHUNK_SIZE); chunk <= last; chunk++) {
+    if (!HasChunk(bitmap, chunk)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::vector<unsigned char> SwooshSwarmChunks::GetBitmap()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return bitmap;
+}
+
+// ==========================================================================
+// SwooshSwarmTracker
+// ==========================================================================
+
+int SwooshSwarmTracker::SendAnnounce(net_socket *sock, uint32_t port, uint32_t message_id, uint32_t ttl_ms,
+                                     const std::vector<unsigned char> &bitmap)
+{
+  if (net_send_u32(sock, port) != 0 ||
+      net_send_u32(sock, message_id) != 0 ||
+      net_send_u32(sock, ttl_ms) != 0 ||
+      net_send_data(sock, bitmap.data(), bitmap.size()) != 0) {
+    DebugLog("ERROR: can't send swarm announce\n");
+    return -1;
+  }
+  return 0;
+}
+
+int SwooshSwarmTracker::ReceivePeers(net_socket *sock, uint64_t file_size, std::vector<SwooshSwarmPeer> *peers,
+                                     std::vector<unsigned char> *hashes)
+{
+  uint32_t num_peers;
+  if (net_recv_u32(sock, &num_peers) != 0 || num_peers > SWOOSH_SWARM_MAX_PEERS) {
+    DebugLog("ERROR: can't read swarm peers\n");
+    return -1;
+  }
+
+  peers->clear();
+  for (uint32_t i = 0; i < num_peers; i++) {
+    SwooshSwarmPeer peer;
+    uint32_t host_len;
+    if (net_recv_u32(sock, &host_len) != 0 || host_len > SWARM_MAX_HOST_SIZE) {
+      DebugLog("ERROR: can't read swarm peer host\n");
+      return -1;
+    }
+    peer.host.resize(host_len);
+    peer.bitmap.resize(SwooshSwarmChunks::GetBitmapSize(file_size));
+    if (net_recv_data(sock, &peer.host[0], host_len) != 0 ||
+        net_recv_u32(sock, &peer.port) != 0 ||
+        net_recv_u32(sock, &peer.message_id) != 0 ||
+        net_recv_data(sock, peer.bitmap.data(), peer.bitmap.size()) != 0) {
+      DebugLog("ERROR: can't read swarm peer\n");
+      return -1;
+    }
+    peers->push_back(std::move(peer));
+  }
+
+  hashes->resize((size_t) SwooshSwarmChunks::GetNumChunks(file_size) * SWOOSH_DELTA_HASH_SIZE);
+  if (net_recv_data(sock, hashes->data(), hashes->size()) != 0) {
+    DebugLog("ERROR: can't read swarm chunk hashes\n");
+    return -1;
+  }
+  return 0;
+}
+
+bool SwooshSwarmTracker::BuildHashes(const std::string &file_name, uint64_t file_size)
+{
+  // called with hash_lock held; the first receiver to ask waits for them
+  if (!chunk_hashes.empty()) {
+    return true;
+  }
+
+  std::ifstream file(file_name, std::ios::binary);
+  if (!file.good()) {
+    DebugLog("ERROR: can't open file '%s'\n", file_name.c_str());
+    return false;
+  }
+  uint32_t num_chunks = SwooshSwarmChunks::GetNumChunks(file_size);
+  std::vector<unsigned char> hashes((size_t) num_chunks * SWOOSH_DELTA_HASH_SIZE);
+  std::vector<char> buf;
+  for (uint32_t chunk = 0; chunk < num_chunks; chunk++) {
+    if (!HashChunk(file, file_size, chunk, buf, &hashes[(size_t) chunk * SWOOSH_DELTA_HASH_SIZE])) {
+      DebugLog("ERROR: can't read file '%s'\n", file_name.c_str());
+      return false;
+    }
+  }
+  chunk_hashes = std::move(hashes);
+  return true;
+}
+
+int SwooshSwarmTracker::Serve(net_socket *sock, const std::string &file_name, uint64_t file_size)
+{
+  // read announce
+  SwooshSwarmPeer peer;
+  uint32_t ttl_ms;
+  peer.bitmap.resize(SwooshSwarmChunks::GetBitmapSize(file_size));
+  if (net_recv_u32(sock, &peer.port) != 0 ||
+      net_recv_u32(sock, &peer.message_id) != 0 ||
+      net_recv_u32(sock, &ttl_ms) != 0 ||
+      net_recv_data(sock, peer.bitmap.data(), peer.bitmap.size()) != 0) {
+    DebugLog("ERROR: can't read swarm announce\n");
+    return -1;
+  }
+
+  // we only know where the peer is if it connected directly
+  char host[SWARM_MAX_HOST_SIZE];
+  bool have_host = (peer.port != 0 && net_get_socket_host(sock, host, sizeof(host)) == 0);
+  if (have_host) {
+    peer.host = host;
+  }
+  ttl_ms = std::min(ttl_ms, (uint32_t) SWOOSH_SWARM_SEED_TIME_MS);
+
+  std::vector<SwooshSwarmPeer> others;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto now = std::chrono::steady_clock::now();
+    entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const Entry &entry) {
+      return entry.expires <= now ||
+        (have_host && entry.peer.host == peer.host && entry.peer.port == peer.port && entry.peer.message_id == peer.message_id);
+    }), entries.end());
+    for (const auto &entry : entries) {
+      others.push_back(entry.peer);
+    }
+    if (have_host && ttl_ms > 0 && entries.size() < SWOOSH_SWARM_MAX_PEERS) {
+      entries.push_back(Entry{std::move(peer), now + std::chrono::milliseconds(ttl_ms)});
+    }
+  }
+
+  // send the other peers
+  if (net_send_u32(sock, (uint32_t) others.size()) != 0) {
+    DebugLog("ERROR: can't send swarm peers\n");
+    return -1;
+  }
+  for (const auto &other : others) {
+    if (net_send_u32(sock, (uint32_t) other.host.size()) != 0 ||
+        net_send_data(sock, other.host.data(), other.host.size()) != 0 ||
+        net_send_u32(sock, other.port) != 0 ||
+        net_send_u32(sock, other.message_id) != 0 ||
+        net_send_data(sock, other.bitmap.data(), other.bitmap.size()) != 0) {
+      DebugLog("ERROR: can't send swarm peer\n");
+      return -1;
+    }
+  }
+
+  // send the chunk hashes
+  std::lock_guard<std::mutex> guard(hash_lock);
+  if (!BuildHashes(file_name, file_size) ||
+      net_send_data(sock, chunk_hashes.data(), chunk_hashes.size()) != 0) {
+    DebugLog("ERROR: can't send swarm chunk hashes\n");
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef SWOOSH_SWARM_H_FILE
+#define SWOOSH_SWARM_H_FILE
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+
+#include "swoosh_data.h"
+
+#define SWOOSH_SWARM_MIN_SIZE      (2*SWOOSH_SWARM_CHUNK_SIZE)   // smaller files are downloaded from the sender
+#define SWOOSH_SWARM_PEER_TTL_MS   30000             // peers downloading a file announce themselves within this time
+#define SWOOSH_SWARM_SEED_TIME_MS  (10*60*1000)      // time a finished download keeps serving its chunks
+#define SWOOSH_SWARM_MAX_PEERS     64                // peers kept for each file
+
+// ==========================================================================
+// SwooshSwarmChunks
+// ==========================================================================
+
+// Chunks of a file we have, to serve to other receivers of the same file
+// while we're still downloading it.  In bitmaps, chunk i is bit (i % 8) of
+// byte (i / 8).
+class SwooshSwarmChunks
+{
+protected:
+  std::mutex lock;
+  uint64_t file_size;
+  uint32_t num_chunks;
+  std::vector<unsigned char> bitmap;
+
+public:
+  SwooshSwarmChunks(uint64_t file_size);
+
+  static uint32_t GetNumChunks(uint64_t file_size);
+  static size_t GetBitmapSize(uint64_t file_size) { return (GetNumChunks(file_size) + 7) / 8; }
+  static bool HasChunk(const std::vector<unsigned char> &bitmap, uint32_t chunk);
+
+  // check a chunk written to a file against its hash from the tracker
+  static bool CheckChunk(const std::string &file_name, uint64_t file_size, uint32_t chunk, const unsigned char *hash);
+
+  uint32_t GetNumChunks() { return num_chunks; }
+  void Add(uint32_t chunk);
+  bool HasRange(uint64_t offset, uint64_t len);
+  std::vector<unsigned char> GetBitmap();
+};
+
+// ==========================================================================
+// SwooshSwarmTracker
+// ==========================================================================
+
+struct SwooshSwarmPeer {
+  std::string host;
+  uint32_t port;
+  uint32_t message_id;              // id the peer serves the file as
+  std::vector<unsigned char> bitmap;
+};
+
+// Receivers of a file, kept by its sender so they can find each other.
+// Each receiver announces itself with the chunks it has, and gets the
+// list of other receivers in the reply, followed by the hash of each
+// chunk so it can check the chunks it gets from them.
+class SwooshSwarmTracker
+{
+protected:
+  struct Entry {
+    SwooshSwarmPeer peer;
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  std::mutex lock;
+  std::vector<Entry> entries;
+  std::mutex hash_lock;
+  std::vector<unsigned char> chunk_hashes;   // SWOOSH_DELTA_HASH_SIZE bytes per chunk, empty until needed
+
+  bool BuildHashes(const std::string &file_name, uint64_t file_size);
+
+public:
+  // handle a SWOOSH_DATA_REQUEST_SWARM
+  int Serve(net_socket *sock, const std::string &file_name, uint64_t file_size);
+
+  // request parts, used by receivers
+  static int SendAnnounce(net_socket *sock, uint32_t port, uint32_t message_id, uint32_t ttl_ms,
+                          const std::vector<unsigned char> &bitmap);
+  static int ReceivePeers(net_socket *sock, uint64_t file_size, std::vector<SwooshSwarmPeer> *peers,
+                          std::vector<unsigned char> *hashes);
+};
+
+#endif /* SWOOSH_SWARM_H_FILE */
@@ -0,0 +1,136 @@
+#include "targetver.h"
+#include "swoosh_thread_pool.h"
+
+#include <thread>
+
+#include "util.h"
+
+// worker running on the current thread, used to keep tasks submitted
+// from a task on the same worker
+static thread_local void *current_pool = nullptr;
+static thread_local size_t current_worker = 0;
+
+SwooshThreadPool::SwooshThreadPool(size_t num_threads, size_t max_queued)
+  : shared(std::make_shared<Shared>())
+{
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+  shared->num_queued = 0;
+  shared->next_worker = 0;
+  shared->max_queued = max_queued;
+  shared->stopping = false;
+  for (size_t i = 0; i < num_threads; i++) {
+    shared->workers.emplace_back(new Worker());
+  }
+
+  // workers hold their own reference to the shared state, so they're
+  // never joined: a long transfer can't block the pool from going away
+  for (size_t i = 0; i < num_threads; i++) {
+    std::thread worker_thread{WorkerLoop, shared, i};
+    worker_thread.detach();
+  }
+}
+
+SwooshThreadPool::~SwooshThreadPool()
+{
+  Stop();
+}
+
+void SwooshThreadPool::Stop()
+{
+  {
+    std::lock_guard<std::mutex> guard(shared->wait_lock);
+    shared->stopping = true;
+  }
+  shared->wait_cond.notify_all();
+
+  // nothing is queued after stopping is set, so whatever is left now is
+  // never run; cancel it here, outside the queue locks
+  std::vector<Task> left;
+  for (auto &worker : shared->workers) {
+    std::lock_guard<std::mutex> guard(worker->lock);
+    for (auto &task : worker->tasks) {
+      left.push_back(std::move(task));
+    }
+    shared->num_queued -= worker->tasks.size();
+    worker->tasks.clear();
+  }
+  for (auto &task : left) {
+    if (task.cancel) {
+      task.cancel();
+    }
+  }
+}
+
+bool SwooshThreadPool::Submit(std::function<void()> task, std::function<void()> cancel)
+{
+  size_t index;
+  if (current_pool == shared.get()) {
+    index = current_worker;
+  } else {
+    index = shared->next_worker++ % shared->workers.size();
+  }
+
+  // queued and signalled with the wait lock held, so Stop() can't miss the
+  // task, a worker can't miss the wakeup between checking the queues and
+  // going to sleep, and a stopped worker can't free the state under us
+  std::lock_guard<std::mutex> guard(shared->wait_lock);
+  if (shared->stopping || shared->num_queued >= shared->max_queued) {
+    return false;
+  }
+  {
+    Worker &worker = *shared->workers[index];
+    std::lock_guard<std::mutex> worker_guard(worker.lock);
+    worker.tasks.push_back(Task{std::move(task), std::move(cancel)});
+    shared->num_queued++;
+  }
+  shared->wait_cond.notify_one();
+  return true;
+}
+
+bool SwooshThreadPool::PopTask(Shared &shared, size_t index, Task *task)
+{
+  // take the oldest task from our own queue, or steal the newest from another
+  size_t num_workers = shared.workers.size();
+  for (size_t i = 0; i < num_workers; i++) {
+    Worker &worker = *shared.workers[(index + i) % num_workers];
+    std::lock_guard<std::mutex> guard(worker.lock);
+    if (worker.tasks.empty()) {
+      continue;
+    }
+    if (i == 0) {
+      *task = std::move(worker.tasks.front());
+      worker.tasks.pop_front();
+    } else {
+      *task = std::move(worker.tasks.back());
+      worker.tasks.pop_back();
+    }
+    shared.num_queued--;
+    return true;
+  }
+  return false;
+}
+
+void SwooshThreadPool::WorkerLoop(std::shared_ptr<Shared> shared, size_t index)
+{
+  current_pool = shared.get();
+  current_worker = index;
+
+  // once stopped, queued tasks are left to Stop() to cancel
+  while (!shared->stopping) {
+    Task task;
+    if (PopTask(*shared, index, &task)) {
+      task.run();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(shared->wait_lock);
+    shared->wait_cond.wait(lock, [&shared] {
+      return shared->stopping || shared->num_queued > 0;
+    });
+    if (shared->stopping) {
+      break;
+    }
+  }
+}
@@ -0,0 +1,63 @@
+#ifndef SWOOSH_THREAD_POOL_H_FILE
+#define SWOOSH_THREAD_POOL_H_FILE
+
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+// ==========================================================================
+// SwooshThreadPool
+// ==========================================================================
+
+// Fixed number of worker threads, each with its own task queue.  Idle
+// workers steal tasks from the other queues.  Submit() refuses new tasks
+// when too many are already waiting, so bursts can't pile up work without
+// bound.  Tasks still waiting when the pool is stopped aren't run: their
+// cancel function is called instead, so they can free what they hold.
+class SwooshThreadPool
+{
+protected:
+  struct Task {
+    std::function<void()> run;
+    std::function<void()> cancel;
+  };
+
+  struct Worker {
+    std::mutex lock;
+    std::deque<Task> tasks;
+  };
+
+  // shared with the worker threads, so they can finish running tasks
+  // after the pool is gone
+  struct Shared {
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex wait_lock;
+    std::condition_variable wait_cond;
+    std::atomic<size_t> num_queued;     // changed with the queue's lock held
+    std::atomic<size_t> next_worker;
+    size_t max_queued;
+    std::atomic<bool> stopping;
+  };
+
+  std::shared_ptr<Shared> shared;
+
+  static void WorkerLoop(std::shared_ptr<Shared> shared, size_t index);
+  static bool PopTask(Shared &shared, size_t index, Task *task);
+
+public:
+  SwooshThreadPool(size_t num_threads, size_t max_queued);
+  ~SwooshThreadPool();
+
+  bool Submit(std::function<void()> task, std::function<void()> cancel = nullptr);
+  void Stop();
+
+  size_t GetNumThreads() { return shared->workers.size(); }
+  size_t GetNumQueued() { return shared->num_queued; }
+};
+
+#endif /* SWOOSH_THREAD_POOL_H_FILE */
@@ -0,0 +1,190 @@
+#include "uring.h"
+
+#if HAVE_IO_URING
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+struct uring {
+  int fd;
+
+  // submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sqe_head;          // entries handed out but not submitted are [sqe_head, sqe_tail)
+  unsigned sqe_tail;
+  unsigned sq_entries;
+
+  // completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+struct uring *uring_open(unsigned entries)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = sys_io_uring_setup(entries, &params);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct uring *ring = calloc(1, sizeof(*ring));
+  if (ring == NULL) {
+    close(fd);
+    return NULL;
+  }
+  ring->fd = fd;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    goto err;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      goto err;
+    }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto err;
+  }
+
+  unsigned char *sq = ring->sq_ring;
+  ring->sq_head  = (unsigned *) (sq + params.sq_off.head);
+  ring->sq_tail  = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask  = *(unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+  ring->sqe_head = ring->sqe_tail = *ring->sq_tail;
+
+  unsigned char *cq = ring->cq_ring;
+  ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes    = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  return ring;
+
+ err:
+  uring_close(ring);
+  return NULL;
+}
+
+void uring_close(struct uring *ring)
+{
+  if (ring == NULL) return;
+  if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != NULL) munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+  free(ring);
+}
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iovecs, unsigned num_iovecs)
+{
+  return (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovecs, num_iovecs) < 0) ? -1 : 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sqe_tail - head >= ring->sq_entries) {
+    return NULL;
+  }
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+  ring->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int uring_submit(struct uring *ring, unsigned wait_nr)
+{
+  // publish the new entries to the kernel
+  unsigned tail = *ring->sq_tail;
+  unsigned to_submit = ring->sqe_tail - ring->sqe_head;
+  while (ring->sqe_head != ring->sqe_tail) {
+    ring->sq_array[tail & ring->sq_mask] = ring->sqe_head & ring->sq_mask;
+    tail++;
+    ring->sqe_head++;
+  }
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+  while (1) {
+    int ret = sys_io_uring_enter(ring->fd, to_submit, wait_nr, (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0);
+    if (ret >= 0) {
+      return 0;
+    }
+    if (errno == EINTR) {
+      // retry with whatever the kernel didn't consume yet
+      to_submit = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+      if (to_submit == 0 && uring_peek_cqe(ring) != NULL) {
+        return 0;
+      }
+      continue;
+    }
+    return -1;
+  }
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,52 @@
+#ifndef URING_H_FILE
+#define URING_H_FILE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Minimal io_uring wrapper using the raw system calls, so it doesn't need
+ * liburing.  Only available on Linux; uring_open() returns NULL when the
+ * kernel doesn't support io_uring (or it's disabled), and callers should
+ * fall back to regular system calls.
+ */
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#if HAVE_IO_URING
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct uring;
+
+// create a ring with room for 'entries' operations in flight
+struct uring *uring_open(unsigned entries);
+void uring_close(struct uring *ring);
+
+// register buffers for IORING_OP_READ_FIXED/IORING_OP_WRITE_FIXED
+int uring_register_buffers(struct uring *ring, const struct iovec *iovecs, unsigned num_iovecs);
+
+// get a cleared submission entry, or NULL if the queue is full
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+// submit queued entries and wait for at least 'wait_nr' completions
+int uring_submit(struct uring *ring, unsigned wait_nr);
+
+// get the next completion, or NULL if there's none; mark it seen when done with it
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+#endif /* HAVE_IO_URING */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* URING_H_FILE */